@@ -0,0 +1,17 @@
+// Index buffer shared by all hit shaders. Every primitive owns a 4 byte aligned range that is either
+// 16 or 32 bit wide, Material.indexOffset is the first word of that range and Material.indexType
+// the VkIndexType it was written with. Define INDEX_BUFFER_BINDING before including.
+
+#define INDEX_TYPE_UINT16 0
+
+layout(binding = INDEX_BUFFER_BINDING, set = 0) readonly buffer Indices { uint i[]; } indices;
+
+uint fetchIndex(uint wordOffset, uint indexType, uint i)
+{
+    if (indexType == INDEX_TYPE_UINT16) {
+        // little endian: the even index sits in the low half of the word
+        uint word = indices.i[wordOffset + (i >> 1)];
+        return (i & 1u) == 0u ? (word & 0xFFFFu) : (word >> 16);
+    }
+    return indices.i[wordOffset + i];
+}
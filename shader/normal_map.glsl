@@ -0,0 +1,12 @@
+// Tangent space normal from a normal map texel. Two channel maps (BC5) sample blue as 0, which would be
+// a normal pointing straight into the surface, so z is rebuilt from x and y for them. The material says
+// which maps are two channel, a regular map may well store a blue of 0.
+
+vec3 unpackNormal(vec4 texel, bool twoChannel)
+{
+    vec3 n = texel.xyz * 2.0 - 1.0;
+    if (twoChannel) {
+        n.z = sqrt(max(1.0 - dot(n.xy, n.xy), 0.0));
+    }
+    return n;
+}
@@ -0,0 +1,72 @@
+// Texture level of detail for ray traced hits using ray cones, after Akenine-Moller et al.,
+// "Texture Level of Detail Strategies for Real-Time Ray Tracing" (Ray Tracing Gems, chapter 20).
+// The cone is carried in RayPayload.coneWidth / coneSpread, a negative spread disables the LOD
+// selection and every lookup reads level 0.
+// Include after texSampler[] (needs GL_EXT_nonuniform_qualifier) and define TEXTURE_FEEDBACK_BINDING before including.
+
+// data[0] enables recording, data[1 + 3 * texture] is the first word of that texture's tile bits,
+// followed by the bits of every level (see vkutils::mipmap::feedbackLevelWords).
+// data[2 + 3 * texture] is the first level of the full chain the bound image holds (texture streaming keeps
+// the finer levels out of memory), data[3 + 3 * texture] the full size as width | height << 16.
+layout(binding = TEXTURE_FEEDBACK_BINDING, set = 0) buffer TextureFeedback { uint data[]; } textureFeedback;
+
+#define TEXTURE_FEEDBACK_TILE_SIZE 32
+// footprint of a disabled cone, far enough below any real value to clamp every lookup to level 0
+#define CONE_FOOTPRINT_NONE -128.0
+
+// Texture independent part of the LOD: half the log2 ratio of texture space to world space triangle area,
+// plus the cone width at the hit, corrected for the angle between ray and surface.
+float coneFootprint(float coneSpread, float coneWidth, vec3 worldEdge1, vec3 worldEdge2, vec2 uvEdge1, vec2 uvEdge2, vec3 direction)
+{
+    if (coneSpread < 0.0 || coneWidth <= 0.0) {
+        return CONE_FOOTPRINT_NONE;
+    }
+    vec3 geometricNormal = cross(worldEdge1, worldEdge2);
+    float worldArea = length(geometricNormal);
+    float uvArea = abs(uvEdge1.x * uvEdge2.y - uvEdge2.x * uvEdge1.y);
+    if (worldArea <= 0.0 || uvArea <= 0.0) {
+        return CONE_FOOTPRINT_NONE;
+    }
+    float cosine = abs(dot(geometricNormal / worldArea, normalize(direction)));
+    return 0.5 * log2(uvArea / worldArea) + log2(coneWidth) - log2(max(cosine, 0.0001));
+}
+
+ivec2 fullTextureSize(int textureIndex)
+{
+    uint packedSize = textureFeedback.data[3 + 3 * textureIndex];
+    return ivec2(packedSize & 0xffffu, packedSize >> 16);
+}
+
+void recordTextureFeedback(int textureIndex, vec2 uv, uint level, ivec2 size)
+{
+    // levels of the full chain, the bound image may only hold its tail
+    uint levelCount = uint(findMSB(max(size.x, size.y))) + 1;
+    level = min(level, levelCount - 1);
+    uint word = textureFeedback.data[1 + 3 * textureIndex];
+    for (uint l = 0; l < level; l++) {
+        uvec2 tiles = (uvec2(max(size >> l, ivec2(1))) + TEXTURE_FEEDBACK_TILE_SIZE - 1) / TEXTURE_FEEDBACK_TILE_SIZE;
+        word += (tiles.x * tiles.y + 31) / 32;
+    }
+    uvec2 levelSize = uvec2(max(size >> level, ivec2(1)));
+    uvec2 tiles = (levelSize + TEXTURE_FEEDBACK_TILE_SIZE - 1) / TEXTURE_FEEDBACK_TILE_SIZE;
+    // repeat addressing, same as the model sampler
+    uvec2 texel = min(uvec2(fract(uv) * vec2(levelSize)), levelSize - 1);
+    uint tile = (texel.y / TEXTURE_FEEDBACK_TILE_SIZE) * tiles.x + texel.x / TEXTURE_FEEDBACK_TILE_SIZE;
+    atomicOr(textureFeedback.data[word + tile / 32], 1u << (tile % 32));
+}
+
+vec4 sampleTextureCone(int textureIndex, vec2 uv, float footprint)
+{
+    ivec2 size = fullTextureSize(textureIndex);
+    float lod = max(footprint + 0.5 * log2(float(size.x) * float(size.y)), 0.0);
+    if (textureFeedback.data[0] != 0) {
+        // trilinear filtering reads both neighbouring levels
+        recordTextureFeedback(textureIndex, uv, uint(floor(lod)), size);
+        if (fract(lod) > 0.0) {
+            recordTextureFeedback(textureIndex, uv, uint(floor(lod)) + 1, size);
+        }
+    }
+    // level 0 of the bound image is level residentLevel of the full chain
+    float residentLevel = float(textureFeedback.data[2 + 3 * textureIndex]);
+    return textureLod(texSampler[nonuniformEXT(textureIndex)], uv, max(lod - residentLevel, 0.0));
+}
@@ -1,12 +1,8 @@
 #version 460
+#extension GL_GOOGLE_include_directive : enable
 
-layout (location = 0) in vec3 inPosition;
-layout (location = 1) in vec3 inNormal;
-layout (location = 2) in vec2 inUV;
-layout (location = 3) in vec4 inColor;
-layout (location = 4) in vec4 inJoint;
-layout (location = 5) in vec4 inWeight;
-layout (location = 6) in vec4 inTangent;
+#define VERTEX_INPUT
+#include "vertex_layout.glsl"
 
 layout( push_constant ) uniform constants
 {
@@ -26,14 +22,18 @@ layout (location = 6) out vec3 outTangent;
 
 void main()
 {
+	Vertex vertex = inputVertex();
+	vec3 inPosition = vertex.pos;
+	vec3 inNormal = vertex.normal;
+	vec4 inTangent = vertex.tangent;
 	gl_Position = PushConstants.proj * PushConstants.view * PushConstants.model * vec4(inPosition, 1.0f);
 	outPosition = (PushConstants.model * vec4(inPosition, 1.0f)).xyz;
 	vec3 normal = normalize((transpose(inverse(PushConstants.model)) * vec4(inNormal, 1.0)).xyz);
 	vec3 tangent = normalize(transpose(inverse(PushConstants.model)) * inTangent).xyz;
 	outNormal =  normal;
-	outUV = inUV;
-	outColor = inColor;
-	outJoint = inJoint;
-	outWeight = inWeight;
+	outUV = vertex.uv;
+	outColor = vertex.color;
+	outJoint = vertex.joint0;
+	outWeight = vertex.weight0;
 	outTangent = tangent;
 }
\ No newline at end of file
@@ -1,4 +1,6 @@
 #include <Core.h>
+#include <iostream>
+#include <algorithm>
 
 vk::Core::Core()
 {
@@ -6,4 +8,42 @@ vk::Core::Core()
 
 vk::Core::~Core()
 {
-}
\ No newline at end of file
+}
+
+void vk::Core::submit(vk::Queue queue, const vk::SubmitInfo &submitInfo, vk::Fence fence)
+{
+    std::lock_guard<std::mutex> lock(_queueMutex);
+    queue.submit(submitInfo, fence);
+}
+
+void vk::Core::submitLoad(const vk::SubmitInfo &submitInfo, vk::Fence fence)
+{
+    submit(_loadQueue, submitInfo, fence);
+}
+
+void vk::Core::submitLoadAndWait(vk::CommandBuffer cmd)
+{
+    vk::Fence fence = _device.createFence(vk::FenceCreateInfo());
+    vk::SubmitInfo submitInfo{};
+    submitInfo.setCommandBuffers(cmd);
+    submitLoad(submitInfo, fence);
+    if (_device.waitForFences(fence, true, UINT64_MAX) != vk::Result::eSuccess)
+    {
+        std::cerr << "Load queue fence wait failed" << std::endl;
+    }
+    _device.destroyFence(fence);
+    _device.freeCommandBuffers(_loadCmdPool, cmd);
+}
+
+std::vector<uint32_t> vk::Core::queueFamilies() const
+{
+    std::vector<uint32_t> families = {_graphicsQueueFamily};
+    for (uint32_t family : {_transferQueueFamily, _computeQueueFamily})
+    {
+        if (std::find(families.begin(), families.end(), family) == families.end())
+        {
+            families.push_back(family);
+        }
+    }
+    return families;
+}
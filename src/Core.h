@@ -2,7 +2,9 @@
 
 #include <vk_types.h>
 #include <vk_initializers.h>
+#include <vk_memory_telemetry.h>
 #include <vector>
+#include <mutex>
 
 namespace vk {
     class Core
@@ -36,6 +38,8 @@ namespace vk {
         SDL_Window* _window{nullptr};
         vk::detail::DynamicLoader _dl;
         vma::Allocator _allocator;
+        // what createBuffer and createImage allocated, per category
+        vkutils::MemoryTelemetry _memoryTelemetry;
         vk::DebugUtilsMessengerEXT _debug_messenger;
 
         vk::Instance _instance;
@@ -44,6 +48,8 @@ namespace vk {
 
         vk::SurfaceKHR _surface;
         vk::SwapchainKHR _swapchain;
+        // VK_EXT_swapchain_maintenance1 is enabled, a present can signal a fence once the presentation engine is done with it
+        bool _swapchainMaintenance1{false};
         vk::Format _swapchainImageFormat;
         std::vector<vk::Framebuffer> _framebuffers;
         std::vector<vk::Image> _swapchainImages;
@@ -56,7 +62,31 @@ namespace vk {
 
         vk::CommandPool _cmdPool;
 
+        // Scenes are loaded through their own queue and command pool, so a background load neither waits for
+        // rendering nor records into a pool the render thread uses. _loadQueue is a second queue of the graphics
+        // family when it has one and _graphicsQueue otherwise, every submit goes through _queueMutex either way.
+        vk::Queue _loadQueue;
+        vk::CommandPool _loadCmdPool;
+        std::mutex _queueMutex;
+
+        // Uploads copy on _transferQueue and the loader builds acceleration structures on _computeQueue. Both come
+        // from a family without graphics when the device has one, so they run alongside rendering on their own
+        // engines, otherwise they are _loadQueue with its family and pool. Their pools belong to the loader thread.
+        vk::Queue _transferQueue;
+        uint32_t _transferQueueFamily;
+        vk::CommandPool _transferCmdPool;
+        vk::Queue _computeQueue;
+        uint32_t _computeQueueFamily;
+        vk::CommandPool _computeCmdPool;
+
         Core();
         ~Core();
+        // any queue, under _queueMutex
+        void submit(vk::Queue queue, const vk::SubmitInfo &submitInfo, vk::Fence fence);
+        void submitLoad(const vk::SubmitInfo &submitInfo, vk::Fence fence);
+        // submits cmd, waits for its fence instead of the whole queue and frees it back to _loadCmdPool
+        void submitLoadAndWait(vk::CommandBuffer cmd);
+        // the distinct families of the graphics, transfer and compute queues
+        std::vector<uint32_t> queueFamilies() const;
     };
 }
\ No newline at end of file
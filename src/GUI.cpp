@@ -22,6 +22,26 @@ vk::GUI::GUI():_core(){
     settings.ambient_multiplier = 1.f;
     settings.mips = true;
     settings.mips_sensitivity = 0.01f;
+    settings.texture_lod = true;
+    settings.texture_feedback = false;
+    settings.texture_bytes_touched = 0;
+    settings.texture_streaming = true;
+    settings.texture_budget_mb = 1024;
+    settings.texture_streaming_active = false;
+    settings.texture_resident_levels = 0;
+    settings.texture_total_levels = 0;
+    settings.texture_pending = 0;
+    settings.texture_resident_bytes = 0;
+    settings.texture_total_bytes = 0;
+    settings.texture_limit_bytes = 0;
+    settings.texture_heap_usage = 0;
+    settings.texture_heap_budget = 0;
+    settings.texture_streamed_levels = 0;
+    settings.texture_evicted_levels = 0;
+    settings.memory_dump_at_exit = false;
+    settings.animate_instances = false;
+    settings.load_instance_benchmark = false;
+    settings.dynamic_instances_active = false;
     settings.tm_operator = 3;
     settings.tm_param_linear = 2.f;
     settings.tm_param_reinhard = 4.f;
@@ -70,6 +90,26 @@ vk::GUI::GUI(vk::Core *core)
     settings.ambient_multiplier = 1.f;
     settings.mips = true;
     settings.mips_sensitivity = 0.01f;
+    settings.texture_lod = true;
+    settings.texture_feedback = false;
+    settings.texture_bytes_touched = 0;
+    settings.texture_streaming = true;
+    settings.texture_budget_mb = 1024;
+    settings.texture_streaming_active = false;
+    settings.texture_resident_levels = 0;
+    settings.texture_total_levels = 0;
+    settings.texture_pending = 0;
+    settings.texture_resident_bytes = 0;
+    settings.texture_total_bytes = 0;
+    settings.texture_limit_bytes = 0;
+    settings.texture_heap_usage = 0;
+    settings.texture_heap_budget = 0;
+    settings.texture_streamed_levels = 0;
+    settings.texture_evicted_levels = 0;
+    settings.memory_dump_at_exit = false;
+    settings.animate_instances = false;
+    settings.load_instance_benchmark = false;
+    settings.dynamic_instances_active = false;
     settings.tm_operator = 3;
     settings.tm_param_linear = 2.f;
     settings.tm_param_reinhard = 4.f;
@@ -273,6 +313,35 @@ void vk::GUI::update()
             uint32_t averagefps = (uint32_t) floor(1000.f / average);
             sprintf(plotlabel, "FPS: %u", averagefps);
             ImGui::PlotLines(plotlabel, values, IM_ARRAYSIZE(values), values_offset, overlay, 0.0f, 16.666f, ImVec2(0, 100.0f));
+            if (ImGui::CollapsingHeader("Memory"))
+            {
+                const double mb = 1024.0 * 1024.0;
+                vkutils::MemoryTelemetry::Snapshot memory = _core->_memoryTelemetry.snapshot();
+                for (size_t c = static_cast<size_t>(vkutils::MemoryCategory::eVertex); c < memory.categories.size(); c++)
+                {
+                    const vkutils::MemoryTelemetry::Category &category = memory.categories[c];
+                    if (category.peakBytes == 0)
+                    {
+                        continue;
+                    }
+                    ImGui::Text("  %s: %.1f MB in %llu, peak %.1f MB", vkutils::memoryCategoryName(static_cast<vkutils::MemoryCategory>(c)), category.bytes / mb, static_cast<unsigned long long>(category.allocations), category.peakBytes / mb);
+                }
+                for (size_t i = 0; i < memory.heaps.size(); i++)
+                {
+                    const vkutils::MemoryTelemetry::Heap &heap = memory.heaps[i];
+                    ImGui::Text("  Heap %zu%s: %.1f of %.1f MB budget, %u blocks", i, heap.deviceLocal ? " (device local)" : "", heap.usage / mb, heap.budget / mb, heap.blockCount);
+                    if (heap.budget > 0)
+                    {
+                        ImGui::ProgressBar(static_cast<float>(static_cast<double>(heap.usage) / heap.budget), ImVec2(-1.0f, 0.0f));
+                    }
+                }
+                if (ImGui::Button("Dump JSON"))
+                {
+                    _core->_memoryTelemetry.dump();
+                }
+                ImGui::SameLine();
+                ImGui::Checkbox("At Exit", &settings.memory_dump_at_exit);
+            }
         ImGui::End();
 
         ImGui::Begin("Settings", NULL);
@@ -305,6 +374,32 @@ void vk::GUI::update()
             {
                 ImGui::SliderFloat("Radiance Sensititvity", &settings.mips_sensitivity, 0.01f, 1.f, "%.2f");
             }
+            ImGui::SeparatorText("Textures");
+            ImGui::Checkbox("Ray Cone Texture LOD", &settings.texture_lod);
+            ImGui::Checkbox("Texture Feedback", &settings.texture_feedback);
+            if(settings.texture_feedback)
+            {
+                ImGui::Text("  Texels touched per frame: %.2f MB", static_cast<double>(settings.texture_bytes_touched) / (1024 * 1024));
+            }
+            if(settings.texture_streaming_active)
+            {
+                const double mb = 1024.0 * 1024.0;
+                ImGui::Checkbox("Texture Streaming", &settings.texture_streaming);
+                ImGui::SliderInt("Texture Budget (MB)", reinterpret_cast<int *>(&settings.texture_budget_mb), 64, 8192);
+                ImGui::Text("  Resident: %.1f of %.1f MB, limit %.1f MB", settings.texture_resident_bytes / mb, settings.texture_total_bytes / mb, settings.texture_limit_bytes / mb);
+                ImGui::Text("  Mip levels: %u of %u resident, %u pending", settings.texture_resident_levels, settings.texture_total_levels, settings.texture_pending);
+                ImGui::Text("  Streamed in %llu, evicted %llu levels", static_cast<unsigned long long>(settings.texture_streamed_levels), static_cast<unsigned long long>(settings.texture_evicted_levels));
+                ImGui::Text("  Device local heaps: %.1f of %.1f MB", settings.texture_heap_usage / mb, settings.texture_heap_budget / mb);
+            }
+            ImGui::SeparatorText("Scene");
+            if(settings.dynamic_instances_active)
+            {
+                ImGui::Checkbox("Animate Instances", &settings.animate_instances);
+            }
+            if(ImGui::Button("TLAS Update Benchmark"))
+            {
+                settings.load_instance_benchmark = true;
+            }
             ImGui::SeparatorText("Environment Map");
             ImGui::SliderFloat("Skylight Multiplier", &settings.ambient_multiplier, 0.f, 20.f, "%.1f");
             ImGui::SeparatorText("Tonemapping");
@@ -463,6 +558,19 @@ void vk::GUI::destroyFramebuffer()
     }
 }
 
+void vk::GUI::retireFramebuffers(vkutils::DeletionQueue &deletionQueue)
+{
+    std::vector<vk::Framebuffer> framebuffers;
+    framebuffers.swap(_framebuffers);
+    vk::Device device = _core->_device;
+    deletionQueue.push_function([=]() {
+        for (vk::Framebuffer framebuffer : framebuffers)
+        {
+            device.destroyFramebuffer(framebuffer);
+        }
+    });
+}
+
 void vk::GUI::destroy()
 {
     ImGui_ImplVulkan_Shutdown();
@@ -23,6 +23,8 @@ namespace vk {
         void additionalWindows();
         void handleInput(const SDL_Event *event);
         void destroyFramebuffer();
+        // hands the framebuffers over to deletionQueue, for a resize while frames still render into them
+        void retireFramebuffers(vkutils::DeletionQueue &deletionQueue);
         void destroy();
         ~GUI();
     };
@@ -0,0 +1,711 @@
+#include <vk_block_compression.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+	constexpr uint32_t fourCC(char a, char b, char c, char d)
+	{
+		return static_cast<uint32_t>(a) | (static_cast<uint32_t>(b) << 8) | (static_cast<uint32_t>(c) << 16) | (static_cast<uint32_t>(d) << 24);
+	}
+
+	// DXGI_FORMAT values of the DX10 header
+	constexpr uint32_t dxgiBC1 = 71;
+	constexpr uint32_t dxgiBC1Srgb = 72;
+	constexpr uint32_t dxgiBC3 = 77;
+	constexpr uint32_t dxgiBC3Srgb = 78;
+	constexpr uint32_t dxgiBC4 = 80;
+	constexpr uint32_t dxgiBC5 = 83;
+	constexpr uint32_t dxgiBC7 = 98;
+	constexpr uint32_t dxgiBC7Srgb = 99;
+
+	// byte offsets into the 124 byte DDS_HEADER that follows the magic
+	constexpr size_t ddsHeaderSize = 124;
+	constexpr size_t ddsHeight = 8;
+	constexpr size_t ddsWidth = 12;
+	constexpr size_t ddsMipMapCount = 24;
+	constexpr size_t ddsPixelFormatFlags = 76;
+	constexpr size_t ddsFourCC = 80;
+	constexpr size_t ddsCaps2 = 108;
+	constexpr size_t ddsDX10HeaderSize = 20;
+
+	constexpr unsigned char ktx2Identifier[12] = {0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A};
+	constexpr size_t ktx2HeaderSize = 80;
+
+	constexpr int bc7Weights[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+	uint32_t readU32(const unsigned char *data)
+	{
+		uint32_t value;
+		memcpy(&value, data, sizeof(value));
+		return value;
+	}
+
+	uint64_t readU64(const unsigned char *data)
+	{
+		uint64_t value;
+		memcpy(&value, data, sizeof(value));
+		return value;
+	}
+
+	void writeU32(unsigned char *data, uint32_t value)
+	{
+		memcpy(data, &value, sizeof(value));
+	}
+
+	vkutils::bc::Format formatFromDXGI(uint32_t dxgi)
+	{
+		switch (dxgi)
+		{
+		case dxgiBC1:
+		case dxgiBC1Srgb:
+			return vkutils::bc::Format::eBC1;
+		case dxgiBC3:
+		case dxgiBC3Srgb:
+			return vkutils::bc::Format::eBC3;
+		case dxgiBC4:
+			return vkutils::bc::Format::eBC4;
+		case dxgiBC5:
+			return vkutils::bc::Format::eBC5;
+		case dxgiBC7:
+		case dxgiBC7Srgb:
+			return vkutils::bc::Format::eBC7;
+		default:
+			return vkutils::bc::Format::eUnknown;
+		}
+	}
+
+	uint32_t dxgiFromFormat(vkutils::bc::Format format)
+	{
+		switch (format)
+		{
+		case vkutils::bc::Format::eBC1:
+			return dxgiBC1;
+		case vkutils::bc::Format::eBC3:
+			return dxgiBC3;
+		case vkutils::bc::Format::eBC4:
+			return dxgiBC4;
+		case vkutils::bc::Format::eBC5:
+			return dxgiBC5;
+		case vkutils::bc::Format::eBC7:
+			return dxgiBC7;
+		default:
+			return 0;
+		}
+	}
+
+	// VkFormat values as stored in the KTX2 header, srgb variants are read as their unorm counterpart
+	vkutils::bc::Format formatFromVkFormat(uint32_t vkFormat)
+	{
+		switch (vkFormat)
+		{
+		case 131: // VK_FORMAT_BC1_RGB_UNORM_BLOCK
+		case 132:
+		case 133: // VK_FORMAT_BC1_RGBA_UNORM_BLOCK
+		case 134:
+			return vkutils::bc::Format::eBC1;
+		case 137: // VK_FORMAT_BC3_UNORM_BLOCK
+		case 138:
+			return vkutils::bc::Format::eBC3;
+		case 139: // VK_FORMAT_BC4_UNORM_BLOCK
+			return vkutils::bc::Format::eBC4;
+		case 141: // VK_FORMAT_BC5_UNORM_BLOCK
+			return vkutils::bc::Format::eBC5;
+		case 145: // VK_FORMAT_BC7_UNORM_BLOCK
+		case 146:
+			return vkutils::bc::Format::eBC7;
+		default:
+			return vkutils::bc::Format::eUnknown;
+		}
+	}
+
+	// Fills levelOffsets for a tightly packed chain and returns false if size can't hold it.
+	bool layoutLevels(vkutils::bc::CompressedImage &image, size_t size)
+	{
+		image.levelOffsets.clear();
+		size_t total = 0;
+		for (uint32_t level = 0; level < image.mipLevels; level++)
+		{
+			image.levelOffsets.push_back(total);
+			total += vkutils::bc::levelBytes(image.format, image.width, image.height, level);
+		}
+		image.levelOffsets.push_back(total);
+		return total <= size;
+	}
+
+	// Endpoints along the principal axis of the block, the axis comes from a few power iterations on the covariance.
+	void principalEndpoints(const float texels[16][4], uint32_t channels, float low[4], float high[4])
+	{
+		float mean[4] = {};
+		for (uint32_t i = 0; i < 16; i++)
+		{
+			for (uint32_t c = 0; c < channels; c++)
+			{
+				mean[c] += texels[i][c] / 16.0f;
+			}
+		}
+		float covariance[4][4] = {};
+		for (uint32_t i = 0; i < 16; i++)
+		{
+			for (uint32_t a = 0; a < channels; a++)
+			{
+				for (uint32_t b = 0; b < channels; b++)
+				{
+					covariance[a][b] += (texels[i][a] - mean[a]) * (texels[i][b] - mean[b]);
+				}
+			}
+		}
+		float axis[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+		for (uint32_t iteration = 0; iteration < 8; iteration++)
+		{
+			float next[4] = {};
+			float length = 0.0f;
+			for (uint32_t a = 0; a < channels; a++)
+			{
+				for (uint32_t b = 0; b < channels; b++)
+				{
+					next[a] += covariance[a][b] * axis[b];
+				}
+				length = std::max(length, std::abs(next[a]));
+			}
+			if (length <= 0.0f)
+			{
+				break;
+			}
+			for (uint32_t c = 0; c < channels; c++)
+			{
+				axis[c] = next[c] / length;
+			}
+		}
+		float axisLength = 0.0f;
+		for (uint32_t c = 0; c < channels; c++)
+		{
+			axisLength += axis[c] * axis[c];
+		}
+		float minT = 0.0f;
+		float maxT = 0.0f;
+		if (axisLength > 0.0f)
+		{
+			minT = 1e30f;
+			maxT = -1e30f;
+			for (uint32_t i = 0; i < 16; i++)
+			{
+				float t = 0.0f;
+				for (uint32_t c = 0; c < channels; c++)
+				{
+					t += (texels[i][c] - mean[c]) * axis[c];
+				}
+				t /= axisLength;
+				minT = std::min(minT, t);
+				maxT = std::max(maxT, t);
+			}
+		}
+		for (uint32_t c = 0; c < channels; c++)
+		{
+			low[c] = std::clamp(mean[c] + axis[c] * minT, 0.0f, 255.0f);
+			high[c] = std::clamp(mean[c] + axis[c] * maxT, 0.0f, 255.0f);
+		}
+	}
+
+	uint16_t toRGB565(const float color[4])
+	{
+		uint32_t r = static_cast<uint32_t>(std::lround(color[0] * 31.0f / 255.0f));
+		uint32_t g = static_cast<uint32_t>(std::lround(color[1] * 63.0f / 255.0f));
+		uint32_t b = static_cast<uint32_t>(std::lround(color[2] * 31.0f / 255.0f));
+		return static_cast<uint16_t>((r << 11) | (g << 5) | b);
+	}
+
+	void fromRGB565(uint16_t color, int rgb[3])
+	{
+		int r = (color >> 11) & 31;
+		int g = (color >> 5) & 63;
+		int b = color & 31;
+		rgb[0] = (r << 3) | (r >> 2);
+		rgb[1] = (g << 2) | (g >> 4);
+		rgb[2] = (b << 3) | (b >> 2);
+	}
+
+	// LSB first bit writer for the 128 bit BC7 block
+	struct BitWriter
+	{
+		unsigned char *block;
+		uint32_t position = 0;
+		void write(uint32_t value, uint32_t bits)
+		{
+			for (uint32_t i = 0; i < bits; i++, position++)
+			{
+				if (value & (1u << i))
+				{
+					block[position / 8] |= static_cast<unsigned char>(1u << (position % 8));
+				}
+			}
+		}
+	};
+}
+
+const char *vkutils::bc::formatName(Format format)
+{
+	switch (format)
+	{
+	case Format::eBC1:
+		return "BC1";
+	case Format::eBC3:
+		return "BC3";
+	case Format::eBC4:
+		return "BC4";
+	case Format::eBC5:
+		return "BC5";
+	case Format::eBC7:
+		return "BC7";
+	default:
+		return "unknown";
+	}
+}
+
+uint32_t vkutils::bc::blockBytes(Format format)
+{
+	return format == Format::eBC1 || format == Format::eBC4 ? 8 : 16;
+}
+
+size_t vkutils::bc::levelBytes(Format format, uint32_t width, uint32_t height, uint32_t level)
+{
+	size_t blocksX = (std::max(width >> level, 1u) + 3) / 4;
+	size_t blocksY = (std::max(height >> level, 1u) + 3) / 4;
+	return blocksX * blocksY * blockBytes(format);
+}
+
+bool vkutils::bc::isDDS(const unsigned char *data, size_t size)
+{
+	return size >= 4 && readU32(data) == fourCC('D', 'D', 'S', ' ');
+}
+
+bool vkutils::bc::isKTX2(const unsigned char *data, size_t size)
+{
+	return size >= sizeof(ktx2Identifier) && memcmp(data, ktx2Identifier, sizeof(ktx2Identifier)) == 0;
+}
+
+bool vkutils::bc::readDDS(const unsigned char *data, size_t size, CompressedImage &image, std::string &error)
+{
+	if (!isDDS(data, size) || size < 4 + ddsHeaderSize || readU32(data + 4) != ddsHeaderSize)
+	{
+		error = "not a DDS file";
+		return false;
+	}
+	const unsigned char *header = data + 4;
+	size_t dataOffset = 4 + ddsHeaderSize;
+	Format format = Format::eUnknown;
+	// DDPF_FOURCC
+	uint32_t code = (readU32(header + ddsPixelFormatFlags) & 0x4) ? readU32(header + ddsFourCC) : 0;
+	if (code == fourCC('D', 'X', '1', '0'))
+	{
+		if (size < dataOffset + ddsDX10HeaderSize)
+		{
+			error = "truncated DX10 header";
+			return false;
+		}
+		const unsigned char *dx10 = data + dataOffset;
+		// resource dimension 3 is TEXTURE2D, misc flag 4 marks a cube map
+		if (readU32(dx10 + 4) != 3 || (readU32(dx10 + 8) & 0x4) || readU32(dx10 + 12) > 1)
+		{
+			error = "only single 2d textures are supported";
+			return false;
+		}
+		format = formatFromDXGI(readU32(dx10));
+		dataOffset += ddsDX10HeaderSize;
+	}
+	else if (code == fourCC('D', 'X', 'T', '1'))
+	{
+		format = Format::eBC1;
+	}
+	else if (code == fourCC('D', 'X', 'T', '5'))
+	{
+		format = Format::eBC3;
+	}
+	else if (code == fourCC('A', 'T', 'I', '1') || code == fourCC('B', 'C', '4', 'U'))
+	{
+		format = Format::eBC4;
+	}
+	else if (code == fourCC('A', 'T', 'I', '2') || code == fourCC('B', 'C', '5', 'U'))
+	{
+		format = Format::eBC5;
+	}
+	if (format == Format::eUnknown)
+	{
+		error = "unsupported DDS pixel format";
+		return false;
+	}
+	// DDSCAPS2_CUBEMAP and DDSCAPS2_VOLUME
+	if (readU32(header + ddsCaps2) & (0x200 | 0x200000))
+	{
+		error = "only single 2d textures are supported";
+		return false;
+	}
+
+	image.format = format;
+	image.width = readU32(header + ddsWidth);
+	image.height = readU32(header + ddsHeight);
+	image.mipLevels = std::max(readU32(header + ddsMipMapCount), 1u);
+	if (image.width == 0 || image.height == 0 || image.mipLevels > 32 || !layoutLevels(image, size - dataOffset))
+	{
+		image = CompressedImage();
+		error = "DDS data is truncated";
+		return false;
+	}
+	image.data.assign(data + dataOffset, data + dataOffset + image.levelOffsets.back());
+	return true;
+}
+
+bool vkutils::bc::readKTX2(const unsigned char *data, size_t size, CompressedImage &image, std::string &error)
+{
+	if (!isKTX2(data, size) || size < ktx2HeaderSize)
+	{
+		error = "not a KTX2 file";
+		return false;
+	}
+	uint32_t vkFormat = readU32(data + 12);
+	uint32_t width = readU32(data + 20);
+	uint32_t height = readU32(data + 24);
+	uint32_t depth = readU32(data + 28);
+	uint32_t layers = readU32(data + 32);
+	uint32_t faces = readU32(data + 36);
+	uint32_t levels = std::max(readU32(data + 40), 1u);
+	uint32_t supercompression = readU32(data + 44);
+	if (vkFormat == 0)
+	{
+		error = "Basis Universal payloads (KHR_texture_basisu) are not supported, only KTX2 with raw BCn levels";
+		return false;
+	}
+	if (supercompression != 0)
+	{
+		error = "supercompression scheme " + std::to_string(supercompression) + " is not supported";
+		return false;
+	}
+	if (depth > 1 || layers > 1 || faces != 1 || width == 0 || height == 0 || levels > 32)
+	{
+		error = "only single 2d textures are supported";
+		return false;
+	}
+	Format format = formatFromVkFormat(vkFormat);
+	if (format == Format::eUnknown)
+	{
+		error = "unsupported vkFormat " + std::to_string(vkFormat);
+		return false;
+	}
+	if (size < ktx2HeaderSize + static_cast<size_t>(levels) * 24)
+	{
+		error = "KTX2 level index is truncated";
+		return false;
+	}
+
+	image.format = format;
+	image.width = width;
+	image.height = height;
+	image.mipLevels = levels;
+	layoutLevels(image, SIZE_MAX);
+	image.data.resize(image.levelOffsets.back());
+	// the level index lists byteOffset, byteLength and uncompressedByteLength of every level, largest first
+	for (uint32_t level = 0; level < levels; level++)
+	{
+		const unsigned char *entry = data + ktx2HeaderSize + level * 24;
+		uint64_t offset = readU64(entry);
+		uint64_t length = readU64(entry + 8);
+		size_t expected = image.levelOffsets[level + 1] - image.levelOffsets[level];
+		if (length < expected || offset > size || expected > size - offset)
+		{
+			image = CompressedImage();
+			error = "KTX2 level " + std::to_string(level) + " is truncated";
+			return false;
+		}
+		memcpy(image.data.data() + image.levelOffsets[level], data + offset, expected);
+	}
+	return true;
+}
+
+std::vector<unsigned char> vkutils::bc::writeDDS(const CompressedImage &image)
+{
+	std::vector<unsigned char> file(4 + ddsHeaderSize + ddsDX10HeaderSize + image.levelOffsets.back(), 0);
+	unsigned char *header = file.data() + 4;
+	writeU32(file.data(), fourCC('D', 'D', 'S', ' '));
+	writeU32(header, ddsHeaderSize);
+	// DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_MIPMAPCOUNT | DDSD_LINEARSIZE
+	writeU32(header + 4, 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000);
+	writeU32(header + ddsHeight, image.height);
+	writeU32(header + ddsWidth, image.width);
+	writeU32(header + 16, static_cast<uint32_t>(levelBytes(image.format, image.width, image.height, 0)));
+	writeU32(header + ddsMipMapCount, image.mipLevels);
+	writeU32(header + 72, 32);
+	writeU32(header + ddsPixelFormatFlags, 0x4);
+	writeU32(header + ddsFourCC, fourCC('D', 'X', '1', '0'));
+	// DDSCAPS_TEXTURE, plus DDSCAPS_COMPLEX | DDSCAPS_MIPMAP for chains
+	writeU32(header + 104, image.mipLevels > 1 ? 0x1000 | 0x8 | 0x400000 : 0x1000);
+
+	unsigned char *dx10 = header + ddsHeaderSize;
+	writeU32(dx10, dxgiFromFormat(image.format));
+	writeU32(dx10 + 4, 3);
+	writeU32(dx10 + 12, 1);
+	std::copy(image.data.begin(), image.data.begin() + image.levelOffsets.back(), dx10 + ddsDX10HeaderSize);
+	return file;
+}
+
+void vkutils::bc::encodeBC1(const unsigned char *texels, unsigned char *block)
+{
+	float colors[16][4];
+	for (uint32_t i = 0; i < 16; i++)
+	{
+		for (uint32_t c = 0; c < 4; c++)
+		{
+			colors[i][c] = texels[i * 4 + c];
+		}
+	}
+	float low[4], high[4];
+	principalEndpoints(colors, 3, low, high);
+	uint16_t color0 = toRGB565(high);
+	uint16_t color1 = toRGB565(low);
+	// color0 > color1 selects the four color mode
+	if (color0 < color1)
+	{
+		std::swap(color0, color1);
+	}
+	int palette[4][3];
+	fromRGB565(color0, palette[0]);
+	fromRGB565(color1, palette[1]);
+	for (uint32_t c = 0; c < 3; c++)
+	{
+		palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+		palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+	}
+
+	uint32_t indices = 0;
+	if (color0 != color1)
+	{
+		for (uint32_t i = 0; i < 16; i++)
+		{
+			int bestError = INT32_MAX;
+			uint32_t best = 0;
+			for (uint32_t p = 0; p < 4; p++)
+			{
+				int error = 0;
+				for (uint32_t c = 0; c < 3; c++)
+				{
+					int d = texels[i * 4 + c] - palette[p][c];
+					error += d * d;
+				}
+				if (error < bestError)
+				{
+					bestError = error;
+					best = p;
+				}
+			}
+			indices |= best << (i * 2);
+		}
+	}
+	memcpy(block, &color0, 2);
+	memcpy(block + 2, &color1, 2);
+	memcpy(block + 4, &indices, 4);
+}
+
+void vkutils::bc::encodeBC4(const unsigned char *texels, uint32_t channel, unsigned char *block)
+{
+	int low = 255;
+	int high = 0;
+	for (uint32_t i = 0; i < 16; i++)
+	{
+		low = std::min<int>(low, texels[i * 4 + channel]);
+		high = std::max<int>(high, texels[i * 4 + channel]);
+	}
+	// red0 > red1 selects eight interpolated values, equal endpoints make every index 0 exact
+	int palette[8] = {high, low};
+	for (int p = 2; p < 8; p++)
+	{
+		palette[p] = ((8 - p) * high + (p - 1) * low) / 7;
+	}
+	uint64_t indices = 0;
+	if (high != low)
+	{
+		for (uint32_t i = 0; i < 16; i++)
+		{
+			int bestError = INT32_MAX;
+			uint64_t best = 0;
+			for (uint32_t p = 0; p < 8; p++)
+			{
+				int error = std::abs(texels[i * 4 + channel] - palette[p]);
+				if (error < bestError)
+				{
+					bestError = error;
+					best = p;
+				}
+			}
+			indices |= best << (i * 3);
+		}
+	}
+	block[0] = static_cast<unsigned char>(high);
+	block[1] = static_cast<unsigned char>(low);
+	for (uint32_t b = 0; b < 6; b++)
+	{
+		block[2 + b] = static_cast<unsigned char>(indices >> (b * 8));
+	}
+}
+
+void vkutils::bc::encodeBC5(const unsigned char *texels, unsigned char *block)
+{
+	encodeBC4(texels, 0, block);
+	encodeBC4(texels, 1, block + 8);
+}
+
+void vkutils::bc::encodeBC7(const unsigned char *texels, unsigned char *block)
+{
+	float colors[16][4];
+	for (uint32_t i = 0; i < 16; i++)
+	{
+		for (uint32_t c = 0; c < 4; c++)
+		{
+			colors[i][c] = texels[i * 4 + c];
+		}
+	}
+	float endpoints[2][4];
+	principalEndpoints(colors, 4, endpoints[0], endpoints[1]);
+
+	// mode 6 endpoints are 7 bits per channel plus one p bit shared by the channels of an endpoint
+	int quantized[2][4];
+	int pBits[2];
+	int expanded[2][4];
+	for (uint32_t e = 0; e < 2; e++)
+	{
+		float bestError = 1e30f;
+		for (int p = 0; p < 2; p++)
+		{
+			int q[4];
+			float error = 0.0f;
+			for (uint32_t c = 0; c < 4; c++)
+			{
+				q[c] = std::clamp(static_cast<int>(std::lround((endpoints[e][c] - p) / 2.0f)), 0, 127);
+				float d = endpoints[e][c] - static_cast<float>(q[c] * 2 + p);
+				error += d * d;
+			}
+			if (error < bestError)
+			{
+				bestError = error;
+				pBits[e] = p;
+				for (uint32_t c = 0; c < 4; c++)
+				{
+					quantized[e][c] = q[c];
+					expanded[e][c] = q[c] * 2 + p;
+				}
+			}
+		}
+	}
+
+	int palette[16][4];
+	for (uint32_t w = 0; w < 16; w++)
+	{
+		for (uint32_t c = 0; c < 4; c++)
+		{
+			palette[w][c] = ((64 - bc7Weights[w]) * expanded[0][c] + bc7Weights[w] * expanded[1][c] + 32) >> 6;
+		}
+	}
+	uint32_t indices[16];
+	for (uint32_t i = 0; i < 16; i++)
+	{
+		int bestError = INT32_MAX;
+		for (uint32_t w = 0; w < 16; w++)
+		{
+			int error = 0;
+			for (uint32_t c = 0; c < 4; c++)
+			{
+				int d = texels[i * 4 + c] - palette[w][c];
+				error += d * d;
+			}
+			if (error < bestError)
+			{
+				bestError = error;
+				indices[i] = w;
+			}
+		}
+	}
+	// the first index is stored with 3 bits, its top bit must be 0. Swapping the endpoints mirrors every index.
+	if (indices[0] & 8)
+	{
+		std::swap(quantized[0], quantized[1]);
+		std::swap(pBits[0], pBits[1]);
+		for (uint32_t &index : indices)
+		{
+			index = 15 - index;
+		}
+	}
+
+	memset(block, 0, 16);
+	BitWriter writer{block};
+	writer.write(1u << 6, 7);
+	for (uint32_t c = 0; c < 4; c++)
+	{
+		writer.write(quantized[0][c], 7);
+		writer.write(quantized[1][c], 7);
+	}
+	writer.write(pBits[0], 1);
+	writer.write(pBits[1], 1);
+	writer.write(indices[0], 3);
+	for (uint32_t i = 1; i < 16; i++)
+	{
+		writer.write(indices[i], 4);
+	}
+}
+
+vkutils::bc::CompressedImage vkutils::bc::compressChain(Format format, const unsigned char *chain, const std::vector<size_t> &levelOffsets, uint32_t width, uint32_t height)
+{
+	CompressedImage image;
+	image.format = format;
+	image.width = width;
+	image.height = height;
+	image.mipLevels = static_cast<uint32_t>(levelOffsets.size() - 1);
+	layoutLevels(image, SIZE_MAX);
+	image.data.resize(image.levelOffsets.back());
+
+	uint32_t bytes = blockBytes(format);
+	for (uint32_t level = 0; level < image.mipLevels; level++)
+	{
+		uint32_t levelWidth = std::max(width >> level, 1u);
+		uint32_t levelHeight = std::max(height >> level, 1u);
+		uint32_t blocksX = (levelWidth + 3) / 4;
+		uint32_t blocksY = (levelHeight + 3) / 4;
+		const unsigned char *src = chain + levelOffsets[level];
+		unsigned char *dst = image.data.data() + image.levelOffsets[level];
+		for (uint32_t by = 0; by < blocksY; by++)
+		{
+			for (uint32_t bx = 0; bx < blocksX; bx++)
+			{
+				unsigned char texels[16 * 4];
+				for (uint32_t y = 0; y < 4; y++)
+				{
+					uint32_t sy = std::min(by * 4 + y, levelHeight - 1);
+					for (uint32_t x = 0; x < 4; x++)
+					{
+						uint32_t sx = std::min(bx * 4 + x, levelWidth - 1);
+						memcpy(texels + (y * 4 + x) * 4, src + (static_cast<size_t>(sy) * levelWidth + sx) * 4, 4);
+					}
+				}
+				unsigned char *out = dst + (static_cast<size_t>(by) * blocksX + bx) * bytes;
+				switch (format)
+				{
+				case Format::eBC1:
+					encodeBC1(texels, out);
+					break;
+				case Format::eBC4:
+					encodeBC4(texels, 0, out);
+					break;
+				case Format::eBC5:
+					encodeBC5(texels, out);
+					break;
+				case Format::eBC7:
+					encodeBC7(texels, out);
+					break;
+				default:
+					// BC3 is read but not written, BC7 covers the same content at the same size
+					memset(out, 0, bytes);
+					break;
+				}
+			}
+		}
+	}
+	return image;
+}
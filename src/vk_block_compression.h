@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace vkutils
+{
+	// Block compressed (BCn) textures: DDS and KTX2 containers and a small encoder for the offline compressor.
+	// KTX2 is read only with a vkFormat of raw BCn levels, Basis Universal payloads are rejected.
+	// Kept free of vulkan so tools can link it, vk_model maps the formats to vk::Format.
+	namespace bc
+	{
+		enum class Format
+		{
+			eUnknown,
+			eBC1,
+			eBC3,
+			eBC4,
+			eBC5,
+			eBC7
+		};
+
+		struct CompressedImage
+		{
+			Format format = Format::eUnknown;
+			uint32_t width = 0;
+			uint32_t height = 0;
+			uint32_t mipLevels = 0;
+			// every level tightly packed, largest first
+			std::vector<unsigned char> data{};
+			// byte offset of every level followed by the total size, same layout as vkutils::mipmap::buildChainRGBA8
+			std::vector<size_t> levelOffsets{};
+			bool valid() const { return format != Format::eUnknown; }
+		};
+
+		const char *formatName(Format format);
+		// Bytes of one 4x4 block, 8 for the single and 16 for the two part formats.
+		uint32_t blockBytes(Format format);
+		size_t levelBytes(Format format, uint32_t width, uint32_t height, uint32_t level);
+
+		bool isDDS(const unsigned char *data, size_t size);
+		bool isKTX2(const unsigned char *data, size_t size);
+		// Only single 2d textures with one of the formats above are accepted, anything else
+		// (cube maps, arrays, uncompressed or supercompressed payloads) fails with the reason in error.
+		bool readDDS(const unsigned char *data, size_t size, CompressedImage &image, std::string &error);
+		bool readKTX2(const unsigned char *data, size_t size, CompressedImage &image, std::string &error);
+		// Always writes the DX10 header extension, it is the only way to describe BC5 and BC7.
+		std::vector<unsigned char> writeDDS(const CompressedImage &image);
+
+		// Encoders take a 4x4 rgba8 block in row major order.
+		// BC1 for opaque color, the alpha channel is ignored.
+		void encodeBC1(const unsigned char *texels, unsigned char *block);
+		// BC4 of a single channel, BC5 stores red and green as two BC4 blocks.
+		void encodeBC4(const unsigned char *texels, uint32_t channel, unsigned char *block);
+		void encodeBC5(const unsigned char *texels, unsigned char *block);
+		// BC7 mode 6 only: one subset with rgba endpoints and 16 weights, good enough for color with alpha.
+		void encodeBC7(const unsigned char *texels, unsigned char *block);
+		// Compresses every level of an rgba8 chain, levels smaller than a block are padded by repeating the edge.
+		CompressedImage compressChain(Format format, const unsigned char *chain, const std::vector<size_t> &levelOffsets, uint32_t width, uint32_t height);
+	}
+}
@@ -1,4 +1,5 @@
 ﻿#include <vk_engine.h>
+#include <vk_mipmap.h>
 #include <stb_image.h>
 #include <thread>
 
@@ -34,7 +35,11 @@ void VulkanEngine::init()
 
 	init_pipelines();
 
-	createShaderBindingTable();
+	init_texture_feedback();
+
+	init_texture_streaming();
+
+	init_skinning(_loadedPipelines.skinningShader);
 
 	init_descriptors();
 
@@ -46,7 +51,45 @@ void VulkanEngine::cleanup()
 {
 	if (_isInitialized)
 	{
+		if (_sceneLoader.joinable())
+		{
+			_sceneLoader.join();
+		}
 		_core._device.waitIdle();
+		if (_gui.settings.memory_dump_at_exit)
+		{
+			_core._memoryTelemetry.dump();
+		}
+		if (_sceneReady)
+		{
+			// loaded but never swapped in
+			_loadedScene->destroy();
+			delete _loadedScene;
+			_core._device.destroyPipeline(_loadedPipelines.raytracerPipeline);
+			_core._device.destroyPipelineLayout(_loadedPipelines.raytracerPipelineLayout);
+			_core._device.destroyDescriptorSetLayout(_loadedPipelines.raytracerSetLayout);
+			_core._device.destroyPipelineLayout(_loadedPipelines.rasterizerPipelineLayout);
+			_core._device.destroyDescriptorSetLayout(_loadedPipelines.rasterizerSetLayout);
+			for (const vkutils::AllocatedBuffer& table : {_loadedPipelines.raygenShaderBindingTable, _loadedPipelines.missShaderBindingTable, _loadedPipelines.hitShaderBindingTable})
+			{
+				vkutils::destroyBuffer(_core, table);
+			}
+			for (vk::ShaderModule shader : {_loadedPipelines.rasterizerShaders[0], _loadedPipelines.rasterizerShaders[1], _loadedPipelines.skinningShader})
+			{
+				_core._device.destroyShaderModule(shader);
+			}
+		}
+		_deferredDeletion.flush();
+		// a present that never completed would leave its fence unsignaled, so this waits a bounded time only
+		if (_presentFenceRetires > 0 && _core._device.waitForFences(_presentFence, true, 1000000000) != vk::Result::eSuccess)
+		{
+			std::cerr << "the last present on the swapchain did not complete" << std::endl;
+		}
+		for (auto& retired : _retiredSwapchains)
+		{
+			retired.flush();
+		}
+		_sceneDeletionQueue.flush();
 		_mainDeletionQueue.flush();
 		_resizeDeletionQueue.flush();
 		_core._instance.destroySurfaceKHR(_core._surface);
@@ -63,8 +106,33 @@ void VulkanEngine::draw()
 	if (SDL_GetWindowFlags(_core._window) & SDL_WINDOW_MINIMIZED)
 		return;
 
-	vk::Result waitFencesResult = _core._device.waitForFences(get_current_frame()._renderFence, true, UINT64_MAX);
+	// the frame that used this frame's resources last signaled the timeline FRAME_OVERLAP submissions ago
+	if (_frameTimelineValue >= FRAME_OVERLAP)
+	{
+		vk::SemaphoreWaitInfo waitInfo({}, _frameTimeline, _frameTimelineValue - FRAME_OVERLAP + 1);
+		if (_core._device.waitSemaphores(waitInfo, UINT64_MAX) != vk::Result::eSuccess)
+		{
+			throw std::runtime_error("failed to wait for the frame timeline!");
+		}
+	}
 	_core._allocator.setCurrentFrameIndex(_frameNumber);
+	// the presentation engine is done with the first present on the new swapchain, the retired ones only wait for the timeline now
+	if (_presentFenceRetires > 0 && _core._device.getFenceStatus(_presentFence) == vk::Result::eSuccess)
+	{
+		_core._device.resetFences(_presentFence);
+		for (; _presentFenceRetires > 0; _presentFenceRetires--)
+		{
+			// the current value is past their last frame and keeps _deferredDeletion in order
+			_deferredDeletion.push(_frameTimelineValue, std::move(_retiredSwapchains.front()));
+			_retiredSwapchains.pop_front();
+		}
+	}
+	_deferredDeletion.collect(_core._device.getSemaphoreCounterValue(_frameTimeline));
+	update_storage_image_descriptor();
+	if (_sceneReady)
+	{
+		switch_scene();
+	}
 	get_current_frame()._mainCommandBuffer.reset();
 
 	uint32_t swapchainImageIndex;
@@ -82,7 +150,6 @@ void VulkanEngine::draw()
 	else if(aquireNextImageResult != vk::Result::eSuccess){
 		throw std::runtime_error("failed to acquire swap chain image!");
 	}
-	_core._device.resetFences(get_current_frame()._renderFence);
 
 	vk::CommandBuffer cmd = get_current_frame()._mainCommandBuffer;
 
@@ -96,6 +163,17 @@ void VulkanEngine::draw()
 	_lastTime = now;
 
 	cmd.begin(cmdBeginInfo);
+		// swaps in streamed images before the header of this frame's feedback buffer is written
+		update_texture_streaming(cmd);
+		read_texture_feedback();
+		animate_instances();
+		// node edits reach the world matrices the rasterizer reads, a no-op for models nothing moved in
+		for (Model *model : _currentScene->models)
+		{
+			model->updateTransforms();
+		}
+		update_skinning(cmd);
+		_currentScene->updateTopLevel(cmd, _frameNumber, FRAME_OVERLAP);
 		if(_gui.settings.renderer == 0)
 		{
 			vk::RenderPassBeginInfo rpInfo = vkinit::renderpass_begin_info(_renderPass, _core._windowExtent, _core._framebuffers[swapchainImageIndex]);
@@ -107,7 +185,6 @@ void VulkanEngine::draw()
 			rpInfo.setClearValues(clearValues);
 
 			cmd.beginRenderPass(rpInfo, vk::SubpassContents::eInline);
-			vk::DeviceSize offset = 0;
 
 			vk::Viewport viewport;
 			viewport.x = 0.0f;
@@ -124,27 +201,45 @@ void VulkanEngine::draw()
 			scissor.extent = _core._windowExtent;
 			cmd.setScissor(0, scissor);
 
-			cmd.bindVertexBuffers(0, 1, &_currentScene->vertexBuffer._buffer, &offset);
-			cmd.bindIndexBuffer(_currentScene->indexBuffer._buffer, offset, vk::IndexType::eUint32);
+			std::vector<vk::Buffer> vertexBuffers;
+			std::vector<vk::DeviceSize> vertexBufferOffsets;
+			for (auto& vertexBuffer : _currentScene->vertexBuffers)
+			{
+				vertexBuffers.push_back(vertexBuffer.buffer);
+				vertexBufferOffsets.push_back(vertexBuffer.offset);
+			}
+			cmd.bindVertexBuffers(0, vertexBuffers, vertexBufferOffsets);
 			cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, _rasterizerPipeline);
 			cmd.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, _rasterizerPipelineLayout, 0, get_current_frame()._rasterizerDescriptor, {});
+			// ranges of every model in the shared buffers, instances of a model draw the same range
+			std::vector<uint32_t> vertexOffsets;
+			std::vector<uint32_t> indexByteOffsets;
 			uint32_t vertexOffset = 0;
-			uint32_t indexOffset = 0;
-			uint32_t modelMatrixIndex = 0;
+			uint32_t indexByteOffset = 0;
 			for (auto model : _currentScene->models){
-				glm::mat4 modelMatrix = _currentScene->modelMatrices[modelMatrixIndex];
+				vertexOffsets.push_back(vertexOffset);
+				indexByteOffsets.push_back(indexByteOffset);
+				vertexOffset += model->_vertexCount;
+				indexByteOffset += model->_indexBytes;
+			}
+			for (size_t instance = 0; instance < _currentScene->instanceModels.size(); instance++){
+				uint32_t modelIndex = _currentScene->instanceModels[instance];
+				Model* model = _currentScene->models[modelIndex];
+				glm::mat4 modelMatrix = _currentScene->modelMatrices[instance];
 				for (auto node : model->_linearNodes)
 				{
+					// skinned nodes draw the instance's posed copy, which is in model space already
+					bool posed = node->skin >= 0 && !_currentScene->instancePosedVertices.empty();
 					for(auto primitive : node->primitives)
 					{
-						PushConstants.model = modelMatrix * node->getMatrix();
+						PushConstants.model = posed ? modelMatrix : modelMatrix * node->getMatrix();
 						cmd.pushConstants(_rasterizerPipelineLayout, vk::ShaderStageFlagBits::eVertex, 0, sizeof(vkutils::PushConstants), &PushConstants);
-						cmd.drawIndexed(primitive->indexCount, 1, indexOffset + primitive->firstIndex, vertexOffset, 0);
+						// the index width can change per primitive, so the index buffer is bound per draw
+						cmd.bindIndexBuffer(_currentScene->indexBuffer.buffer, _currentScene->indexBuffer.offset + indexByteOffsets[modelIndex] + primitive->indexByteOffset, primitive->indexType);
+						uint32_t firstVertex = posed ? _currentScene->posedVertex(static_cast<uint32_t>(instance), primitive) : vertexOffsets[modelIndex] + primitive->firstVertex;
+						cmd.drawIndexed(primitive->indexCount, 1, 0, firstVertex, 0);
 					}
 				}
-				vertexOffset += (uint32_t) model->_vertices.size();
-				indexOffset += (uint32_t) model->_indices.size();
-				modelMatrixIndex += 1;
 			}
 			cmd.endRenderPass();
 		}
@@ -180,6 +275,9 @@ void VulkanEngine::draw()
 			cmd.bindDescriptorSets(vk::PipelineBindPoint::eRayTracingKHR, _raytracerPipelineLayout, 0, 1, &get_current_frame()._raytracerDescriptor, 0, 0);
 			cmd.pushConstants(_raytracerPipelineLayout, vk::ShaderStageFlagBits::eRaygenKHR, 0, sizeof(vkutils::PushConstants), &PushConstants);
 			cmd.traceRaysKHR(&raygenShaderSbtEntry, &missShaderSbtEntry, &hitShaderSbtEntry, &callableShaderSbtEntry, _core._windowExtent.width, _core._windowExtent.height, 1);
+			// texture feedback is read back on the host once this frame's fence signaled
+			vk::MemoryBarrier feedbackBarrier(vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eHostRead);
+			cmd.pipelineBarrier(vk::PipelineStageFlagBits::eRayTracingShaderKHR, vk::PipelineStageFlagBits::eHost, {}, feedbackBarrier, nullptr, nullptr);
 
 			// compute pipeline dispatch
 			ComputeConstants.deltaTime = static_cast<float>(_deltaTime);
@@ -236,19 +334,45 @@ void VulkanEngine::draw()
 	cmd.end();
 
 	vk::SubmitInfo submit = vkinit::submit_info(&cmd);
-	vk::PipelineStageFlags waitStage = vk::PipelineStageFlagBits::eColorAttachmentOutput;
-	submit.setWaitDstStageMask(waitStage);
-	submit.setWaitSemaphores(get_current_frame()._presentSemaphore);
-	submit.setSignalSemaphores(get_current_frame()._renderSemaphore);
-
-	_core._graphicsQueue.submit(submit, get_current_frame()._renderFence);
+	std::vector<vk::Semaphore> waitSemaphores = {get_current_frame()._presentSemaphore};
+	std::vector<vk::PipelineStageFlags> waitStages = {vk::PipelineStageFlagBits::eColorAttachmentOutput};
+	for (vk::Semaphore semaphore : _streamingWaits)
+	{
+		waitSemaphores.push_back(semaphore);
+		waitStages.push_back(vk::PipelineStageFlagBits::eRayTracingShaderKHR);
+	}
+	_streamingWaits.clear();
+	submit.setWaitDstStageMask(waitStages);
+	submit.setWaitSemaphores(waitSemaphores);
+	// binary semaphores ignore their value
+	std::array<vk::Semaphore, 2> signalSemaphores = {get_current_frame()._renderSemaphore, _frameTimeline};
+	std::array<uint64_t, 2> signalValues = {0, _frameTimelineValue + 1};
+	vk::TimelineSemaphoreSubmitInfo timelineInfo;
+	timelineInfo.setSignalSemaphoreValues(signalValues);
+	submit.setSignalSemaphores(signalSemaphores);
+	submit.pNext = &timelineInfo;
 
 	vk::PresentInfoKHR presentInfo = vkinit::present_info();
 	presentInfo.setSwapchains(_core._swapchain);
 	presentInfo.setWaitSemaphores(get_current_frame()._renderSemaphore);
 	presentInfo.setImageIndices(swapchainImageIndex);
+	// every swapchain retired so far is older than this one, the fence of this present covers them all
+	vk::SwapchainPresentFenceInfoEXT presentFenceInfo;
+	if (_core._swapchainMaintenance1 && _presentFenceRetires == 0 && !_retiredSwapchains.empty())
+	{
+		presentFenceInfo.setFences(_presentFence);
+		presentInfo.pNext = &presentFenceInfo;
+		_presentFenceRetires = _retiredSwapchains.size();
+	}
 
-	vk::Result queuePresentResult = _core._presentQueue.presentKHR(presentInfo);
+	vk::Result queuePresentResult;
+	{
+		// the loader thread may be submitting to the same queue
+		std::lock_guard<std::mutex> lock(_core._queueMutex);
+		_core._graphicsQueue.submit(submit);
+		_frameTimelineValue++;
+		queuePresentResult = _core._presentQueue.presentKHR(presentInfo);
+	}
 	if (queuePresentResult == vk::Result::eErrorOutOfDateKHR || queuePresentResult == vk::Result::eSuboptimalKHR || _framebufferResized) {
 		_framebufferResized = false;
 		recreateSwapchain();
@@ -280,6 +404,13 @@ void VulkanEngine::run()
 						_gui.settings.renderer = 0;
 					}
 				}
+				else if (e.key.key == SDLK_L && !_sceneSetups.empty())
+				{
+					if (load_scene_async((_sceneSetup + 1) % _sceneSetups.size()))
+					{
+						_sceneSetup = (_sceneSetup + 1) % _sceneSetups.size();
+					}
+				}
 			}
 			else if(e.type == SDL_EVENT_WINDOW_RESIZED || e.type == SDL_EVENT_WINDOW_PIXEL_SIZE_CHANGED)
 			{
@@ -314,6 +445,15 @@ void VulkanEngine::run()
 		}
 		_cam.update();
 		_gui.update();
+		if (_gui.settings.load_instance_benchmark)
+		{
+			_gui.settings.load_instance_benchmark = false;
+			if (load_scene_async(_instanceBenchmarkSetup))
+			{
+				_sceneSetup = _instanceBenchmarkSetup;
+				_gui.settings.animate_instances = true;
+			}
+		}
 		draw();
 	}
 }
@@ -338,6 +478,20 @@ void VulkanEngine::init_vulkan()
 	{
 		_core._instanceExtensions.emplace_back(SDLExtension);
 	}
+	// present fences come with swapchain maintenance, which needs the surface side of it on the instance
+	bool surfaceMaintenance1 = false;
+	bool surfaceCapabilities2 = false;
+	for (auto extensionProperty : vk::enumerateInstanceExtensionProperties())
+	{
+		surfaceMaintenance1 |= std::string(extensionProperty.extensionName.data()) == std::string(VK_EXT_SURFACE_MAINTENANCE_1_EXTENSION_NAME);
+		surfaceCapabilities2 |= std::string(extensionProperty.extensionName.data()) == std::string(VK_KHR_GET_SURFACE_CAPABILITIES_2_EXTENSION_NAME);
+	}
+	surfaceMaintenance1 = surfaceMaintenance1 && surfaceCapabilities2;
+	if (surfaceMaintenance1)
+	{
+		_core._instanceExtensions.push_back(VK_EXT_SURFACE_MAINTENANCE_1_EXTENSION_NAME);
+		_core._instanceExtensions.push_back(VK_KHR_GET_SURFACE_CAPABILITIES_2_EXTENSION_NAME);
+	}
 	std::sort(_core._instanceExtensions.begin(), _core._instanceExtensions.end());
 	_core._instanceExtensions.erase(std::unique(_core._instanceExtensions.begin(), _core._instanceExtensions.end()), _core._instanceExtensions.end());
 
@@ -400,10 +554,22 @@ void VulkanEngine::init_vulkan()
 	vkutils::QueueFamilyIndices indices = vkutils::findQueueFamilies(_core._chosenGPU, _core._surface);
 	std::vector<vk::DeviceQueueCreateInfo> queueCreateInfos;
 	std::set<uint32_t> uniqueQueueFamilies = {indices.graphicsFamily.value(), indices.presentFamily.value()};
-	float queuePriority = 1.0f;
+	// uploads and acceleration structure builds go to families without graphics when there are some
+	if (indices.transferFamily)
+	{
+		uniqueQueueFamilies.insert(indices.transferFamily.value());
+	}
+	if (indices.computeFamily)
+	{
+		uniqueQueueFamilies.insert(indices.computeFamily.value());
+	}
+	// a second graphics queue, when the family has one, lets background scene loads overlap rendering
+	bool separateLoadQueue = _core._chosenGPU.getQueueFamilyProperties()[indices.graphicsFamily.value()].queueCount > 1;
+	std::array<float, 2> queuePriorities = {1.0f, 0.5f};
 	for (uint32_t queueFamily : uniqueQueueFamilies)
 	{
-		vk::DeviceQueueCreateInfo queueCreateInfo({}, queueFamily, 1, &queuePriority);
+		uint32_t queueCount = queueFamily == indices.graphicsFamily.value() && separateLoadQueue ? 2 : 1;
+		vk::DeviceQueueCreateInfo queueCreateInfo({}, queueFamily, queueCount, queuePriorities.data());
 		queueCreateInfos.push_back(queueCreateInfo);
 	}
 
@@ -413,6 +579,18 @@ void VulkanEngine::init_vulkan()
 	{
 		if (std::string(extensionProperty.extensionName.data()) == std::string(VK_KHR_PORTABILITY_SUBSET_EXTENSION_NAME))
 			_core._deviceExtensions.push_back(VK_KHR_PORTABILITY_SUBSET_EXTENSION_NAME);
+		if (surfaceMaintenance1 && std::string(extensionProperty.extensionName.data()) == std::string(VK_EXT_SWAPCHAIN_MAINTENANCE_1_EXTENSION_NAME))
+			_core._swapchainMaintenance1 = true;
+	}
+	// without it resizes wait for the present queue before they retire the old swapchain
+	if (_core._swapchainMaintenance1)
+	{
+		auto features = _core._chosenGPU.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceSwapchainMaintenance1FeaturesEXT>();
+		_core._swapchainMaintenance1 = features.get<vk::PhysicalDeviceSwapchainMaintenance1FeaturesEXT>().swapchainMaintenance1;
+	}
+	if (_core._swapchainMaintenance1)
+	{
+		_core._deviceExtensions.push_back(VK_EXT_SWAPCHAIN_MAINTENANCE_1_EXTENSION_NAME);
 	}
 
 	vk::DeviceCreateInfo createInfo;
@@ -424,15 +602,23 @@ void VulkanEngine::init_vulkan()
 	{
 		createInfo = vk::DeviceCreateInfo({}, queueCreateInfos, {}, _core._deviceExtensions, {});
 	}
-	vk::StructureChain<vk::DeviceCreateInfo, vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceRayTracingPipelineFeaturesKHR, vk::PhysicalDeviceAccelerationStructureFeaturesKHR, vk::PhysicalDeviceBufferDeviceAddressFeatures, vk::PhysicalDeviceDescriptorIndexingFeatures, vk::PhysicalDeviceShaderAtomicFloatFeaturesEXT> deviceCreateInfo = {
+	// block compressed textures are optional, the model loader falls back to the uncompressed images without them
+	bool textureCompressionBC = _core._chosenGPU.getFeatures().textureCompressionBC;
+	vk::StructureChain<vk::DeviceCreateInfo, vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceRayTracingPipelineFeaturesKHR, vk::PhysicalDeviceAccelerationStructureFeaturesKHR, vk::PhysicalDeviceBufferDeviceAddressFeatures, vk::PhysicalDeviceDescriptorIndexingFeatures, vk::PhysicalDeviceShaderAtomicFloatFeaturesEXT, vk::PhysicalDeviceTimelineSemaphoreFeatures, vk::PhysicalDeviceSwapchainMaintenance1FeaturesEXT> deviceCreateInfo = {
 		createInfo,
-		vk::PhysicalDeviceFeatures2().setFeatures(vk::PhysicalDeviceFeatures().setSamplerAnisotropy(true).setShaderInt64(true)),
+		vk::PhysicalDeviceFeatures2().setFeatures(vk::PhysicalDeviceFeatures().setSamplerAnisotropy(true).setShaderInt64(true).setTextureCompressionBC(textureCompressionBC)),
 		vk::PhysicalDeviceRayTracingPipelineFeaturesKHR().setRayTracingPipeline(true),
 		vk::PhysicalDeviceAccelerationStructureFeaturesKHR().setAccelerationStructure(true),
 		vk::PhysicalDeviceBufferDeviceAddressFeatures().setBufferDeviceAddress(true),
 		vk::PhysicalDeviceDescriptorIndexingFeatures().setRuntimeDescriptorArray(true),
-		vk::PhysicalDeviceShaderAtomicFloatFeaturesEXT().setShaderBufferFloat32Atomics(true).setShaderBufferFloat32AtomicAdd(true)
+		vk::PhysicalDeviceShaderAtomicFloatFeaturesEXT().setShaderBufferFloat32Atomics(true).setShaderBufferFloat32AtomicAdd(true),
+		vk::PhysicalDeviceTimelineSemaphoreFeatures().setTimelineSemaphore(true),
+		vk::PhysicalDeviceSwapchainMaintenance1FeaturesEXT().setSwapchainMaintenance1(true)
 	};
+	if (!_core._swapchainMaintenance1)
+	{
+		deviceCreateInfo.unlink<vk::PhysicalDeviceSwapchainMaintenance1FeaturesEXT>();
+	}
 	auto _physicalDeviceProperties = _core._chosenGPU.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceRayTracingPipelinePropertiesKHR, vk::PhysicalDeviceAccelerationStructurePropertiesKHR, vk::PhysicalDeviceDescriptorIndexingProperties>();
 	_raytracingPipelineProperties = _physicalDeviceProperties.get<vk::PhysicalDeviceRayTracingPipelinePropertiesKHR>();
 	try
@@ -445,7 +631,17 @@ void VulkanEngine::init_vulkan()
 	}
 	VULKAN_HPP_DEFAULT_DISPATCHER.init(_core._device);
 	_core._graphicsQueue = _core._device.getQueue(indices.graphicsFamily.value(), 0);
+	_core._graphicsQueueFamily = indices.graphicsFamily.value();
 	_core._presentQueue = _core._device.getQueue(indices.presentFamily.value(), 0);
+	_core._presentQueueFamily = indices.presentFamily.value();
+	_core._loadQueue = separateLoadQueue ? _core._device.getQueue(indices.graphicsFamily.value(), 1) : _core._graphicsQueue;
+	std::cout << "Scenes load through " << (separateLoadQueue ? "a second graphics queue" : "the graphics queue") << std::endl;
+	_core._transferQueueFamily = indices.transferFamily.value_or(_core._graphicsQueueFamily);
+	_core._transferQueue = indices.transferFamily ? _core._device.getQueue(_core._transferQueueFamily, 0) : _core._loadQueue;
+	_core._computeQueueFamily = indices.computeFamily.value_or(_core._graphicsQueueFamily);
+	_core._computeQueue = indices.computeFamily ? _core._device.getQueue(_core._computeQueueFamily, 0) : _core._loadQueue;
+	std::cout << "Uploads copy on " << (indices.transferFamily ? "a dedicated transfer queue" : "the load queue") << ", acceleration structures build on " << (indices.computeFamily ? "an async compute queue" : "the load queue") << std::endl;
+	std::cout << "Resized swapchains retire " << (_core._swapchainMaintenance1 ? "on present fences" : "after a present queue wait") << std::endl;
 
 	vma::AllocatorCreateInfo allocatorInfo = vma::AllocatorCreateInfo(vma::AllocatorCreateFlagBits::eExtMemoryBudget | vma::AllocatorCreateFlagBits::eBufferDeviceAddress, _core._chosenGPU, _core._device, {}, {}, {}, {}, {}, _core._instance, VK_API_VERSION_1_2);
 	try
@@ -457,7 +653,11 @@ void VulkanEngine::init_vulkan()
 		std::cerr << "Exception Thrown: " << e.what();
 	}
 
-	std::vector<vma::Budget> heapBudgets = _core._allocator.getHeapBudgets();
+	_core._memoryTelemetry.init(_core._allocator, _core._chosenGPU);
+	for (const vkutils::MemoryTelemetry::Heap& heap : _core._memoryTelemetry.snapshot().heaps)
+	{
+		std::cout << (heap.deviceLocal ? "Device local" : "Host") << " heap: " << heap.size / (1024 * 1024) << " MB, budget " << heap.budget / (1024 * 1024) << " MB" << std::endl;
+	}
 
 }
 
@@ -499,6 +699,8 @@ void VulkanEngine::init_swapchain()
 	createInfo.compositeAlpha = vk::CompositeAlphaFlagBitsKHR::eOpaque;
 	createInfo.presentMode = presentMode;
 	createInfo.clipped = VK_TRUE;
+	// null on the first call, on a resize the retired swapchain stays alive until its last frame finished
+	createInfo.oldSwapchain = _core._swapchain;
 	try
 	{
 		_core._swapchain = _core._device.createSwapchainKHR(createInfo);
@@ -507,8 +709,10 @@ void VulkanEngine::init_swapchain()
 	{
 		std::cerr << "Exception Thrown: " << e.what();
 	}
+	// the deletors capture the handles, by the time a resize retires them the members hold the new ones
+	vk::SwapchainKHR swapchain = _core._swapchain;
 	_resizeDeletionQueue.push_function([=](){
-		_core._device.destroySwapchainKHR(_core._swapchain);
+		_core._device.destroySwapchainKHR(swapchain);
 	});
 
 	_core._swapchainImageFormat = surfaceFormat.format;
@@ -525,9 +729,10 @@ void VulkanEngine::init_swapchain()
 	vk::ImageCreateInfo dimg_info = vkinit::image_create_info(_depthFormat, vk::ImageUsageFlagBits::eDepthStencilAttachment, vk::Extent3D{_core._windowExtent.width, _core._windowExtent.height, 1});
 	_depthImage = vkutils::createImage(_core, dimg_info, vk::ImageAspectFlagBits::eDepth, vma::MemoryUsage::eAutoPreferDevice);
 
+	vkutils::AllocatedImage depthImage = _depthImage;
 	_resizeDeletionQueue.push_function([=]() {
-		_core._device.destroyImageView(_depthImage._view);
-		_core._allocator.destroyImage(_depthImage._image, _depthImage._allocation);
+		_core._device.destroyImageView(depthImage._view);
+		vkutils::destroyImage(_core, depthImage);
 	});
 }
 
@@ -550,9 +755,11 @@ void VulkanEngine::init_framebuffers()
 		{
 			std::cerr << "Exception Thrown: " << e.what();
 		}
+		vk::Framebuffer framebuffer = _core._framebuffers[i];
+		vk::ImageView imageView = _core._swapchainImageViews[i];
 		_resizeDeletionQueue.push_function([=](){
-			_core._device.destroyFramebuffer(_core._framebuffers[i]);
-			_core._device.destroyImageView(_core._swapchainImageViews[i]);
+			_core._device.destroyFramebuffer(framebuffer);
+			_core._device.destroyImageView(imageView);
 		});
 	}
 }
@@ -623,8 +830,9 @@ void VulkanEngine::init_default_renderpass()
 	{
 		std::cerr << "Exception Thrown: " << e.what();
 	}
+	vk::RenderPass renderPass = _renderPass;
 	_resizeDeletionQueue.push_function([=](){
-		_core._device.destroyRenderPass(_renderPass, nullptr);
+		_core._device.destroyRenderPass(renderPass, nullptr);
 	});
 }
 
@@ -644,6 +852,27 @@ void VulkanEngine::init_commands()
 		_core._device.destroyCommandPool(_core._cmdPool, nullptr);
 	});
 
+	_core._loadCmdPool = _core._device.createCommandPool(vkinit::command_pool_create_info(_core._graphicsQueueFamily));
+	_mainDeletionQueue.push_function([=](){
+		_core._device.destroyCommandPool(_core._loadCmdPool, nullptr);
+	});
+	_core._transferCmdPool = _core._loadCmdPool;
+	if (_core._transferQueueFamily != _core._graphicsQueueFamily)
+	{
+		_core._transferCmdPool = _core._device.createCommandPool(vkinit::command_pool_create_info(_core._transferQueueFamily));
+		_mainDeletionQueue.push_function([=](){
+			_core._device.destroyCommandPool(_core._transferCmdPool, nullptr);
+		});
+	}
+	_core._computeCmdPool = _core._loadCmdPool;
+	if (_core._computeQueueFamily != _core._graphicsQueueFamily)
+	{
+		_core._computeCmdPool = _core._device.createCommandPool(vkinit::command_pool_create_info(_core._computeQueueFamily));
+		_mainDeletionQueue.push_function([=](){
+			_core._device.destroyCommandPool(_core._computeCmdPool, nullptr);
+		});
+	}
+
 	commandPoolInfo = vkinit::command_pool_create_info(_core._graphicsQueueFamily, vk::CommandPoolCreateFlagBits::eResetCommandBuffer);
 
 	for (int i = 0; i < FRAME_OVERLAP; i++) {
@@ -673,21 +902,26 @@ void VulkanEngine::init_commands()
 
 void VulkanEngine::init_sync_structures()
 {
-	vk::FenceCreateInfo fenceCreateInfo = vkinit::fence_create_info(vk::FenceCreateFlagBits::eSignaled);
 	vk::SemaphoreCreateInfo semaphoreCreateInfo = vkinit::semaphore_create_info();
 
-	for (int i = 0; i < FRAME_OVERLAP; i++) {
-		try
-		{
-			_frames[i]._renderFence = _core._device.createFence(fenceCreateInfo);
-		}
-		catch (std::exception &e)
-		{
-			std::cerr << "Exception Thrown: " << e.what();
-		}
-		_resizeDeletionQueue.push_function([=](){
-			_core._device.destroyFence(_frames[i]._renderFence, nullptr);
+	// the timeline outlives resizes, only the binary semaphores of the swapchain are recreated with it
+	if (!_frameTimeline)
+	{
+		vk::SemaphoreTypeCreateInfo timelineInfo(vk::SemaphoreType::eTimeline, 0);
+		_frameTimeline = _core._device.createSemaphore(vk::SemaphoreCreateInfo({}, &timelineInfo));
+		_mainDeletionQueue.push_function([=](){
+			_core._device.destroySemaphore(_frameTimeline, nullptr);
+		});
+	}
+	if (_core._swapchainMaintenance1 && !_presentFence)
+	{
+		_presentFence = _core._device.createFence(vk::FenceCreateInfo());
+		_mainDeletionQueue.push_function([=](){
+			_core._device.destroyFence(_presentFence, nullptr);
 		});
+	}
+
+	for (int i = 0; i < FRAME_OVERLAP; i++) {
 		try
 		{
 			_frames[i]._presentSemaphore = _core._device.createSemaphore(semaphoreCreateInfo);
@@ -697,10 +931,12 @@ void VulkanEngine::init_sync_structures()
 		{
 			std::cerr << "Exception Thrown: " << e.what();
 		}
+		vk::Semaphore presentSemaphore = _frames[i]._presentSemaphore;
+		vk::Semaphore renderSemaphore = _frames[i]._renderSemaphore;
 		_resizeDeletionQueue.push_function([=]()
 		{
-			_core._device.destroySemaphore(_frames[i]._presentSemaphore, nullptr);
-			_core._device.destroySemaphore(_frames[i]._renderSemaphore, nullptr);
+			_core._device.destroySemaphore(presentSemaphore, nullptr);
+			_core._device.destroySemaphore(renderSemaphore, nullptr);
 		});
 	}
 }
@@ -715,9 +951,9 @@ void VulkanEngine::init_gui()
 
 void VulkanEngine::init_accumulation_image()
 {
-	_accumulationImage = createStorageImage(vk::Format::eR32G32B32A32Sfloat, 3840, 2160);
+	_accumulationImage = createStorageImage(vk::Format::eR32G32B32A32Sfloat, 3840, 2160, vkutils::MemoryCategory::eAccumulation);
 	_mainDeletionQueue.push_function([=]() {
-		_core._allocator.destroyImage(_accumulationImage._image, _accumulationImage._allocation);
+		vkutils::destroyImage(_core, _accumulationImage);
 		_core._device.destroyImageView(_accumulationImage._view);
 	});
 }
@@ -768,7 +1004,7 @@ void VulkanEngine::init_hdr_map()
 	_hdrMap = vkutils::imageFromData(_core, pixels, imageCreateInfo, vk::ImageAspectFlagBits::eColor, vma::MemoryUsage::eAutoPreferDevice);
 
 	_mainDeletionQueue.push_function([=]() {
-		_core._allocator.destroyImage(_hdrMap._image, _hdrMap._allocation);
+		vkutils::destroyImage(_core, _hdrMap);
 		_core._device.destroyImageView(_hdrMap._view);
 		_core._device.destroySampler(_envMapSampler);
 	});
@@ -785,6 +1021,7 @@ void VulkanEngine::init_ubo() {
 	_settingsUBO.exposure = _gui.settings.exposure;
 	_settingsUBO.mips = _gui.settings.mips;
 	_settingsUBO.mips_sensitivity = _gui.settings.mips_sensitivity;
+	_settingsUBO.texture_lod = _gui.settings.texture_lod;
 	_settingsUBO.tonemapper = _gui.settings.tm_operator;
 	switch (_gui.settings.tm_operator)
 	{
@@ -821,13 +1058,108 @@ void VulkanEngine::init_ubo() {
 	_settingsBuffer = vkutils::hostBufferFromData(_core, &_settingsUBO, sizeof(vkutils::Shadersettings), vk::BufferUsageFlagBits::eUniformBuffer, vma::MemoryUsage::eAutoPreferDevice, vma::AllocationCreateFlagBits::eHostAccessSequentialWrite);
 
 	_mainDeletionQueue.push_function([=]() {
-		_core._allocator.destroyBuffer(_settingsBuffer._buffer, _settingsBuffer._allocation);
+		vkutils::destroyBuffer(_core, _settingsBuffer);
 	});
 }
 
 void VulkanEngine::init_pipelines()
 {
-	// init rasterization pipeline
+	// the startup scene goes through _loadedPipelines like the ones loaded in the background
+	_loadedPipelines = build_scene_pipelines(*_currentScene, _shaderIncludes);
+	use_scene_pipelines(_loadedPipelines);
+
+	// init compute Pipeline
+	{
+		vk::DescriptorSetLayoutBinding histogramBufferBinding;
+		histogramBufferBinding.binding = 0;
+		histogramBufferBinding.descriptorType = vk::DescriptorType::eStorageBuffer;
+		histogramBufferBinding.descriptorCount = 1;
+		histogramBufferBinding.stageFlags = vk::ShaderStageFlagBits::eCompute;
+
+		vk::DescriptorSetLayoutBinding resultImageLayoutBinding;
+		resultImageLayoutBinding.binding = 1;
+		resultImageLayoutBinding.descriptorType = vk::DescriptorType::eStorageImage;
+		resultImageLayoutBinding.descriptorCount = 1;
+		resultImageLayoutBinding.stageFlags = vk::ShaderStageFlagBits::eCompute;
+
+		vk::DescriptorSetLayoutBinding accumulationImageLayoutBinding;
+		accumulationImageLayoutBinding.binding = 2;
+		accumulationImageLayoutBinding.descriptorType = vk::DescriptorType::eStorageImage;
+		accumulationImageLayoutBinding.descriptorCount = 1;
+		accumulationImageLayoutBinding.stageFlags = vk::ShaderStageFlagBits::eCompute;
+
+		vk::DescriptorSetLayoutBinding settingsBufferBinding;
+		settingsBufferBinding.binding = 3;
+		settingsBufferBinding.descriptorType = vk::DescriptorType::eUniformBuffer;
+		settingsBufferBinding.descriptorCount = 1;
+		settingsBufferBinding.stageFlags = vk::ShaderStageFlagBits::eCompute;
+
+		std::vector<vk::DescriptorSetLayoutBinding> bindings({
+			histogramBufferBinding,
+			resultImageLayoutBinding,
+			accumulationImageLayoutBinding,
+			settingsBufferBinding
+		});
+
+		vk::DescriptorSetLayoutCreateInfo setinfo;
+		setinfo.setBindings(bindings);
+		_computeSetLayout = _core._device.createDescriptorSetLayout(setinfo);
+
+		vk::ShaderModule histogramShaderModule = load_shader_module(vk::ShaderStageFlagBits::eCompute, "/luminanceHistogram.comp");
+		vk::PipelineShaderStageCreateInfo histogramShaderStageInfo = vkinit::pipeline_shader_stage_create_info(vk::ShaderStageFlagBits::eCompute, histogramShaderModule);
+
+		vk::ShaderModule averageShaderModule = load_shader_module(vk::ShaderStageFlagBits::eCompute, "/luminanceAverage.comp");
+		vk::PipelineShaderStageCreateInfo averageShaderStageInfo = vkinit::pipeline_shader_stage_create_info(vk::ShaderStageFlagBits::eCompute, averageShaderModule);
+
+		vk::ShaderModule postprocessingShaderModule = load_shader_module(vk::ShaderStageFlagBits::eCompute, "/postprocessing.comp");
+		vk::PipelineShaderStageCreateInfo postprocessingShaderStageInfo = vkinit::pipeline_shader_stage_create_info(vk::ShaderStageFlagBits::eCompute, postprocessingShaderModule);
+
+		vk::PipelineLayoutCreateInfo pipelineLayoutInfo({}, _computeSetLayout);
+		vk::PushConstantRange push_constants{vk::ShaderStageFlagBits::eCompute, 0, sizeof(vkutils::ComputeConstants)};
+		pipelineLayoutInfo.setPushConstantRanges(push_constants);
+
+		_computePipelineLayout = _core._device.createPipelineLayout(pipelineLayoutInfo);
+		
+		vk::ComputePipelineCreateInfo pipelineInfos[3];
+		pipelineInfos[0] = vk::ComputePipelineCreateInfo({}, histogramShaderStageInfo, _computePipelineLayout);
+		pipelineInfos[1] = vk::ComputePipelineCreateInfo({}, averageShaderStageInfo, _computePipelineLayout);
+		pipelineInfos[2] = vk::ComputePipelineCreateInfo({}, postprocessingShaderStageInfo, _computePipelineLayout);
+		try
+		{
+			for (size_t i = 0; i < 3; i++)
+			{
+				vk::Result result;
+				std::tie(result, _computePipelines[i]) = _core._device.createComputePipeline({}, pipelineInfos[i]);
+				if (result != vk::Result::eSuccess)
+				{
+					throw std::runtime_error("failed to create compute Pipeline!");
+				}
+			}
+		}
+		catch (std::exception &e)
+		{
+			std::cerr << "Exception Thrown: " << e.what();
+		}
+
+		_core._device.destroyShaderModule(histogramShaderModule);
+		_core._device.destroyShaderModule(averageShaderModule);
+		_core._device.destroyShaderModule(postprocessingShaderModule);
+
+		_mainDeletionQueue.push_function([=]() {
+			for(auto pipeline : _computePipelines){
+				_core._device.destroyPipeline(pipeline);
+			}
+			_core._device.destroyPipelineLayout(_computePipelineLayout);
+			_core._device.destroyDescriptorSetLayout(_computeSetLayout);
+		});
+	}
+
+}
+
+VulkanEngine::ScenePipelines VulkanEngine::build_scene_pipelines(const Scene& scene, const std::map<std::string, std::string>& includes)
+{
+	ScenePipelines pipelines;
+	// rasterization pipeline layout and shaders
 	{
 		vk::DescriptorSetLayoutBinding materialBufferBinding;
 		materialBufferBinding.binding = 0;
@@ -838,49 +1170,17 @@ void VulkanEngine::init_pipelines()
 		vk::DescriptorSetLayoutCreateInfo setinfo;
 		setinfo.setBindings(materialBufferBinding);
 
-		_rasterizerSetLayout = _core._device.createDescriptorSetLayout(setinfo);
+		pipelines.rasterizerSetLayout = _core._device.createDescriptorSetLayout(setinfo);
 
-		vk::ShaderModule vertexShader = load_shader_module(vk::ShaderStageFlagBits::eVertex, "/triangle.vert");
-		vk::ShaderModule fragShader = load_shader_module(vk::ShaderStageFlagBits::eFragment, "/triangle.frag");
+		pipelines.rasterizerShaders[0] = load_shader_module(vk::ShaderStageFlagBits::eVertex, "/triangle.vert", includes);
+		pipelines.rasterizerShaders[1] = load_shader_module(vk::ShaderStageFlagBits::eFragment, "/triangle.frag", includes);
 
 		vk::PipelineLayoutCreateInfo pipeline_layout_info = vkinit::pipeline_layout_create_info();
-		pipeline_layout_info.setSetLayouts(_rasterizerSetLayout);
+		pipeline_layout_info.setSetLayouts(pipelines.rasterizerSetLayout);
 		vk::PushConstantRange push_constants{vk::ShaderStageFlagBits::eVertex, 0, sizeof(vkutils::PushConstants)};
 		pipeline_layout_info.setPushConstantRanges(push_constants);
 
-		_rasterizerPipelineLayout = _core._device.createPipelineLayout(pipeline_layout_info);
-
-		VertexInputDescription vertexDescription = Vertex::get_vertex_description();
-
-		std::vector<vk::DynamicState> dynamicStates = {
-            vk::DynamicState::eViewport,
-            vk::DynamicState::eScissor
-        };
-        vk::PipelineDynamicStateCreateInfo dynamicState;
-        dynamicState.setDynamicStates(dynamicStates);
-
-		vkutils::PipelineBuilder pipelineBuilder;
-		pipelineBuilder._shaderStages.push_back(vkinit::pipeline_shader_stage_create_info(vk::ShaderStageFlagBits::eVertex, vertexShader));
-		pipelineBuilder._shaderStages.push_back(vkinit::pipeline_shader_stage_create_info(vk::ShaderStageFlagBits::eFragment, fragShader));
-		pipelineBuilder._vertexInputInfo.setVertexAttributeDescriptions(vertexDescription.attributes);
-		pipelineBuilder._vertexInputInfo.setVertexBindingDescriptions(vertexDescription.bindings);
-		pipelineBuilder._inputAssembly = vkinit::input_assembly_create_info(vk::PrimitiveTopology::eTriangleList);
-		pipelineBuilder._rasterizer = vkinit::rasterization_state_create_info(vk::PolygonMode::eFill);
-		pipelineBuilder._multisampling = vkinit::multisampling_state_create_info();
-		pipelineBuilder._colorBlendAttachment = vkinit::color_blend_attachment_state();
-		pipelineBuilder._pipelineLayout = _rasterizerPipelineLayout;
-		pipelineBuilder._dynamicStates = std::vector<vk::DynamicState> {vk::DynamicState::eViewport, vk::DynamicState::eScissor};
-		pipelineBuilder._depthStencil = vkinit::depth_stencil_create_info(true, true, vk::CompareOp::eLessOrEqual);
-		_rasterizerPipeline = pipelineBuilder.build_pipeline(_core._device, _renderPass);
-
-		_core._device.destroyShaderModule(fragShader);
-		_core._device.destroyShaderModule(vertexShader);
-
-		_mainDeletionQueue.push_function([=]() {
-			_core._device.destroyPipeline(_rasterizerPipeline);
-			_core._device.destroyPipelineLayout(_rasterizerPipelineLayout);
-			_core._device.destroyDescriptorSetLayout(_rasterizerSetLayout);
-		});
+		pipelines.rasterizerPipelineLayout = _core._device.createPipelineLayout(pipeline_layout_info);
 	}
 
 	// init raytracing pipeline
@@ -906,7 +1206,7 @@ void VulkanEngine::init_pipelines()
 		vk::DescriptorSetLayoutBinding vertexBufferBinding;
 		vertexBufferBinding.binding = 3;
 		vertexBufferBinding.descriptorType = vk::DescriptorType::eStorageBuffer;
-		vertexBufferBinding.descriptorCount = 1;
+		vertexBufferBinding.descriptorCount = scene.vertexLayout.streamCount();
 		vertexBufferBinding.stageFlags = vk::ShaderStageFlagBits::eClosestHitKHR | vk::ShaderStageFlagBits::eAnyHitKHR;
 
 		vk::DescriptorSetLayoutBinding materialBufferBinding;
@@ -937,10 +1237,16 @@ void VulkanEngine::init_pipelines()
 		vk::DescriptorSetLayoutBinding textureLayoutBinding{};
         textureLayoutBinding.binding = 8;
         textureLayoutBinding.descriptorType = vk::DescriptorType::eCombinedImageSampler;
-        textureLayoutBinding.descriptorCount = static_cast<uint32_t>(_currentScene->textures.size());
+        textureLayoutBinding.descriptorCount = static_cast<uint32_t>(scene.textures.size());
         textureLayoutBinding.pImmutableSamplers = nullptr;
         textureLayoutBinding.stageFlags = vk::ShaderStageFlagBits::eClosestHitKHR | vk::ShaderStageFlagBits::eAnyHitKHR;
 
+		vk::DescriptorSetLayoutBinding textureFeedbackBinding;
+		textureFeedbackBinding.binding = 9;
+		textureFeedbackBinding.descriptorType = vk::DescriptorType::eStorageBuffer;
+		textureFeedbackBinding.descriptorCount = 1;
+		textureFeedbackBinding.stageFlags = vk::ShaderStageFlagBits::eClosestHitKHR | vk::ShaderStageFlagBits::eAnyHitKHR;
+
 		std::vector<vk::DescriptorSetLayoutBinding> bindings({
 			accelerationStructureLayoutBinding,
 			accumulationImageLayoutBinding,
@@ -950,27 +1256,28 @@ void VulkanEngine::init_pipelines()
 			lightBufferBinding,
 			hdrMapLayoutBinding,
 			settingsBufferBinding,
-			textureLayoutBinding
+			textureLayoutBinding,
+			textureFeedbackBinding
 		});
 
 		vk::DescriptorSetLayoutCreateInfo setinfo;
 		setinfo.setBindings(bindings);
 
-		_raytracerSetLayout = _core._device.createDescriptorSetLayout(setinfo);
+		pipelines.raytracerSetLayout = _core._device.createDescriptorSetLayout(setinfo);
 
 		vk::PipelineLayoutCreateInfo pipeline_layout_info = vkinit::pipeline_layout_create_info();
-		pipeline_layout_info.setSetLayouts(_raytracerSetLayout);
+		pipeline_layout_info.setSetLayouts(pipelines.raytracerSetLayout);
 		vk::PushConstantRange push_constants{vk::ShaderStageFlagBits::eRaygenKHR, 0, sizeof(vkutils::PushConstants)};
 		pipeline_layout_info.setPushConstantRanges(push_constants);
 
-		_raytracerPipelineLayout = _core._device.createPipelineLayout(pipeline_layout_info);
+		pipelines.raytracerPipelineLayout = _core._device.createPipelineLayout(pipeline_layout_info);
 
 		std::vector<vk::PipelineShaderStageCreateInfo> shaderStages;
 		vk::ShaderModule raygenShader, missShader, missShadow, hitShader, aHitShader;
 
 		// Ray generation group
 		{
-			raygenShader = load_shader_module(vk::ShaderStageFlagBits::eRaygenKHR, "/simple.rgen");
+			raygenShader = load_shader_module(vk::ShaderStageFlagBits::eRaygenKHR, "/simple.rgen", includes);
 			shaderStages.push_back(vkinit::pipeline_shader_stage_create_info(vk::ShaderStageFlagBits::eRaygenKHR, raygenShader));
 			vk::RayTracingShaderGroupCreateInfoKHR shaderGroup;
 			shaderGroup.type = vk::RayTracingShaderGroupTypeKHR::eGeneral;
@@ -978,12 +1285,12 @@ void VulkanEngine::init_pipelines()
 			shaderGroup.closestHitShader = vk::ShaderUnusedKHR;
 			shaderGroup.anyHitShader = vk::ShaderUnusedKHR;
 			shaderGroup.intersectionShader = vk::ShaderUnusedKHR;
-			_shaderGroups.push_back(shaderGroup);
+			pipelines.shaderGroups.push_back(shaderGroup);
 		}
 
 		// Miss group
 		{
-			missShader = load_shader_module(vk::ShaderStageFlagBits::eMissKHR, "/simple.rmiss");
+			missShader = load_shader_module(vk::ShaderStageFlagBits::eMissKHR, "/simple.rmiss", includes);
 			shaderStages.push_back(vkinit::pipeline_shader_stage_create_info(vk::ShaderStageFlagBits::eMissKHR, missShader));
 			vk::RayTracingShaderGroupCreateInfoKHR shaderGroup;
 			shaderGroup.type = vk::RayTracingShaderGroupTypeKHR::eGeneral;
@@ -991,12 +1298,12 @@ void VulkanEngine::init_pipelines()
 			shaderGroup.closestHitShader = vk::ShaderUnusedKHR;
 			shaderGroup.anyHitShader = vk::ShaderUnusedKHR;
 			shaderGroup.intersectionShader = vk::ShaderUnusedKHR;
-			_shaderGroups.push_back(shaderGroup);
+			pipelines.shaderGroups.push_back(shaderGroup);
 		}
 
 		// Miss group - Shadow
 		{
-			missShadow = load_shader_module(vk::ShaderStageFlagBits::eMissKHR, "/shadow.rmiss");
+			missShadow = load_shader_module(vk::ShaderStageFlagBits::eMissKHR, "/shadow.rmiss", includes);
 			shaderStages.push_back(vkinit::pipeline_shader_stage_create_info(vk::ShaderStageFlagBits::eMissKHR, missShadow));
 			vk::RayTracingShaderGroupCreateInfoKHR shaderGroup;
 			shaderGroup.type = vk::RayTracingShaderGroupTypeKHR::eGeneral;
@@ -1004,14 +1311,14 @@ void VulkanEngine::init_pipelines()
 			shaderGroup.closestHitShader = vk::ShaderUnusedKHR;
 			shaderGroup.anyHitShader = vk::ShaderUnusedKHR;
 			shaderGroup.intersectionShader = vk::ShaderUnusedKHR;
-			_shaderGroups.push_back(shaderGroup);
+			pipelines.shaderGroups.push_back(shaderGroup);
 		}
 
 		// Hit group - Triangles
 		{
-			hitShader = load_shader_module(vk::ShaderStageFlagBits::eClosestHitKHR, "/MIPS.rchit");
+			hitShader = load_shader_module(vk::ShaderStageFlagBits::eClosestHitKHR, "/MIPS.rchit", includes);
 			shaderStages.push_back(vkinit::pipeline_shader_stage_create_info(vk::ShaderStageFlagBits::eClosestHitKHR, hitShader));
-			aHitShader = load_shader_module(vk::ShaderStageFlagBits::eAnyHitKHR, "/simple.rahit");
+			aHitShader = load_shader_module(vk::ShaderStageFlagBits::eAnyHitKHR, "/simple.rahit", includes);
 			shaderStages.push_back(vkinit::pipeline_shader_stage_create_info(vk::ShaderStageFlagBits::eAnyHitKHR, aHitShader));
 			vk::RayTracingShaderGroupCreateInfoKHR shaderGroup;
 			shaderGroup.type = vk::RayTracingShaderGroupTypeKHR::eTrianglesHitGroup;
@@ -1019,20 +1326,20 @@ void VulkanEngine::init_pipelines()
 			shaderGroup.closestHitShader = static_cast<uint32_t>(shaderStages.size()) - 2;
 			shaderGroup.anyHitShader = static_cast<uint32_t>(shaderStages.size()) - 1;
 			shaderGroup.intersectionShader = vk::ShaderUnusedKHR;
-			_shaderGroups.push_back(shaderGroup);
+			pipelines.shaderGroups.push_back(shaderGroup);
 		}
 
 		// Create the ray tracing pipeline
 		vk::RayTracingPipelineCreateInfoKHR rayTracingPipelineInfo;
 		rayTracingPipelineInfo.setStages(shaderStages);
-		rayTracingPipelineInfo.setGroups(_shaderGroups);
+		rayTracingPipelineInfo.setGroups(pipelines.shaderGroups);
 		rayTracingPipelineInfo.maxPipelineRayRecursionDepth = 31;
-		rayTracingPipelineInfo.layout = _raytracerPipelineLayout;
+		rayTracingPipelineInfo.layout = pipelines.raytracerPipelineLayout;
 
 		try
 		{
 			vk::Result result;
-			std::tie(result, _raytracerPipeline) = _core._device.createRayTracingPipelineKHR({}, {}, rayTracingPipelineInfo);
+			std::tie(result, pipelines.raytracerPipeline) = _core._device.createRayTracingPipelineKHR({}, {}, rayTracingPipelineInfo);
 			if (result != vk::Result::eSuccess)
 			{
 				throw std::runtime_error("failed to create graphics Pipeline!");
@@ -1049,102 +1356,176 @@ void VulkanEngine::init_pipelines()
 		_core._device.destroyShaderModule(hitShader);
 		_core._device.destroyShaderModule(aHitShader);
 
-		_mainDeletionQueue.push_function([=]() {
-			_core._device.destroyPipeline(_raytracerPipeline);
-			_core._device.destroyPipelineLayout(_raytracerPipelineLayout);
-			_core._device.destroyDescriptorSetLayout(_raytracerSetLayout);
-		});
 	}
 
-	// init compute Pipeline
+	// on the loader thread for background loads, so swapping the scene in does not wait for the copies
+	createShaderBindingTable(pipelines);
+
+	if (!scene.skinnedPrimitives.empty())
 	{
-		vk::DescriptorSetLayoutBinding histogramBufferBinding;
-		histogramBufferBinding.binding = 0;
-		histogramBufferBinding.descriptorType = vk::DescriptorType::eStorageBuffer;
-		histogramBufferBinding.descriptorCount = 1;
-		histogramBufferBinding.stageFlags = vk::ShaderStageFlagBits::eCompute;
+		pipelines.skinningShader = load_shader_module(vk::ShaderStageFlagBits::eCompute, "/skinning.comp", includes);
+	}
+	return pipelines;
+}
 
-		vk::DescriptorSetLayoutBinding resultImageLayoutBinding;
-		resultImageLayoutBinding.binding = 1;
-		resultImageLayoutBinding.descriptorType = vk::DescriptorType::eStorageImage;
-		resultImageLayoutBinding.descriptorCount = 1;
-		resultImageLayoutBinding.stageFlags = vk::ShaderStageFlagBits::eCompute;
+void VulkanEngine::use_scene_pipelines(ScenePipelines& pipelines)
+{
+	_rasterizerSetLayout = pipelines.rasterizerSetLayout;
+	_rasterizerPipelineLayout = pipelines.rasterizerPipelineLayout;
+	_raytracerSetLayout = pipelines.raytracerSetLayout;
+	_raytracerPipelineLayout = pipelines.raytracerPipelineLayout;
+	_raytracerPipeline = pipelines.raytracerPipeline;
+	_shaderGroups = pipelines.shaderGroups;
+	_raygenShaderBindingTable = pipelines.raygenShaderBindingTable;
+	_missShaderBindingTable = pipelines.missShaderBindingTable;
+	_hitShaderBindingTable = pipelines.hitShaderBindingTable;
 
-		vk::DescriptorSetLayoutBinding accumulationImageLayoutBinding;
-		accumulationImageLayoutBinding.binding = 2;
-		accumulationImageLayoutBinding.descriptorType = vk::DescriptorType::eStorageImage;
-		accumulationImageLayoutBinding.descriptorCount = 1;
-		accumulationImageLayoutBinding.stageFlags = vk::ShaderStageFlagBits::eCompute;
+	// init rasterization pipeline
+	{
+		VertexInputDescription vertexDescription = Vertex::get_vertex_description(_currentScene->vertexLayout);
 
-		vk::DescriptorSetLayoutBinding settingsBufferBinding;
-		settingsBufferBinding.binding = 3;
-		settingsBufferBinding.descriptorType = vk::DescriptorType::eUniformBuffer;
-		settingsBufferBinding.descriptorCount = 1;
-		settingsBufferBinding.stageFlags = vk::ShaderStageFlagBits::eCompute;
+		vkutils::PipelineBuilder pipelineBuilder;
+		pipelineBuilder._shaderStages.push_back(vkinit::pipeline_shader_stage_create_info(vk::ShaderStageFlagBits::eVertex, pipelines.rasterizerShaders[0]));
+		pipelineBuilder._shaderStages.push_back(vkinit::pipeline_shader_stage_create_info(vk::ShaderStageFlagBits::eFragment, pipelines.rasterizerShaders[1]));
+		pipelineBuilder._vertexInputInfo.setVertexAttributeDescriptions(vertexDescription.attributes);
+		pipelineBuilder._vertexInputInfo.setVertexBindingDescriptions(vertexDescription.bindings);
+		pipelineBuilder._inputAssembly = vkinit::input_assembly_create_info(vk::PrimitiveTopology::eTriangleList);
+		pipelineBuilder._rasterizer = vkinit::rasterization_state_create_info(vk::PolygonMode::eFill);
+		pipelineBuilder._multisampling = vkinit::multisampling_state_create_info();
+		pipelineBuilder._colorBlendAttachment = vkinit::color_blend_attachment_state();
+		pipelineBuilder._pipelineLayout = _rasterizerPipelineLayout;
+		pipelineBuilder._dynamicStates = std::vector<vk::DynamicState> {vk::DynamicState::eViewport, vk::DynamicState::eScissor};
+		pipelineBuilder._depthStencil = vkinit::depth_stencil_create_info(true, true, vk::CompareOp::eLessOrEqual);
+		_rasterizerPipeline = pipelineBuilder.build_pipeline(_core._device, _renderPass);
 
-		std::vector<vk::DescriptorSetLayoutBinding> bindings({
-			histogramBufferBinding,
-			resultImageLayoutBinding,
-			accumulationImageLayoutBinding,
-			settingsBufferBinding
-		});
+		_core._device.destroyShaderModule(pipelines.rasterizerShaders[1]);
+		_core._device.destroyShaderModule(pipelines.rasterizerShaders[0]);
+	}
 
-		vk::DescriptorSetLayoutCreateInfo setinfo;
-		setinfo.setBindings(bindings);
-		_computeSetLayout = _core._device.createDescriptorSetLayout(setinfo);
+	// the handles are captured, by the time the scene is retired the members belong to the next one
+	vk::Pipeline rasterizerPipeline = _rasterizerPipeline;
+	_sceneDeletionQueue.push_function([=]() {
+		_core._device.destroyPipeline(rasterizerPipeline);
+		_core._device.destroyPipelineLayout(pipelines.rasterizerPipelineLayout);
+		_core._device.destroyDescriptorSetLayout(pipelines.rasterizerSetLayout);
+		_core._device.destroyPipeline(pipelines.raytracerPipeline);
+		_core._device.destroyPipelineLayout(pipelines.raytracerPipelineLayout);
+		_core._device.destroyDescriptorSetLayout(pipelines.raytracerSetLayout);
+		// the tables hold the pipeline's handles and go with it
+		for (const vkutils::AllocatedBuffer& table : {pipelines.raygenShaderBindingTable, pipelines.missShaderBindingTable, pipelines.hitShaderBindingTable})
+		{
+			vkutils::destroyBuffer(_core, table);
+		}
+	});
+}
 
-		vk::ShaderModule histogramShaderModule = load_shader_module(vk::ShaderStageFlagBits::eCompute, "/luminanceHistogram.comp");
-		vk::PipelineShaderStageCreateInfo histogramShaderStageInfo = vkinit::pipeline_shader_stage_create_info(vk::ShaderStageFlagBits::eCompute, histogramShaderModule);
-
-		vk::ShaderModule averageShaderModule = load_shader_module(vk::ShaderStageFlagBits::eCompute, "/luminanceAverage.comp");
-		vk::PipelineShaderStageCreateInfo averageShaderStageInfo = vkinit::pipeline_shader_stage_create_info(vk::ShaderStageFlagBits::eCompute, averageShaderModule);
+void VulkanEngine::init_descriptors()
+{
+	init_scene_descriptors();
+	//init compute descriptors
+	{
+		std::vector<vk::DescriptorPoolSize> poolSizes =
+		{
+			{ vk::DescriptorType::eStorageBuffer, 1 },
+			{ vk::DescriptorType::eStorageImage, 2 },
+			{ vk::DescriptorType::eUniformBuffer, 1 }
+		};
 
-		vk::ShaderModule postprocessingShaderModule = load_shader_module(vk::ShaderStageFlagBits::eCompute, "/postprocessing.comp");
-		vk::PipelineShaderStageCreateInfo postprocessingShaderStageInfo = vkinit::pipeline_shader_stage_create_info(vk::ShaderStageFlagBits::eCompute, postprocessingShaderModule);
+		vk::DescriptorPoolCreateInfo pool_info;
+		pool_info.setMaxSets(3);
+		pool_info.setPoolSizes(poolSizes);
 
-		vk::PipelineLayoutCreateInfo pipelineLayoutInfo({}, _computeSetLayout);
-		vk::PushConstantRange push_constants{vk::ShaderStageFlagBits::eCompute, 0, sizeof(vkutils::ComputeConstants)};
-		pipelineLayoutInfo.setPushConstantRanges(push_constants);
+		_computeDescriptorPool = _core._device.createDescriptorPool(pool_info);
 
-		_computePipelineLayout = _core._device.createPipelineLayout(pipelineLayoutInfo);
-		
-		vk::ComputePipelineCreateInfo pipelineInfos[3];
-		pipelineInfos[0] = vk::ComputePipelineCreateInfo({}, histogramShaderStageInfo, _computePipelineLayout);
-		pipelineInfos[1] = vk::ComputePipelineCreateInfo({}, averageShaderStageInfo, _computePipelineLayout);
-		pipelineInfos[2] = vk::ComputePipelineCreateInfo({}, postprocessingShaderStageInfo, _computePipelineLayout);
-		try
+		for (int i = 0; i < FRAME_OVERLAP; i++)
 		{
-			for (size_t i = 0; i < 3; i++)
-			{
-				vk::Result result;
-				std::tie(result, _computePipelines[i]) = _core._device.createComputePipeline({}, pipelineInfos[i]);
-				if (result != vk::Result::eSuccess)
-				{
-					throw std::runtime_error("failed to create compute Pipeline!");
-				}
+			_frames[i]._storageImage = createStorageImage(_core._swapchainImageFormat, _core._windowExtent.width, _core._windowExtent.height);
+			vkutils::ImageStats imageInfo;
+			imageInfo.average = 0.3f;
+			for (auto &&bin : imageInfo.histogram) {
+				bin = 0;
 			}
+			_frames[i]._imageStats = vkutils::deviceBufferFromData(_core, &imageInfo, sizeof(vkutils::ImageStats), vk::BufferUsageFlagBits::eStorageBuffer, vma::MemoryUsage::eAutoPreferDevice);
+
+			vk::DescriptorSetAllocateInfo allocInfo;
+			allocInfo.descriptorPool = _computeDescriptorPool;
+			allocInfo.setSetLayouts(_computeSetLayout);
+			
+			_frames[i]._computeDescriptor = _core._device.allocateDescriptorSets(allocInfo).front();
+			
+			vk::DescriptorBufferInfo histogramDescriptor;
+			histogramDescriptor.buffer = _frames[i]._imageStats._buffer;
+			histogramDescriptor.offset = 0;
+			histogramDescriptor.range = sizeof(vkutils::ImageStats);
+			vk::WriteDescriptorSet histogramWrite;
+			histogramWrite.dstBinding = 0;
+			histogramWrite.dstSet = _frames[i]._computeDescriptor;
+			histogramWrite.descriptorCount = 1;
+			histogramWrite.descriptorType = vk::DescriptorType::eStorageBuffer;
+			histogramWrite.setBufferInfo(histogramDescriptor);
+
+			vk::DescriptorImageInfo resultImageDescriptor;
+			resultImageDescriptor.imageView = _frames[i]._storageImage._view;
+			resultImageDescriptor.imageLayout = vk::ImageLayout::eGeneral;
+			vk::WriteDescriptorSet resultImageWrite;
+			resultImageWrite.dstSet = _frames[i]._computeDescriptor;
+			resultImageWrite.descriptorType = vk::DescriptorType::eStorageImage;
+			resultImageWrite.dstBinding = 1;
+			resultImageWrite.pImageInfo = &resultImageDescriptor;
+			resultImageWrite.descriptorCount = 1;
+
+			vk::DescriptorImageInfo accumulationImageDescriptor;
+			accumulationImageDescriptor.imageView = _accumulationImage._view;
+			accumulationImageDescriptor.imageLayout = vk::ImageLayout::eGeneral;
+			vk::WriteDescriptorSet accumulationImageWrite;
+			accumulationImageWrite.dstSet = _frames[i]._computeDescriptor;
+			accumulationImageWrite.descriptorType = vk::DescriptorType::eStorageImage;
+			accumulationImageWrite.dstBinding = 2;
+			accumulationImageWrite.pImageInfo = &accumulationImageDescriptor;
+			accumulationImageWrite.descriptorCount = 1;
+
+			vk::DescriptorBufferInfo settingsUboDescriptor;
+			settingsUboDescriptor.buffer = _settingsBuffer._buffer;
+			settingsUboDescriptor.offset = 0;
+			settingsUboDescriptor.range = sizeof(vkutils::Shadersettings);
+			vk::WriteDescriptorSet settingsUniformBufferWrite;
+			settingsUniformBufferWrite.dstSet = _frames[i]._computeDescriptor;
+			settingsUniformBufferWrite.descriptorType = vk::DescriptorType::eUniformBuffer;
+			settingsUniformBufferWrite.dstBinding = 3;
+			settingsUniformBufferWrite.pBufferInfo = &settingsUboDescriptor;
+			settingsUniformBufferWrite.descriptorCount = 1;
+
+			std::vector<vk::WriteDescriptorSet> setWrites = {
+				histogramWrite,
+				resultImageWrite,
+				accumulationImageWrite,
+				settingsUniformBufferWrite
+			};
+			_core._device.updateDescriptorSets(setWrites, {});
 		}
-		catch (std::exception &e)
+	}
+	_mainDeletionQueue.push_function([&]() {
+		_core._device.destroyDescriptorPool(_computeDescriptorPool);
+		for (int i = 0; i < FRAME_OVERLAP; i++)
 		{
-			std::cerr << "Exception Thrown: " << e.what();
+			vkutils::destroyBuffer(_core, _frames[i]._imageStats);
 		}
-
-		_core._device.destroyShaderModule(histogramShaderModule);
-		_core._device.destroyShaderModule(averageShaderModule);
-		_core._device.destroyShaderModule(postprocessingShaderModule);
-
-		_mainDeletionQueue.push_function([=]() {
-			for(auto pipeline : _computePipelines){
-				_core._device.destroyPipeline(pipeline);
-			}
-			_core._device.destroyPipelineLayout(_computePipelineLayout);
-			_core._device.destroyDescriptorSetLayout(_computeSetLayout);
-		});
+	});
+	std::array<vkutils::AllocatedImage, FRAME_OVERLAP> storageImages;
+	for (int i = 0; i < FRAME_OVERLAP; i++)
+	{
+		storageImages[i] = _frames[i]._storageImage;
 	}
-
+	_resizeDeletionQueue.push_function([=]() {
+		for (const vkutils::AllocatedImage& storageImage : storageImages)
+		{
+			vkutils::destroyImage(_core, storageImage);
+			_core._device.destroyImageView(storageImage._view);
+		}
+	});
 }
 
-void VulkanEngine::init_descriptors()
+void VulkanEngine::init_scene_descriptors()
 {
 	//init rasterizing descriptors
 	{
@@ -1168,8 +1549,8 @@ void VulkanEngine::init_descriptors()
 			_frames[i]._rasterizerDescriptor = _core._device.allocateDescriptorSets(allocInfo).front();
 
 			vk::DescriptorBufferInfo binfo;
-			binfo.buffer = _currentScene->materialBuffer._buffer;
-			binfo.offset = 0;
+			binfo.buffer = _currentScene->materialBuffer.buffer;
+			binfo.offset = _currentScene->materialBuffer.offset;
 			binfo.range = _currentScene->materials.size() * sizeof(vkutils::Material);
 
 			vk::WriteDescriptorSet setWrite;
@@ -1187,7 +1568,7 @@ void VulkanEngine::init_descriptors()
 		std::vector<vk::DescriptorPoolSize> poolSizes = {
 			{ vk::DescriptorType::eAccelerationStructureKHR, 1 },
 			{ vk::DescriptorType::eStorageImage, 1 },
-			{ vk::DescriptorType::eStorageBuffer, 4 },
+			{ vk::DescriptorType::eStorageBuffer, (4 + _currentScene->vertexLayout.streamCount()) * FRAME_OVERLAP },
 			{ vk::DescriptorType::eCombinedImageSampler, static_cast<uint32_t>(_currentScene->textures.size()) + 1 },
 			{ vk::DescriptorType::eUniformBuffer, 1 }
 		};
@@ -1226,9 +1607,9 @@ void VulkanEngine::init_descriptors()
 			accumulationImageWrite.descriptorCount = 1;
 
 			vk::DescriptorBufferInfo indexDescriptor;
-			indexDescriptor.buffer = _currentScene->indexBuffer._buffer;
-			indexDescriptor.offset = 0;
-			indexDescriptor.range = _currentScene->indices.size() * sizeof(uint32_t);
+			indexDescriptor.buffer = _currentScene->indexBuffer.buffer;
+			indexDescriptor.offset = _currentScene->indexBuffer.offset;
+			indexDescriptor.range = _currentScene->indexBytes;
 			vk::WriteDescriptorSet indexBufferWrite;
 			indexBufferWrite.dstSet = _frames[i]._raytracerDescriptor;
 			indexBufferWrite.descriptorType = vk::DescriptorType::eStorageBuffer;
@@ -1236,20 +1617,24 @@ void VulkanEngine::init_descriptors()
 			indexBufferWrite.pBufferInfo = &indexDescriptor;
 			indexBufferWrite.descriptorCount = 1;
 
-			vk::DescriptorBufferInfo vertexDescriptor;
-			vertexDescriptor.buffer = _currentScene->vertexBuffer._buffer;
-			vertexDescriptor.offset = 0;
-			vertexDescriptor.range = _currentScene->vertices.size() * sizeof(Vertex);
+			std::vector<vk::DescriptorBufferInfo> vertexDescriptors;
+			for (uint32_t stream = 0; stream < _currentScene->vertexLayout.streamCount(); stream++)
+			{
+				vk::DescriptorBufferInfo vertexDescriptor;
+				vertexDescriptor.buffer = _currentScene->vertexBuffers[stream].buffer;
+				vertexDescriptor.offset = _currentScene->vertexBuffers[stream].offset;
+				vertexDescriptor.range = static_cast<vk::DeviceSize>(_currentScene->vertexCount) * _currentScene->vertexLayout.strides[stream];
+				vertexDescriptors.push_back(vertexDescriptor);
+			}
 			vk::WriteDescriptorSet vertexBufferWrite;
 			vertexBufferWrite.dstSet = _frames[i]._raytracerDescriptor;
 			vertexBufferWrite.descriptorType = vk::DescriptorType::eStorageBuffer;
 			vertexBufferWrite.dstBinding = 3;
-			vertexBufferWrite.pBufferInfo = &vertexDescriptor;
-			vertexBufferWrite.descriptorCount = 1;
+			vertexBufferWrite.setBufferInfo(vertexDescriptors);
 
 			vk::DescriptorBufferInfo uboDescriptor;
-			uboDescriptor.buffer = _currentScene->materialBuffer._buffer;
-			uboDescriptor.offset = 0;
+			uboDescriptor.buffer = _currentScene->materialBuffer.buffer;
+			uboDescriptor.offset = _currentScene->materialBuffer.offset;
 			uboDescriptor.range = _currentScene->materials.size() * sizeof(vkutils::Material);
 			vk::WriteDescriptorSet uniformBufferWrite;
 			uniformBufferWrite.dstSet = _frames[i]._raytracerDescriptor;
@@ -1259,8 +1644,8 @@ void VulkanEngine::init_descriptors()
 			uniformBufferWrite.descriptorCount = 1;
 
 			vk::DescriptorBufferInfo lightsDescriptor;
-			lightsDescriptor.buffer = _currentScene->lightBuffer._buffer;
-			lightsDescriptor.offset = 0;
+			lightsDescriptor.buffer = _currentScene->lightBuffer.buffer;
+			lightsDescriptor.offset = _currentScene->lightBuffer.offset;
 			lightsDescriptor.range = _currentScene->lights.size() * sizeof(vkutils::LightProxy);
 			vk::WriteDescriptorSet lightBufferWrite;
 			lightBufferWrite.dstSet = _frames[i]._raytracerDescriptor;
@@ -1303,6 +1688,17 @@ void VulkanEngine::init_descriptors()
 			}
             textureImageWrite.setImageInfo(imageInfos);
 
+			vk::DescriptorBufferInfo textureFeedbackDescriptor;
+			textureFeedbackDescriptor.buffer = _frames[i]._textureFeedback._buffer;
+			textureFeedbackDescriptor.offset = 0;
+			textureFeedbackDescriptor.range = _textureFeedbackWords * sizeof(uint32_t);
+			vk::WriteDescriptorSet textureFeedbackWrite;
+			textureFeedbackWrite.dstSet = _frames[i]._raytracerDescriptor;
+			textureFeedbackWrite.descriptorType = vk::DescriptorType::eStorageBuffer;
+			textureFeedbackWrite.dstBinding = 9;
+			textureFeedbackWrite.pBufferInfo = &textureFeedbackDescriptor;
+			textureFeedbackWrite.descriptorCount = 1;
+
 			std::vector<vk::WriteDescriptorSet> setWrites = {
 				accelerationStructureWrite,
 				accumulationImageWrite,
@@ -1312,112 +1708,26 @@ void VulkanEngine::init_descriptors()
 				lightBufferWrite,
 				hdrImageWrite,
 				settingsUniformBufferWrite,
-				textureImageWrite
-			};
-			_core._device.updateDescriptorSets(setWrites, {});
-		}
-	}
-	//init compute descriptors
-	{
-		std::vector<vk::DescriptorPoolSize> poolSizes =
-		{
-			{ vk::DescriptorType::eStorageBuffer, 1 },
-			{ vk::DescriptorType::eStorageImage, 2 },
-			{ vk::DescriptorType::eUniformBuffer, 1 }
-		};
-
-		vk::DescriptorPoolCreateInfo pool_info;
-		pool_info.setMaxSets(3);
-		pool_info.setPoolSizes(poolSizes);
-
-		_computeDescriptorPool = _core._device.createDescriptorPool(pool_info);
-
-		for (int i = 0; i < FRAME_OVERLAP; i++)
-		{
-			_frames[i]._storageImage = createStorageImage(_core._swapchainImageFormat, _core._windowExtent.width, _core._windowExtent.height);
-			vkutils::ImageStats imageInfo;
-			imageInfo.average = 0.3f;
-			for (auto &&bin : imageInfo.histogram) {
-				bin = 0;
-			}
-			_frames[i]._imageStats = vkutils::deviceBufferFromData(_core, &imageInfo, sizeof(vkutils::ImageStats), vk::BufferUsageFlagBits::eStorageBuffer, vma::MemoryUsage::eAutoPreferDevice);
-
-			vk::DescriptorSetAllocateInfo allocInfo;
-			allocInfo.descriptorPool = _computeDescriptorPool;
-			allocInfo.setSetLayouts(_computeSetLayout);
-			
-			_frames[i]._computeDescriptor = _core._device.allocateDescriptorSets(allocInfo).front();
-			
-			vk::DescriptorBufferInfo histogramDescriptor;
-			histogramDescriptor.buffer = _frames[i]._imageStats._buffer;
-			histogramDescriptor.offset = 0;
-			histogramDescriptor.range = sizeof(vkutils::ImageStats);
-			vk::WriteDescriptorSet histogramWrite;
-			histogramWrite.dstBinding = 0;
-			histogramWrite.dstSet = _frames[i]._computeDescriptor;
-			histogramWrite.descriptorCount = 1;
-			histogramWrite.descriptorType = vk::DescriptorType::eStorageBuffer;
-			histogramWrite.setBufferInfo(histogramDescriptor);
-
-			vk::DescriptorImageInfo resultImageDescriptor;
-			resultImageDescriptor.imageView = _frames[i]._storageImage._view;
-			resultImageDescriptor.imageLayout = vk::ImageLayout::eGeneral;
-			vk::WriteDescriptorSet resultImageWrite;
-			resultImageWrite.dstSet = _frames[i]._computeDescriptor;
-			resultImageWrite.descriptorType = vk::DescriptorType::eStorageImage;
-			resultImageWrite.dstBinding = 1;
-			resultImageWrite.pImageInfo = &resultImageDescriptor;
-			resultImageWrite.descriptorCount = 1;
-
-			vk::DescriptorImageInfo accumulationImageDescriptor;
-			accumulationImageDescriptor.imageView = _accumulationImage._view;
-			accumulationImageDescriptor.imageLayout = vk::ImageLayout::eGeneral;
-			vk::WriteDescriptorSet accumulationImageWrite;
-			accumulationImageWrite.dstSet = _frames[i]._computeDescriptor;
-			accumulationImageWrite.descriptorType = vk::DescriptorType::eStorageImage;
-			accumulationImageWrite.dstBinding = 2;
-			accumulationImageWrite.pImageInfo = &accumulationImageDescriptor;
-			accumulationImageWrite.descriptorCount = 1;
-
-			vk::DescriptorBufferInfo settingsUboDescriptor;
-			settingsUboDescriptor.buffer = _settingsBuffer._buffer;
-			settingsUboDescriptor.offset = 0;
-			settingsUboDescriptor.range = sizeof(vkutils::Shadersettings);
-			vk::WriteDescriptorSet settingsUniformBufferWrite;
-			settingsUniformBufferWrite.dstSet = _frames[i]._computeDescriptor;
-			settingsUniformBufferWrite.descriptorType = vk::DescriptorType::eUniformBuffer;
-			settingsUniformBufferWrite.dstBinding = 3;
-			settingsUniformBufferWrite.pBufferInfo = &settingsUboDescriptor;
-			settingsUniformBufferWrite.descriptorCount = 1;
-
-			std::vector<vk::WriteDescriptorSet> setWrites = {
-				histogramWrite,
-				resultImageWrite,
-				accumulationImageWrite,
-				settingsUniformBufferWrite
+				textureImageWrite,
+				textureFeedbackWrite
 			};
 			_core._device.updateDescriptorSets(setWrites, {});
 		}
 	}
-	_mainDeletionQueue.push_function([&]() {
-		_core._device.destroyDescriptorPool(_raytracerDescriptorPool);
-		_core._device.destroyDescriptorPool(_rasterizerDescriptorPool);
-		_core._device.destroyDescriptorPool(_computeDescriptorPool);
-		for (int i = 0; i < FRAME_OVERLAP; i++)
-		{
-			_core._allocator.destroyBuffer(_frames[i]._imageStats._buffer, _frames[i]._imageStats._allocation);
-		}
-	});
-	_resizeDeletionQueue.push_function([&]() {
-		for (int i = 0; i < FRAME_OVERLAP; i++)
-		{
-			_core._allocator.destroyImage(_frames[i]._storageImage._image, _frames[i]._storageImage._allocation);
-			_core._device.destroyImageView(_frames[i]._storageImage._view);
-		}
+	vk::DescriptorPool rasterizerDescriptorPool = _rasterizerDescriptorPool;
+	vk::DescriptorPool raytracerDescriptorPool = _raytracerDescriptorPool;
+	_sceneDeletionQueue.push_function([=]() {
+		_core._device.destroyDescriptorPool(raytracerDescriptorPool);
+		_core._device.destroyDescriptorPool(rasterizerDescriptorPool);
 	});
 }
 
 vk::ShaderModule VulkanEngine::load_shader_module(vk::ShaderStageFlagBits type, std::string filePath)
+{
+	return load_shader_module(type, filePath, _shaderIncludes);
+}
+
+vk::ShaderModule VulkanEngine::load_shader_module(vk::ShaderStageFlagBits type, std::string filePath, const std::map<std::string, std::string>& includes)
 {
 	shaderc_shader_kind shaderKind = shaderc_glsl_infer_from_source;
 	switch (type) {
@@ -1460,10 +1770,10 @@ vk::ShaderModule VulkanEngine::load_shader_module(vk::ShaderStageFlagBits type,
     }
     std::string shaderCodeGlsl = std::string((std::istreambuf_iterator<char>(input_file)), std::istreambuf_iterator<char>());
 
-	auto preprocessed = vkshader::preprocess_shader("shader_src", shaderKind, shaderCodeGlsl, shaderc_optimization_level_performance);
+	auto preprocessed = vkshader::preprocess_shader("shader_src", shaderKind, shaderCodeGlsl, shaderc_optimization_level_performance, includes);
 
     std::cout << "Compiling shader  " << SHADER_PATH + filePath << "" << std::endl;
-    auto spirv = vkshader::compile_file("shader_src", shaderKind, preprocessed.c_str(), shaderc_optimization_level_performance);
+    auto spirv = vkshader::compile_file("shader_src", shaderKind, preprocessed.c_str(), shaderc_optimization_level_performance, includes);
 
 	vk::ShaderModuleCreateInfo createInfo({}, spirv);
 	vk::ShaderModule shaderModule;
@@ -1483,46 +1793,377 @@ void VulkanEngine::load_models()
 	auto start_all = std::chrono::high_resolution_clock::now();
 
 	// load bistro optimized
+	_sceneSetups.push_back([](Scene& scene) {
+		scene.vertexFormat = vkutils::VertexLayout::eCompact;
+		scene.splitVertexStreams = true;
+		scene.optimizeMeshes = true;
+		scene.streamTextures = true;
+		scene.cacheDirectory = ASSET_PATH"/cache";
+		scene.add(ASSET_PATH"/models/RedBox.glb");
+		// scene.add(ASSET_PATH"/models/dragon.glb");
+		// scene.add(ASSET_PATH"/models/bunny.glb", glm::scale(glm::mat4(1.0), glm::vec3(0.8)));
+		// scene.add(ASSET_PATH"/models/sphere_plastic.glb", glm::scale(glm::translate(glm::mat4(1.0), glm::vec3(-0.5, -0.5, 0.5)), glm::vec3(0.25))); 
+		// scene.add(ASSET_PATH"/models/sphere_plastic.glb", glm::scale(glm::translate(glm::mat4(1.0), glm::vec3(0.5, 0.25, 0.5)), glm::vec3(0.25))); 
+		// scene.add(ASSET_PATH"/models/roughness_test_transmissive.glb");
+		// animated characters, every instance is skinned into its own vertices and BLAS
+		// for (int i = 0; i < 36; i++)
+		// 	scene.add(ASSET_PATH"/models/CesiumMan.glb", glm::translate(glm::mat4(1.0), glm::vec3(i % 6 - 3, 0, i / 6 - 3)));
+	});
+	// loaded in the background with the L key
+	_sceneSetups.push_back([](Scene& scene) {
+		scene.vertexFormat = vkutils::VertexLayout::eCompact;
+		scene.optimizeMeshes = true;
+		scene.streamTextures = true;
+		scene.cacheDirectory = ASSET_PATH"/cache";
+		scene.add(ASSET_PATH"/models/bistro_new_1.glb");
+	});
+	// the TLAS update benchmark, animate_instances logs the frame and refit times while they spin
+	_instanceBenchmarkSetup = static_cast<uint32_t>(_sceneSetups.size());
+	_sceneSetups.push_back([](Scene& scene) {
+		scene.dynamicInstances = true;
+		for (int i = 0; i < 10000; i++)
+			scene.add(ASSET_PATH"/models/RedBox.glb", glm::scale(glm::translate(glm::mat4(1.0), glm::vec3(i % 100 - 50, 0, i / 100 - 50)), glm::vec3(0.4)));
+	});
+
 	Scene* scene1 = new Scene(_core);
-	scene1->add(ASSET_PATH"/models/RedBox.glb");
-	// scene1->add(ASSET_PATH"/models/dragon.glb");
-	// scene1->add(ASSET_PATH"/models/bunny.glb", glm::scale(glm::mat4(1.0), glm::vec3(0.8)));
-	// scene1->add(ASSET_PATH"/models/sphere_plastic.glb", glm::scale(glm::translate(glm::mat4(1.0), glm::vec3(-0.5, -0.5, 0.5)), glm::vec3(0.25))); 
-	// scene1->add(ASSET_PATH"/models/sphere_plastic.glb", glm::scale(glm::translate(glm::mat4(1.0), glm::vec3(0.5, 0.25, 0.5)), glm::vec3(0.25))); 
-	// scene1->add(ASSET_PATH"/models/roughness_test_transmissive.glb");
+	_sceneSetups[0](*scene1);
 	scene1->build();
 	scene1->buildAccelerationStructure();
 	_currentScene = scene1;
-	_scenes.push_back(scene1);
+	own_scene(scene1);
+	_gui.settings.dynamic_instances_active = scene1->dynamicInstances;
+	// shaders fetch vertices through the layout the scene was built with
+	_shaderIncludes["vertex_layout.glsl"] = _currentScene->vertexLayout.glsl();
 	
 	auto elapsed_all = std::chrono::high_resolution_clock::now() - start_all;
 	long long microseconds_all = std::chrono::duration_cast<std::chrono::microseconds>(elapsed_all).count();
 	std::cout << "scene1 loading time: " << microseconds_all / 1e6 << "s" << std::endl;
+}
 
-	// start_all = std::chrono::high_resolution_clock::now();
-	// std::thread th { [=]() {
-	// 	Scene* scene2 = new Scene(_core);
-	// 	scene2->add(ASSET_PATH"/models/bistro_new_1.glb");
-	// 	_scenes.push_back(scene2);
-	// 	auto elapsed_all = std::chrono::high_resolution_clock::now() - start_all;
-	// 	auto microseconds_all = std::chrono::duration_cast<std::chrono::microseconds>(elapsed_all).count();
-	// 	std::cout << "scene2 loading time: " << microseconds_all / 1e6 << "s" << std::endl;
-    // }};
-	// th.detach();
+void VulkanEngine::own_scene(Scene* scene)
+{
+	_scenes.push_back(scene);
+	_sceneDeletionQueue.push_function([=]() {
+		scene->destroy();
+		_scenes.erase(std::find(_scenes.begin(), _scenes.end(), scene));
+		delete scene;
+	});
+}
 
-	_mainDeletionQueue.push_function([&]() {
-		for(auto& scene : _scenes){
-			scene->destroy();
-			delete scene;
+bool VulkanEngine::load_scene_async(uint32_t setup)
+{
+	if (_sceneLoading)
+	{
+		std::cout << "Scene " << setup << " not loaded, another scene is still loading" << std::endl;
+		return false;
+	}
+	_sceneLoading = true;
+	// the render thread keeps its includes, the loader compiles against the new scene's vertex layout
+	std::map<std::string, std::string> includes = _shaderIncludes;
+	_sceneLoader = std::thread([this, setup, includes]() mutable {
+		auto start = std::chrono::high_resolution_clock::now();
+		Scene* scene = new Scene(_core);
+		_sceneSetups[setup](*scene);
+		scene->build();
+		scene->buildAccelerationStructure();
+		includes["vertex_layout.glsl"] = scene->vertexLayout.glsl();
+		_loadedPipelines = build_scene_pipelines(*scene, includes);
+		_loadedScene = scene;
+		auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		std::cout << "Scene " << setup << " loaded in the background in " << microseconds / 1e6 << "s" << std::endl;
+		_sceneReady.store(true, std::memory_order_release);
+	});
+	return true;
+}
+
+void VulkanEngine::switch_scene()
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	_sceneLoader.join();
+	_sceneReady = false;
+	_sceneLoading = false;
+
+	// frames up to the previous one may still use the old scene, it is destroyed once the timeline passed the last
+	_deferredDeletion.push(_frameTimelineValue, std::move(_sceneDeletionQueue));
+	_textureStreamer = std::make_shared<TextureStreamer>();
+	_skinning = std::make_shared<Skinning>();
+	for (int i = 0; i < FRAME_OVERLAP; i++)
+	{
+		_streamedTextures[i].clear();
+	}
+	_gui.settings.texture_streaming_active = false;
+
+	_currentScene = _loadedScene;
+	_loadedScene = nullptr;
+	own_scene(_currentScene);
+	_gui.settings.dynamic_instances_active = _currentScene->dynamicInstances;
+	_shaderIncludes["vertex_layout.glsl"] = _currentScene->vertexLayout.glsl();
+	use_scene_pipelines(_loadedPipelines);
+	init_texture_feedback();
+	init_texture_streaming();
+	init_skinning(_loadedPipelines.skinningShader);
+	init_scene_descriptors();
+	PushConstants.accumulatedFrames = 0;
+	auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+	std::cout << "Switched scenes in " << microseconds / 1e3 << "ms on the render thread" << std::endl;
+}
+
+void VulkanEngine::init_texture_feedback()
+{
+	// header: enable flag, then per texture the first word of its tile bits, its resident level and its packed size,
+	// followed by the tile bits of every level of every texture
+	uint32_t textureCount = static_cast<uint32_t>(_currentScene->textures.size());
+	_textureFeedbackHeader.assign(1 + 3 * textureCount, 0);
+	uint32_t word = 1 + 3 * textureCount;
+	for (uint32_t t = 0; t < textureCount; t++)
+	{
+		const Texture& texture = _currentScene->textures[t];
+		_textureFeedbackHeader[1 + 3 * t] = word;
+		_textureFeedbackHeader[2 + 3 * t] = texture.residentLevel;
+		_textureFeedbackHeader[3 + 3 * t] = texture.width | (texture.height << 16);
+		for (uint32_t level = 0; level < texture.mipLevels; level++)
+		{
+			word += vkutils::mipmap::feedbackLevelWords(texture.width, texture.height, level);
+		}
+	}
+	_textureFeedbackWords = word;
+
+	std::vector<uint32_t> initialData(_textureFeedbackWords, 0);
+	std::copy(_textureFeedbackHeader.begin(), _textureFeedbackHeader.end(), initialData.begin());
+	for (int i = 0; i < FRAME_OVERLAP; i++)
+	{
+		_frames[i]._textureFeedback = vkutils::hostBufferFromData(_core, initialData.data(), _textureFeedbackWords * sizeof(uint32_t), vk::BufferUsageFlagBits::eStorageBuffer, vma::MemoryUsage::eAuto, vma::AllocationCreateFlagBits::eHostAccessRandom);
+	}
+	std::cout << "Texture feedback buffer: " << _textureFeedbackWords * sizeof(uint32_t) / 1024 << " KB per frame" << std::endl;
+
+	std::array<vkutils::AllocatedBuffer, FRAME_OVERLAP> feedback;
+	for (int i = 0; i < FRAME_OVERLAP; i++)
+	{
+		feedback[i] = _frames[i]._textureFeedback;
+	}
+	_sceneDeletionQueue.push_function([=]() {
+		for (const vkutils::AllocatedBuffer& buffer : feedback)
+		{
+			vkutils::destroyBuffer(_core, buffer);
 		}
 	});
 }
 
+void VulkanEngine::read_texture_feedback()
+{
+	// the fence of this frame was waited on, so the buffer holds the tiles its previous submission sampled
+	vkutils::AllocatedBuffer& feedback = get_current_frame()._textureFeedback;
+	uint32_t* words = static_cast<uint32_t*>(_core._allocator.mapMemory(feedback._allocation));
+	_core._allocator.invalidateAllocation(feedback._allocation, 0, VK_WHOLE_SIZE);
+	size_t textureCount = _currentScene->textures.size();
+	bool streaming = _textureStreamer->active() && _gui.settings.texture_streaming;
+	if (words[0] != 0)
+	{
+		uint64_t bytes = 0;
+		// finest level every texture was sampled at, what the streamer wants resident
+		std::vector<uint32_t> finestLevels(textureCount, UINT32_MAX);
+		for (size_t t = 0; t < textureCount; t++)
+		{
+			const Texture& texture = _currentScene->textures[t];
+			uint32_t word = _textureFeedbackHeader[1 + 3 * t];
+			for (uint32_t level = 0; level < texture.mipLevels; level++)
+			{
+				uint32_t levelWords = vkutils::mipmap::feedbackLevelWords(texture.width, texture.height, level);
+				if (_gui.settings.texture_feedback)
+				{
+					bytes += vkutils::mipmap::feedbackLevelBytes(words + word, texture.width, texture.height, level);
+				}
+				if (finestLevels[t] == UINT32_MAX && std::any_of(words + word, words + word + levelWords, [](uint32_t bits) { return bits != 0; }))
+				{
+					finestLevels[t] = level;
+				}
+				word += levelWords;
+			}
+		}
+		if (_gui.settings.texture_feedback)
+		{
+			_gui.settings.texture_bytes_touched = bytes;
+			if (_frameNumber % 100 == 0)
+			{
+				std::cout << "Texture feedback: " << static_cast<double>(bytes) / (1024 * 1024) << " MB of texels touched per frame (ray cone LOD " << (_gui.settings.texture_lod ? "on" : "off") << ")" << std::endl;
+			}
+		}
+		if (streaming)
+		{
+			_textureStreamer->update(finestLevels, _frameNumber);
+		}
+		std::fill(words + _textureFeedbackHeader.size(), words + _textureFeedbackWords, 0u);
+	}
+	// the streamer may have swapped images since this buffer was last used
+	for (size_t t = 0; t < textureCount; t++)
+	{
+		words[2 + 3 * t] = _currentScene->textures[t].residentLevel;
+	}
+	words[0] = (_gui.settings.texture_feedback || streaming) && _gui.settings.renderer == 1 ? 1 : 0;
+	_core._allocator.flushAllocation(feedback._allocation, 0, VK_WHOLE_SIZE);
+	_core._allocator.unmapMemory(feedback._allocation);
+}
+
+void VulkanEngine::init_texture_streaming()
+{
+	if (!_textureStreamer->init(_core, *_currentScene, static_cast<vk::DeviceSize>(_gui.settings.texture_budget_mb) * 1024 * 1024))
+	{
+		return;
+	}
+	_gui.settings.texture_streaming_active = true;
+	_sceneDeletionQueue.push_function([streamer = _textureStreamer]() {
+		streamer->destroy();
+	});
+}
+
+void VulkanEngine::update_texture_streaming(vk::CommandBuffer cmd)
+{
+	if (!_textureStreamer->active())
+	{
+		return;
+	}
+	_textureStreamer->setPaused(!_gui.settings.texture_streaming);
+	_textureStreamer->setBudget(static_cast<vk::DeviceSize>(_gui.settings.texture_budget_mb) * 1024 * 1024);
+	std::vector<uint32_t> changed = _textureStreamer->apply(cmd, _frameNumber, FRAME_OVERLAP, _streamingWaits);
+	if (!changed.empty())
+	{
+		for (int i = 0; i < FRAME_OVERLAP; i++)
+		{
+			_streamedTextures[i].insert(changed.begin(), changed.end());
+		}
+		// samples taken with the coarser levels would stay in the image
+		PushConstants.accumulatedFrames = 0;
+	}
+
+	// only this frame's set is rewritten, the previous frame may still read the other one
+	std::set<uint32_t>& dirty = _streamedTextures[_frameNumber % FRAME_OVERLAP];
+	if (!dirty.empty())
+	{
+		std::vector<vk::WriteDescriptorSet> writes;
+		for (uint32_t t : dirty)
+		{
+			vk::WriteDescriptorSet textureImageWrite;
+			textureImageWrite.dstSet = get_current_frame()._raytracerDescriptor;
+			textureImageWrite.dstBinding = 8;
+			textureImageWrite.dstArrayElement = t;
+			textureImageWrite.descriptorType = vk::DescriptorType::eCombinedImageSampler;
+			textureImageWrite.descriptorCount = 1;
+			textureImageWrite.pImageInfo = &_currentScene->textures[t].descriptor;
+			writes.push_back(textureImageWrite);
+		}
+		_core._device.updateDescriptorSets(writes, {});
+		dirty.clear();
+	}
+
+	TextureStreamer::Stats stats = _textureStreamer->stats();
+	_gui.settings.texture_resident_levels = stats.residentLevels;
+	_gui.settings.texture_total_levels = stats.totalLevels;
+	_gui.settings.texture_pending = stats.pending;
+	_gui.settings.texture_resident_bytes = stats.residentBytes;
+	_gui.settings.texture_total_bytes = stats.totalBytes;
+	_gui.settings.texture_limit_bytes = stats.budgetBytes;
+	_gui.settings.texture_heap_usage = stats.heapUsage;
+	_gui.settings.texture_heap_budget = stats.heapBudget;
+	_gui.settings.texture_streamed_levels = stats.streamedLevels;
+	_gui.settings.texture_evicted_levels = stats.evictedLevels;
+	if (_frameNumber % 500 == 0)
+	{
+		std::cout << "Texture streaming: " << stats.residentBytes / (1024.0 * 1024.0) << " MB resident (limit " << stats.budgetBytes / (1024.0 * 1024.0) << " MB), " << stats.streamedLevels << " levels streamed in, " << stats.evictedLevels << " evicted" << std::endl;
+	}
+}
+
+void VulkanEngine::move_instance(uint32_t instance, const glm::mat4& transform)
+{
+	// samples of the old and of the new place are only wrong when one of them is in view
+	Scene::Bounds before = _currentScene->instanceBounds(instance);
+	_currentScene->setInstanceTransform(instance, transform);
+	Scene::Bounds after = _currentScene->instanceBounds(instance);
+	if (vkutils::boxInFrustum(_viewProjection, before.min, before.max) || vkutils::boxInFrustum(_viewProjection, after.min, after.max))
+	{
+		PushConstants.accumulatedFrames = 0;
+	}
+}
+
+void VulkanEngine::animate_instances()
+{
+	if (!_currentScene->dynamicInstances || !_gui.settings.animate_instances)
+	{
+		return;
+	}
+	auto start = std::chrono::high_resolution_clock::now();
+	// every instance spins around its own up axis
+	glm::mat4 rotation = glm::rotate(glm::mat4(1.0f), static_cast<float>(_deltaTime) * 0.5f, glm::vec3(0.0f, 1.0f, 0.0f));
+	for (uint32_t instance = 0; instance < _currentScene->instanceModels.size(); instance++)
+	{
+		move_instance(instance, _currentScene->modelMatrices[instance] * rotation);
+	}
+	_instanceUpdateTime += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() / 1e6;
+	_animatedFrameTime += _deltaTime;
+	if (++_animatedFrames == 500)
+	{
+		std::cout << "Moving " << _currentScene->instanceModels.size() << " instances: frame time " << _animatedFrameTime / _animatedFrames * 1000.0 << " ms, transforms " << _instanceUpdateTime / _animatedFrames * 1000.0 << " ms on the cpu, "
+			<< _currentScene->tlasRefits << " TLAS refits and " << _currentScene->tlasRebuilds << " rebuilds so far" << std::endl;
+		_animatedFrames = 0;
+		_animatedFrameTime = 0.0;
+		_instanceUpdateTime = 0.0;
+	}
+}
+
+void VulkanEngine::init_skinning(vk::ShaderModule shader)
+{
+	if (!shader)
+	{
+		return;
+	}
+	bool skinned = _skinning->init(_core, *_currentScene, shader, FRAME_OVERLAP);
+	_core._device.destroyShaderModule(shader);
+	if (skinned)
+	{
+		_sceneDeletionQueue.push_function([skinning = _skinning]() {
+			skinning->destroy();
+		});
+	}
+}
+
+void VulkanEngine::update_skinning(vk::CommandBuffer cmd)
+{
+	if (!_skinning->active())
+	{
+		return;
+	}
+	auto start = std::chrono::high_resolution_clock::now();
+	_skinning->update(cmd, _frameNumber, static_cast<float>(_deltaTime));
+	// the characters move every frame, only the accumulation of views without them survives
+	for (uint32_t instance = 0; instance < _currentScene->instanceModels.size(); instance++)
+	{
+		if (_currentScene->instancePosedVertices[instance] == UINT32_MAX)
+		{
+			continue;
+		}
+		Scene::Bounds bounds = _currentScene->instanceBounds(instance);
+		if (vkutils::boxInFrustum(_viewProjection, bounds.min, bounds.max))
+		{
+			PushConstants.accumulatedFrames = 0;
+			break;
+		}
+	}
+	_skinningTime += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() / 1e6;
+	if (++_skinnedFrames == 500)
+	{
+		const Skinning::Stats& stats = _skinning->stats();
+		std::cout << "Skinning " << stats.instances << " instances (" << stats.joints << " joints, " << stats.vertices << " vertices, " << stats.dispatches << " dispatches): "
+			<< _skinningTime / _skinnedFrames * 1000.0 << " ms per frame on the cpu for animation, joint upload and recording" << std::endl;
+		_skinnedFrames = 0;
+		_skinningTime = 0.0;
+	}
+}
+
 void VulkanEngine::updateBuffers() {
 	// write camdata to push constant struct
 	glm::mat4 view = _cam.getView();
 	glm::mat4 projection = glm::perspective(glm::radians(_fov), (float) _core._windowExtent.width / _core._windowExtent.height, 0.1f, 1000.0f);
 	projection[1][1] *= -1;
+	_viewProjection = projection * view;
 	if(_gui.settings.renderer == 0)
 	{
 		PushConstants.proj = projection;
@@ -1548,7 +2189,8 @@ void VulkanEngine::updateBuffers() {
 		|| _settingsUBO.limit_samples != _gui.settings.limit_samples
 		|| _settingsUBO.max_samples != _gui.settings.max_samples 
 		|| _settingsUBO.mips != _gui.settings.mips 
-		|| _settingsUBO.mips_sensitivity != _gui.settings.mips_sensitivity){
+		|| _settingsUBO.mips_sensitivity != _gui.settings.mips_sensitivity
+		|| (_settingsUBO.texture_lod > 0) != _gui.settings.texture_lod){
 		_cam.changed = true;
 	}
 	// shwo cam pos
@@ -1570,6 +2212,7 @@ void VulkanEngine::updateBuffers() {
 	_settingsUBO.exposure = _gui.settings.exposure;
 	_settingsUBO.mips = _gui.settings.mips;
 	_settingsUBO.mips_sensitivity = _gui.settings.mips_sensitivity;
+	_settingsUBO.texture_lod = _gui.settings.texture_lod;
 	_settingsUBO.tonemapper = _gui.settings.tm_operator;
 	switch (_gui.settings.tm_operator)
 	{
@@ -1607,7 +2250,7 @@ void VulkanEngine::updateBuffers() {
 	_core._allocator.unmapMemory(_settingsBuffer._allocation);
 }
 
-vkutils::AllocatedImage VulkanEngine::createStorageImage(vk::Format format, uint32_t width, uint32_t height)
+vkutils::AllocatedImage VulkanEngine::createStorageImage(vk::Format format, uint32_t width, uint32_t height, vkutils::MemoryCategory category)
 {
 	vk::ImageCreateInfo imageInfo;
 	imageInfo.imageType = vk::ImageType::e2D;
@@ -1621,108 +2264,122 @@ vkutils::AllocatedImage VulkanEngine::createStorageImage(vk::Format format, uint
 	imageInfo.tiling = vk::ImageTiling::eOptimal;
 	imageInfo.usage = vk::ImageUsageFlagBits::eTransferSrc | vk::ImageUsageFlagBits::eStorage;
 	imageInfo.initialLayout = vk::ImageLayout::eUndefined;
-	vkutils::AllocatedImage storageImage = vkutils::createImage(_core, imageInfo, vk::ImageAspectFlagBits::eColor, vma::MemoryUsage::eAutoPreferDevice);
+	vkutils::AllocatedImage storageImage = vkutils::createImage(_core, imageInfo, vk::ImageAspectFlagBits::eColor, vma::MemoryUsage::eAutoPreferDevice, {}, category);
 
-    vk::CommandBuffer cmd = vkutils::getCommandBuffer(_core);
+    // the load pool may be recording on the loader thread, resizes use the render thread's own pool
+    vk::CommandBuffer cmd = _core._device.allocateCommandBuffers(vkinit::command_buffer_allocate_info(_core._cmdPool, 1, vk::CommandBufferLevel::ePrimary)).front();
     vk::CommandBufferBeginInfo beginInfo{};
     beginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
     cmd.begin(beginInfo);
 		vkutils::setImageLayout(cmd, storageImage._image, vk::ImageLayout::eUndefined, vk::ImageLayout::eGeneral, { vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1 });
     cmd.end();
 
+    // a fence instead of waiting for the queue, which still runs the frames in flight on a resize
+    vk::Fence fence = _core._device.createFence(vk::FenceCreateInfo());
     vk::SubmitInfo submitInfo{};
     submitInfo.setCommandBuffers(cmd);
-    _core._graphicsQueue.submit(submitInfo);
-    _core._graphicsQueue.waitIdle();
+    _core.submit(_core._graphicsQueue, submitInfo, fence);
+    if (_core._device.waitForFences(fence, true, UINT64_MAX) != vk::Result::eSuccess)
+    {
+        std::cerr << "Storage image fence wait failed" << std::endl;
+    }
+    _core._device.destroyFence(fence);
     _core._device.freeCommandBuffers(_core._cmdPool, cmd);
 
 	return storageImage;
 }
 
-void VulkanEngine::createShaderBindingTable() {
+void VulkanEngine::createShaderBindingTable(ScenePipelines& pipelines) {
 	const uint32_t handleSize = _raytracingPipelineProperties.shaderGroupHandleSize;
 	const uint32_t handleSizeAligned = vkutils::alignedSize(handleSize, _raytracingPipelineProperties.shaderGroupHandleAlignment);
-	const uint32_t groupCount = static_cast<uint32_t>(_shaderGroups.size());
+	const uint32_t groupCount = static_cast<uint32_t>(pipelines.shaderGroups.size());
 	const uint32_t sbtSize = groupCount * handleSizeAligned;
 
-	auto shaderHandleStorage = _core._device.getRayTracingShaderGroupHandlesKHR<uint8_t>(_raytracerPipeline, (uint32_t) 0, groupCount, (size_t) sbtSize);
+	auto shaderHandleStorage = _core._device.getRayTracingShaderGroupHandlesKHR<uint8_t>(pipelines.raytracerPipeline, (uint32_t) 0, groupCount, (size_t) sbtSize);
 
+	// queueShared, the upload copies them on the transfer queue
 	const vk::BufferUsageFlags bufferUsageFlags = vk::BufferUsageFlagBits::eShaderBindingTableKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eTransferDst;
 	const vma::MemoryUsage memoryUsage = vma::MemoryUsage::eAutoPreferDevice;
-	_raygenShaderBindingTable = vkutils::createBuffer(_core, handleSize, bufferUsageFlags, memoryUsage);
-	_missShaderBindingTable =  vkutils::createBuffer(_core, handleSize * 2, bufferUsageFlags, memoryUsage);
-	_hitShaderBindingTable =  vkutils::createBuffer(_core, handleSize, bufferUsageFlags, memoryUsage);
-
-	vkutils::AllocatedBuffer raygenShaderBindingTableStaging = vkutils::createBuffer(_core, handleSize, vk::BufferUsageFlagBits::eTransferSrc, vma::MemoryUsage::eAuto, vma::AllocationCreateFlagBits::eHostAccessSequentialWrite);
-	vkutils::AllocatedBuffer missShaderBindingTableStaging = vkutils::createBuffer(_core, handleSize * 2, vk::BufferUsageFlagBits::eTransferSrc, vma::MemoryUsage::eAuto, vma::AllocationCreateFlagBits::eHostAccessSequentialWrite);
-	vkutils::AllocatedBuffer hitShaderBindingTableStaging = vkutils::createBuffer(_core, handleSize, vk::BufferUsageFlagBits::eTransferSrc, vma::MemoryUsage::eAuto, vma::AllocationCreateFlagBits::eHostAccessSequentialWrite);
-
-	// Copy handles
-	void* dataRaygen = _core._allocator.mapMemory(raygenShaderBindingTableStaging._allocation);
-		memcpy(dataRaygen, shaderHandleStorage.data(), handleSize);
-	_core._allocator.unmapMemory(raygenShaderBindingTableStaging._allocation);
-
-	void* dataMiss = _core._allocator.mapMemory(missShaderBindingTableStaging._allocation);
-		memcpy(dataMiss, shaderHandleStorage.data() + handleSizeAligned, handleSize  * 2);
-	_core._allocator.unmapMemory(missShaderBindingTableStaging._allocation);
-
-	void* dataHit = _core._allocator.mapMemory(hitShaderBindingTableStaging._allocation);
-		memcpy(dataHit, shaderHandleStorage.data() + handleSizeAligned * 3, handleSize);
-	_core._allocator.unmapMemory(hitShaderBindingTableStaging._allocation);
-
-    vkutils::copyBuffer(_core, raygenShaderBindingTableStaging._buffer, _raygenShaderBindingTable._buffer, handleSize);
-	vkutils::copyBuffer(_core, missShaderBindingTableStaging._buffer, _missShaderBindingTable._buffer, handleSize * 2);
-	vkutils::copyBuffer(_core, hitShaderBindingTableStaging._buffer, _hitShaderBindingTable._buffer, handleSize);
-    _core._allocator.destroyBuffer(raygenShaderBindingTableStaging._buffer, raygenShaderBindingTableStaging._allocation);
-	_core._allocator.destroyBuffer(missShaderBindingTableStaging._buffer, missShaderBindingTableStaging._allocation);
-	_core._allocator.destroyBuffer(hitShaderBindingTableStaging._buffer, hitShaderBindingTableStaging._allocation);
-
-	_mainDeletionQueue.push_function([=]() {
-		_core._allocator.destroyBuffer(_raygenShaderBindingTable._buffer, _raygenShaderBindingTable._allocation);
-		_core._allocator.destroyBuffer(_missShaderBindingTable._buffer, _missShaderBindingTable._allocation);
-		_core._allocator.destroyBuffer(_hitShaderBindingTable._buffer, _hitShaderBindingTable._allocation);
-	});
+	pipelines.raygenShaderBindingTable = vkutils::createBuffer(_core, handleSize, bufferUsageFlags, memoryUsage, {}, true);
+	pipelines.missShaderBindingTable =  vkutils::createBuffer(_core, handleSize * 2, bufferUsageFlags, memoryUsage, {}, true);
+	pipelines.hitShaderBindingTable =  vkutils::createBuffer(_core, handleSize, bufferUsageFlags, memoryUsage, {}, true);
+
+	// one submit for the three tables instead of a queue round trip each
+	vkutils::UploadContext upload(_core, sbtSize);
+	upload.copy(shaderHandleStorage.data(), handleSize, pipelines.raygenShaderBindingTable._buffer);
+	upload.copy(shaderHandleStorage.data() + handleSizeAligned, handleSize * 2, pipelines.missShaderBindingTable._buffer);
+	upload.copy(shaderHandleStorage.data() + handleSizeAligned * 3, handleSize, pipelines.hitShaderBindingTable._buffer);
+	upload.finish();
 }
 
 void VulkanEngine::recreateSwapchain() {
-	_core._device.waitIdle();
 	_framebufferResized = false;
 	int w, h;
 	SDL_GetWindowSizeInPixels(_core._window, &w, &h);
 	_core._windowExtent = vk::Extent2D{static_cast<uint32_t>(w), static_cast<uint32_t>(h)};
 	_cam.updateSize(_core._windowExtent.width, _core._windowExtent.height);
 
-	_resizeDeletionQueue.flush();
-	_gui.destroyFramebuffer();
+	// the frames in flight keep rendering into the old swapchain, its resources go once the timeline passed them.
+	// The timeline says nothing about the presentation engine, which may still hold the old swapchain and wait on its
+	// render semaphores, so they also wait for a present on the new swapchain to complete. Without present fences this
+	// rare path waits for the present queue instead.
+	_gui.retireFramebuffers(_resizeDeletionQueue);
+	if (_core._swapchainMaintenance1)
+	{
+		_retiredSwapchains.push_back(std::move(_resizeDeletionQueue));
+		_resizeDeletionQueue.deletors.clear();
+	}
+	else
+	{
+		{
+			std::lock_guard<std::mutex> lock(_core._queueMutex);
+			_core._presentQueue.waitIdle();
+		}
+		_deferredDeletion.push(_frameTimelineValue, std::move(_resizeDeletionQueue));
+	}
 
 	init_swapchain();
 	init_default_renderpass();
 	init_framebuffers();
 	_gui.initFrambuffers();
 	init_sync_structures();
+	std::array<vkutils::AllocatedImage, FRAME_OVERLAP> storageImages;
 	for (int i = 0; i < FRAME_OVERLAP; i++)
 	{
 		_frames[i]._storageImage = createStorageImage(_core._swapchainImageFormat, _core._windowExtent.width, _core._windowExtent.height);
-
-		vk::DescriptorImageInfo resultImageDescriptor;
-		resultImageDescriptor.imageView = _frames[i]._storageImage._view;
-		resultImageDescriptor.imageLayout = vk::ImageLayout::eGeneral;
-		vk::WriteDescriptorSet resultImageWriteCompute;
-		resultImageWriteCompute.dstSet = _frames[i]._computeDescriptor;
-		resultImageWriteCompute.descriptorType = vk::DescriptorType::eStorageImage;
-		resultImageWriteCompute.dstBinding = 1;
-		resultImageWriteCompute.pImageInfo = &resultImageDescriptor;
-		resultImageWriteCompute.descriptorCount = 1;
-
-		std::vector<vk::WriteDescriptorSet> setWrites = {
-			resultImageWriteCompute
-		};
-		_core._device.updateDescriptorSets(setWrites, {});
+		storageImages[i] = _frames[i]._storageImage;
+		// the descriptor set may still be in use, draw rewrites it once the frame's slot is free again
+		_storageImageStale[i] = true;
 	}
-	_resizeDeletionQueue.push_function([&]() {
-		for (int i = 0; i < FRAME_OVERLAP; i++) {
-			_core._allocator.destroyImage(_frames[i]._storageImage._image, _frames[i]._storageImage._allocation);
-			_core._device.destroyImageView(_frames[i]._storageImage._view);
+	_resizeDeletionQueue.push_function([=]() {
+		for (const vkutils::AllocatedImage& storageImage : storageImages) {
+			vkutils::destroyImage(_core, storageImage);
+			_core._device.destroyImageView(storageImage._view);
 		}
 	});
+}
+
+void VulkanEngine::update_storage_image_descriptor()
+{
+	uint32_t frame = _frameNumber % FRAME_OVERLAP;
+	if (!_storageImageStale[frame])
+	{
+		return;
+	}
+	_storageImageStale[frame] = false;
+
+	vk::DescriptorImageInfo resultImageDescriptor;
+	resultImageDescriptor.imageView = _frames[frame]._storageImage._view;
+	resultImageDescriptor.imageLayout = vk::ImageLayout::eGeneral;
+	vk::WriteDescriptorSet resultImageWriteCompute;
+	resultImageWriteCompute.dstSet = _frames[frame]._computeDescriptor;
+	resultImageWriteCompute.descriptorType = vk::DescriptorType::eStorageImage;
+	resultImageWriteCompute.dstBinding = 1;
+	resultImageWriteCompute.pImageInfo = &resultImageDescriptor;
+	resultImageWriteCompute.descriptorCount = 1;
+
+	std::vector<vk::WriteDescriptorSet> setWrites = {
+		resultImageWriteCompute
+	};
+	_core._device.updateDescriptorSets(setWrites, {});
 }
\ No newline at end of file
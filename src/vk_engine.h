@@ -3,8 +3,14 @@
 #include <vk_shader_utils.h>
 #include <vk_utils.h>
 #include <vk_scene.h>
+#include <vk_texture_streamer.h>
+#include <vk_skinning.h>
 #include <Camera.h>
 #include <GUI.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
 
 #undef MemoryBarrier
 
@@ -27,8 +33,22 @@ public:
 	vkutils::ComputeConstants ComputeConstants;
 	Camera _cam;
 	float _fov;
+	// projection * view of the current frame, moved instances outside of it keep the accumulated image
+	glm::mat4 _viewProjection{1.0f};
+	// frame time while instances are animated, logged every 500 frames
+	uint32_t _animatedFrames{0};
+	double _animatedFrameTime{0.0};
+	double _instanceUpdateTime{0.0};
+	// cpu time of the skinning update while characters are animated, logged every 500 frames
+	uint32_t _skinnedFrames{0};
+	double _skinningTime{0.0};
 
 	vkutils::FrameData _frames[FRAME_OVERLAP];
+	// counts the submitted frames, every frame signals the next value
+	vk::Semaphore _frameTimeline;
+	uint64_t _frameTimelineValue{0};
+	// frames whose compute descriptor still points at a storage image replaced by a resize
+	bool _storageImageStale[FRAME_OVERLAP]{};
 	vk::RenderPass _renderPass;
 
 	vk::PipelineLayout _rasterizerPipelineLayout;
@@ -48,6 +68,39 @@ public:
 	
 	Scene* _currentScene;
 	std::vector<Scene*> _scenes;
+	std::map<std::string, std::string> _shaderIncludes;
+
+	// What the rasterizer and the raytracer are built against, it changes with the scene's vertex layout and
+	// texture count. The loader thread compiles it for the scene it loads, the rasterizer pipeline itself needs
+	// the render pass and is only created when the scene is swapped in.
+	struct ScenePipelines {
+		vk::DescriptorSetLayout rasterizerSetLayout;
+		vk::PipelineLayout rasterizerPipelineLayout;
+		vk::ShaderModule rasterizerShaders[2];
+		vk::DescriptorSetLayout raytracerSetLayout;
+		vk::PipelineLayout raytracerPipelineLayout;
+		vk::Pipeline raytracerPipeline;
+		std::vector<vk::RayTracingShaderGroupCreateInfoKHR> shaderGroups;
+		// the handles of raytracerPipeline, uploaded by the thread that builds it
+		vkutils::AllocatedBuffer raygenShaderBindingTable;
+		vkutils::AllocatedBuffer missShaderBindingTable;
+		vkutils::AllocatedBuffer hitShaderBindingTable;
+		// skinning.comp for scenes with skinned nodes, consumed by init_skinning
+		vk::ShaderModule skinningShader;
+	};
+	// scene setups the L key cycles through, every one adds the models of a scene and sets its options
+	std::vector<std::function<void(Scene&)>> _sceneSetups;
+	uint32_t _sceneSetup{0};
+	// 10k instances moving every frame, loaded by the GUI's benchmark button
+	uint32_t _instanceBenchmarkSetup{0};
+	// background loading, _sceneReady is set by the loader once _loadedScene and _loadedPipelines are complete
+	std::thread _sceneLoader;
+	std::atomic<bool> _sceneReady{false};
+	bool _sceneLoading{false};
+	Scene* _loadedScene{nullptr};
+	ScenePipelines _loadedPipelines;
+	// destroys everything built for _currentScene, moved into _deferredDeletion when another scene is swapped in
+	vkutils::DeletionQueue _sceneDeletionQueue;
 
 	vkutils::Shadersettings _settingsUBO;
 	vkutils::AllocatedBuffer _settingsBuffer;
@@ -68,8 +121,29 @@ public:
 
 	vkutils::AllocatedImage _accumulationImage;
 
+	// enable flag, then first word of the tile bits, resident level and packed size of every texture, see shader/texture_lod.glsl
+	std::vector<uint32_t> _textureFeedbackHeader;
+	uint32_t _textureFeedbackWords{0};
+
+	// shared with the deletion queue of their scene, which keeps them alive until it is retired
+	std::shared_ptr<TextureStreamer> _textureStreamer = std::make_shared<TextureStreamer>();
+	// textures whose image was swapped by the streamer and that still need a descriptor write in that frame's set
+	std::set<uint32_t> _streamedTextures[FRAME_OVERLAP];
+	// copies of the streamed images on the transfer queue, the frame that acquires them waits for these
+	std::vector<vk::Semaphore> _streamingWaits;
+
+	std::shared_ptr<Skinning> _skinning = std::make_shared<Skinning>();
+
 	vkutils::DeletionQueue _resizeDeletionQueue;
 	vkutils::DeletionQueue _mainDeletionQueue;
+	// retired scenes and the swapchain resources of resizes, keyed by the _frameTimeline value of their last frame
+	vkutils::DeferredDeletionQueue _deferredDeletion;
+	// swapchains replaced by a resize and their resources, they wait for a present on a newer swapchain to signal
+	// _presentFence before they go to _deferredDeletion
+	std::deque<vkutils::DeletionQueue> _retiredSwapchains;
+	vk::Fence _presentFence;
+	// how many of _retiredSwapchains the pending _presentFence retires, 0 when no present waits on it
+	size_t _presentFenceRetires{0};
 
 	void init();
 	void cleanup();
@@ -78,6 +152,13 @@ public:
 
 	vkutils::FrameData& get_current_frame();
 
+	// moves an instance of the current scene, the TLAS follows in the next frame
+	void move_instance(uint32_t instance, const glm::mat4& transform);
+
+	// Builds the scene of _sceneSetups[setup] on a background thread, draw swaps it in once it is ready.
+	// Returns false while another load is still running.
+	bool load_scene_async(uint32_t setup);
+
 private:
 	void init_vulkan();
 
@@ -103,21 +184,49 @@ private:
 
 	void init_pipelines();
 
+	ScenePipelines build_scene_pipelines(const Scene& scene, const std::map<std::string, std::string>& includes);
+
+	void use_scene_pipelines(ScenePipelines& pipelines);
+
+	void init_scene_descriptors();
+
 	void load_models();
 
+	void own_scene(Scene* scene);
+
+	void switch_scene();
+
+	void init_texture_feedback();
+
+	void read_texture_feedback();
+
+	void init_texture_streaming();
+
+	void update_texture_streaming(vk::CommandBuffer cmd);
+
+	void animate_instances();
+
+	void init_skinning(vk::ShaderModule shader);
+
+	void update_skinning(vk::CommandBuffer cmd);
+
 	void upload_model(Model& model);
 
 	void init_bottom_level_acceleration_structure(Model &model);
 
 	void init_top_level_acceleration_structure();
 
-	vkutils::AllocatedImage createStorageImage(vk::Format format, uint32_t width, uint32_t height);
+	vkutils::AllocatedImage createStorageImage(vk::Format format, uint32_t width, uint32_t height, vkutils::MemoryCategory category = vkutils::MemoryCategory::eRenderTarget);
 
-	void createShaderBindingTable();
+	void update_storage_image_descriptor();
+
+	void createShaderBindingTable(ScenePipelines& pipelines);
 
 	void updateBuffers();
 
 	void recreateSwapchain();
 
 	vk::ShaderModule load_shader_module(vk::ShaderStageFlagBits type, std::string filePath);
+
+	vk::ShaderModule load_shader_module(vk::ShaderStageFlagBits type, std::string filePath, const std::map<std::string, std::string>& includes);
 };
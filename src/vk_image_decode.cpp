@@ -0,0 +1,115 @@
+#include <vk_image_decode.h>
+#include <stb_image.h>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define VKUTILS_DECODE_SSSE3
+#include <tmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON)
+#define VKUTILS_DECODE_NEON
+#include <arm_neon.h>
+#endif
+
+namespace
+{
+	void expandScalar(const unsigned char *rgb, unsigned char *rgba, size_t pixelCount)
+	{
+		for (size_t i = 0; i < pixelCount; i++)
+		{
+			rgba[i * 4 + 0] = rgb[i * 3 + 0];
+			rgba[i * 4 + 1] = rgb[i * 3 + 1];
+			rgba[i * 4 + 2] = rgb[i * 3 + 2];
+			rgba[i * 4 + 3] = 255;
+		}
+	}
+
+#if defined(VKUTILS_DECODE_SSSE3)
+	bool hasSSSE3()
+	{
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 9)) != 0;
+#else
+		return __builtin_cpu_supports("ssse3");
+#endif
+	}
+
+#if !defined(_MSC_VER)
+	__attribute__((target("ssse3")))
+#endif
+	size_t expandSSSE3(const unsigned char *rgb, unsigned char *rgba, size_t pixelCount)
+	{
+		// every 16 byte load holds 5 1/3 pixels, the shuffle spreads the first 4 and the or sets their alpha
+		const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+		const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xFF000000u));
+		size_t i = 0;
+		// stop while a full 16 byte load still fits into the source
+		for (; i + 6 <= pixelCount; i += 4)
+		{
+			__m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rgb + i * 3));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(rgba + i * 4), _mm_or_si128(_mm_shuffle_epi8(pixels, shuffle), alpha));
+		}
+		return i;
+	}
+#endif
+}
+
+void vkutils::decode::expandRGBToRGBA(const unsigned char *rgb, unsigned char *rgba, size_t pixelCount)
+{
+	size_t done = 0;
+#if defined(VKUTILS_DECODE_SSSE3)
+	static const bool ssse3 = hasSSSE3();
+	if (ssse3)
+	{
+		done = expandSSSE3(rgb, rgba, pixelCount);
+	}
+#elif defined(VKUTILS_DECODE_NEON)
+	for (; done + 16 <= pixelCount; done += 16)
+	{
+		uint8x16x3_t pixels = vld3q_u8(rgb + done * 3);
+		uint8x16x4_t expanded;
+		expanded.val[0] = pixels.val[0];
+		expanded.val[1] = pixels.val[1];
+		expanded.val[2] = pixels.val[2];
+		expanded.val[3] = vdupq_n_u8(255);
+		vst4q_u8(rgba + done * 4, expanded);
+	}
+#endif
+	expandScalar(rgb + done * 3, rgba + done * 4, pixelCount - done);
+}
+
+bool vkutils::decode::decodeRGBA8(const unsigned char *bytes, size_t size, uint32_t &width, uint32_t &height, std::vector<unsigned char> &rgba, std::string &error)
+{
+	int w, h, components;
+	if (!stbi_info_from_memory(bytes, static_cast<int>(size), &w, &h, &components))
+	{
+		error = stbi_failure_reason();
+		return false;
+	}
+	// stb_image's own channel conversion is a scalar loop, rgb is expanded here instead
+	int requested = components == 3 ? 3 : 4;
+	stbi_uc *pixels = stbi_load_from_memory(bytes, static_cast<int>(size), &w, &h, &components, requested);
+	if (!pixels)
+	{
+		error = stbi_failure_reason();
+		return false;
+	}
+	width = static_cast<uint32_t>(w);
+	height = static_cast<uint32_t>(h);
+	size_t pixelCount = static_cast<size_t>(width) * height;
+	rgba.resize(pixelCount * 4);
+	if (requested == 3)
+	{
+		expandRGBToRGBA(pixels, rgba.data(), pixelCount);
+	}
+	else
+	{
+		memcpy(rgba.data(), pixels, pixelCount * 4);
+	}
+	stbi_image_free(pixels);
+	return true;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace vkutils
+{
+	// Thread safe image decoding for the loader's thread pool, stb_image does the PNG/JPEG work.
+	namespace decode
+	{
+		// rgb8 -> rgba8 with alpha 255. Uses SSSE3 or NEON when available, rgb and rgba must not overlap.
+		void expandRGBToRGBA(const unsigned char *rgb, unsigned char *rgba, size_t pixelCount);
+		// Decodes to tightly packed rgba8, three channel images are expanded with expandRGBToRGBA.
+		bool decodeRGBA8(const unsigned char *bytes, size_t size, uint32_t &width, uint32_t &height, std::vector<unsigned char> &rgba, std::string &error);
+	}
+}
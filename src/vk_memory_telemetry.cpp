@@ -0,0 +1,158 @@
+#include <vk_memory_telemetry.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+const char *vkutils::memoryCategoryName(MemoryCategory category)
+{
+    switch (category)
+    {
+        case MemoryCategory::eVertex: return "vertex";
+        case MemoryCategory::eIndex: return "index";
+        case MemoryCategory::eTexture: return "texture";
+        case MemoryCategory::eAccelerationStructure: return "acceleration structure";
+        case MemoryCategory::eScratch: return "scratch";
+        case MemoryCategory::eShaderBindingTable: return "shader binding table";
+        case MemoryCategory::eAccumulation: return "accumulation";
+        case MemoryCategory::eRenderTarget: return "render target";
+        case MemoryCategory::eStaging: return "staging";
+        case MemoryCategory::eArena: return "arena free";
+        case MemoryCategory::eOther: return "other";
+        default: return "inferred";
+    }
+}
+
+void vkutils::MemoryTelemetry::init(vma::Allocator allocator, vk::PhysicalDevice physicalDevice)
+{
+    vk::PhysicalDeviceMemoryProperties properties = physicalDevice.getMemoryProperties();
+    std::lock_guard<std::mutex> lock(_mutex);
+    _allocator = allocator;
+    _heaps.assign(properties.memoryHeaps.begin(), properties.memoryHeaps.begin() + properties.memoryHeapCount);
+}
+
+vkutils::MemoryCategory vkutils::MemoryTelemetry::categorize(vk::BufferUsageFlags usage)
+{
+    // acceleration structure storage and tables first, scene buffers carry several of the other flags at once
+    if (usage & vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR)
+        return MemoryCategory::eAccelerationStructure;
+    if (usage & vk::BufferUsageFlagBits::eShaderBindingTableKHR)
+        return MemoryCategory::eShaderBindingTable;
+    if (usage & vk::BufferUsageFlagBits::eIndexBuffer)
+        return MemoryCategory::eIndex;
+    if (usage & vk::BufferUsageFlagBits::eVertexBuffer)
+        return MemoryCategory::eVertex;
+    if (usage == vk::BufferUsageFlagBits::eTransferSrc)
+        return MemoryCategory::eStaging;
+    return MemoryCategory::eOther;
+}
+
+vkutils::MemoryCategory vkutils::MemoryTelemetry::categorize(vk::ImageUsageFlags usage)
+{
+    if (usage & vk::ImageUsageFlagBits::eSampled)
+        return MemoryCategory::eTexture;
+    if (usage & (vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eDepthStencilAttachment | vk::ImageUsageFlagBits::eStorage))
+        return MemoryCategory::eRenderTarget;
+    return MemoryCategory::eOther;
+}
+
+void vkutils::MemoryTelemetry::track(vma::Allocation allocation, MemoryCategory category)
+{
+    if (!allocation || !_allocator)
+    {
+        return;
+    }
+    uint64_t size = _allocator.getAllocationInfo(allocation).size;
+    std::lock_guard<std::mutex> lock(_mutex);
+    _allocations[static_cast<VmaAllocation>(allocation)] = Tracked{category, size};
+    Category &counted = _categories[static_cast<size_t>(category)];
+    counted.bytes += size;
+    counted.allocations++;
+    counted.peakBytes = std::max(counted.peakBytes, counted.bytes);
+}
+
+void vkutils::MemoryTelemetry::untrack(vma::Allocation allocation)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _allocations.find(static_cast<VmaAllocation>(allocation));
+    if (it == _allocations.end())
+    {
+        return;
+    }
+    Category &counted = _categories[static_cast<size_t>(it->second.category)];
+    counted.bytes -= it->second.size;
+    counted.allocations--;
+    _allocations.erase(it);
+}
+
+void vkutils::MemoryTelemetry::transfer(MemoryCategory from, MemoryCategory to, uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _categories[static_cast<size_t>(from)].bytes -= bytes;
+    Category &counted = _categories[static_cast<size_t>(to)];
+    counted.bytes += bytes;
+    counted.peakBytes = std::max(counted.peakBytes, counted.bytes);
+}
+
+vkutils::MemoryTelemetry::Snapshot vkutils::MemoryTelemetry::snapshot() const
+{
+    Snapshot snapshot;
+    std::vector<vma::Budget> budgets = _allocator ? _allocator.getHeapBudgets() : std::vector<vma::Budget>{};
+    std::lock_guard<std::mutex> lock(_mutex);
+    snapshot.categories = _categories;
+    for (size_t i = 0; i < _heaps.size() && i < budgets.size(); i++)
+    {
+        Heap heap;
+        heap.deviceLocal = static_cast<bool>(_heaps[i].flags & vk::MemoryHeapFlagBits::eDeviceLocal);
+        heap.size = _heaps[i].size;
+        heap.usage = budgets[i].usage;
+        heap.budget = budgets[i].budget;
+        heap.blockBytes = budgets[i].statistics.blockBytes;
+        heap.allocationBytes = budgets[i].statistics.allocationBytes;
+        heap.blockCount = budgets[i].statistics.blockCount;
+        heap.allocationCount = budgets[i].statistics.allocationCount;
+        snapshot.heaps.push_back(heap);
+    }
+    return snapshot;
+}
+
+std::string vkutils::MemoryTelemetry::json() const
+{
+    Snapshot snapshot = this->snapshot();
+    std::ostringstream out;
+    out << "{\n    \"categories\": {";
+    const char *separator = "\n";
+    for (size_t c = static_cast<size_t>(MemoryCategory::eVertex); c < snapshot.categories.size(); c++)
+    {
+        const Category &category = snapshot.categories[c];
+        out << separator << "        \"" << memoryCategoryName(static_cast<MemoryCategory>(c)) << "\": {\"bytes\": " << category.bytes
+            << ", \"allocations\": " << category.allocations << ", \"peakBytes\": " << category.peakBytes << "}";
+        separator = ",\n";
+    }
+    out << "\n    },\n    \"heaps\": [";
+    separator = "\n";
+    for (size_t i = 0; i < snapshot.heaps.size(); i++)
+    {
+        const Heap &heap = snapshot.heaps[i];
+        out << separator << "        {\"index\": " << i << ", \"deviceLocal\": " << (heap.deviceLocal ? "true" : "false")
+            << ", \"size\": " << heap.size << ", \"usage\": " << heap.usage << ", \"budget\": " << heap.budget
+            << ", \"blockBytes\": " << heap.blockBytes << ", \"allocationBytes\": " << heap.allocationBytes
+            << ", \"blockCount\": " << heap.blockCount << ", \"allocationCount\": " << heap.allocationCount << "}";
+        separator = ",\n";
+    }
+    out << "\n    ]\n}\n";
+    return out.str();
+}
+
+bool vkutils::MemoryTelemetry::dump(const std::string &path) const
+{
+    std::ofstream out(path, std::ios::trunc);
+    if (!out)
+    {
+        std::cerr << "Could not write the memory telemetry to " << path << std::endl;
+        return false;
+    }
+    out << json();
+    std::cout << "Memory telemetry written to " << path << std::endl;
+    return true;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <vk_types.h>
+#include <array>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace vkutils
+{
+    // What a buffer or image holds, every allocation of createBuffer and createImage is counted under one.
+    // eInferred picks one from the usage flags, only scratch, staging and the render targets need an explicit tag.
+    enum class MemoryCategory : uint32_t
+    {
+        eInferred,
+        eVertex,
+        eIndex,
+        eTexture,
+        eAccelerationStructure,
+        eScratch,
+        eShaderBindingTable,
+        eAccumulation,
+        eRenderTarget,
+        eStaging,
+        // blocks of a BufferArena, the ranges in use move to the category they were allocated for
+        eArena,
+        eOther,
+        eCount
+    };
+    const char *memoryCategoryName(MemoryCategory category);
+
+    // Bytes allocated per MemoryCategory next to the heap budgets and VMA statistics VK_EXT_memory_budget
+    // reports. The loader thread allocates as well, so every call locks.
+    class MemoryTelemetry {
+    public:
+        class Category {
+        public:
+            uint64_t bytes = 0;
+            uint64_t allocations = 0;
+            uint64_t peakBytes = 0;
+        };
+        class Heap {
+        public:
+            bool deviceLocal = false;
+            uint64_t size = 0;
+            // usage and budget of the whole process, block and allocation bytes of VMA only
+            uint64_t usage = 0;
+            uint64_t budget = 0;
+            uint64_t blockBytes = 0;
+            uint64_t allocationBytes = 0;
+            uint32_t blockCount = 0;
+            uint32_t allocationCount = 0;
+        };
+        class Snapshot {
+        public:
+            std::array<Category, static_cast<size_t>(MemoryCategory::eCount)> categories{};
+            std::vector<Heap> heaps{};
+        };
+        void init(vma::Allocator allocator, vk::PhysicalDevice physicalDevice);
+        static MemoryCategory categorize(vk::BufferUsageFlags usage);
+        static MemoryCategory categorize(vk::ImageUsageFlags usage);
+        void track(vma::Allocation allocation, MemoryCategory category);
+        void untrack(vma::Allocation allocation);
+        // moves bytes of a tracked allocation between categories, for sub-allocations
+        void transfer(MemoryCategory from, MemoryCategory to, uint64_t bytes);
+        Snapshot snapshot() const;
+        std::string json() const;
+        bool dump(const std::string &path = "memory_telemetry.json") const;
+    private:
+        struct Tracked {
+            MemoryCategory category;
+            uint64_t size;
+        };
+        vma::Allocator _allocator;
+        std::vector<vk::MemoryHeap> _heaps{};
+        mutable std::mutex _mutex;
+        std::unordered_map<VmaAllocation, Tracked> _allocations{};
+        std::array<Category, static_cast<size_t>(MemoryCategory::eCount)> _categories{};
+    };
+}
@@ -0,0 +1,192 @@
+#include <vk_mesh_optimizer.h>
+#include <cstring>
+#include <unordered_map>
+
+namespace
+{
+	// hashes and compares whole vertices bytewise, padding is zeroed by the loader so this is exact
+	struct VertexBytesHash
+	{
+		size_t operator()(const Vertex *vertex) const
+		{
+			const unsigned char *bytes = reinterpret_cast<const unsigned char *>(vertex);
+			uint64_t hash = 14695981039346656037ull;
+			for (size_t i = 0; i < sizeof(Vertex); i++)
+			{
+				hash = (hash ^ bytes[i]) * 1099511628211ull;
+			}
+			return static_cast<size_t>(hash);
+		}
+	};
+
+	struct VertexBytesEqual
+	{
+		bool operator()(const Vertex *a, const Vertex *b) const
+		{
+			return std::memcmp(a, b, sizeof(Vertex)) == 0;
+		}
+	};
+}
+
+size_t vkutils::meshopt::simulateCacheMisses(const std::vector<uint32_t> &indices, size_t vertexCount, uint32_t cacheSize)
+{
+	// timestamps instead of an explicit queue: a vertex is cached while fewer than cacheSize misses happened since its own
+	std::vector<size_t> insertedAt(vertexCount, SIZE_MAX);
+	size_t misses = 0;
+	for (uint32_t index : indices)
+	{
+		if (insertedAt[index] == SIZE_MAX || misses - insertedAt[index] >= cacheSize)
+		{
+			insertedAt[index] = misses;
+			misses++;
+		}
+	}
+	return misses;
+}
+
+size_t vkutils::meshopt::weldVertices(std::vector<Vertex> &vertices, std::vector<uint32_t> &indices)
+{
+	std::unordered_map<const Vertex *, uint32_t, VertexBytesHash, VertexBytesEqual> unique;
+	unique.reserve(vertices.size());
+	std::vector<uint32_t> remap(vertices.size());
+	std::vector<Vertex> welded;
+	welded.reserve(vertices.size());
+	for (size_t i = 0; i < vertices.size(); i++)
+	{
+		auto inserted = unique.emplace(&vertices[i], static_cast<uint32_t>(welded.size()));
+		if (inserted.second)
+		{
+			welded.push_back(vertices[i]);
+		}
+		remap[i] = inserted.first->second;
+	}
+	for (uint32_t &index : indices)
+	{
+		index = remap[index];
+	}
+	vertices.swap(welded);
+	return vertices.size();
+}
+
+void vkutils::meshopt::optimizeVertexCache(std::vector<uint32_t> &indices, size_t vertexCount, uint32_t cacheSize)
+{
+	size_t triangleCount = indices.size() / 3;
+	if (triangleCount == 0 || vertexCount == 0)
+	{
+		return;
+	}
+
+	// vertex -> triangle adjacency in compressed rows
+	std::vector<uint32_t> live(vertexCount, 0);
+	for (uint32_t index : indices)
+	{
+		live[index]++;
+	}
+	std::vector<uint32_t> adjacencyOffset(vertexCount + 1, 0);
+	for (size_t v = 0; v < vertexCount; v++)
+	{
+		adjacencyOffset[v + 1] = adjacencyOffset[v] + live[v];
+	}
+	std::vector<uint32_t> adjacency(indices.size());
+	std::vector<uint32_t> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+	for (size_t t = 0; t < triangleCount; t++)
+	{
+		for (size_t k = 0; k < 3; k++)
+		{
+			adjacency[fill[indices[t * 3 + k]]++] = static_cast<uint32_t>(t);
+		}
+	}
+
+	std::vector<uint32_t> cacheTime(vertexCount, 0);
+	std::vector<bool> emitted(triangleCount, false);
+	std::vector<uint32_t> deadEnd;
+	std::vector<uint32_t> candidates;
+	std::vector<uint32_t> output;
+	output.reserve(indices.size());
+	uint32_t timestamp = cacheSize + 1;
+	size_t cursor = 0;
+	int64_t fanning = 0;
+
+	while (fanning >= 0)
+	{
+		candidates.clear();
+		// emit every remaining triangle around the fanning vertex
+		for (uint32_t a = adjacencyOffset[fanning]; a < adjacencyOffset[fanning + 1]; a++)
+		{
+			uint32_t t = adjacency[a];
+			if (emitted[t])
+			{
+				continue;
+			}
+			for (size_t k = 0; k < 3; k++)
+			{
+				uint32_t v = indices[t * 3 + k];
+				output.push_back(v);
+				deadEnd.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if (timestamp - cacheTime[v] > cacheSize)
+				{
+					cacheTime[v] = timestamp++;
+				}
+			}
+			emitted[t] = true;
+		}
+
+		// next fanning vertex: the candidate that stays in cache longest, otherwise a dead end, otherwise any live vertex
+		fanning = -1;
+		int64_t bestPriority = -1;
+		for (uint32_t v : candidates)
+		{
+			if (live[v] == 0)
+			{
+				continue;
+			}
+			int64_t priority = 0;
+			if (timestamp - cacheTime[v] + 2 * live[v] <= cacheSize)
+			{
+				priority = timestamp - cacheTime[v];
+			}
+			if (priority > bestPriority)
+			{
+				bestPriority = priority;
+				fanning = v;
+			}
+		}
+		while (fanning < 0 && !deadEnd.empty())
+		{
+			uint32_t v = deadEnd.back();
+			deadEnd.pop_back();
+			if (live[v] > 0)
+			{
+				fanning = v;
+			}
+		}
+		while (fanning < 0 && cursor < vertexCount)
+		{
+			if (live[cursor] > 0)
+			{
+				fanning = static_cast<int64_t>(cursor);
+			}
+			cursor++;
+		}
+	}
+	indices.swap(output);
+}
+
+void vkutils::meshopt::optimizeVertexFetch(std::vector<Vertex> &vertices, std::vector<uint32_t> &indices)
+{
+	std::vector<uint32_t> remap(vertices.size(), UINT32_MAX);
+	std::vector<Vertex> ordered;
+	ordered.reserve(vertices.size());
+	for (uint32_t &index : indices)
+	{
+		if (remap[index] == UINT32_MAX)
+		{
+			remap[index] = static_cast<uint32_t>(ordered.size());
+			ordered.push_back(vertices[index]);
+		}
+		index = remap[index];
+	}
+	vertices.swap(ordered);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <vk_vertex_layout.h>
+#include <cstdint>
+#include <vector>
+
+namespace vkutils
+{
+	// Import time index/vertex optimizations for a single indexed triangle list.
+	namespace meshopt
+	{
+		// Number of vertex shader invocations a FIFO post-transform cache of cacheSize entries would miss.
+		// Divided by the triangle count this is the ACMR, 0.5 is the ideal for large regular meshes and 3.0 the worst case.
+		size_t simulateCacheMisses(const std::vector<uint32_t> &indices, size_t vertexCount, uint32_t cacheSize = 16);
+		// Merges vertices that are bitwise identical and rewrites the indices, returns the new vertex count.
+		size_t weldVertices(std::vector<Vertex> &vertices, std::vector<uint32_t> &indices);
+		// Reorders triangles for post-transform cache locality (Tipsify, Sander et al. 2007).
+		void optimizeVertexCache(std::vector<uint32_t> &indices, size_t vertexCount, uint32_t cacheSize = 16);
+		// Reorders vertices into the order the index buffer first touches them and drops unreferenced ones.
+		void optimizeVertexFetch(std::vector<Vertex> &vertices, std::vector<uint32_t> &indices);
+	}
+}
@@ -0,0 +1,85 @@
+#include <vk_mipmap.h>
+#include <algorithm>
+
+uint32_t vkutils::mipmap::levelCount(uint32_t width, uint32_t height)
+{
+	uint32_t levels = 1;
+	uint32_t size = std::max(width, height);
+	while (size > 1)
+	{
+		size >>= 1;
+		levels++;
+	}
+	return levels;
+}
+
+std::vector<size_t> vkutils::mipmap::buildChainRGBA8(const unsigned char *image, uint32_t width, uint32_t height, std::vector<unsigned char> &chain)
+{
+	uint32_t levels = levelCount(width, height);
+	std::vector<size_t> offsets;
+	size_t total = 0;
+	for (uint32_t level = 0; level < levels; level++)
+	{
+		offsets.push_back(total);
+		total += static_cast<size_t>(std::max(width >> level, 1u)) * std::max(height >> level, 1u) * 4;
+	}
+	offsets.push_back(total);
+	chain.resize(total);
+	std::copy(image, image + static_cast<size_t>(width) * height * 4, chain.begin());
+
+	for (uint32_t level = 1; level < levels; level++)
+	{
+		uint32_t srcWidth = std::max(width >> (level - 1), 1u);
+		uint32_t srcHeight = std::max(height >> (level - 1), 1u);
+		uint32_t dstWidth = std::max(width >> level, 1u);
+		uint32_t dstHeight = std::max(height >> level, 1u);
+		const unsigned char *src = chain.data() + offsets[level - 1];
+		unsigned char *dst = chain.data() + offsets[level];
+		for (uint32_t y = 0; y < dstHeight; y++)
+		{
+			// a dimension that is already 1 is not halved, clamp the second tap onto the first
+			uint32_t y0 = std::min(y * 2, srcHeight - 1);
+			uint32_t y1 = std::min(y * 2 + 1, srcHeight - 1);
+			for (uint32_t x = 0; x < dstWidth; x++)
+			{
+				uint32_t x0 = std::min(x * 2, srcWidth - 1);
+				uint32_t x1 = std::min(x * 2 + 1, srcWidth - 1);
+				for (uint32_t c = 0; c < 4; c++)
+				{
+					uint32_t sum = src[(y0 * srcWidth + x0) * 4 + c] + src[(y0 * srcWidth + x1) * 4 + c] + src[(y1 * srcWidth + x0) * 4 + c] + src[(y1 * srcWidth + x1) * 4 + c];
+					dst[(y * dstWidth + x) * 4 + c] = static_cast<unsigned char>((sum + 2) / 4);
+				}
+			}
+		}
+	}
+	return offsets;
+}
+
+uint32_t vkutils::mipmap::feedbackLevelWords(uint32_t width, uint32_t height, uint32_t level)
+{
+	uint32_t tilesX = (std::max(width >> level, 1u) + feedbackTileSize - 1) / feedbackTileSize;
+	uint32_t tilesY = (std::max(height >> level, 1u) + feedbackTileSize - 1) / feedbackTileSize;
+	return (tilesX * tilesY + 31) / 32;
+}
+
+uint64_t vkutils::mipmap::feedbackLevelBytes(const uint32_t *words, uint32_t width, uint32_t height, uint32_t level)
+{
+	uint32_t levelWidth = std::max(width >> level, 1u);
+	uint32_t levelHeight = std::max(height >> level, 1u);
+	uint32_t tilesX = (levelWidth + feedbackTileSize - 1) / feedbackTileSize;
+	uint32_t tilesY = (levelHeight + feedbackTileSize - 1) / feedbackTileSize;
+	uint64_t bytes = 0;
+	for (uint32_t tile = 0; tile < tilesX * tilesY; tile++)
+	{
+		if (words[tile / 32] & (1u << (tile % 32)))
+		{
+			// border tiles only cover the texels that exist
+			uint32_t tileX = tile % tilesX;
+			uint32_t tileY = tile / tilesX;
+			uint64_t texelsX = std::min(feedbackTileSize, levelWidth - tileX * feedbackTileSize);
+			uint64_t texelsY = std::min(feedbackTileSize, levelHeight - tileY * feedbackTileSize);
+			bytes += texelsX * texelsY * 4;
+		}
+	}
+	return bytes;
+}
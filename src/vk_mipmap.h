@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace vkutils
+{
+	// Cpu side helpers for texture mip chains, the gpu path is vkutils::generateMipmaps.
+	namespace mipmap
+	{
+		// Levels of a full chain down to 1x1, level i has the extent max(size >> i, 1).
+		uint32_t levelCount(uint32_t width, uint32_t height);
+		// Box filters an rgba8 image into a full chain stored level after level in chain.
+		// Returns the byte offset of every level followed by the total size, ready for vkutils::imageFromMipChain.
+		std::vector<size_t> buildChainRGBA8(const unsigned char *image, uint32_t width, uint32_t height, std::vector<unsigned char> &chain);
+
+		// Texture feedback records which 32x32 texel tiles of which level were sampled, one bit per tile.
+		constexpr uint32_t feedbackTileSize = 32;
+		// Number of 32 bit words the tile bits of one level occupy, levels are stored one after another.
+		uint32_t feedbackLevelWords(uint32_t width, uint32_t height, uint32_t level);
+		// Bytes of the rgba8 texels covered by the set tile bits of one level.
+		uint64_t feedbackLevelBytes(const uint32_t *words, uint32_t width, uint32_t height, uint32_t level);
+	}
+}
@@ -1,74 +1,59 @@
 #include <vk_model.h>
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <unordered_map>
+#include <glm/gtc/quaternion.hpp>
+#include <vk_image_decode.h>
+#include <vk_mesh_optimizer.h>
+#include <vk_mipmap.h>
+#include <vk_threadpool.h>
+#include <json.hpp>
 
-VertexInputDescription Vertex::get_vertex_description()
-{
-	VertexInputDescription description;
-
-	// we will have just 1 vertex buffer binding, with a per-vertex rate
-	vk::VertexInputBindingDescription mainBinding = {};
-	mainBinding.binding = 0;
-	mainBinding.stride = sizeof(Vertex);
-	mainBinding.inputRate = vk::VertexInputRate::eVertex;
-	description.bindings.push_back(mainBinding);
-
-	// Position will be stored at Location 0
-	vk::VertexInputAttributeDescription posAttribute = {};
-	posAttribute.binding = 0;
-	posAttribute.location = 0;
-	posAttribute.format = vk::Format::eR32G32B32Sfloat;
-	posAttribute.offset = offsetof(Vertex, pos);
-
-	// Normal will be stored at Location 1
-	vk::VertexInputAttributeDescription normalAttribute = {};
-	normalAttribute.binding = 0;
-	normalAttribute.location = 1;
-	normalAttribute.format = vk::Format::eR32G32B32Sfloat;
-	normalAttribute.offset = offsetof(Vertex, normal);
-
-	// Position will be stored at Location 2
-	vk::VertexInputAttributeDescription uvAttribute = {};
-	uvAttribute.binding = 0;
-	uvAttribute.location = 2;
-	uvAttribute.format = vk::Format::eR32G32Sfloat;
-	uvAttribute.offset = offsetof(Vertex, uv);
-
-	// Position will be stored at Location 3
-	vk::VertexInputAttributeDescription colorAttribute = {};
-	colorAttribute.binding = 0;
-	colorAttribute.location = 3;
-	colorAttribute.format = vk::Format::eR32G32B32A32Sfloat;
-	colorAttribute.offset = offsetof(Vertex, color);
-
-	// Position will be stored at Location 4
-	vk::VertexInputAttributeDescription jointAttribute = {};
-	jointAttribute.binding = 0;
-	jointAttribute.location = 4;
-	jointAttribute.format = vk::Format::eR32G32B32A32Sfloat;
-	jointAttribute.offset = offsetof(Vertex, joint0);
-
-	// Position will be stored at Location 5
-	vk::VertexInputAttributeDescription weightAttribute = {};
-	weightAttribute.binding = 0;
-	weightAttribute.location = 5;
-	weightAttribute.format = vk::Format::eR32G32B32A32Sfloat;
-	weightAttribute.offset = offsetof(Vertex, weight0);
-
-	// Position will be stored at Location 6
-	vk::VertexInputAttributeDescription tangentAttribute = {};
-	tangentAttribute.binding = 0;
-	tangentAttribute.location = 6;
-	tangentAttribute.format = vk::Format::eR32G32B32A32Sfloat;
-	tangentAttribute.offset = offsetof(Vertex, tangent);
-
-	description.attributes.push_back(posAttribute);
-	description.attributes.push_back(normalAttribute);
-	description.attributes.push_back(uvAttribute);
-	description.attributes.push_back(colorAttribute);
-	description.attributes.push_back(jointAttribute);
-	description.attributes.push_back(weightAttribute);
-	description.attributes.push_back(tangentAttribute);
-	return description;
+namespace
+{
+	vk::Format vulkanFormat(vkutils::bc::Format format)
+	{
+		switch (format)
+		{
+		case vkutils::bc::Format::eBC1:
+			return vk::Format::eBc1RgbaUnormBlock;
+		case vkutils::bc::Format::eBC3:
+			return vk::Format::eBc3UnormBlock;
+		case vkutils::bc::Format::eBC4:
+			return vk::Format::eBc4UnormBlock;
+		case vkutils::bc::Format::eBC5:
+			return vk::Format::eBc5UnormBlock;
+		case vkutils::bc::Format::eBC7:
+			return vk::Format::eBc7UnormBlock;
+		default:
+			return vk::Format::eUndefined;
+		}
+	}
+}
+
+vk::ImageCreateInfo TextureChain::imageInfo(uint32_t firstLevel) const
+{
+	vk::ImageCreateInfo imageCreateInfo;
+	imageCreateInfo.imageType = vk::ImageType::e2D;
+	imageCreateInfo.format = format;
+	imageCreateInfo.extent = vk::Extent3D{ std::max(width >> firstLevel, 1u), std::max(height >> firstLevel, 1u), 1 };
+	imageCreateInfo.mipLevels = mipLevels - firstLevel;
+	imageCreateInfo.arrayLayers = 1;
+	imageCreateInfo.initialLayout = vk::ImageLayout::eUndefined;
+	imageCreateInfo.usage = vk::ImageUsageFlagBits::eSampled;
+	return imageCreateInfo;
+}
+
+std::vector<size_t> TextureChain::offsetsFrom(uint32_t firstLevel) const
+{
+	std::vector<size_t> offsets(levelOffsets.begin() + firstLevel, levelOffsets.end());
+	for (size_t &offset : offsets) {
+		offset -= levelOffsets[firstLevel];
+	}
+	return offsets;
 }
 
 Model::Model(): core(){
@@ -88,86 +73,206 @@ void Model::destroy()
 		
 		for(auto& texture : _textures) {
 			core->_device.destroyImageView(texture.image._view);
-			core->_allocator.destroyImage(texture.image._image, texture.image._allocation);
+			vkutils::destroyImage(*core, texture.image);
 		}
 		core->_device.destroySampler(_sampler);
 		_textures.clear();
 	}
 }
 
-void Model::loadImages()
+void Model::createSampler()
 {
 	vk::SamplerCreateInfo samplerInfo;
 	samplerInfo.magFilter = vk::Filter::eLinear;
-	samplerInfo.minFilter = vk::Filter::eNearest;
-	samplerInfo.mipmapMode = vk::SamplerMipmapMode::eNearest;
+	samplerInfo.minFilter = vk::Filter::eLinear;
+	samplerInfo.mipmapMode = vk::SamplerMipmapMode::eLinear;
 	samplerInfo.addressModeU = vk::SamplerAddressMode::eRepeat;
 	samplerInfo.addressModeV = vk::SamplerAddressMode::eRepeat;
 	samplerInfo.addressModeW = vk::SamplerAddressMode::eRepeat;
 	samplerInfo.compareOp = vk::CompareOp::eNever;
 	samplerInfo.borderColor = vk::BorderColor::eFloatOpaqueWhite;
-	samplerInfo.maxLod = 1;
+	samplerInfo.maxLod = vk::LodClampNone;
 	samplerInfo.maxAnisotropy = 8.0f;
 	samplerInfo.anisotropyEnable = true;
 	_sampler = core->_device.createSampler(samplerInfo);
+}
 
-	for (tinygltf::Image &image : _input.images) {
-		Texture texture;
-		unsigned char* buffer = nullptr;
-		vk::DeviceSize bufferSize = 0;
-		
-		bool deleteBuffer = false;
-		if (image.component == 3) {
-			bufferSize = image.width * image.height * 4;
-			buffer = new unsigned char[bufferSize];
-			unsigned char* rgba = buffer;
-			unsigned char* rgb = &image.image[0];
-			for (size_t i = 0; i < image.width * image.height; ++i) {
-				for (int32_t j = 0; j < 3; ++j) {
-					rgba[j] = rgb[j];
-				}
-				rgba += 4;
-				rgb += 3;
-			}
-			deleteBuffer = true;
-		}
-		else {
-			buffer = &image.image[0];
-			bufferSize = image.image.size();
+void Model::loadImages(vkutils::UploadContext &uploadContext)
+{
+	createSampler();
+
+	auto start = std::chrono::high_resolution_clock::now();
+	vk::Format format = vk::Format::eR8G8B8A8Unorm;
+	MipMode mipMode = _mipMode;
+	if (_streamTextures || _keepTextureChains) {
+		// the streamer and the scene cache read the levels from the cpu chain, so every chain has to exist there
+		mipMode = eCpuMips;
+	}
+	auto formatProperties = core->_chosenGPU.getFormatProperties(format);
+	if(mipMode == eBlitMips && (!(formatProperties.optimalTilingFeatures & vk::FormatFeatureFlagBits::eBlitSrc) || !(formatProperties.optimalTilingFeatures & vk::FormatFeatureFlagBits::eBlitDst) || !(formatProperties.optimalTilingFeatures & vk::FormatFeatureFlagBits::eSampledImageFilterLinear)))
+	{
+		mipMode = eCpuMips;
+	}
+	// cpu side preparation runs on the pool, the uploads below only copy into staging and record commands
+	struct ImageUpload
+	{
+		vk::ImageCreateInfo imageInfo;
+		const unsigned char *data = nullptr;
+		// set when the image needed converting or filtering
+		std::vector<unsigned char> pixels;
+		// empty when level 0 is uploaded and the chain is blitted
+		std::vector<size_t> levelOffsets;
+	};
+	std::vector<ImageUpload> uploads(_input.images.size());
+	vkutils::ThreadPool::shared().parallelFor(_input.images.size(), [&](size_t imageIndex) {
+		tinygltf::Image &image = _input.images[imageIndex];
+		ImageUpload &upload = uploads[imageIndex];
+		vk::ImageCreateInfo &imageCreateInfo = upload.imageInfo;
+		imageCreateInfo.imageType = vk::ImageType::e2D;
+		imageCreateInfo.arrayLayers = 1;
+		imageCreateInfo.initialLayout = vk::ImageLayout::eUndefined;
+		imageCreateInfo.usage = vk::ImageUsageFlagBits::eSampled;
+
+		if (imageIndex < _compressedImages.size() && _compressedImages[imageIndex].valid()) {
+			// the blocks go to the gpu as they are, the mip chain comes from the file
+			const vkutils::bc::CompressedImage &compressed = _compressedImages[imageIndex];
+			imageCreateInfo.format = vulkanFormat(compressed.format);
+			imageCreateInfo.mipLevels = compressed.mipLevels;
+			imageCreateInfo.extent = vk::Extent3D{ compressed.width, compressed.height, 1 };
+			upload.data = compressed.data.data();
+			upload.levelOffsets = compressed.levelOffsets;
+			return;
 		}
 
-		vk::Format format = vk::Format::eR8G8B8A8Unorm;
+		const unsigned char *buffer = image.image.data();
 		uint32_t width = image.width;
 		uint32_t height = image.height;
-
-		auto formatProperties = core->_chosenGPU.getFormatProperties(format);
-		if(!(formatProperties.optimalTilingFeatures & vk::FormatFeatureFlagBits::eBlitSrc) || !(formatProperties.optimalTilingFeatures & vk::FormatFeatureFlagBits::eBlitDst))
-		{
-			throw std::runtime_error("unsported Image Format!");
+		if (image.image.empty()) {
+			// images no texture samples, fallbacks of a usable compressed source included, and images that failed to
+			// decode keep their slot with a white texel
+			upload.pixels.assign(4, 255);
+			buffer = upload.pixels.data();
+			width = 1;
+			height = 1;
+		}
+		else if (image.component == 3) {
+			upload.pixels.resize(static_cast<size_t>(width) * height * 4);
+			vkutils::decode::expandRGBToRGBA(image.image.data(), upload.pixels.data(), static_cast<size_t>(width) * height);
+			buffer = upload.pixels.data();
 		}
 
-		vk::ImageCreateInfo imageCreateInfo;
-		imageCreateInfo.imageType = vk::ImageType::e2D;
 		imageCreateInfo.format = format;
-		imageCreateInfo.mipLevels = 1;
-		imageCreateInfo.arrayLayers = 1;
-		imageCreateInfo.initialLayout = vk::ImageLayout::eUndefined;
+		imageCreateInfo.mipLevels = mipMode == eNoMips ? 1 : vkutils::mipmap::levelCount(width, height);
 		imageCreateInfo.extent = vk::Extent3D{ width, height, 1 };
-		imageCreateInfo.usage = vk::ImageUsageFlagBits::eSampled;
-		texture.image = vkutils::imageFromData(*core, buffer, imageCreateInfo, vk::ImageAspectFlagBits::eColor, vma::MemoryUsage::eAutoPreferDevice);
+		if (mipMode == eCpuMips) {
+			std::vector<unsigned char> chain;
+			upload.levelOffsets = vkutils::mipmap::buildChainRGBA8(buffer, width, height, chain);
+			upload.pixels.swap(chain);
+			buffer = upload.pixels.data();
+		}
+		upload.data = buffer;
+	});
+	auto prepared = std::chrono::high_resolution_clock::now();
+
+	size_t compressedCount = 0;
+	vk::DeviceSize compressedBytes = 0;
+	vk::DeviceSize uncompressedBytes = 0;
+	vk::DeviceSize streamedChainBytes = 0;
+	vk::DeviceSize firstByte = uploadContext.uploadedBytes;
+	uint32_t firstSubmit = uploadContext.submitCount;
+	bool keepChains = _streamTextures || _keepTextureChains;
+	if (keepChains) {
+		_textureChains.resize(uploads.size());
+	}
+	for (size_t imageIndex = 0; imageIndex < uploads.size(); imageIndex++) {
+		ImageUpload &upload = uploads[imageIndex];
+		const vk::Extent3D &extent = upload.imageInfo.extent;
+		bool compressed = imageIndex < _compressedImages.size() && _compressedImages[imageIndex].valid();
+		if (keepChains) {
+			// the chain moves to _textureChains, uploadChain decides how many levels go to the gpu now
+			TextureChain &chain = _textureChains[imageIndex];
+			chain.format = upload.imageInfo.format;
+			chain.width = extent.width;
+			chain.height = extent.height;
+			chain.mipLevels = upload.imageInfo.mipLevels;
+			chain.levelOffsets = upload.levelOffsets;
+			chain.data.swap(compressed ? _compressedImages[imageIndex].data : upload.pixels);
+			_textures.push_back(uploadChain(uploadContext, chain, chain.data.data()));
+			streamedChainBytes += chain.levelOffsets.back();
+		}
+		else {
+			Texture texture;
+			if (upload.levelOffsets.empty()) {
+				texture.image = uploadContext.image(const_cast<unsigned char *>(upload.data), static_cast<vk::DeviceSize>(extent.width) * extent.height * 4, upload.imageInfo, vk::ImageAspectFlagBits::eColor, vma::MemoryUsage::eAutoPreferDevice);
+			}
+			else {
+				texture.image = uploadContext.mipChain(const_cast<unsigned char *>(upload.data), upload.levelOffsets, upload.imageInfo, vk::ImageAspectFlagBits::eColor, vma::MemoryUsage::eAutoPreferDevice);
+			}
+			texture.width = extent.width;
+			texture.height = extent.height;
+			texture.mipLevels = upload.imageInfo.mipLevels;
+			texture.descriptor = vk::DescriptorImageInfo(_sampler, texture.image._view, vk::ImageLayout::eShaderReadOnlyOptimal);
+			texture.index = static_cast<uint32_t>(_textures.size());
+			_textures.push_back(texture);
+		}
+		// staging holds its own copy from here on
+		std::vector<unsigned char>().swap(upload.pixels);
+
+		if (compressed) {
+			compressedCount++;
+			compressedBytes += upload.levelOffsets.back();
+			uncompressedBytes += static_cast<vk::DeviceSize>(extent.width) * extent.height * 4 * 4 / 3;
+		}
+	}
+	// the ring holds its own copy, the scene waits for the uploads once everything is staged
+	for (vkutils::bc::CompressedImage &compressed : _compressedImages) {
+		std::vector<unsigned char>().swap(compressed.data);
+	}
+	auto staged = std::chrono::high_resolution_clock::now();
+	vk::DeviceSize stagedBytes = uploadContext.uploadedBytes - firstByte;
 
-		vk::DescriptorImageInfo imageInfo;
-		imageInfo.imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
-		imageInfo.imageView = texture.image._view;
-		imageInfo.sampler = _sampler;
-		texture.descriptor = imageInfo;
+	auto prepareTime = std::chrono::duration_cast<std::chrono::microseconds>(prepared - start).count();
+	auto stageTime = std::chrono::duration_cast<std::chrono::microseconds>(staged - prepared).count();
+	std::cout << "Textures of " << _filename << ": prepared " << uploads.size() << " images in " << prepareTime / 1e6 << "s, staged " << stagedBytes / (1024.0 * 1024.0) << " MB in " << stageTime / 1e6 << "s, " << uploadContext.submitCount - firstSubmit << " submissions" << std::endl;
+	if (compressedCount > 0) {
+		std::cout << "Uploaded " << compressedCount << " block compressed textures: " << compressedBytes / (1024.0 * 1024.0) << " MB instead of " << uncompressedBytes / (1024.0 * 1024.0) << " MB as rgba8" << std::endl;
+	}
+	if (_streamTextures) {
+		std::cout << "Streaming textures of " << _filename << ": " << stagedBytes / (1024.0 * 1024.0) << " MB of " << streamedChainBytes / (1024.0 * 1024.0) << " MB resident at the " << _streamingTierSize << " texel tier" << std::endl;
+	}
+}
+
+Texture Model::uploadChain(vkutils::UploadContext &upload, const TextureChain &chain, const unsigned char *data)
+{
+	Texture texture;
+	if (_streamTextures) {
+		// only the tail up to the tier size, TextureStreamer brings in the finer levels on demand
+		while (texture.residentLevel + 1 < chain.mipLevels && std::max(chain.width >> texture.residentLevel, chain.height >> texture.residentLevel) > _streamingTierSize) {
+			texture.residentLevel++;
+		}
+	}
+	texture.image = upload.mipChain(const_cast<unsigned char *>(data + chain.levelOffsets[texture.residentLevel]), chain.offsetsFrom(texture.residentLevel), chain.imageInfo(texture.residentLevel), vk::ImageAspectFlagBits::eColor, vma::MemoryUsage::eAutoPreferDevice);
+	texture.width = chain.width;
+	texture.height = chain.height;
+	texture.mipLevels = chain.mipLevels;
+	texture.descriptor = vk::DescriptorImageInfo(_sampler, texture.image._view, vk::ImageLayout::eShaderReadOnlyOptimal);
+	texture.index = static_cast<uint32_t>(_textures.size());
+	return texture;
+}
 
-		texture.index = static_cast<uint32_t>(_textures.size());
-		_textures.push_back(texture);
-		if (deleteBuffer) {
-            delete[] buffer;
-        }
+void Model::restoreTextures(vkutils::UploadContext &upload, std::vector<TextureChain> &chains, const std::vector<const unsigned char *> &data)
+{
+	createSampler();
+	for (size_t i = 0; i < chains.size(); i++) {
+		_textures.push_back(uploadChain(upload, chains[i], data[i]));
+		if (_streamTextures) {
+			chains[i].data.assign(data[i], data[i] + chains[i].levelOffsets.back());
+		}
+	}
+	if (_streamTextures) {
+		_textureChains.swap(chains);
 	}
+	isBuilded = true;
 }
 
 void Model::loadMaterials()
@@ -233,25 +338,27 @@ void Model::loadMaterials()
 			material.alphaCutoff = static_cast<float>(mat.additionalValues["alphaCutoff"].Factor());
 		}
 		if (mat.values.find("baseColorTexture") != mat.values.end()) {
-			material.baseColorTexture = getTextureIndex(_input.textures[mat.values["baseColorTexture"].TextureIndex()].source);
+			material.baseColorTexture = getTextureIndex(textureSource(_input.textures[mat.values["baseColorTexture"].TextureIndex()]));
 		}
 		if (mat.values.find("metallicRoughnessTexture") != mat.values.end()) {
-			material.metallicRoughnessTexture = getTextureIndex(_input.textures[mat.values["metallicRoughnessTexture"].TextureIndex()].source);
+			material.metallicRoughnessTexture = getTextureIndex(textureSource(_input.textures[mat.values["metallicRoughnessTexture"].TextureIndex()]));
 		}
 		if(mat.additionalValues.find("normalTexture") != mat.additionalValues.end()) {
-			material.normalTexture = getTextureIndex(_input.textures[mat.additionalValues["normalTexture"].TextureIndex()].source);
+			int source = textureSource(_input.textures[mat.additionalValues["normalTexture"].TextureIndex()]);
+			material.normalTexture = getTextureIndex(source);
+			material.normalTwoChannel = source >= 0 && static_cast<size_t>(source) < _compressedImages.size() && _compressedImages[source].format == vkutils::bc::Format::eBC5;
 		}
 		if (mat.additionalValues.find("emissiveTexture") != mat.additionalValues.end()) {
-			material.emissiveTexture = getTextureIndex(_input.textures[mat.additionalValues["emissiveTexture"].TextureIndex()].source);
+			material.emissiveTexture = getTextureIndex(textureSource(_input.textures[mat.additionalValues["emissiveTexture"].TextureIndex()]));
 		}
 		if (mat.values.find("occlusionTexture") != mat.values.end()) {
-			material.occlusionTexture = getTextureIndex(_input.textures[mat.values["occlusionTexture"].TextureIndex()].source);
+			material.occlusionTexture = getTextureIndex(textureSource(_input.textures[mat.values["occlusionTexture"].TextureIndex()]));
 		}
 		if (mat.values.find("specularGlossinessTexture") != mat.values.end()) {
-			material.specularGlossinessTexture = getTextureIndex(_input.textures[mat.values["specularGlossinessTexture"].TextureIndex()].source);
+			material.specularGlossinessTexture = getTextureIndex(textureSource(_input.textures[mat.values["specularGlossinessTexture"].TextureIndex()]));
 		}
 		if (mat.values.find("diffuseTexture") != mat.values.end()) {
-			material.diffuseTexture = getTextureIndex(_input.textures[mat.values["diffuseTexture"].TextureIndex()].source);
+			material.diffuseTexture = getTextureIndex(textureSource(_input.textures[mat.values["diffuseTexture"].TextureIndex()]));
 		}
 
 		_materials.push_back(material);
@@ -259,6 +366,23 @@ void Model::loadMaterials()
 	_materials.push_back(Material());
 }
 
+int Model::textureSource(const tinygltf::Texture &texture)
+{
+	// a DDS alternative wins when it was read and the device can sample it, source is the fallback. KHR_texture_basisu
+	// is not looked at, its KTX2 files hold Basis Universal payloads that would need a transcoder. KTX2 files with
+	// raw BCn levels are still used when a texture's source is one.
+	auto ext = texture.extensions.find("MSFT_texture_dds");
+	if (ext != texture.extensions.end() && ext->second.Has("source"))
+	{
+		int source = ext->second.Get("source").GetNumberAsInt();
+		if (source >= 0 && static_cast<size_t>(source) < _compressedImages.size() && _compressedImages[source].valid())
+		{
+			return source;
+		}
+	}
+	return texture.source;
+}
+
 uint32_t Model::getTextureIndex(uint32_t index)
 {
 	if (index < _textures.size() && index >= 0) {
@@ -267,27 +391,30 @@ uint32_t Model::getTextureIndex(uint32_t index)
 	return static_cast<uint32_t>(_textures.size() - 1);
 }
 
-void Model::loadNode(const tinygltf::Node &inputNode, Node *parent, std::vector<uint32_t> &indexBuffer, std::vector<Vertex> &vertexBuffer)
+void Model::loadNode(const tinygltf::Node &inputNode, Node *parent)
 {
 	Node *node = new Node{};
 	node->name = inputNode.name;
 	node->parent = parent;
 
+	node->skin = inputNode.skin;
+
 	// Get the local node matrix
-	// It's either made up from translation, rotation, scale or a 4x4 matrix
+	// It's either made up from translation, rotation, scale or a 4x4 matrix. The parts stay separate so
+	// animations can replace them, localMatrix() puts them together.
 	node->matrix = glm::mat4(1.0f);
+	node->rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
 	if (inputNode.translation.size() == 3)
 	{
-		node->matrix = glm::translate(node->matrix, glm::vec3(glm::make_vec3(inputNode.translation.data())));
+		node->translation = glm::vec3(glm::make_vec3(inputNode.translation.data()));
 	}
 	if (inputNode.rotation.size() == 4)
 	{
-		glm::quat q = glm::make_quat(inputNode.rotation.data());
-		node->matrix *= glm::mat4(q);
+		node->rotation = glm::make_quat(inputNode.rotation.data());
 	}
 	if (inputNode.scale.size() == 3)
 	{
-		node->matrix = glm::scale(node->matrix, glm::vec3(glm::make_vec3(inputNode.scale.data())));
+		node->scale = glm::vec3(glm::make_vec3(inputNode.scale.data()));
 	}
 	if (inputNode.matrix.size() == 16)
 	{
@@ -299,118 +426,59 @@ void Model::loadNode(const tinygltf::Node &inputNode, Node *parent, std::vector<
 	{
 		for (size_t i = 0; i < inputNode.children.size(); i++)
 		{
-			loadNode(_input.nodes[inputNode.children[i]], node, indexBuffer, vertexBuffer);
+			loadNode(_input.nodes[inputNode.children[i]], node);
 		}
 	}
 
-	// If the node contains mesh data, we load vertices and indices from the buffers
-	// In glTF this is done via accessors and buffer views
-	if (inputNode.mesh > -1)
+	// If the node contains mesh data, we only count its vertices and indices here
+	// Offsets are assigned in build() and the data itself is written later by writePrimitive
+	if (inputNode.mesh > -1 && _meshInstances[inputNode.mesh] >= 0)
+	{
+		// another user of an instanced mesh, build() copies the primitives once their ranges are known
+		node->mesh = _meshInstances[inputNode.mesh];
+		_instancedMeshes[node->mesh].nodes.push_back(node);
+	}
+	else if (inputNode.mesh > -1)
 	{
-		const tinygltf::Mesh mesh = _input.meshes[inputNode.mesh];
+		const tinygltf::Mesh &mesh = _input.meshes[inputNode.mesh];
 		// Iterate through all primitives of this node's mesh
 		for (size_t i = 0; i < mesh.primitives.size(); i++)
 		{
 			const tinygltf::Primitive &glTFPrimitive = mesh.primitives[i];
-			uint32_t firstIndex = static_cast<uint32_t>(indexBuffer.size());
-			uint32_t firstVertex = static_cast<uint32_t>(vertexBuffer.size());
 			uint32_t indexCount = 0;
 			uint32_t vertexCount = 0;
-			// Vertices
+			if (glTFPrimitive.attributes.find("POSITION") != glTFPrimitive.attributes.end())
 			{
-				const float *positionBuffer = nullptr;
-				const float *normalsBuffer = nullptr;
-				const float *texCoordsBuffer = nullptr;
-				const float *tangentsBuffer = nullptr;
-
-				// Get buffer data for vertex normals
-				if (glTFPrimitive.attributes.find("POSITION") != glTFPrimitive.attributes.end())
-				{
-					const tinygltf::Accessor &accessor = _input.accessors[glTFPrimitive.attributes.find("POSITION")->second];
-					const tinygltf::BufferView &view = _input.bufferViews[accessor.bufferView];
-					positionBuffer = reinterpret_cast<const float *>(&(_input.buffers[view.buffer].data[accessor.byteOffset + view.byteOffset]));
-					vertexCount = static_cast<uint32_t>(accessor.count);
-				}
-				// Get buffer data for vertex normals
-				if (glTFPrimitive.attributes.find("NORMAL") != glTFPrimitive.attributes.end())
-				{
-					const tinygltf::Accessor &accessor = _input.accessors[glTFPrimitive.attributes.find("NORMAL")->second];
-					const tinygltf::BufferView &view = _input.bufferViews[accessor.bufferView];
-					normalsBuffer = reinterpret_cast<const float *>(&(_input.buffers[view.buffer].data[accessor.byteOffset + view.byteOffset]));
-				}
-				// Get buffer data for vertex texture coordinates
-				// glTF supports multiple sets, we only load the first one
-				if (glTFPrimitive.attributes.find("TEXCOORD_0") != glTFPrimitive.attributes.end())
-				{
-					const tinygltf::Accessor &accessor = _input.accessors[glTFPrimitive.attributes.find("TEXCOORD_0")->second];
-					const tinygltf::BufferView &view = _input.bufferViews[accessor.bufferView];
-					texCoordsBuffer = reinterpret_cast<const float *>(&(_input.buffers[view.buffer].data[accessor.byteOffset + view.byteOffset]));
-				}
-				// POI: This sample uses normal mapping, so we also need to load the tangents from the glTF file
-				if (glTFPrimitive.attributes.find("TANGENT") != glTFPrimitive.attributes.end())
-				{
-					const tinygltf::Accessor &accessor = _input.accessors[glTFPrimitive.attributes.find("TANGENT")->second];
-					const tinygltf::BufferView &view = _input.bufferViews[accessor.bufferView];
-					tangentsBuffer = reinterpret_cast<const float *>(&(_input.buffers[view.buffer].data[accessor.byteOffset + view.byteOffset]));
-				}
-
-				// Append data to model's vertex buffer
-				for (size_t v = 0; v < vertexCount; v++)
-				{
-					Vertex vert{};
-					vert.pos = glm::vec4(glm::make_vec3(&positionBuffer[v * 3]), 1.0f);
-					vert.normal = glm::normalize(glm::vec3(normalsBuffer ? glm::make_vec3(&normalsBuffer[v * 3]) : glm::vec3(0.0f)));
-					vert.uv = texCoordsBuffer ? glm::make_vec2(&texCoordsBuffer[v * 2]) : glm::vec3(0.0f);
-					vert.color = glm::vec4(1.0f);
-					vert.tangent = tangentsBuffer ? glm::make_vec4(&tangentsBuffer[v * 4]) : glm::vec4(0.0f);
-					vertexBuffer.push_back(vert);
-				}
+				vertexCount = static_cast<uint32_t>(_input.accessors[glTFPrimitive.attributes.find("POSITION")->second].count);
 			}
-			// Indices
+			_hasColors |= glTFPrimitive.attributes.count("COLOR_0") > 0;
+			_hasSkin |= glTFPrimitive.attributes.count("JOINTS_0") > 0 && glTFPrimitive.attributes.count("WEIGHTS_0") > 0;
+			if (glTFPrimitive.indices > -1)
 			{
 				const tinygltf::Accessor &accessor = _input.accessors[glTFPrimitive.indices];
-				const tinygltf::BufferView &bufferView = _input.bufferViews[accessor.bufferView];
-				const tinygltf::Buffer &buffer = _input.buffers[bufferView.buffer];
-
-				indexCount += static_cast<uint32_t>(accessor.count);
-
 				// glTF supports different component types of indices
-				switch (accessor.componentType)
+				if (accessor.componentType != TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT && accessor.componentType != TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT && accessor.componentType != TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE)
 				{
-				case TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT:
-				{
-					const uint32_t *buf = reinterpret_cast<const uint32_t *>(&buffer.data[accessor.byteOffset + bufferView.byteOffset]);
-					for (size_t index = 0; index < accessor.count; index++)
-					{
-						indexBuffer.push_back(buf[index] + firstVertex);
-					}
-					break;
-				}
-				case TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT:
-				{
-					const uint16_t *buf = reinterpret_cast<const uint16_t *>(&buffer.data[accessor.byteOffset + bufferView.byteOffset]);
-					for (size_t index = 0; index < accessor.count; index++)
-					{
-						indexBuffer.push_back(buf[index] + firstVertex);
-					}
-					break;
-				}
-				case TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE:
-				{
-					const uint8_t *buf = reinterpret_cast<const uint8_t *>(&buffer.data[accessor.byteOffset + bufferView.byteOffset]);
-					for (size_t index = 0; index < accessor.count; index++)
-					{
-						indexBuffer.push_back(buf[index] + firstVertex);
-					}
-					break;
-				}
-				default:
 					std::cerr << "Index component type " << accessor.componentType << " not supported!" << std::endl;
-					return;
+					continue;
 				}
+				indexCount = static_cast<uint32_t>(accessor.count);
+			}
+			// indices without vertices have nothing to index, the primitive is skipped like a non indexed one
+			if (vertexCount == 0 && indexCount > 0)
+			{
+				std::cerr << "Primitive " << i << " of mesh " << mesh.name << " has indices but no vertices, skipping it" << std::endl;
+				indexCount = 0;
 			}
-			Primitive *primitive = new Primitive(firstIndex, indexCount, firstVertex, vertexCount, glTFPrimitive.material > -1 ? _materials[glTFPrimitive.material] : _materials.back());
+			Primitive *primitive = new Primitive(0, indexCount, 0, vertexCount, glTFPrimitive.material > -1 ? _materials[glTFPrimitive.material] : _materials.back());
 			node->primitives.push_back(primitive);
+			_primitiveSources.push_back({&glTFPrimitive, primitive});
+		}
+		if (_meshInstances[inputNode.mesh] == -1)
+		{
+			node->mesh = static_cast<int32_t>(_instancedMeshes.size());
+			_meshInstances[inputNode.mesh] = node->mesh;
+			_instancedMeshes.push_back({node, {node}});
 		}
 	}
 
@@ -422,35 +490,864 @@ void Model::loadNode(const tinygltf::Node &inputNode, Node *parent, std::vector<
 	{
 		_nodes.push_back(node);
 	}
+	_nodeIndices[&inputNode - _input.nodes.data()] = static_cast<uint32_t>(_linearNodes.size());
 	_linearNodes.push_back(node);
 }
 
-bool Model::load_from_glb(const char *filename)
+void Model::loadSkins()
+{
+	for (const tinygltf::Skin &inputSkin : _input.skins)
+	{
+		Skin skin;
+		for (int joint : inputSkin.joints)
+		{
+			skin.joints.push_back(_nodeIndices[joint]);
+		}
+		skin.inverseBindMatrices.assign(skin.joints.size(), glm::mat4(1.0f));
+		if (inputSkin.inverseBindMatrices > -1)
+		{
+			const tinygltf::Accessor &accessor = _input.accessors[inputSkin.inverseBindMatrices];
+			const tinygltf::BufferView &view = _input.bufferViews[accessor.bufferView];
+			int stride = accessor.ByteStride(view) > 0 ? accessor.ByteStride(view) : static_cast<int>(sizeof(glm::mat4));
+			const unsigned char *data = accessorData(inputSkin.inverseBindMatrices);
+			for (size_t j = 0; j < skin.joints.size() && j < accessor.count; j++)
+			{
+				skin.inverseBindMatrices[j] = glm::make_mat4x4(reinterpret_cast<const float *>(data + j * stride));
+			}
+		}
+		_skinJointOffsets.push_back(_jointCount);
+		_jointCount += static_cast<uint32_t>(skin.joints.size());
+		_skins.push_back(skin);
+	}
+}
+
+void Model::loadAnimations()
 {
+	for (const tinygltf::Animation &inputAnimation : _input.animations)
+	{
+		Animation animation;
+		animation.name = inputAnimation.name;
+		animation.start = std::numeric_limits<float>::max();
+		animation.end = 0.0f;
+		for (const tinygltf::AnimationSampler &inputSampler : inputAnimation.samplers)
+		{
+			Animation::Sampler sampler;
+			if (inputSampler.interpolation == "STEP")
+			{
+				sampler.interpolation = Animation::eStep;
+			}
+			else if (inputSampler.interpolation == "CUBICSPLINE")
+			{
+				sampler.interpolation = Animation::eCubicSpline;
+			}
+			const tinygltf::Accessor &input = _input.accessors[inputSampler.input];
+			for (size_t k = 0; k < input.count; k++)
+			{
+				sampler.times.push_back(readAccessor(inputSampler.input, k, glm::vec4(0.0f)).x);
+			}
+			if (!sampler.times.empty())
+			{
+				animation.start = std::min(animation.start, sampler.times.front());
+				animation.end = std::max(animation.end, sampler.times.back());
+			}
+			const tinygltf::Accessor &output = _input.accessors[inputSampler.output];
+			for (size_t k = 0; k < output.count; k++)
+			{
+				sampler.values.push_back(readAccessor(inputSampler.output, k, glm::vec4(0.0f)));
+			}
+			animation.samplers.push_back(sampler);
+		}
+		for (const tinygltf::AnimationChannel &inputChannel : inputAnimation.channels)
+		{
+			Animation::Channel channel;
+			// morph target weights are not supported
+			if (inputChannel.target_path == "translation")
+			{
+				channel.path = Animation::eTranslation;
+			}
+			else if (inputChannel.target_path == "rotation")
+			{
+				channel.path = Animation::eRotation;
+			}
+			else if (inputChannel.target_path == "scale")
+			{
+				channel.path = Animation::eScale;
+			}
+			else
+			{
+				continue;
+			}
+			if (inputChannel.target_node < 0)
+			{
+				continue;
+			}
+			channel.node = _nodeIndices[inputChannel.target_node];
+			channel.sampler = static_cast<uint32_t>(inputChannel.sampler);
+			animation.channels.push_back(channel);
+		}
+		if (animation.start > animation.end)
+		{
+			animation.start = animation.end;
+		}
+		_animations.push_back(animation);
+	}
+	if (!_skins.empty())
+	{
+		std::cout << _filename << ": " << _skins.size() << " skins with " << _jointCount << " joints, " << _animations.size() << " animations" << std::endl;
+	}
+}
+
+Pose Model::restPose() const
+{
+	Pose pose;
+	for (Node *node : _linearNodes)
+	{
+		pose.translations.push_back(node->translation);
+		pose.rotations.push_back(node->rotation);
+		pose.scales.push_back(node->scale);
+	}
+	pose.matrices.resize(_linearNodes.size());
+	updatePose(pose);
+	return pose;
+}
+
+void Model::animate(Pose &pose, const Animation &animation, float time) const
+{
+	time += animation.start;
+	for (const Animation::Channel &channel : animation.channels)
+	{
+		const Animation::Sampler &sampler = animation.samplers[channel.sampler];
+		if (sampler.times.empty())
+		{
+			continue;
+		}
+		// key k is the last one at or before time, times outside the keys clamp to the first or last value
+		size_t keys = sampler.times.size();
+		size_t k = std::upper_bound(sampler.times.begin(), sampler.times.end(), time) - sampler.times.begin();
+		k = k > 0 ? k - 1 : 0;
+		size_t next = std::min(k + 1, keys - 1);
+		float delta = sampler.times[next] - sampler.times[k];
+		float t = delta > 0.0f ? glm::clamp((time - sampler.times[k]) / delta, 0.0f, 1.0f) : 0.0f;
+		glm::vec4 value;
+		if (sampler.interpolation == Animation::eCubicSpline)
+		{
+			// Hermite spline between the values of both keys with the out tangent of k and the in tangent of next
+			const glm::vec4 *values = sampler.values.data();
+			float t2 = t * t;
+			float t3 = t2 * t;
+			value = (2.0f * t3 - 3.0f * t2 + 1.0f) * values[k * 3 + 1] + (t3 - 2.0f * t2 + t) * delta * values[k * 3 + 2]
+				+ (-2.0f * t3 + 3.0f * t2) * values[next * 3 + 1] + (t3 - t2) * delta * values[next * 3];
+		}
+		else if (sampler.interpolation == Animation::eStep || channel.path != Animation::eRotation)
+		{
+			value = sampler.interpolation == Animation::eStep ? sampler.values[k] : glm::mix(sampler.values[k], sampler.values[next], t);
+		}
+		else
+		{
+			glm::quat a(sampler.values[k].w, sampler.values[k].x, sampler.values[k].y, sampler.values[k].z);
+			glm::quat b(sampler.values[next].w, sampler.values[next].x, sampler.values[next].y, sampler.values[next].z);
+			glm::quat q = glm::slerp(a, b, t);
+			value = glm::vec4(q.x, q.y, q.z, q.w);
+		}
+		switch (channel.path)
+		{
+		case Animation::eTranslation:
+			pose.translations[channel.node] = glm::vec3(value);
+			break;
+		case Animation::eRotation:
+			pose.rotations[channel.node] = glm::normalize(glm::quat(value.w, value.x, value.y, value.z));
+			break;
+		case Animation::eScale:
+			pose.scales[channel.node] = glm::vec3(value);
+			break;
+		}
+	}
+}
+
+void Model::updatePose(Pose &pose) const
+{
+	// _linearNodes holds every node after its children, walking it backwards visits the parents first
+	for (size_t i = _linearNodes.size(); i-- > 0;)
+	{
+		glm::mat4 local = glm::translate(glm::mat4(1.0f), pose.translations[i]) * glm::mat4(pose.rotations[i]) * glm::scale(glm::mat4(1.0f), pose.scales[i]) * _linearNodes[i]->matrix;
+		pose.matrices[i] = _nodeParents[i] >= 0 ? pose.matrices[_nodeParents[i]] * local : local;
+	}
+}
+
+void Model::jointMatrices(const Pose &pose, glm::mat4 *matrices) const
+{
+	for (size_t s = 0; s < _skins.size(); s++)
+	{
+		const Skin &skin = _skins[s];
+		glm::mat4 *skinMatrices = matrices + _skinJointOffsets[s];
+		for (size_t j = 0; j < skin.joints.size(); j++)
+		{
+			skinMatrices[j] = pose.matrices[skin.joints[j]] * skin.inverseBindMatrices[j];
+		}
+	}
+}
+
+size_t Model::primitiveCount() const
+{
+	return _primitiveSources.size();
+}
+
+void Model::writeGeometry(const vkutils::VertexLayout &layout, const std::vector<unsigned char *> &vertexStreams, unsigned char *indexBuffer)
+{
+	for (size_t i = 0; i < _primitiveSources.size(); i++)
+	{
+		writePrimitive(i, layout, vertexStreams, indexBuffer);
+	}
+}
+
+void Model::writePrimitive(size_t index, const vkutils::VertexLayout &layout, const std::vector<unsigned char *> &vertexStreams, unsigned char *indexBuffer)
+{
+	// Primitives own disjoint ranges of both buffers, so any number of them may be written concurrently
+	const PrimitiveSource &source = _primitiveSources[index];
+	const Primitive &primitive = *source.primitive;
+	uint16_t *indices16 = reinterpret_cast<uint16_t *>(indexBuffer + primitive.indexByteOffset);
+	uint32_t *indices32 = reinterpret_cast<uint32_t *>(indexBuffer + primitive.indexByteOffset);
+	bool shortIndices = primitive.indexType == vk::IndexType::eUint16;
+	if (source.optimized)
+	{
+		for (size_t v = 0; v < source.vertices.size(); v++)
+		{
+			layout.write(source.vertices[v], vertexStreams, primitive.firstVertex + v);
+		}
+		for (size_t i = 0; i < source.indices.size(); i++)
+		{
+			if (shortIndices)
+			{
+				indices16[i] = static_cast<uint16_t>(source.indices[i]);
+			}
+			else
+			{
+				indices32[i] = source.indices[i];
+			}
+		}
+	}
+	else
+	{
+		// Encode into the primitive's range of every vertex stream of the layout
+		readVertices(*source.input, primitive.vertexCount, [&](size_t v, const Vertex &vert) {
+			layout.write(vert, vertexStreams, primitive.firstVertex + v);
+		});
+		if (primitive.indexCount > 0)
+		{
+			if (shortIndices)
+			{
+				readIndices(*source.input, indices16);
+			}
+			else
+			{
+				readIndices(*source.input, indices32);
+			}
+		}
+	}
+	// 16 bit ranges are padded to 4 bytes, keep the padding deterministic
+	if (shortIndices && primitive.indexCount % 2 == 1)
+	{
+		indices16[primitive.indexCount] = 0;
+	}
+}
+
+template <typename Sink>
+void Model::readVertices(const tinygltf::Primitive &glTFPrimitive, uint32_t vertexCount, Sink sink)
+{
+	const float *positionBuffer = nullptr;
+	const float *normalsBuffer = nullptr;
+	const float *texCoordsBuffer = nullptr;
+	const float *tangentsBuffer = nullptr;
+
+	// Get buffer data for vertex positions
+	if (glTFPrimitive.attributes.find("POSITION") != glTFPrimitive.attributes.end())
+	{
+		positionBuffer = reinterpret_cast<const float *>(accessorData(glTFPrimitive.attributes.find("POSITION")->second));
+	}
+	// Get buffer data for vertex normals
+	if (glTFPrimitive.attributes.find("NORMAL") != glTFPrimitive.attributes.end())
+	{
+		normalsBuffer = reinterpret_cast<const float *>(accessorData(glTFPrimitive.attributes.find("NORMAL")->second));
+	}
+	// Get buffer data for vertex texture coordinates
+	// glTF supports multiple sets, we only load the first one
+	if (glTFPrimitive.attributes.find("TEXCOORD_0") != glTFPrimitive.attributes.end())
+	{
+		texCoordsBuffer = reinterpret_cast<const float *>(accessorData(glTFPrimitive.attributes.find("TEXCOORD_0")->second));
+	}
+	// POI: This sample uses normal mapping, so we also need to load the tangents from the glTF file
+	if (glTFPrimitive.attributes.find("TANGENT") != glTFPrimitive.attributes.end())
+	{
+		tangentsBuffer = reinterpret_cast<const float *>(accessorData(glTFPrimitive.attributes.find("TANGENT")->second));
+	}
+
+	// Optional attributes may be normalized integers, they go through readAccessor
+	int colorAccessor = glTFPrimitive.attributes.count("COLOR_0") ? glTFPrimitive.attributes.at("COLOR_0") : -1;
+	int jointAccessor = glTFPrimitive.attributes.count("JOINTS_0") ? glTFPrimitive.attributes.at("JOINTS_0") : -1;
+	int weightAccessor = glTFPrimitive.attributes.count("WEIGHTS_0") ? glTFPrimitive.attributes.at("WEIGHTS_0") : -1;
+
+	for (size_t v = 0; v < vertexCount; v++)
+	{
+		Vertex vert{};
+		vert.pos = glm::vec4(glm::make_vec3(&positionBuffer[v * 3]), 1.0f);
+		vert.normal = glm::normalize(glm::vec3(normalsBuffer ? glm::make_vec3(&normalsBuffer[v * 3]) : glm::vec3(0.0f)));
+		vert.uv = texCoordsBuffer ? glm::make_vec2(&texCoordsBuffer[v * 2]) : glm::vec3(0.0f);
+		vert.color = colorAccessor > -1 ? readAccessor(colorAccessor, v, glm::vec4(1.0f)) : glm::vec4(1.0f);
+		vert.joint0 = jointAccessor > -1 ? readAccessor(jointAccessor, v, glm::vec4(0.0f)) : glm::vec4(0.0f);
+		vert.weight0 = weightAccessor > -1 ? readAccessor(weightAccessor, v, glm::vec4(0.0f)) : glm::vec4(0.0f);
+		vert.tangent = tangentsBuffer ? glm::make_vec4(&tangentsBuffer[v * 4]) : glm::vec4(0.0f);
+		sink(v, vert);
+	}
+}
+
+template <typename T>
+void Model::readIndices(const tinygltf::Primitive &glTFPrimitive, T *dst)
+{
+	const tinygltf::Accessor &accessor = _input.accessors[glTFPrimitive.indices];
+	const unsigned char *data = accessorData(glTFPrimitive.indices);
+
+	switch (accessor.componentType)
+	{
+	case TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT:
+	{
+		const uint32_t *buf = reinterpret_cast<const uint32_t *>(data);
+		for (size_t index = 0; index < accessor.count; index++)
+		{
+			dst[index] = static_cast<T>(buf[index]);
+		}
+		break;
+	}
+	case TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT:
+	{
+		const uint16_t *buf = reinterpret_cast<const uint16_t *>(data);
+		for (size_t index = 0; index < accessor.count; index++)
+		{
+			dst[index] = static_cast<T>(buf[index]);
+		}
+		break;
+	}
+	case TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE:
+	{
+		const uint8_t *buf = reinterpret_cast<const uint8_t *>(data);
+		for (size_t index = 0; index < accessor.count; index++)
+		{
+			dst[index] = static_cast<T>(buf[index]);
+		}
+		break;
+	}
+	}
+}
+
+void Model::optimizeGeometry()
+{
+	struct Statistics
+	{
+		size_t verticesBefore = 0;
+		size_t verticesAfter = 0;
+		size_t indicesBefore = 0;
+		size_t indicesAfter = 0;
+		size_t missesBefore = 0;
+		size_t missesAfter = 0;
+	};
+	std::vector<Statistics> statistics(_primitiveSources.size());
+	auto start = std::chrono::high_resolution_clock::now();
+	vkutils::ThreadPool::shared().parallelFor(_primitiveSources.size(), [&](size_t index) {
+		PrimitiveSource &source = _primitiveSources[index];
+		Primitive &primitive = *source.primitive;
+		// non indexed primitives are never drawn or put into a BLAS, leave them alone
+		if (primitive.indexCount == 0)
+		{
+			return;
+		}
+		source.vertices.resize(primitive.vertexCount);
+		source.indices.resize(primitive.indexCount);
+		readVertices(*source.input, primitive.vertexCount, [&](size_t v, const Vertex &vert) {
+			source.vertices[v] = vert;
+		});
+		readIndices(*source.input, source.indices.data());
+
+		Statistics &stats = statistics[index];
+		stats.verticesBefore = source.vertices.size();
+		stats.indicesBefore = source.indices.size();
+		stats.missesBefore = vkutils::meshopt::simulateCacheMisses(source.indices, source.vertices.size());
+		vkutils::meshopt::weldVertices(source.vertices, source.indices);
+		vkutils::meshopt::optimizeVertexCache(source.indices, source.vertices.size());
+		vkutils::meshopt::optimizeVertexFetch(source.vertices, source.indices);
+		stats.verticesAfter = source.vertices.size();
+		stats.indicesAfter = source.indices.size();
+		stats.missesAfter = vkutils::meshopt::simulateCacheMisses(source.indices, source.vertices.size());
+
+		primitive.vertexCount = static_cast<uint32_t>(source.vertices.size());
+		primitive.indexCount = static_cast<uint32_t>(source.indices.size());
+		source.optimized = true;
+	});
+	auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+
+	Statistics total;
+	for (const Statistics &stats : statistics)
+	{
+		total.verticesBefore += stats.verticesBefore;
+		total.verticesAfter += stats.verticesAfter;
+		total.indicesBefore += stats.indicesBefore;
+		total.indicesAfter += stats.indicesAfter;
+		total.missesBefore += stats.missesBefore;
+		total.missesAfter += stats.missesAfter;
+	}
+	double triangles = std::max<size_t>(total.indicesAfter / 3, 1);
+	std::cout << "Optimized " << _filename << " in " << elapsed / 1e6 << "s: vertices " << total.verticesBefore << " -> " << total.verticesAfter
+		<< ", indices " << total.indicesBefore << " -> " << total.indicesAfter
+		<< ", ACMR (FIFO 16) " << total.missesBefore / triangles << " -> " << total.missesAfter / triangles << std::endl;
+}
+
+void Model::releaseSourceData()
+{
+	// textures and geometry are on their way to the gpu, drop the cpu side copies and the mapping
+	for (tinygltf::Image &image : _input.images) {
+		std::vector<unsigned char>().swap(image.image);
+	}
+	std::vector<tinygltf::Buffer>().swap(_input.buffers);
+	_primitiveSources.clear();
+	_mappedBuffers.clear();
+	_file.close();
+}
+
+const unsigned char *Model::bufferData(int buffer)
+{
+	if (buffer < static_cast<int>(_mappedBuffers.size()) && _mappedBuffers[buffer])
+	{
+		return _mappedBuffers[buffer];
+	}
+	return _input.buffers[buffer].data.data();
+}
+
+const unsigned char *Model::accessorData(int accessor)
+{
+	const tinygltf::Accessor &inputAccessor = _input.accessors[accessor];
+	const tinygltf::BufferView &view = _input.bufferViews[inputAccessor.bufferView];
+	return bufferData(view.buffer) + view.byteOffset + inputAccessor.byteOffset;
+}
+
+glm::vec4 Model::readAccessor(int accessor, size_t element, glm::vec4 value)
+{
+	const tinygltf::Accessor &inputAccessor = _input.accessors[accessor];
+	const tinygltf::BufferView &view = _input.bufferViews[inputAccessor.bufferView];
+	int components = std::min(tinygltf::GetNumComponentsInType(inputAccessor.type), 4);
+	int stride = inputAccessor.ByteStride(view);
+	if (stride <= 0)
+	{
+		stride = components * tinygltf::GetComponentSizeInBytes(inputAccessor.componentType);
+	}
+	const unsigned char *data = accessorData(accessor) + element * stride;
+	for (int c = 0; c < components; c++)
+	{
+		switch (inputAccessor.componentType)
+		{
+		case TINYGLTF_PARAMETER_TYPE_FLOAT:
+			value[c] = reinterpret_cast<const float *>(data)[c];
+			break;
+		case TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE:
+			value[c] = inputAccessor.normalized ? data[c] / 255.0f : data[c];
+			break;
+		case TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT:
+		{
+			uint16_t component = reinterpret_cast<const uint16_t *>(data)[c];
+			value[c] = inputAccessor.normalized ? component / 65535.0f : component;
+			break;
+		}
+		// only used normalized, by quantized animation rotations
+		case TINYGLTF_PARAMETER_TYPE_BYTE:
+		{
+			int8_t component = reinterpret_cast<const int8_t *>(data)[c];
+			value[c] = inputAccessor.normalized ? std::max(component / 127.0f, -1.0f) : component;
+			break;
+		}
+		case TINYGLTF_PARAMETER_TYPE_SHORT:
+		{
+			int16_t component = reinterpret_cast<const int16_t *>(data)[c];
+			value[c] = inputAccessor.normalized ? std::max(component / 32767.0f, -1.0f) : component;
+			break;
+		}
+		}
+	}
+	return value;
+}
+
+bool Model::load_from_glb(const char *filename, LoadMode mode)
+{
+	_filename = filename;
+	if (mode == eMemoryMapped)
+	{
+		if (loadMapped(filename))
+		{
+			return true;
+		}
+		std::cerr << "Could not memory map " << filename << ", falling back to copying loader" << std::endl;
+	}
+
 	tinygltf::TinyGLTF gltfContext;
+	gltfContext.SetImageLoader(&Model::loadImageData, this);
 	std::string error, warning;
 
 	bool fileLoaded = gltfContext.LoadBinaryFromFile(&_input, &error, &warning, filename);
-
+	if (fileLoaded)
+	{
+		decodeImages();
+	}
 	return fileLoaded;
 }
 
+bool Model::loadMapped(const char *filename)
+{
+	if (!_file.open(filename))
+	{
+		return false;
+	}
+	const unsigned char *data = _file.data();
+	const size_t size = _file.size();
+	auto fail = [&]() {
+		_file.close();
+		_mappedBuffers.clear();
+		_mappedImageViews.clear();
+		_input = tinygltf::Model();
+		return false;
+	};
+
+	// GLB layout: 12 byte header (magic, version, length), JSON chunk, optional BIN chunk
+	uint32_t header[5];
+	if (size < sizeof(header))
+	{
+		return fail();
+	}
+	memcpy(header, data, sizeof(header));
+	const uint32_t jsonLength = header[3];
+	if (header[0] != 0x46546C67 || header[1] != 2 || header[4] != 0x4E4F534A || jsonLength > size - sizeof(header))
+	{
+		return fail();
+	}
+	const char *json = reinterpret_cast<const char *>(data + sizeof(header));
+	const unsigned char *bin = nullptr;
+	const size_t binHeaderOffset = sizeof(header) + jsonLength;
+	if (binHeaderOffset + 8 <= size)
+	{
+		uint32_t binHeader[2];
+		memcpy(binHeader, data + binHeaderOffset, sizeof(binHeader));
+		if (binHeader[1] == 0x004E4942 && binHeader[0] <= size - binHeaderOffset - 8)
+		{
+			bin = data + binHeaderOffset + 8;
+		}
+	}
+
+	nlohmann::json document = nlohmann::json::parse(json, json + jsonLength, nullptr, false);
+	if (document.is_discarded())
+	{
+		return fail();
+	}
+	// The buffer without uri is the BIN chunk. tinygltf only gets a 4 byte stub for it,
+	// accessors are read from the mapping instead.
+	if (document.contains("buffers"))
+	{
+		for (auto &buffer : document["buffers"])
+		{
+			if (buffer.contains("uri"))
+			{
+				_mappedBuffers.push_back(nullptr);
+				continue;
+			}
+			if (!bin)
+			{
+				return fail();
+			}
+			buffer["uri"] = "data:application/octet-stream;base64,AAAAAA==";
+			buffer["byteLength"] = 4;
+			_mappedBuffers.push_back(bin);
+		}
+	}
+	// Images stored in buffer views would hand loadImageData a pointer past the stub. While tinygltf parses they
+	// point at a view of a stub of their own, decodeImages reads them from the mapping and the views are restored after.
+	int stubImageView = -1;
+	if (document.contains("images"))
+	{
+		for (auto &image : document["images"])
+		{
+			if (!image.contains("bufferView"))
+			{
+				_mappedImageViews.push_back(-1);
+				continue;
+			}
+			_mappedImageViews.push_back(image["bufferView"].get<int>());
+			if (stubImageView < 0)
+			{
+				document["buffers"].push_back(nlohmann::json{{"uri", "data:application/octet-stream;base64,AAAAAA=="}, {"byteLength", 4}});
+				document["bufferViews"].push_back(nlohmann::json{{"buffer", document["buffers"].size() - 1}, {"byteLength", 4}});
+				stubImageView = static_cast<int>(document["bufferViews"].size()) - 1;
+			}
+			image["bufferView"] = stubImageView;
+		}
+	}
+
+	std::string patched = document.dump();
+	std::string path(filename);
+	std::string baseDir = path.find_last_of("/\\") != std::string::npos ? path.substr(0, path.find_last_of("/\\")) : "";
+	tinygltf::TinyGLTF gltfContext;
+	gltfContext.SetImageLoader(&Model::loadImageData, this);
+	std::string error, warning;
+	if (!gltfContext.LoadASCIIFromString(&_input, &error, &warning, patched.c_str(), static_cast<unsigned int>(patched.size()), baseDir))
+	{
+		std::cerr << error << std::endl;
+		return fail();
+	}
+	if (stubImageView > -1)
+	{
+		_input.bufferViews.pop_back();
+		_input.buffers.pop_back();
+	}
+	for (size_t i = 0; i < _mappedImageViews.size() && i < _input.images.size(); i++)
+	{
+		if (_mappedImageViews[i] > -1)
+		{
+			if (static_cast<size_t>(_mappedImageViews[i]) >= _input.bufferViews.size())
+			{
+				std::cerr << "Image " << i << " of " << filename << " has an invalid buffer view" << std::endl;
+				return fail();
+			}
+			_input.images[i].bufferView = _mappedImageViews[i];
+		}
+	}
+	decodeImages();
+	return true;
+}
+
+void Model::decodeImages()
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	_compressedImages.resize(std::max(_compressedImages.size(), _input.images.size()));
+	std::vector<std::string> errors(_input.images.size());
+	std::atomic<size_t> decodedCount{0};
+	std::atomic<uint64_t> decodedBytes{0};
+	vkutils::ThreadPool &pool = vkutils::ThreadPool::shared();
+	// GLB images come from the mapping, everything else was collected by loadImageData
+	auto encoded = [&](size_t i, const unsigned char *&bytes, size_t &size) {
+		bytes = nullptr;
+		size = 0;
+		if (i < _mappedImageViews.size() && _mappedImageViews[i] > -1)
+		{
+			const tinygltf::BufferView &view = _input.bufferViews[_mappedImageViews[i]];
+			bytes = bufferData(view.buffer) + view.byteOffset;
+			size = view.byteLength;
+		}
+		else if (i < _encodedImages.size())
+		{
+			bytes = _encodedImages[i].data();
+			size = _encodedImages[i].size();
+		}
+		return size > 0;
+	};
+	// block compressed images first, whether a texture uses its source fallback depends on them
+	pool.parallelFor(_input.images.size(), [&](size_t i) {
+		const unsigned char *bytes;
+		size_t size;
+		if (encoded(i, bytes, size) && (vkutils::bc::isDDS(bytes, size) || vkutils::bc::isKTX2(bytes, size)))
+		{
+			readCompressedImage(_input.images[i], i, bytes, size, errors[i]);
+		}
+	});
+	for (size_t i = 0; i < _compressedImages.size(); i++)
+	{
+		vkutils::bc::CompressedImage &compressed = _compressedImages[i];
+		if (compressed.valid() && !(core->_chosenGPU.getFormatProperties(vulkanFormat(compressed.format)).optimalTilingFeatures & vk::FormatFeatureFlagBits::eSampledImage))
+		{
+			std::cerr << vkutils::bc::formatName(compressed.format) << " is not supported by the device, image " << i << " of " << _filename << " falls back to the uncompressed source" << std::endl;
+			compressed = vkutils::bc::CompressedImage();
+		}
+	}
+	// only the image a texture samples is decoded, fallbacks of usable compressed images and unreferenced
+	// images keep their slot with a white texel (see loadImages)
+	std::vector<char> selected(_input.images.size(), 0);
+	for (const tinygltf::Texture &texture : _input.textures)
+	{
+		int source = textureSource(texture);
+		if (source >= 0 && static_cast<size_t>(source) < selected.size())
+		{
+			selected[source] = 1;
+		}
+	}
+	size_t skippedCount = 0;
+	for (size_t i = 0; i < selected.size(); i++)
+	{
+		if (!selected[i])
+		{
+			_compressedImages[i] = vkutils::bc::CompressedImage();
+			skippedCount++;
+		}
+	}
+	pool.parallelFor(_input.images.size(), [&](size_t i) {
+		const unsigned char *bytes;
+		size_t size;
+		if (!selected[i] || _compressedImages[i].valid() || !encoded(i, bytes, size) || vkutils::bc::isDDS(bytes, size) || vkutils::bc::isKTX2(bytes, size))
+		{
+			return;
+		}
+		tinygltf::Image &image = _input.images[i];
+		uint32_t width, height;
+		if (!vkutils::decode::decodeRGBA8(bytes, size, width, height, image.image, errors[i]))
+		{
+			return;
+		}
+		image.width = static_cast<int>(width);
+		image.height = static_cast<int>(height);
+		image.component = 4;
+		image.bits = 8;
+		image.pixel_type = TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE;
+		decodedCount++;
+		decodedBytes += image.image.size();
+	});
+	std::vector<std::vector<unsigned char>>().swap(_encodedImages);
+	for (size_t i = 0; i < errors.size(); i++)
+	{
+		if (!errors[i].empty())
+		{
+			std::cerr << "Failed to decode image " << i << " of " << _filename << ": " << errors[i] << std::endl;
+		}
+	}
+	auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+	std::cout << "Decoded " << decodedCount << " images (" << decodedBytes / (1024.0 * 1024.0) << " MB) of " << _filename << " on " << pool.size() << " threads in " << elapsed / 1e6 << "s, skipped " << skippedCount << " unused images" << std::endl;
+}
+
+bool Model::loadImageData(tinygltf::Image *image, const int imageIndex, std::string *error, std::string *warning, int requestedWidth, int requestedHeight, const unsigned char *bytes, int size, void *userData)
+{
+	// tinygltf calls this on the loading thread for every image, only the encoded bytes are kept here and decodeImages
+	// decodes them on the pool. DDS and KTX2 files are recognised there as well.
+	Model *model = static_cast<Model *>(userData);
+	// buffer view images of the mapped loader only see the stub here, decodeImages reads them from the mapping
+	if (static_cast<size_t>(imageIndex) < model->_mappedImageViews.size() && model->_mappedImageViews[imageIndex] > -1)
+	{
+		return true;
+	}
+	if (model->_encodedImages.size() <= static_cast<size_t>(imageIndex))
+	{
+		model->_encodedImages.resize(imageIndex + 1);
+	}
+	model->_encodedImages[imageIndex].assign(bytes, bytes + size);
+	return true;
+}
+
+bool Model::readCompressedImage(tinygltf::Image &image, size_t imageIndex, const unsigned char *bytes, size_t size, std::string &error)
+{
+	// the blocks are kept by the model, image.image stays empty. Unreadable files are not fatal, the texture falls back to its source.
+	vkutils::bc::CompressedImage &compressed = _compressedImages[imageIndex];
+	bool read = vkutils::bc::isDDS(bytes, size) ? vkutils::bc::readDDS(bytes, size, compressed, error) : vkutils::bc::readKTX2(bytes, size, compressed, error);
+	if (!read)
+	{
+		return false;
+	}
+	image.width = static_cast<int>(compressed.width);
+	image.height = static_cast<int>(compressed.height);
+	image.component = 4;
+	return true;
+}
+
 tinygltf::Model* Model::getGltfData()
 {
 	return &_input;
 }
 
-void Model::build()
+void Model::build(vkutils::UploadContext &upload)
 {
-	loadImages();
+	loadImages(upload);
 	loadMaterials();
+	// a mesh is instanced when several nodes use it and it is big enough, everything else stays baked
+	std::vector<uint32_t> meshUsers(_input.meshes.size(), 0);
+	for (const tinygltf::Node &node : _input.nodes)
+	{
+		if (node.mesh > -1)
+		{
+			meshUsers[node.mesh]++;
+		}
+	}
+	_meshInstances.assign(_input.meshes.size(), -2);
+	for (size_t m = 0; m < _input.meshes.size() && _instanceMeshes; m++)
+	{
+		size_t triangles = 0;
+		for (const tinygltf::Primitive &primitive : _input.meshes[m].primitives)
+		{
+			triangles += primitive.indices > -1 ? _input.accessors[primitive.indices].count / 3 : 0;
+		}
+		if (meshUsers[m] > 1 && triangles >= _instanceMinTriangles)
+		{
+			_meshInstances[m] = -1;
+		}
+	}
+	// every skinned node gets its own posed copy of the mesh, so those stay out of the instanced meshes
+	for (const tinygltf::Node &node : _input.nodes)
+	{
+		if (node.mesh > -1 && node.skin > -1)
+		{
+			_meshInstances[node.mesh] = -2;
+		}
+	}
+	_nodeIndices.assign(_input.nodes.size(), 0);
 	const tinygltf::Scene &scene = _input.scenes[0];
 	for (size_t i = 0; i < scene.nodes.size(); i++)
 	{
-		const tinygltf::Node node = _input.nodes[scene.nodes[i]];
-		loadNode(node, nullptr, _indices, _vertices);
+		const tinygltf::Node &node = _input.nodes[scene.nodes[i]];
+		loadNode(node, nullptr);
+	}
+	std::unordered_map<const Node *, int32_t> linearIndices;
+	for (size_t i = 0; i < _linearNodes.size(); i++)
+	{
+		linearIndices[_linearNodes[i]] = static_cast<int32_t>(i);
+	}
+	for (Node *node : _linearNodes)
+	{
+		_nodeParents.push_back(node->parent ? linearIndices[node->parent] : -1);
+	}
+	// both reference nodes by glTF index, which only maps to _linearNodes once every node is loaded
+	loadSkins();
+	loadAnimations();
+	if (_optimizeGeometry)
+	{
+		optimizeGeometry();
+	}
+	// exclusive prefix sum over the primitive sizes gives every primitive its own output range
+	for (auto &source : _primitiveSources)
+	{
+		Primitive *primitive = source.primitive;
+		primitive->firstVertex = _vertexCount;
+		primitive->firstIndex = _indexCount;
+		primitive->indexType = primitive->vertexCount <= 0xFFFF ? vk::IndexType::eUint16 : vk::IndexType::eUint32;
+		primitive->indexByteOffset = _indexBytes;
+		uint32_t indexSize = primitive->indexType == vk::IndexType::eUint16 ? 2 : 4;
+		_vertexCount += primitive->vertexCount;
+		_indexCount += primitive->indexCount;
+		// every range starts 4 byte aligned so 32 bit ranges stay aligned and shaders can address ranges in words
+		_indexBytes += vkutils::alignedSize(primitive->indexCount * indexSize, 4);
+	}
+	size_t sharedVertices = 0;
+	size_t sharedTriangles = 0;
+	size_t instanceNodes = 0;
+	for (InstancedMesh &mesh : _instancedMeshes)
+	{
+		for (Node *node : mesh.nodes)
+		{
+			if (node == mesh.node)
+			{
+				continue;
+			}
+			for (Primitive *primitive : mesh.node->primitives)
+			{
+				node->primitives.push_back(new Primitive(*primitive));
+				sharedVertices += primitive->vertexCount;
+				sharedTriangles += primitive->indexCount / 3;
+			}
+		}
+		instanceNodes += mesh.nodes.size();
+	}
+	if (!_instancedMeshes.empty())
+	{
+		std::cout << "Instanced " << _instancedMeshes.size() << " meshes of " << _filename << " on " << instanceNodes << " nodes, " << sharedVertices << " vertices and " << sharedTriangles << " triangles are not duplicated" << std::endl;
 	}
 
+	buildTransforms();
 	for (auto node : _linearNodes)
 	{
 		if (node->primitives.size() > 0)
@@ -467,6 +1364,141 @@ void Model::build()
 	isBuilded = true;
 }
 
+void Model::buildTransforms()
+{
+	// _linearNodes holds every node after its children, backwards it is in parents first order
+	_transformOrder.assign(_linearNodes.rbegin(), _linearNodes.rend());
+	size_t count = _transformOrder.size();
+	std::unordered_map<const Node *, int32_t> slots;
+	for (size_t i = 0; i < count; i++)
+	{
+		slots[_transformOrder[i]] = static_cast<int32_t>(i);
+	}
+	_transformParents.resize(count);
+	_localMatrices.resize(count);
+	_worldMatrices.resize(count);
+	_transformDirty.assign(count, 0);
+	for (size_t i = 0; i < count; i++)
+	{
+		Node *node = _transformOrder[i];
+		auto parent = node->parent ? slots.find(node->parent) : slots.end();
+		_transformParents[i] = parent != slots.end() ? parent->second : -1;
+		_localMatrices[i] = node->localMatrix();
+		_worldMatrices[i] = _transformParents[i] >= 0 ? _worldMatrices[_transformParents[i]] * _localMatrices[i] : _localMatrices[i];
+		node->transform = static_cast<uint32_t>(i);
+		node->world = &_worldMatrices[i];
+	}
+	_transformsDirty = false;
+}
+
+void Model::setLocalTransform(Node *node, const glm::vec3 &translation, const glm::quat &rotation, const glm::vec3 &scale)
+{
+	node->translation = translation;
+	node->rotation = rotation;
+	node->scale = scale;
+	_localMatrices[node->transform] = node->localMatrix();
+	_transformDirty[node->transform] = 1;
+	_transformsDirty = true;
+}
+
+uint32_t Model::updateTransforms()
+{
+	if (!_transformsDirty)
+	{
+		return 0;
+	}
+	// a parent comes before its children, so its flag already holds whether it moved in this pass
+	uint32_t updated = 0;
+	size_t count = _worldMatrices.size();
+	for (size_t i = 0; i < count; i++)
+	{
+		int32_t parent = _transformParents[i];
+		if (parent >= 0 && _transformDirty[parent])
+		{
+			_transformDirty[i] = 1;
+		}
+		if (_transformDirty[i])
+		{
+			_worldMatrices[i] = parent >= 0 ? _worldMatrices[parent] * _localMatrices[i] : _localMatrices[i];
+			updated++;
+		}
+	}
+	std::fill(_transformDirty.begin(), _transformDirty.end(), 0);
+	_transformsDirty = false;
+	return updated;
+}
+
+void Model::benchmarkTransforms(uint32_t nodeCount)
+{
+	// a binary tree, node i is the child of node (i - 1) / 2, so the deepest nodes have log2(nodeCount) ancestors
+	Model model;
+	std::vector<Node> nodes(nodeCount);
+	for (uint32_t i = 0; i < nodeCount; i++)
+	{
+		Node &node = nodes[i];
+		node.parent = i > 0 ? &nodes[(i - 1) / 2] : nullptr;
+		node.matrix = glm::mat4(1.0f);
+		node.translation = glm::vec3(static_cast<float>(i % 7) * 0.1f, 0.5f, 0.0f);
+		node.rotation = glm::angleAxis(0.01f * static_cast<float>(i % 13), glm::vec3(0.0f, 1.0f, 0.0f));
+		node.scale = glm::vec3(1.0f);
+	}
+	// _linearNodes is children first
+	for (uint32_t i = nodeCount; i-- > 0;)
+	{
+		model._linearNodes.push_back(&nodes[i]);
+	}
+	auto seconds = [](std::chrono::high_resolution_clock::time_point start) {
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() / 1e6;
+	};
+
+	auto start = std::chrono::high_resolution_clock::now();
+	std::vector<glm::mat4> walked(nodeCount);
+	for (uint32_t i = 0; i < nodeCount; i++)
+	{
+		walked[i] = nodes[i].getMatrix();
+	}
+	double walkTime = seconds(start);
+
+	start = std::chrono::high_resolution_clock::now();
+	model.buildTransforms();
+	double buildTime = seconds(start);
+
+	// every node moved: the full pass
+	for (Node &node : nodes)
+	{
+		model.setLocalTransform(&node, node.translation, node.rotation, node.scale);
+	}
+	start = std::chrono::high_resolution_clock::now();
+	uint32_t fullUpdated = model.updateTransforms();
+	double fullTime = seconds(start);
+
+	// a few subtrees moved
+	for (uint32_t i = 0; i < nodeCount; i += 1000)
+	{
+		model.setLocalTransform(&nodes[i], nodes[i].translation, nodes[i].rotation, nodes[i].scale);
+	}
+	start = std::chrono::high_resolution_clock::now();
+	uint32_t partialUpdated = model.updateTransforms();
+	double partialTime = seconds(start);
+
+	start = std::chrono::high_resolution_clock::now();
+	float difference = 0.0f;
+	for (uint32_t i = 0; i < nodeCount; i++)
+	{
+		glm::mat4 cached = nodes[i].getMatrix();
+		for (int c = 0; c < 4; c++)
+		{
+			difference = std::max(difference, glm::length(cached[c] - walked[i][c]));
+		}
+	}
+	double readTime = seconds(start);
+	std::cout << "Transform benchmark, " << nodeCount << " nodes: walking the parents " << walkTime * 1000.0 << " ms, flattening " << buildTime * 1000.0
+		<< " ms, full update " << fullTime * 1000.0 << " ms (" << fullUpdated << " nodes), partial update " << partialTime * 1000.0 << " ms (" << partialUpdated
+		<< " nodes), cached reads " << readTime * 1000.0 << " ms, max difference " << difference << std::endl;
+	// the nodes belong to the vector, not to the model
+	model._linearNodes.clear();
+}
+
 glm::mat4 Node::localMatrix()
 {
 	return glm::translate(glm::mat4(1.0f), translation) * glm::mat4(rotation) * glm::scale(glm::mat4(1.0f), scale) * matrix;
@@ -474,6 +1506,10 @@ glm::mat4 Node::localMatrix()
 
 glm::mat4 Node::getMatrix()
 {
+	if (world)
+	{
+		return *world;
+	}
 	glm::mat4 m = localMatrix();
 	Node *p = parent;
 	while (p)
@@ -2,19 +2,36 @@
 
 #include <Core.h>
 #include <vk_utils.h>
-
-struct VertexInputDescription
-{
-	std::vector<vk::VertexInputBindingDescription> bindings;
-	std::vector<vk::VertexInputAttributeDescription> attributes;
-	vk::PipelineVertexInputStateCreateFlags flags;
-};
+#include <vk_platform.h>
+#include <vk_block_compression.h>
+#include <vk_vertex_layout.h>
 
 struct Texture
 {
 	vkutils::AllocatedImage image;
 	uint32_t index;
 	vk::DescriptorImageInfo descriptor;
+	uint32_t width{1};
+	uint32_t height{1};
+	uint32_t mipLevels{1};
+	// first level of the full chain held by image, width, height and mipLevels always describe the full chain
+	uint32_t residentLevel{0};
+};
+
+// Cpu copy of a texture's full mip chain, kept for streamed textures so finer levels can be uploaded later.
+struct TextureChain
+{
+	vk::Format format{vk::Format::eUndefined};
+	uint32_t width{1};
+	uint32_t height{1};
+	uint32_t mipLevels{1};
+	std::vector<unsigned char> data{};
+	// byte offset of every level followed by the total size
+	std::vector<size_t> levelOffsets{};
+	// image of the levels [firstLevel, mipLevels) and their offsets relative to levelOffsets[firstLevel]
+	vk::ImageCreateInfo imageInfo(uint32_t firstLevel) const;
+	std::vector<size_t> offsetsFrom(uint32_t firstLevel) const;
+	vk::DeviceSize bytesFrom(uint32_t firstLevel) const { return levelOffsets.back() - levelOffsets[firstLevel]; }
 };
 
 struct Material
@@ -41,6 +58,8 @@ struct Material
 	float transmissionFactor = 0.0f;
 	float ior = 1.5f;
 	AlphaMode alphaMode = ALPHAMODE_OPAQUE;
+	// the normal map is BC5, which stores only x and y
+	bool normalTwoChannel = false;
 };
 
 struct Primitive
@@ -50,6 +69,9 @@ struct Primitive
 	uint32_t firstVertex;
 	uint32_t vertexCount;
 	Material& material;
+	// indices are relative to firstVertex and stored 16 bit whenever the vertex count allows it
+	uint32_t indexByteOffset = 0;
+	vk::IndexType indexType = vk::IndexType::eUint32;
 
 	Primitive(uint32_t firstIndex, uint32_t indexCount, uint32_t firstVertex, uint32_t vertexCount, Material& material) : firstIndex(firstIndex), indexCount(indexCount), firstVertex(firstVertex), vertexCount(vertexCount), material(material) {};
 };
@@ -64,6 +86,13 @@ struct Node
 	glm::vec3 translation{};
 	glm::vec3 scale{1.0f};
 	glm::quat rotation{};
+	// index into Model::_instancedMeshes, -1 when the primitives are baked into the model's BLAS
+	int32_t mesh = -1;
+	// index into Model::_skins, the primitives are then posed by the skinning pass and the node's own matrix is ignored
+	int32_t skin = -1;
+	// entry of the model's flattened transforms, set by Model::buildTransforms. Without one getMatrix walks the parents.
+	uint32_t transform = UINT32_MAX;
+	const glm::mat4 *world = nullptr;
 	glm::mat4 localMatrix();
 	glm::mat4 getMatrix();
 	~Node() {
@@ -76,44 +105,198 @@ struct Node
 	}
 };
 
-struct Vertex
+// A glTF mesh referenced by several nodes. Its geometry is written once, the primitives of every other node
+// are copies sharing the ranges of the first node's and the scene builds one BLAS instanced per node.
+struct InstancedMesh
+{
+	// owns the primitives whose geometry is written
+	Node *node = nullptr;
+	// every node using the mesh, node included
+	std::vector<Node *> nodes{};
+};
+
+// Joints are indices into Model::_linearNodes.
+struct Skin
+{
+	std::vector<uint32_t> joints{};
+	std::vector<glm::mat4> inverseBindMatrices{};
+};
+
+struct Animation
+{
+	enum Interpolation
+	{
+		eLinear,
+		eStep,
+		eCubicSpline
+	};
+	enum Path
+	{
+		eTranslation,
+		eRotation,
+		eScale
+	};
+	struct Sampler
+	{
+		Interpolation interpolation = eLinear;
+		std::vector<float> times{};
+		// cubic splines store in tangent, value and out tangent per key
+		std::vector<glm::vec4> values{};
+	};
+	struct Channel
+	{
+		Path path = eTranslation;
+		// index into Model::_linearNodes
+		uint32_t node = 0;
+		uint32_t sampler = 0;
+	};
+	std::string name;
+	std::vector<Sampler> samplers{};
+	std::vector<Channel> channels{};
+	float start = 0.0f;
+	float end = 0.0f;
+};
+
+// Local transforms of every node of a model and the model space matrices flattened from them, by _linearNodes
+// index. Every animated instance owns one, the nodes themselves keep the rest pose.
+struct Pose
 {
-	glm::vec3 pos;
-	float pad0;
-	glm::vec3 normal;
-	float pad1;
-	glm::vec2 uv;
-	float pad2[2];
-	glm::vec4 color;
-	glm::vec4 joint0;
-	glm::vec4 weight0;
-	glm::vec4 tangent;
-	static VertexInputDescription get_vertex_description();
+	std::vector<glm::vec3> translations{};
+	std::vector<glm::quat> rotations{};
+	std::vector<glm::vec3> scales{};
+	std::vector<glm::mat4> matrices{};
 };
 
 class Model
 {
 public:
+	enum LoadMode
+	{
+		eCopy,
+		eMemoryMapped
+	};
+	enum MipMode
+	{
+		eNoMips,
+		// level 0 is uploaded and the chain is blitted on the gpu
+		eBlitMips,
+		// the chain is box filtered on the cpu, used for testing and when the format can't be blitted
+		eCpuMips
+	};
 	std::vector<Node *> _nodes{};
 	std::vector<Node *> _linearNodes{};
-	std::vector<uint32_t> _indices{};
-	std::vector<Vertex> _vertices{};
+	uint32_t _vertexCount{0};
+	uint32_t _indexCount{0};
+	uint32_t _indexBytes{0};
+	bool _hasColors{false};
+	bool _hasSkin{false};
+	bool _optimizeGeometry{false};
+	MipMode _mipMode{eBlitMips};
+	// keep every texture's chain on the cpu and upload only the levels up to _streamingTierSize, see TextureStreamer
+	bool _streamTextures{false};
+	uint32_t _streamingTierSize{128};
+	// keep the chains after upload even without streaming, set while a scene cache is written
+	bool _keepTextureChains{false};
+	// meshes used by more than one node become InstancedMesh, below _instanceMinTriangles a mesh is cheaper
+	// baked per node than as one more TLAS instance per node
+	bool _instanceMeshes{true};
+	uint32_t _instanceMinTriangles{256};
+	std::vector<InstancedMesh> _instancedMeshes{};
 	std::vector<Texture> _textures{};
+	// by texture index, only filled when _streamTextures or _keepTextureChains is set
+	std::vector<TextureChain> _textureChains{};
 	std::vector<Material> _materials{};
 	std::vector<vk::TransformMatrixKHR> _transforms{};
+	std::vector<Skin> _skins{};
+	std::vector<Animation> _animations{};
+	// by _linearNodes index, the parent's index or -1
+	std::vector<int32_t> _nodeParents{};
+	// first joint matrix of every skin in the array jointMatrices fills, _jointCount matrices in total
+	std::vector<uint32_t> _skinJointOffsets{};
+	uint32_t _jointCount{0};
+	// Model space matrix of every node, flattened parents first so one pass in order updates the hierarchy.
+	// Node::getMatrix reads its entry, local transforms change through setLocalTransform.
+	std::vector<Node *> _transformOrder{};
+	std::vector<int32_t> _transformParents{};
+	std::vector<glm::mat4> _localMatrices{};
+	std::vector<glm::mat4> _worldMatrices{};
+	std::vector<uint8_t> _transformDirty{};
+	std::string _filename;
 	vk::Sampler _sampler;
 	vk::Core* core;
 	Model();
 	Model(vk::Core &core);
 	void destroy();
-	bool load_from_glb(const char *filename);
+	bool load_from_glb(const char *filename, LoadMode mode = eMemoryMapped);
 	tinygltf::Model* getGltfData();
-	void build();
+	// textures are staged into upload, they are ready once it finished
+	void build(vkutils::UploadContext &upload);
+	size_t primitiveCount() const;
+	void writeGeometry(const vkutils::VertexLayout &layout, const std::vector<unsigned char *> &vertexStreams, unsigned char *indexBuffer);
+	void writePrimitive(size_t index, const vkutils::VertexLayout &layout, const std::vector<unsigned char *> &vertexStreams, unsigned char *indexBuffer);
+	void releaseSourceData();
+	// Scene cache: nodes, primitives, materials and counts are filled in by the cache, this uploads the textures
+	// from the chains whose level data lies in data (usually the mapped cache file) and marks the model built.
+	void restoreTextures(vkutils::UploadContext &upload, std::vector<TextureChain> &chains, const std::vector<const unsigned char *> &data);
+	bool skinned() const { return !_skins.empty(); }
+	// Flattens the node hierarchy into the transform arrays, called once the nodes are final.
+	void buildTransforms();
+	void setLocalTransform(Node *node, const glm::vec3 &translation, const glm::quat &rotation, const glm::vec3 &scale);
+	// Recomputes the world matrices of the changed nodes and their descendants, returns how many were updated.
+	uint32_t updateTransforms();
+	// Times getMatrix walking the parents against the flattened transforms on a synthetic hierarchy.
+	static void benchmarkTransforms(uint32_t nodeCount);
+	Pose restPose() const;
+	// Samples every channel of animation at time, seconds from the animation's start, into pose.
+	void animate(Pose &pose, const Animation &animation, float time) const;
+	// Flattens the local transforms of pose into its model space matrices, parents before children.
+	void updatePose(Pose &pose) const;
+	// Writes the _jointCount skinning matrices of pose, model space joint matrix times inverse bind matrix.
+	void jointMatrices(const Pose &pose, glm::mat4 *matrices) const;
 private:
+	struct PrimitiveSource
+	{
+		const tinygltf::Primitive *input;
+		Primitive *primitive;
+		// set by optimizeGeometry, the primitive is then written from these instead of the accessors
+		bool optimized = false;
+		std::vector<Vertex> vertices{};
+		std::vector<uint32_t> indices{};
+	};
 	bool isBuilded;
 	tinygltf::Model _input;
-	void loadImages();
+	vkutils::MappedFile _file;
+	std::vector<const unsigned char *> _mappedBuffers{};
+	std::vector<int> _mappedImageViews{};
+	// DDS and KTX2 images by image index, used instead of the decoded image when the device can sample the format
+	std::vector<vkutils::bc::CompressedImage> _compressedImages{};
+	// encoded bytes of images that are not GLB buffer views, handed over by loadImageData
+	std::vector<std::vector<unsigned char>> _encodedImages{};
+	std::vector<PrimitiveSource> _primitiveSources{};
+	// by glTF mesh, the InstancedMesh it became, -1 while it has none, -2 when it is baked
+	std::vector<int32_t> _meshInstances{};
+	// by glTF node index, its index into _linearNodes
+	std::vector<uint32_t> _nodeIndices{};
+	bool _transformsDirty{false};
+	bool loadMapped(const char *filename);
+	const unsigned char *bufferData(int buffer);
+	const unsigned char *accessorData(int accessor);
+	glm::vec4 readAccessor(int accessor, size_t element, glm::vec4 value);
+	template <typename Sink>
+	void readVertices(const tinygltf::Primitive &glTFPrimitive, uint32_t vertexCount, Sink sink);
+	template <typename T>
+	void readIndices(const tinygltf::Primitive &glTFPrimitive, T *dst);
+	void optimizeGeometry();
+	void decodeImages();
+	static bool loadImageData(tinygltf::Image *image, const int imageIndex, std::string *error, std::string *warning, int requestedWidth, int requestedHeight, const unsigned char *bytes, int size, void *userData);
+	bool readCompressedImage(tinygltf::Image &image, size_t imageIndex, const unsigned char *bytes, size_t size, std::string &error);
+	int textureSource(const tinygltf::Texture &texture);
+	void createSampler();
+	void loadImages(vkutils::UploadContext &upload);
+	Texture uploadChain(vkutils::UploadContext &upload, const TextureChain &chain, const unsigned char *data);
 	void loadMaterials();
-	void loadNode(const tinygltf::Node &inputNode, Node *parent, std::vector<uint32_t> &indexBuffer, std::vector<Vertex> &vertexBuffer);
+	void loadNode(const tinygltf::Node &inputNode, Node *parent);
+	void loadSkins();
+	void loadAnimations();
 	uint32_t getTextureIndex(uint32_t index);
 };
\ No newline at end of file
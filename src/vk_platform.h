@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace vkutils
+{
+    // Read-only memory mapping of a whole file. The mapping stays valid until close() or destruction.
+    class MappedFile {
+    public:
+        MappedFile();
+        ~MappedFile();
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        bool open(const char* filename);
+        void close();
+        bool isOpen() const;
+        const unsigned char* data() const;
+        size_t size() const;
+    private:
+        const unsigned char* _data{nullptr};
+        size_t _size{0};
+#ifdef _WIN32
+        void* _file{nullptr};
+        void* _mapping{nullptr};
+#else
+        int _fd{-1};
+#endif
+    };
+    // Peak resident set size of the process in bytes, 0 if unavailable.
+    size_t peakResidentSetSize();
+}
@@ -1,5 +1,13 @@
 #include <vk_scene.h>
+#include <algorithm>
 #include <iterator>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <unordered_map>
+#include <vk_threadpool.h>
+#include <vk_scene_cache.h>
 
 Scene::Scene(): core(){
     _isBuilded = false;
@@ -11,299 +19,778 @@ Scene::Scene(vk::Core& core): core(&core){
 
 void Scene::add(std::string path, glm::mat4 transform)
 {
-    Model *model = new Model(*core);
-	model->load_from_glb(path.c_str());
-    models.push_back(model);
-    tlasTransforms.push_back(vkutils::getTransformMatrixKHR(transform));
-    modelMatrices.push_back(transform);
+    std::error_code error;
+    Source source{std::filesystem::weakly_canonical(path, error).string(), 0, 0, instanceMeshes, instanceMinTriangles};
+    if (error) {
+        source.path = path;
+    }
+    source.size = std::filesystem::file_size(source.path, error);
+    if (error) {
+        source.size = 0;
+    }
+    uint32_t model = findAsset(source);
+    if (model == UINT32_MAX) {
+        model = static_cast<uint32_t>(models.size());
+        _sources.push_back(source);
+        // with a cache the glb is only parsed in build() when the cache misses
+        models.push_back(cacheDirectory.empty() ? loadModel(source.path) : nullptr);
+    }
+    addInstance(model, transform);
 }
 
 void Scene::add(Model* model, glm::mat4 transform)
 {
-    models.push_back(model);
+    auto found = std::find(models.begin(), models.end(), model);
+    if (found == models.end()) {
+        _sources.push_back({std::string(), 0, 0, model->_instanceMeshes, model->_instanceMinTriangles});
+        models.push_back(model);
+        found = models.end() - 1;
+    }
+    addInstance(static_cast<uint32_t>(found - models.begin()), transform);
+}
+
+uint32_t Scene::findAsset(Source& source)
+{
+    for (uint32_t i = 0; i < _sources.size(); i++) {
+        if (_sources[i].path == source.path) {
+            return i;
+        }
+    }
+    // a copy of an asset under another name, only files of the same size are worth reading
+    auto contentHash = [](Source& candidate) {
+        if (candidate.contentHash == 0) {
+            vkutils::MappedFile file;
+            if (file.open(candidate.path.c_str())) {
+                candidate.contentHash = vkutils::scenecache::hash(file.data(), file.size());
+            }
+        }
+        return candidate.contentHash;
+    };
+    for (uint32_t i = 0; i < _sources.size(); i++) {
+        if (!_sources[i].path.empty() && source.size != 0 && _sources[i].size == source.size && contentHash(_sources[i]) == contentHash(source)) {
+            std::cout << source.path << " has the same content as " << _sources[i].path << ", adding an instance" << std::endl;
+            return i;
+        }
+    }
+    return UINT32_MAX;
+}
+
+void Scene::addInstance(uint32_t model, const glm::mat4& transform)
+{
+    instanceModels.push_back(model);
     tlasTransforms.push_back(vkutils::getTransformMatrixKHR(transform));
     modelMatrices.push_back(transform);
-    
+}
+
+Model* Scene::loadModel(const std::string& path)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    Model *model = new Model(*core);
+    if (!model->load_from_glb(path.c_str(), loadMode)) {
+        std::cerr << "Failed to load " << path << std::endl;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+    std::cout << "Parsed " << path << " in " << elapsed / 1e6 << "s, peak RSS: " << vkutils::peakResidentSetSize() / (1024 * 1024) << " MB" << std::endl;
+    return model;
 }
 
 void Scene::buildAccelerationStructure()
 {
     createEmptyTexture();
+    computeBounds();
+    // the TLAS follows the refit skinned BLASes through updateTopLevel
+    if(!skinnedPrimitives.empty()){
+        dynamicInstances = true;
+    }
+
+    auto asProperties = core->_chosenGPU.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceAccelerationStructurePropertiesKHR>();
+    vk::DeviceSize scratchAlignment = asProperties.get<vk::PhysicalDeviceAccelerationStructurePropertiesKHR>().minAccelerationStructureScratchOffsetAlignment;
+    float timestampPeriod = asProperties.get<vk::PhysicalDeviceProperties2>().properties.limits.timestampPeriod;
+    // every scene buffer but the acceleration structures themselves lives in the arena, ranges are aligned for
+    // storage buffer descriptors and build scratch alike
+    arena.init(*core, vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eTransferSrc | vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eIndexBuffer | vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR, arenaBlockSize, std::max<vk::DeviceSize>(256, scratchAlignment));
 
-    vk::DeviceSize vertexBufferSize = vertices.size() * sizeof(Vertex);
-    vk::DeviceSize indexBufferSize = indices.size() * sizeof(uint32_t);
+    vk::DeviceSize indexBufferSize = indexBytes;
     vk::DeviceSize lightBufferSize = lights.size() * sizeof(vkutils::LightProxy);
-    vertexBuffer = vkutils::deviceBufferFromData(*core, (void*) vertices.data(), vertexBufferSize, vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eStorageBuffer, vma::MemoryUsage::eAutoPreferDevice);
-    indexBuffer = vkutils::deviceBufferFromData(*core, (void*) indices.data(), indexBufferSize, vk::BufferUsageFlagBits::eIndexBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eStorageBuffer, vma::MemoryUsage::eAutoPreferDevice);
-    lightBuffer = vkutils::deviceBufferFromData(*core, (void*) lights.data(), lightBufferSize, vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eStorageBuffer, vma::MemoryUsage::eAutoPreferDevice);
-    
-    std::vector<uint32_t> materialOffsets;
-    //build blas
-    {
-        uint32_t modelIndexOffset = 0;
-        uint32_t modelVertexOffset = 0;
-        uint32_t modelTextureOffset = 0;
-        for(auto& model : models){
-            materialOffsets.push_back((uint32_t) materials.size());
-            std::vector<vk::TransformMatrixKHR> transformMatrices;
-            for (auto node : model->_linearNodes) {
-                for (auto primitive : node->primitives) {
-                    if (primitive->indexCount > 0) {
-                        vk::TransformMatrixKHR transformMatrix{};
-                        auto m = glm::mat3x4(glm::transpose(node->getMatrix()));
-                        memcpy(&transformMatrix, (void*)&m, sizeof(glm::mat3x4));
-                        transformMatrices.push_back(transformMatrix);
+    // geometry was written into the staging buffers by build(), this is the only copy to the device
+    for(uint32_t stream = 0; stream < vertexLayout.streamCount(); stream++){
+        vk::DeviceSize vertexBufferSize = static_cast<vk::DeviceSize>(vertexCount) * vertexLayout.strides[stream];
+        vk::DeviceSize posedSize = static_cast<vk::DeviceSize>(posedVertexCount) * vertexLayout.strides[stream];
+        vertexBuffers.push_back(arena.allocate(vertexBufferSize + posedSize, vkutils::MemoryCategory::eVertex));
+        uploads->commandBuffer().copyBuffer(vertexStagingBuffers[stream]._buffer, vertexBuffers.back().buffer, vk::BufferCopy(0, vertexBuffers.back().offset, vertexBufferSize));
+        uploads->release(vertexStagingBuffers[stream]);
+    }
+    vertexStagingBuffers.clear();
+    if(posedVertexCount > 0){
+        // every posed copy starts as the rest pose, skinning only rewrites position, normal and tangent
+        vk::CommandBuffer copyCmd = uploads->commandBuffer();
+        vk::MemoryBarrier restPoseBarrier(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eTransferRead);
+        copyCmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer, {}, restPoseBarrier, {}, {});
+        for(uint32_t stream = 0; stream < vertexLayout.streamCount(); stream++){
+            vk::DeviceSize stride = vertexLayout.strides[stream];
+            vk::DeviceSize offset = vertexBuffers[stream].offset;
+            std::vector<vk::BufferCopy> regions;
+            for(uint32_t i = 0; i < instanceModels.size(); i++){
+                for(const SkinnedPrimitive& skinned : skinnedPrimitives){
+                    if(skinned.model == instanceModels[i]){
+                        regions.push_back(vk::BufferCopy(offset + skinned.restVertex * stride, offset + posedVertex(i, skinned.primitive) * stride, skinned.primitive->vertexCount * stride));
                     }
                 }
             }
+            copyCmd.copyBuffer(vertexBuffers[stream].buffer, vertexBuffers[stream].buffer, regions);
+        }
+    }
+    indexBuffer = arena.allocate(indexBufferSize, vkutils::MemoryCategory::eIndex);
+    uploads->commandBuffer().copyBuffer(indexStagingBuffer._buffer, indexBuffer.buffer, vk::BufferCopy(0, indexBuffer.offset, indexBufferSize));
+    uploads->release(indexStagingBuffer);
+    lightBuffer = arena.allocate(lightBufferSize, vkutils::MemoryCategory::eOther);
+    uploads->copy(lights.data(), lightBufferSize, lightBuffer.buffer, lightBuffer.offset);
+    
+    // serialized BLASes of an earlier run replace the build, any mismatch falls back to building them
+    uint64_t key = cacheDirectory.empty() || !skinnedPrimitives.empty() ? 0 : cacheKey();
+    std::string blasCacheFile = key != 0 ? blasCachePath(key) : std::string();
+    bool blasCached = !blasCacheFile.empty() && readBlasCache(blasCacheFile, key);
 
-            vk::DeviceSize transformBufferSize = transformMatrices.size() * sizeof(vk::TransformMatrixKHR);
-            vkutils::AllocatedBuffer transformBuffer = vkutils::deviceBufferFromData(*core, transformMatrices.data(), transformBufferSize, vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress, vma::MemoryUsage::eAutoPreferDevice);
-
-            // Build BLAS
-            std::vector<uint32_t> maxPrimitiveCounts{};
-            std::vector<vk::AccelerationStructureGeometryKHR> geometries{};
-            std::vector<vk::AccelerationStructureBuildRangeInfoKHR> buildRangeInfos{};
-            std::vector<vk::AccelerationStructureBuildRangeInfoKHR*> pBuildRangeInfos{};
-            vk::BufferDeviceAddressInfo vertexBufferAdressInfo(vertexBuffer._buffer);
-            vk::BufferDeviceAddressInfo indexBufferAdressInfo(indexBuffer._buffer);
-            vk::BufferDeviceAddressInfo transformBufferAdressInfo(transformBuffer._buffer);
-            for (auto node : model->_linearNodes) {
-                for (auto primitive : node->primitives) {
-                    if (primitive->indexCount > 0) {
-                        //Device Addresses
-                        vk::DeviceOrHostAddressConstKHR vertexBufferDeviceAddress;
-                        vk::DeviceOrHostAddressConstKHR indexBufferDeviceAddress;
-                        vk::DeviceOrHostAddressConstKHR transformBufferDeviceAddress;
-                        vertexBufferDeviceAddress.deviceAddress = core->_device.getBufferAddress(vertexBufferAdressInfo) + modelVertexOffset * sizeof(Vertex);
-                        indexBufferDeviceAddress.deviceAddress = core->_device.getBufferAddress(indexBufferAdressInfo) + (modelIndexOffset + primitive->firstIndex) * sizeof(uint32_t);
-                        transformBufferDeviceAddress.deviceAddress = core->_device.getBufferAddress(transformBufferAdressInfo) + static_cast<uint32_t>(geometries.size()) * sizeof(vk::TransformMatrixKHR);
-
-                        //Create Geometry for every gltf primitive (node)
-                        vk::AccelerationStructureGeometryTrianglesDataKHR triangles;
-                        triangles.vertexFormat = vk::Format::eR32G32B32Sfloat;
-                        triangles.maxVertex = static_cast<uint32_t>(model->_vertices.size());
-                        triangles.vertexStride = sizeof(Vertex);
-                        triangles.indexType = vk::IndexType::eUint32;
-                        triangles.vertexData = vertexBufferDeviceAddress;
-                        triangles.indexData = indexBufferDeviceAddress;
-                        triangles.transformData = transformBufferDeviceAddress;
-
-                        vk::AccelerationStructureGeometryKHR geometry;
-                        geometry.geometryType = vk::GeometryTypeKHR::eTriangles;
-                        geometry.geometry.triangles = triangles;
-                        if(primitive->material.alphaMode != Material::ALPHAMODE_OPAQUE)
-                        {
-                            geometry.flags = vk::GeometryFlagBitsKHR::eNoDuplicateAnyHitInvocation;
-                        }
-                        else
-                        {
-                            geometry.flags = vk::GeometryFlagBitsKHR::eOpaque;
-                        }
-
-                        geometries.push_back(geometry);
-                        maxPrimitiveCounts.push_back(primitive->indexCount / 3);
-                        vk::AccelerationStructureBuildRangeInfoKHR buildRangeInfo;
-                        buildRangeInfo.firstVertex = 0;
-                        buildRangeInfo.primitiveOffset = 0;
-                        buildRangeInfo.primitiveCount = primitive->indexCount / 3;
-                        buildRangeInfo.transformOffset = 0;
-                        buildRangeInfos.push_back(buildRangeInfo);
-                        
-                        //push Material in same order to Reference it
-                        vkutils::Material material{};
-                        material.indexOffset = modelIndexOffset + primitive->firstIndex;
-                        material.vertexOffset = modelVertexOffset;
-                        material.baseColorTexture = primitive->material.baseColorTexture > -1 ? modelTextureOffset + primitive->material.baseColorTexture : -1;
-                        material.diffuseTexture = primitive->material.diffuseTexture > -1 ? modelTextureOffset + primitive->material.diffuseTexture : -1;
-                        material.emissiveTexture = primitive->material.emissiveTexture > -1 ? modelTextureOffset + primitive->material.emissiveTexture : -1;
-                        material.metallicRoughnessTexture = primitive->material.metallicRoughnessTexture > -1 ? modelTextureOffset + primitive->material.metallicRoughnessTexture : -1;
-                        material.normalTexture = primitive->material.normalTexture > -1 ? modelTextureOffset + primitive->material.normalTexture : -1;
-                        material.occlusionTexture = primitive->material.occlusionTexture > -1 ? modelTextureOffset + primitive->material.occlusionTexture : -1;
-                        material.metallicFactor = primitive->material.metallicFactor;
-                        material.roughnessFactor = primitive->material.roughnessFactor;
-                        material.alphaMode = primitive->material.alphaMode;
-                        material.alphaCutoff = primitive->material.alphaCutoff;
-                        material.baseColorFactor[0] = primitive->material.baseColorFactor.x;
-                        material.baseColorFactor[1] = primitive->material.baseColorFactor.y;
-                        material.baseColorFactor[2] = primitive->material.baseColorFactor.z;
-                        material.baseColorFactor[3] = primitive->material.baseColorFactor.w;
-                        material.emissiveFactor[0] = primitive->material.emissiveFactor.x;
-                        material.emissiveFactor[1] = primitive->material.emissiveFactor.y;
-                        material.emissiveFactor[2] = primitive->material.emissiveFactor.z;
-                        material.emissiveFactor[3] = primitive->material.emissiveFactor.w;
-                        material.emissiveStrength = primitive->material.emissiveStrength;
-                        material.transmissionFactor = primitive->material.transmissionFactor;
-                        material.ior = primitive->material.ior;
-                        material.modelMatrix = node->getMatrix();
-                        materials.push_back(material);
-                    }
+    auto phaseStart = std::chrono::high_resolution_clock::now();
+    auto phaseTime = [&]() {
+        auto now = std::chrono::high_resolution_clock::now();
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - phaseStart).count();
+        phaseStart = now;
+        return elapsed / 1e6;
+    };
+
+    //geometry of every blas
+    struct BlasBuild {
+        std::vector<vk::AccelerationStructureGeometryKHR> geometries{};
+        std::vector<vk::AccelerationStructureBuildRangeInfoKHR> buildRangeInfos{};
+        std::vector<uint32_t> maxPrimitiveCounts{};
+        vk::AccelerationStructureBuildGeometryInfoKHR buildInfo{};
+        vk::AccelerationStructureBuildSizesInfoKHR sizes{};
+        vk::DeviceSize scratchOffset = 0;
+        uint32_t batch = 0;
+    };
+    std::vector<BlasBuild> builds;
+    vkutils::BufferRange transformBuffer{};
+    vk::DeviceSize blasBytes = 0;
+    uint64_t blasTriangles = 0;
+    uint32_t meshBlasCount = 0;
+    if(!blasCached){
+        std::vector<uint32_t> modelIndexByteOffsets;
+        std::vector<uint32_t> modelVertexOffsets;
+        uint32_t indexByteOffset = 0;
+        uint32_t vertexOffset = 0;
+        for(auto& model : models){
+            modelIndexByteOffsets.push_back(indexByteOffset);
+            modelVertexOffsets.push_back(vertexOffset);
+            indexByteOffset += model->_indexBytes;
+            vertexOffset += model->_vertexCount;
+        }
+        // one transform buffer for the geometries of all BLASes
+        std::vector<vk::TransformMatrixKHR> transformMatrices;
+        for(auto& source : blasSources){
+            forEachGeometry(source, [&](Node* node, Primitive*) {
+                vk::TransformMatrixKHR transformMatrix{};
+                // an instanced mesh is built in mesh space, the node matrices go into its TLAS instances
+                auto m = glm::mat3x4(glm::transpose(source.mesh < 0 && source.instance < 0 ? node->getMatrix() : glm::mat4(1.0f)));
+                memcpy(&transformMatrix, (void*)&m, sizeof(glm::mat3x4));
+                transformMatrices.push_back(transformMatrix);
+            });
+        }
+        vk::DeviceSize transformBufferSize = transformMatrices.size() * sizeof(vk::TransformMatrixKHR);
+        transformBuffer = arena.allocate(transformBufferSize, vkutils::MemoryCategory::eOther);
+        uploads->copy(transformMatrices.data(), transformBufferSize, transformBuffer.buffer, transformBuffer.offset);
+
+        vk::DeviceAddress vertexBufferAddress = vertexBuffers[0].address;
+        vk::DeviceAddress indexBufferAddress = indexBuffer.address;
+        vk::DeviceAddress transformBufferAddress = transformBuffer.address;
+        uint32_t transformIndex = 0;
+        builds.resize(blasSources.size());
+        for(size_t b = 0; b < blasSources.size(); b++){
+            const BlasSource& source = blasSources[b];
+            BlasBuild& build = builds[b];
+            uint32_t modelIndexByteOffset = modelIndexByteOffsets[source.model];
+            uint32_t modelVertexOffset = modelVertexOffsets[source.model];
+            forEachGeometry(source, [&](Node*, Primitive* primitive) {
+                //Create Geometry for every gltf primitive (node)
+                vk::AccelerationStructureGeometryTrianglesDataKHR triangles;
+                triangles.vertexFormat = vk::Format::eR32G32B32Sfloat;
+                triangles.maxVertex = primitive->vertexCount - 1;
+                triangles.vertexStride = vertexLayout.strides[0];
+                triangles.indexType = primitive->indexType;
+                // indices are relative to the primitive's first vertex
+                uint32_t firstVertex = source.instance < 0 ? modelVertexOffset + primitive->firstVertex : posedVertex(source.instance, primitive);
+                triangles.vertexData.deviceAddress = vertexBufferAddress + static_cast<vk::DeviceSize>(firstVertex) * vertexLayout.strides[0];
+                triangles.indexData.deviceAddress = indexBufferAddress + modelIndexByteOffset + primitive->indexByteOffset;
+                // posed vertices are in model space already, and the refits run long after the transform buffer is gone
+                if(source.instance < 0){
+                    triangles.transformData.deviceAddress = transformBufferAddress + static_cast<vk::DeviceSize>(transformIndex) * sizeof(vk::TransformMatrixKHR);
                 }
-            }
-            for (auto& rangeInfo : buildRangeInfos) {
-                pBuildRangeInfos.push_back(&rangeInfo);
-            }
+                transformIndex++;
 
-            // Get size info
-            vk::AccelerationStructureBuildGeometryInfoKHR accelerationStructureBuildGeometryInfo;
-            accelerationStructureBuildGeometryInfo.type = vk::AccelerationStructureTypeKHR::eBottomLevel;
-            accelerationStructureBuildGeometryInfo.flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
-            accelerationStructureBuildGeometryInfo.geometryCount = (uint32_t) geometries.size();
-            accelerationStructureBuildGeometryInfo.pGeometries = geometries.data();
+                vk::AccelerationStructureGeometryKHR geometry;
+                geometry.geometryType = vk::GeometryTypeKHR::eTriangles;
+                geometry.geometry.triangles = triangles;
+                if(primitive->material.alphaMode != Material::ALPHAMODE_OPAQUE)
+                {
+                    geometry.flags = vk::GeometryFlagBitsKHR::eNoDuplicateAnyHitInvocation;
+                }
+                else
+                {
+                    geometry.flags = vk::GeometryFlagBitsKHR::eOpaque;
+                }
 
-            auto accelerationStructureBuildSizesInfo = core->_device.getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice, accelerationStructureBuildGeometryInfo, maxPrimitiveCounts);
+                build.geometries.push_back(geometry);
+                build.maxPrimitiveCounts.push_back(primitive->indexCount / 3);
+                vk::AccelerationStructureBuildRangeInfoKHR buildRangeInfo;
+                buildRangeInfo.firstVertex = 0;
+                buildRangeInfo.primitiveOffset = 0;
+                buildRangeInfo.primitiveCount = primitive->indexCount / 3;
+                buildRangeInfo.transformOffset = 0;
+                build.buildRangeInfos.push_back(buildRangeInfo);
+            });
 
-            //Build BLAS Buffer
-            blasBuffer.push_back(vkutils::createBuffer(*core, accelerationStructureBuildSizesInfo.accelerationStructureSize, vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR, vma::MemoryUsage::eAutoPreferDevice));
+            build.buildInfo.type = vk::AccelerationStructureTypeKHR::eBottomLevel;
+            build.buildInfo.flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
+            if(source.instance >= 0){
+                // refit every frame and never compacted, an update has to start from a BLAS built for it
+                build.buildInfo.flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild | vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate;
+            } else if(compactBlas){
+                build.buildInfo.flags |= vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction;
+            }
+            build.buildInfo.mode = vk::BuildAccelerationStructureModeKHR::eBuild;
+            build.buildInfo.setGeometries(build.geometries);
+            build.sizes = core->_device.getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice, build.buildInfo, build.maxPrimitiveCounts);
 
-            //Get BLAS Handle
+            blasBuffer.push_back(vkutils::createBuffer(*core, build.sizes.accelerationStructureSize, vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR, vma::MemoryUsage::eAutoPreferDevice, {}, true));
             vk::AccelerationStructureCreateInfoKHR accelerationStructureCreateInfo;
             accelerationStructureCreateInfo.type = vk::AccelerationStructureTypeKHR::eBottomLevel;
             accelerationStructureCreateInfo.buffer = blasBuffer.back()._buffer;
-            accelerationStructureCreateInfo.size = accelerationStructureBuildSizesInfo.accelerationStructureSize;
+            accelerationStructureCreateInfo.size = build.sizes.accelerationStructureSize;
             blas.push_back(core->_device.createAccelerationStructureKHR(accelerationStructureCreateInfo));
-
-            // Create ScratchBuffer
-            vkutils::AllocatedBuffer scratchBuffer = vkutils::createBuffer(*core, accelerationStructureBuildSizesInfo.buildScratchSize, vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eStorageBuffer, vma::MemoryUsage::eAutoPreferDevice, vma::AllocationCreateFlagBits::eDedicatedMemory);
-            vk::BufferDeviceAddressInfo scratchBufferAdressInfo(scratchBuffer._buffer);
-            vk::DeviceOrHostAddressConstKHR scratchBufferAddress;
-            scratchBufferAddress.deviceAddress = core->_device.getBufferAddress(scratchBufferAdressInfo);
-
-            accelerationStructureBuildGeometryInfo.mode = vk::BuildAccelerationStructureModeKHR::eBuild;
-            accelerationStructureBuildGeometryInfo.dstAccelerationStructure = blas.back();
-            accelerationStructureBuildGeometryInfo.scratchData.deviceAddress = scratchBufferAddress.deviceAddress;
-
-            // Create Single-Use CommandBuffer and Build Acceleration Structure on GPU
-            vk::CommandBufferAllocateInfo allocInfo{};
-            allocInfo.level = vk::CommandBufferLevel::ePrimary;
-            allocInfo.commandPool = core->_cmdPool;
-            allocInfo.commandBufferCount = 1;
-
-            vk::CommandBuffer commandBuffer = core->_device.allocateCommandBuffers(allocInfo).front();
-
-            vk::CommandBufferBeginInfo beginInfo{};
-            beginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
-
-            commandBuffer.begin(beginInfo);
-                commandBuffer.buildAccelerationStructuresKHR(1, &accelerationStructureBuildGeometryInfo, pBuildRangeInfos.data());
-            commandBuffer.end();
-
-            vk::SubmitInfo submitInfo{};
-            submitInfo.setCommandBuffers(commandBuffer);
-            core->_graphicsQueue.submit(submitInfo);
-            core->_graphicsQueue.waitIdle();
-            core->_device.freeCommandBuffers(core->_cmdPool, commandBuffer);
+            build.buildInfo.dstAccelerationStructure = blas.back();
 
             vk::AccelerationStructureDeviceAddressInfoKHR accelerationDeviceAddressInfo;
             accelerationDeviceAddressInfo.accelerationStructure = blas.back();
             blasAddress.push_back(core->_device.getAccelerationStructureAddressKHR(accelerationDeviceAddressInfo));
 
-            //delete Scratch Buffer
-            core->_allocator.destroyBuffer(scratchBuffer._buffer, scratchBuffer._allocation);
-            core->_allocator.destroyBuffer(transformBuffer._buffer, transformBuffer._allocation);
-            modelIndexOffset += (uint32_t) model->_indices.size();
-            modelVertexOffset += (uint32_t) model->_vertices.size();
-            modelTextureOffset += (uint32_t) model->_textures.size();
+            blasBytes += build.sizes.accelerationStructureSize;
+            for (uint32_t count : build.maxPrimitiveCounts) {
+                blasTriangles += count;
+            }
+            meshBlasCount += source.mesh >= 0 ? 1 : 0;
+            if(source.instance >= 0){
+                SkinnedBlas skinned{static_cast<uint32_t>(b), static_cast<uint32_t>(source.instance), build.buildInfo.flags, build.geometries, build.buildRangeInfos};
+                skinned.scratchOffset = skinnedBlas.empty() ? 0 : vkutils::scenecache::align(skinnedBlas.back().scratchOffset + builds[skinnedBlas.back().blas].sizes.updateScratchSize, scratchAlignment);
+                skinnedBlas.push_back(skinned);
+            }
         }
-        vk::DeviceSize materialBufferSize = static_cast<uint32_t>(materials.size()) * sizeof(vkutils::Material);
-        materialBuffer =  vkutils::deviceBufferFromData(*core, materials.data(), materialBufferSize, vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eStorageBuffer, vma::MemoryUsage::eAutoPreferDevice);
+        if(!skinnedBlas.empty()){
+            // all refits of a frame run in one build call, each with its own range of this buffer
+            vk::DeviceSize skinnedScratchSize = skinnedBlas.back().scratchOffset + builds[skinnedBlas.back().blas].sizes.updateScratchSize;
+            skinnedScratchBuffer = arena.allocate(skinnedScratchSize, vkutils::MemoryCategory::eScratch);
+        }
+    }
+    vk::DeviceSize materialBufferSize = static_cast<uint32_t>(materials.size()) * sizeof(vkutils::Material);
+    materialBuffer = arena.allocate(materialBufferSize, vkutils::MemoryCategory::eOther);
+    uploads->copy(materials.data(), materialBufferSize, materialBuffer.buffer, materialBuffer.offset);
+
+    ///tlas instances
+    std::vector<vk::AccelerationStructureInstanceKHR> instances;
+    // BLAS of every instance, its address is filled in once the BLASes are final
+    std::vector<uint32_t> instanceBlas;
+    std::vector<std::vector<uint32_t>> modelBlas(models.size());
+    for(uint32_t b = 0; b < blasSources.size(); b++){
+        modelBlas[blasSources[b].model].push_back(b);
     }
-    ///build tlas
-    {
-        std::vector<vk::AccelerationStructureInstanceKHR> instances;
-        for(uint32_t i = 0; i < blasAddress.size(); i++){
-            vk::DeviceAddress& address = blasAddress[i];
-            vk::TransformMatrixKHR& transform = tlasTransforms[i];
-            uint32_t offset = materialOffsets[i];
-            instances.push_back(vk::AccelerationStructureInstanceKHR(transform, offset, 0xFF, 0, vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable, address));
+    // instances of one model share its BLASes and material ranges, an instanced mesh adds one per node
+    uint64_t sceneTriangles = 0;
+    instanceFirstTlas.clear();
+    tlasLocalMatrices.clear();
+    for(uint32_t i = 0; i < instanceModels.size(); i++){
+        Model* model = models[instanceModels[i]];
+        instanceFirstTlas.push_back(static_cast<uint32_t>(instances.size()));
+        for(uint32_t b : modelBlas[instanceModels[i]]){
+            const BlasSource& source = blasSources[b];
+            if(source.instance >= 0 && static_cast<uint32_t>(source.instance) != i){
+                continue;
+            }
+            if(source.mesh < 0){
+                instances.push_back(vk::AccelerationStructureInstanceKHR(tlasTransforms[i], source.materialOffset, 0xFF, 0, vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable, 0));
+                instanceBlas.push_back(b);
+                tlasLocalMatrices.push_back(glm::mat4(1.0f));
+                sceneTriangles += source.triangles;
+                continue;
+            }
+            for(Node* node : model->_instancedMeshes[source.mesh].nodes){
+                vk::TransformMatrixKHR transform = vkutils::getTransformMatrixKHR(modelMatrices[i] * node->getMatrix());
+                instances.push_back(vk::AccelerationStructureInstanceKHR(transform, source.materialOffset, 0xFF, 0, vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable, 0));
+                instanceBlas.push_back(b);
+                tlasLocalMatrices.push_back(node->getMatrix());
+                sceneTriangles += source.triangles;
+            }
         }
+    }
+    instanceFirstTlas.push_back(static_cast<uint32_t>(instances.size()));
 
-        vk::DeviceSize instancesBufferSize = instances.size() * sizeof(vk::AccelerationStructureInstanceKHR);
-        vkutils::AllocatedBuffer instancesBuffer = vkutils::deviceBufferFromData(*core, instances.data(), instancesBufferSize, vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress, vma::MemoryUsage::eAutoPreferDevice);
+    vk::AccelerationStructureGeometryKHR accelerationStructureGeometry;
+    accelerationStructureGeometry.geometryType = vk::GeometryTypeKHR::eInstances;
+    accelerationStructureGeometry.geometry.instances = vk::AccelerationStructureGeometryInstancesDataKHR(VK_FALSE, {});
 
-        vk::DeviceOrHostAddressConstKHR instanceDataDeviceAddress;
-        vk::BufferDeviceAddressInfo instanceBufferAdressInfo(instancesBuffer._buffer);
-        instanceDataDeviceAddress.deviceAddress = core->_device.getBufferAddress(instanceBufferAdressInfo);
+    vk::AccelerationStructureBuildGeometryInfoKHR tlasBuildInfo;
+    tlasBuildInfo.type = vk::AccelerationStructureTypeKHR::eTopLevel;
+    tlasBuildInfo.flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
+    if(dynamicInstances){
+        tlasBuildInfo.flags |= vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate;
+    }
+    tlasBuildInfo.mode = vk::BuildAccelerationStructureModeKHR::eBuild;
+    tlasBuildInfo.setGeometries(accelerationStructureGeometry);
 
-        vk::AccelerationStructureGeometryInstancesDataKHR instancesData(VK_FALSE, instanceDataDeviceAddress);
+    uint32_t primitive_count = (uint32_t) instances.size();
 
-        vk::AccelerationStructureGeometryKHR accelerationStructureGeometry;
-        accelerationStructureGeometry.geometryType = vk::GeometryTypeKHR::eInstances;
-        accelerationStructureGeometry.geometry.instances = instancesData;
+    auto tlasSizes = core->_device.getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice, tlasBuildInfo, primitive_count);
 
-        vk::AccelerationStructureBuildGeometryInfoKHR accelerationStructureBuildGeometryInfo;
-        accelerationStructureBuildGeometryInfo.type = vk::AccelerationStructureTypeKHR::eTopLevel;
-        accelerationStructureBuildGeometryInfo.flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
-        accelerationStructureBuildGeometryInfo.setGeometries(accelerationStructureGeometry);
+    tlasBuffer = vkutils::createBuffer(*core, tlasSizes.accelerationStructureSize, vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR, vma::MemoryUsage::eAutoPreferDevice, {}, true);
 
-        uint32_t primitive_count = (uint32_t) instances.size();
+    vk::AccelerationStructureCreateInfoKHR accelerationStructureCreateInfo;
+    accelerationStructureCreateInfo.buffer = tlasBuffer._buffer;
+    accelerationStructureCreateInfo.size = tlasSizes.accelerationStructureSize;
+    accelerationStructureCreateInfo.type = vk::AccelerationStructureTypeKHR::eTopLevel;
 
-        auto accelerationStructureBuildSizesInfo = core->_device.getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice, accelerationStructureBuildGeometryInfo, primitive_count);
+    tlas = core->_device.createAccelerationStructureKHR(accelerationStructureCreateInfo);
+    tlasBuildInfo.dstAccelerationStructure = tlas;
+    if(dynamicInstances){
+        // refits and rebuilds at runtime share one scratch buffer that outlives the load
+        vk::DeviceSize tlasScratchSize = std::max(tlasSizes.buildScratchSize, tlasSizes.updateScratchSize);
+        tlasScratchBuffer = arena.allocate(tlasScratchSize, vkutils::MemoryCategory::eScratch);
+    }
 
-        tlasBuffer = vkutils::createBuffer(*core, accelerationStructureBuildSizesInfo.accelerationStructureSize, vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR, vma::MemoryUsage::eAutoPreferDevice, vma::AllocationCreateFlagBits::eDedicatedMemory);
+    vk::AccelerationStructureBuildRangeInfoKHR tlasBuildRangeInfo;
+    tlasBuildRangeInfo.primitiveCount = primitive_count;
+    tlasBuildRangeInfo.primitiveOffset = 0;
+    tlasBuildRangeInfo.firstVertex = 0;
+    tlasBuildRangeInfo.transformOffset = 0;
+    double setupTime = phaseTime();
 
-        vk::AccelerationStructureCreateInfoKHR accelerationStructureCreateInfo;
-        accelerationStructureCreateInfo.buffer = tlasBuffer._buffer;
-        accelerationStructureCreateInfo.size = accelerationStructureBuildSizesInfo.accelerationStructureSize;
-        accelerationStructureCreateInfo.type = vk::AccelerationStructureTypeKHR::eTopLevel;
+    ///scratch arena
+    // BLASes of one batch build concurrently and each needs its own scratch range, batches run one after another
+    // and reuse the arena, so it is sized for the largest batch. The TLAS builds last from the start of the arena.
+    std::vector<vk::DeviceSize> batchScratch{0};
+    for(auto& build : builds){
+        vk::DeviceSize offset = vkutils::scenecache::align(batchScratch.back(), scratchAlignment);
+        if(offset > 0 && offset + build.sizes.buildScratchSize > blasScratchBudget){
+            batchScratch.push_back(0);
+            offset = 0;
+        }
+        build.batch = static_cast<uint32_t>(batchScratch.size() - 1);
+        build.scratchOffset = offset;
+        batchScratch.back() = offset + build.sizes.buildScratchSize;
+    }
+    vk::DeviceSize arenaSize = std::max(*std::max_element(batchScratch.begin(), batchScratch.end()), tlasSizes.buildScratchSize);
+    // ranges are aligned to the scratch offset alignment, a build larger than the free space gets a block of its
+    // own that is freed again with the range
+    vkutils::BufferRange scratchBuffer = arena.allocate(arenaSize, vkutils::MemoryCategory::eScratch);
+    vk::DeviceAddress scratchAddress = scratchBuffer.address;
+    for(auto& build : builds){
+        build.buildInfo.scratchData.deviceAddress = scratchAddress + build.scratchOffset;
+    }
+    tlasBuildInfo.scratchData.deviceAddress = scratchAddress;
 
-        tlas = core->_device.createAccelerationStructureKHR(accelerationStructureCreateInfo);
+    ///record the builds, compaction splits them into two submits
+    std::vector<vk::AccelerationStructureKHR> compactable;
+    for(size_t b = 0; b < builds.size(); b++){
+        if(builds[b].buildInfo.flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction){
+            compactable.push_back(blas[b]);
+        }
+    }
+    bool compact = compactBlas && !compactable.empty();
+    vk::QueryPool timestamps = core->_device.createQueryPool(vk::QueryPoolCreateInfo({}, vk::QueryType::eTimestamp, 5));
+    vk::QueryPool compactedSizes = compact ? core->_device.createQueryPool(vk::QueryPoolCreateInfo({}, vk::QueryType::eAccelerationStructureCompactedSizeKHR, static_cast<uint32_t>(compactable.size()))) : vk::QueryPool();
+    vk::Fence fence = core->_device.createFence(vk::FenceCreateInfo());
+    vk::CommandBufferBeginInfo beginInfo{};
+    beginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+    vk::SubmitInfo submitInfo{};
+    auto submitAndWait = [&](vk::CommandBuffer cmd) {
+        cmd.end();
+        submitInfo.setCommandBuffers(cmd);
+        core->submit(core->_computeQueue, submitInfo, fence);
+        if(core->_device.waitForFences(fence, VK_TRUE, UINT64_MAX) != vk::Result::eSuccess){
+            std::cerr << "Waiting for the acceleration structure build failed" << std::endl;
+        }
+        core->_device.resetFences(fence);
+        core->_device.freeCommandBuffers(core->_computeCmdPool, cmd);
+    };
+    // scratch is reused by the next batch, the TLAS and compaction read the finished BLASes
+    vk::MemoryBarrier buildBarrier(vk::AccessFlagBits::eAccelerationStructureWriteKHR, vk::AccessFlagBits::eAccelerationStructureReadKHR | vk::AccessFlagBits::eAccelerationStructureWriteKHR);
+    vk::PipelineStageFlags asStages = vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR | vk::PipelineStageFlagBits::eAccelerationStructureCopyKHR;
+    // the BLAS builds read the uploaded geometry and transforms. They run on the compute queue, everything they
+    // touch is queueShared, so rendering reads the results without ownership transfers.
+    uploads->finish();
+    vk::CommandBuffer cmd = vkutils::getCommandBuffer(*core, vk::CommandBufferLevel::ePrimary, 1, core->_computeCmdPool);
+    cmd.begin(beginInfo);
+    cmd.resetQueryPool(timestamps, 0, 5);
+    cmd.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, timestamps, 0);
+    for(uint32_t batch = 0; batch < batchScratch.size() && !builds.empty(); batch++){
+        std::vector<vk::AccelerationStructureBuildGeometryInfoKHR> buildInfos;
+        std::vector<const vk::AccelerationStructureBuildRangeInfoKHR*> buildRangeInfos;
+        for(auto& build : builds){
+            if(build.batch == batch){
+                buildInfos.push_back(build.buildInfo);
+                buildRangeInfos.push_back(build.buildRangeInfos.data());
+            }
+        }
+        cmd.buildAccelerationStructuresKHR(buildInfos, buildRangeInfos);
+        cmd.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, asStages, {}, buildBarrier, {}, {});
+    }
+    cmd.writeTimestamp(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, timestamps, 1);
 
-        vkutils::AllocatedBuffer scratchBuffer = vkutils::createBuffer(*core, accelerationStructureBuildSizesInfo.buildScratchSize, vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eStorageBuffer, vma::MemoryUsage::eAutoPreferDevice, vma::AllocationCreateFlagBits::eDedicatedMemory);
-        vk::BufferDeviceAddressInfo scratchBufferAdressInfo(scratchBuffer._buffer);
-        vk::DeviceOrHostAddressConstKHR scratchBufferAddress;
-        scratchBufferAddress.deviceAddress = core->_device.getBufferAddress(scratchBufferAdressInfo);
+    ///compaction
+    vk::DeviceSize compactedBytes = 0;
+    std::vector<vk::AccelerationStructureKHR> built;
+    std::vector<vkutils::AllocatedBuffer> builtBuffers;
+    if(compact){
+        // the compacted sizes are only known once the builds finished, so compaction needs a second submit
+        cmd.resetQueryPool(compactedSizes, 0, static_cast<uint32_t>(compactable.size()));
+        cmd.writeAccelerationStructuresPropertiesKHR(compactable, vk::QueryType::eAccelerationStructureCompactedSizeKHR, compactedSizes, 0);
+        submitAndWait(cmd);
+        std::vector<vk::DeviceSize> sizes = core->_device.getQueryPoolResults<vk::DeviceSize>(compactedSizes, 0, static_cast<uint32_t>(compactable.size()), compactable.size() * sizeof(vk::DeviceSize), sizeof(vk::DeviceSize), vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait).value;
 
-        accelerationStructureBuildGeometryInfo.mode = vk::BuildAccelerationStructureModeKHR::eBuild;
-        accelerationStructureBuildGeometryInfo.dstAccelerationStructure = tlas;
-        accelerationStructureBuildGeometryInfo.scratchData.deviceAddress = scratchBufferAddress.deviceAddress;
+        cmd = vkutils::getCommandBuffer(*core, vk::CommandBufferLevel::ePrimary, 1, core->_computeCmdPool);
+        cmd.begin(beginInfo);
+        // the copies are timed from here, timestamp 1 is before the readback and the recording of this buffer
+        cmd.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, timestamps, 4);
+        builtBuffers.swap(blasBuffer);
+        built.swap(blas);
+        blasAddress.clear();
+        size_t query = 0;
+        for(size_t b = 0; b < built.size(); b++){
+            if(!(builds[b].buildInfo.flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction)){
+                // skinned BLASes stay as built, the loop below must not free them
+                blas.push_back(built[b]);
+                blasBuffer.push_back(builtBuffers[b]);
+                built[b] = vk::AccelerationStructureKHR();
+                vk::AccelerationStructureDeviceAddressInfoKHR accelerationDeviceAddressInfo;
+                accelerationDeviceAddressInfo.accelerationStructure = blas.back();
+                blasAddress.push_back(core->_device.getAccelerationStructureAddressKHR(accelerationDeviceAddressInfo));
+                compactedBytes += builds[b].sizes.accelerationStructureSize;
+                continue;
+            }
+            vk::DeviceSize size = sizes[query++];
+            blasBuffer.push_back(vkutils::createBuffer(*core, size, vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR, vma::MemoryUsage::eAutoPreferDevice, {}, true));
+            vk::AccelerationStructureCreateInfoKHR compactCreateInfo;
+            compactCreateInfo.type = vk::AccelerationStructureTypeKHR::eBottomLevel;
+            compactCreateInfo.buffer = blasBuffer.back()._buffer;
+            compactCreateInfo.size = size;
+            blas.push_back(core->_device.createAccelerationStructureKHR(compactCreateInfo));
+            cmd.copyAccelerationStructureKHR(vk::CopyAccelerationStructureInfoKHR(built[b], blas.back(), vk::CopyAccelerationStructureModeKHR::eCompact));
+            vk::AccelerationStructureDeviceAddressInfoKHR accelerationDeviceAddressInfo;
+            accelerationDeviceAddressInfo.accelerationStructure = blas.back();
+            blasAddress.push_back(core->_device.getAccelerationStructureAddressKHR(accelerationDeviceAddressInfo));
+            compactedBytes += size;
+        }
+        // the TLAS below reads the copies, the originals are freed once they completed
+        cmd.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureCopyKHR, vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, {}, buildBarrier, {}, {});
+    }
+    cmd.writeTimestamp(vk::PipelineStageFlagBits::eAllCommands, timestamps, 2);
 
-        vk::AccelerationStructureBuildRangeInfoKHR accelerationStructureBuildRangeInfo;
-        accelerationStructureBuildRangeInfo.primitiveCount = primitive_count;
-        accelerationStructureBuildRangeInfo.primitiveOffset = 0;
-        accelerationStructureBuildRangeInfo.firstVertex = 0;
-        accelerationStructureBuildRangeInfo.transformOffset = 0;
+    // the BLAS addresses are final now
+    for(size_t i = 0; i < instances.size(); i++){
+        instances[i].accelerationStructureReference = blasAddress[instanceBlas[i]];
+    }
+    vk::DeviceSize instancesBufferSize = instances.size() * sizeof(vk::AccelerationStructureInstanceKHR);
+    vkutils::BufferRange instancesBuffer = arena.allocate(instancesBufferSize, vkutils::MemoryCategory::eOther);
+    uploads->copy(instances.data(), instancesBufferSize, instancesBuffer.buffer, instancesBuffer.offset);
+    uploads->finish();
+    accelerationStructureGeometry.geometry.instances.data.deviceAddress = instancesBuffer.address;
+    tlasBuildInfo.setGeometries(accelerationStructureGeometry);
+    const vk::AccelerationStructureBuildRangeInfoKHR* pTlasBuildRangeInfo = &tlasBuildRangeInfo;
+    cmd.buildAccelerationStructuresKHR(1, &tlasBuildInfo, &pTlasBuildRangeInfo);
+    cmd.writeTimestamp(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, timestamps, 3);
+    double recordTime = phaseTime();
+    submitAndWait(cmd);
+    double buildTime = phaseTime();
 
-        std::vector<vk::AccelerationStructureBuildRangeInfoKHR*> accelerationBuildStructureRangeInfos = { &accelerationStructureBuildRangeInfo };
+    // timestamp 4 is only written by the compaction submit
+    uint32_t timestampCount = compact ? 5 : 4;
+    std::vector<uint64_t> gpuTimes = core->_device.getQueryPoolResults<uint64_t>(timestamps, 0, timestampCount, timestampCount * sizeof(uint64_t), sizeof(uint64_t), vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait).value;
+    core->_device.destroyQueryPool(timestamps);
+    if(compactedSizes){
+        core->_device.destroyQueryPool(compactedSizes);
+    }
+    core->_device.destroyFence(fence);
+    for(size_t b = 0; b < built.size(); b++){
+        if(built[b]){
+            core->_device.destroyAccelerationStructureKHR(built[b]);
+            vkutils::destroyBuffer(*core, builtBuffers[b]);
+        }
+    }
 
-        vk::CommandBufferAllocateInfo allocInfo{};
-        allocInfo.level = vk::CommandBufferLevel::ePrimary;
-        allocInfo.commandPool = core->_cmdPool;
-        allocInfo.commandBufferCount = 1;
+    vk::AccelerationStructureDeviceAddressInfoKHR accelerationDeviceAddressInfo;
+    accelerationDeviceAddressInfo.accelerationStructure = tlas;
+    tlasAddress = core->_device.getAccelerationStructureAddressKHR(accelerationDeviceAddressInfo);
 
-        vk::CommandBuffer cmd = core->_device.allocateCommandBuffers(allocInfo).front();
+    arena.free(scratchBuffer);
+    if(dynamicInstances){
+        tlasInstanceBuffer = instancesBuffer;
+        tlasInstances = instances;
+    } else {
+        arena.free(instancesBuffer);
+    }
+    arena.free(transformBuffer);
 
-        vk::CommandBufferBeginInfo beginInfo{};
-        beginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+    if(!blasCached){
+        std::cout << "Built " << blas.size() << " BLAS (" << meshBlasCount << " of instanced meshes) with " << blasTriangles << " triangles, " << blasBytes / (1024.0 * 1024.0) << " MB in " << batchScratch.size() << " batches" << std::endl;
+    }
+    if(compact){
+        std::cout << "BLAS compaction: " << blasBytes / (1024.0 * 1024.0) << " MB -> " << compactedBytes / (1024.0 * 1024.0) << " MB (" << (blasBytes > 0 ? 100.0 * (blasBytes - compactedBytes) / blasBytes : 0.0) << "% saved) in " << (gpuTimes[2] - gpuTimes[4]) * timestampPeriod / 1e9 << "s on the gpu" << std::endl;
+    }
+    std::cout << "TLAS with " << instances.size() << " instances of " << blas.size() << " BLAS, " << sceneTriangles << " triangles in the scene" << std::endl;
+    if(!skinnedBlas.empty()){
+        std::cout << skinnedBlas.size() << " skinned BLAS refit per frame from " << posedVertexCount << " posed vertices" << std::endl;
+    }
+    std::cout << "Acceleration structure build: setup " << setupTime << "s, record " << recordTime << "s, submit to fence " << buildTime << "s, gpu BLAS " << (gpuTimes[1] - gpuTimes[0]) * timestampPeriod / 1e9 << "s, gpu TLAS " << (gpuTimes[3] - gpuTimes[2]) * timestampPeriod / 1e9 << "s, scratch arena " << arenaSize / (1024.0 * 1024.0) << " MB" << std::endl;
+    std::cout << "Scene arena: " << arena.rangeCount() << " ranges, " << arena.usedBytes() / (1024.0 * 1024.0) << " MB in " << arena.blockCount() << " blocks of " << arena.blockBytes() / (1024.0 * 1024.0) << " MB" << std::endl;
+    std::cout << "Scene upload: " << uploads->uploadedBytes / (1024.0 * 1024.0) << " MB in " << uploads->submitCount << " submissions through a " << uploads->ringSize / (1024.0 * 1024.0) << " MB staging ring, " << uploads->megabytesPerSecond() << " MB/s" << std::endl;
+    uploads.reset();
+    if(!blasCached && !blasCacheFile.empty()){
+        writeBlasCache(blasCacheFile, key);
+    }
+}
 
-        cmd.begin(beginInfo);
-            cmd.buildAccelerationStructuresKHR(1, &accelerationStructureBuildGeometryInfo, accelerationBuildStructureRangeInfos.data());
-        cmd.end();
+void Scene::computeBounds()
+{
+    // the positions are in node space, every node matrix places its primitives in model space
+    const float maxFloat = std::numeric_limits<float>::max();
+    modelBounds.assign(models.size(), Bounds{glm::vec3(maxFloat), glm::vec3(-maxFloat)});
+    if(vertexStagingBuffers.empty()){
+        return;
+    }
+    uint32_t positionStride = vertexLayout.strides[0];
+    const unsigned char* positions = static_cast<const unsigned char*>(core->_allocator.mapMemory(vertexStagingBuffers[0]._allocation));
+    uint32_t vertexOffset = 0;
+    for(size_t m = 0; m < models.size(); m++){
+        Bounds& bounds = modelBounds[m];
+        // the nodes of an instanced mesh share their vertex ranges
+        std::unordered_map<uint32_t, Bounds> primitiveBounds;
+        for(auto node : models[m]->_linearNodes){
+            glm::mat4 matrix = node->getMatrix();
+            for(auto primitive : node->primitives){
+                if(primitive->vertexCount == 0){
+                    continue;
+                }
+                auto found = primitiveBounds.find(primitive->firstVertex);
+                if(found == primitiveBounds.end()){
+                    Bounds local{glm::vec3(maxFloat), glm::vec3(-maxFloat)};
+                    for(uint32_t v = 0; v < primitive->vertexCount; v++){
+                        const glm::vec3& position = *reinterpret_cast<const glm::vec3*>(positions + static_cast<size_t>(vertexOffset + primitive->firstVertex + v) * positionStride);
+                        local.min = glm::min(local.min, position);
+                        local.max = glm::max(local.max, position);
+                    }
+                    found = primitiveBounds.emplace(primitive->firstVertex, local).first;
+                }
+                for(uint32_t corner = 0; corner < 8; corner++){
+                    const Bounds& local = found->second;
+                    glm::vec3 point(corner & 1 ? local.max.x : local.min.x, corner & 2 ? local.max.y : local.min.y, corner & 4 ? local.max.z : local.min.z);
+                    glm::vec3 transformed(matrix * glm::vec4(point, 1.0f));
+                    bounds.min = glm::min(bounds.min, transformed);
+                    bounds.max = glm::max(bounds.max, transformed);
+                }
+            }
+        }
+        vertexOffset += models[m]->_vertexCount;
+    }
+    core->_allocator.unmapMemory(vertexStagingBuffers[0]._allocation);
+}
 
-        vk::SubmitInfo submitInfo{};
-        submitInfo.setCommandBuffers(cmd);
-        core->_graphicsQueue.submit(submitInfo);
-        core->_graphicsQueue.waitIdle();
-        core->_device.freeCommandBuffers(core->_cmdPool, cmd);
+Scene::Bounds Scene::instanceBounds(uint32_t instance) const
+{
+    const Bounds& local = modelBounds[instanceModels[instance]];
+    const glm::mat4& matrix = modelMatrices[instance];
+    const float maxFloat = std::numeric_limits<float>::max();
+    Bounds bounds{glm::vec3(maxFloat), glm::vec3(-maxFloat)};
+    for(uint32_t corner = 0; corner < 8; corner++){
+        glm::vec3 point(corner & 1 ? local.max.x : local.min.x, corner & 2 ? local.max.y : local.min.y, corner & 4 ? local.max.z : local.min.z);
+        glm::vec3 transformed(matrix * glm::vec4(point, 1.0f));
+        bounds.min = glm::min(bounds.min, transformed);
+        bounds.max = glm::max(bounds.max, transformed);
+    }
+    return bounds;
+}
 
-        vk::AccelerationStructureDeviceAddressInfoKHR accelerationDeviceAddressInfo;
-        accelerationDeviceAddressInfo.accelerationStructure = tlas;
+void Scene::setInstanceTransform(uint32_t instance, const glm::mat4& transform)
+{
+    modelMatrices[instance] = transform;
+    tlasTransforms[instance] = vkutils::getTransformMatrixKHR(transform);
+    // before buildAccelerationStructure the build picks the transform up
+    if(!dynamicInstances || instance + 1 >= instanceFirstTlas.size()){
+        return;
+    }
+    uint32_t first = instanceFirstTlas[instance];
+    uint32_t end = instanceFirstTlas[instance + 1];
+    for(uint32_t t = first; t < end; t++){
+        tlasInstances[t].transform = vkutils::getTransformMatrixKHR(transform * tlasLocalMatrices[t]);
+    }
+    tlasDirtyFirst = std::min(tlasDirtyFirst, first);
+    tlasDirtyEnd = std::max(tlasDirtyEnd, end);
+    tlasMovedSinceBuild += end - first;
+}
 
-        tlasAddress = core->_device.getAccelerationStructureAddressKHR(accelerationDeviceAddressInfo);
+bool Scene::updateTopLevel(vk::CommandBuffer cmd, uint32_t frame, uint32_t framesInFlight)
+{
+    if(!dynamicInstances || tlasDirtyFirst >= tlasDirtyEnd){
+        return false;
+    }
+    vk::DeviceSize instanceSize = sizeof(vk::AccelerationStructureInstanceKHR);
+    vk::DeviceSize instancesSize = tlasInstances.size() * instanceSize;
+    if(!tlasStagingBuffer._buffer){
+        tlasStagingBuffer = vkutils::createBuffer(*core, instancesSize * framesInFlight, vk::BufferUsageFlagBits::eTransferSrc, vma::MemoryUsage::eAuto, vma::AllocationCreateFlagBits::eHostAccessSequentialWrite);
+    }
+    // this frame's range was last read by the copy of the frame that used the same frame resources
+    vk::DeviceSize stagingOffset = (frame % framesInFlight) * instancesSize + tlasDirtyFirst * instanceSize;
+    vk::DeviceSize size = (tlasDirtyEnd - tlasDirtyFirst) * instanceSize;
+    unsigned char* mapped = static_cast<unsigned char*>(core->_allocator.mapMemory(tlasStagingBuffer._allocation));
+        memcpy(mapped + stagingOffset, tlasInstances.data() + tlasDirtyFirst, size);
+    core->_allocator.unmapMemory(tlasStagingBuffer._allocation);
+    core->_allocator.flushAllocation(tlasStagingBuffer._allocation, stagingOffset, size);
 
-        core->_allocator.destroyBuffer(scratchBuffer._buffer, scratchBuffer._allocation);
-        core->_allocator.destroyBuffer(instancesBuffer._buffer, instancesBuffer._allocation);
+    // the frames in flight may still trace against the TLAS and the last update may still use the instances and scratch
+    vk::MemoryBarrier reuseBarrier(vk::AccessFlagBits::eAccelerationStructureWriteKHR, vk::AccessFlagBits::eTransferWrite | vk::AccessFlagBits::eAccelerationStructureWriteKHR);
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eRayTracingShaderKHR | vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::PipelineStageFlagBits::eTransfer | vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, {}, reuseBarrier, {}, {});
+    cmd.copyBuffer(tlasStagingBuffer._buffer, tlasInstanceBuffer.buffer, vk::BufferCopy(stagingOffset, tlasInstanceBuffer.offset + tlasDirtyFirst * instanceSize, size));
+    vk::MemoryBarrier copyBarrier(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eAccelerationStructureReadKHR);
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, {}, copyBarrier, {}, {});
+
+    // a refit keeps the old hierarchy and only grows its boxes, enough of them make a rebuild cheaper to trace
+    bool refit = tlasMovedSinceBuild < static_cast<uint64_t>(tlasMaxRefits) * tlasInstances.size();
+    vk::AccelerationStructureGeometryKHR geometry;
+    geometry.geometryType = vk::GeometryTypeKHR::eInstances;
+    geometry.geometry.instances = vk::AccelerationStructureGeometryInstancesDataKHR(VK_FALSE, tlasInstanceBuffer.address);
+    vk::AccelerationStructureBuildGeometryInfoKHR buildInfo;
+    buildInfo.type = vk::AccelerationStructureTypeKHR::eTopLevel;
+    buildInfo.flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace | vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate;
+    buildInfo.mode = refit ? vk::BuildAccelerationStructureModeKHR::eUpdate : vk::BuildAccelerationStructureModeKHR::eBuild;
+    buildInfo.srcAccelerationStructure = refit ? tlas : vk::AccelerationStructureKHR();
+    buildInfo.dstAccelerationStructure = tlas;
+    buildInfo.scratchData.deviceAddress = tlasScratchBuffer.address;
+    buildInfo.setGeometries(geometry);
+    vk::AccelerationStructureBuildRangeInfoKHR buildRangeInfo(static_cast<uint32_t>(tlasInstances.size()), 0, 0, 0);
+    const vk::AccelerationStructureBuildRangeInfoKHR* pBuildRangeInfo = &buildRangeInfo;
+    cmd.buildAccelerationStructuresKHR(1, &buildInfo, &pBuildRangeInfo);
+    vk::MemoryBarrier buildBarrier(vk::AccessFlagBits::eAccelerationStructureWriteKHR, vk::AccessFlagBits::eAccelerationStructureReadKHR);
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::PipelineStageFlagBits::eRayTracingShaderKHR, {}, buildBarrier, {}, {});
+
+    if(refit){
+        tlasRefits++;
+    } else {
+        tlasRebuilds++;
+        tlasMovedSinceBuild = 0;
+    }
+    tlasDirtyFirst = UINT32_MAX;
+    tlasDirtyEnd = 0;
+    return true;
+}
+
+uint32_t Scene::posedVertex(uint32_t instance, const Primitive* primitive) const
+{
+    return instancePosedVertices[instance] + posedOffsets.at(primitive);
+}
+
+void Scene::refitSkinnedBlas(vk::CommandBuffer cmd)
+{
+    if(skinnedBlas.empty()){
+        return;
+    }
+    // the skinning pass wrote the vertices, earlier frames may still trace the BLASes or refit them with the same scratch
+    vk::MemoryBarrier inputBarrier(vk::AccessFlagBits::eShaderWrite | vk::AccessFlagBits::eAccelerationStructureWriteKHR, vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eAccelerationStructureWriteKHR);
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader | vk::PipelineStageFlagBits::eRayTracingShaderKHR | vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, {}, inputBarrier, {}, {});
+    std::vector<vk::AccelerationStructureBuildGeometryInfoKHR> buildInfos;
+    std::vector<const vk::AccelerationStructureBuildRangeInfoKHR*> buildRangeInfos;
+    for(const SkinnedBlas& skinned : skinnedBlas){
+        vk::AccelerationStructureBuildGeometryInfoKHR buildInfo;
+        buildInfo.type = vk::AccelerationStructureTypeKHR::eBottomLevel;
+        buildInfo.flags = skinned.flags;
+        buildInfo.mode = vk::BuildAccelerationStructureModeKHR::eUpdate;
+        buildInfo.srcAccelerationStructure = blas[skinned.blas];
+        buildInfo.dstAccelerationStructure = blas[skinned.blas];
+        buildInfo.scratchData.deviceAddress = skinnedScratchBuffer.address + skinned.scratchOffset;
+        buildInfo.setGeometries(skinned.geometries);
+        buildInfos.push_back(buildInfo);
+        buildRangeInfos.push_back(skinned.buildRangeInfos.data());
+    }
+    cmd.buildAccelerationStructuresKHR(buildInfos, buildRangeInfos);
+    vk::MemoryBarrier buildBarrier(vk::AccessFlagBits::eAccelerationStructureWriteKHR, vk::AccessFlagBits::eAccelerationStructureReadKHR);
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR | vk::PipelineStageFlagBits::eRayTracingShaderKHR, {}, buildBarrier, {}, {});
+    for(const SkinnedBlas& skinned : skinnedBlas){
+        setInstanceTransform(skinned.instance, modelMatrices[skinned.instance]);
     }
 }
 
 void Scene::build()
 {
-    for(auto& model : models){
-        model->build();
+    auto start = std::chrono::high_resolution_clock::now();
+    // textures, geometry and the scene buffers all stage through it until buildAccelerationStructure is done
+    uploads = std::make_unique<vkutils::UploadContext>(*core, uploadRingSize);
+    uint64_t key = cacheDirectory.empty() ? 0 : cacheKey();
+    std::string cacheFile = key != 0 ? cachePath(key) : std::string();
+    if (!cacheFile.empty() && readCache(cacheFile, key)) {
+        _isBuilded = true;
+        return;
+    }
+    for(size_t i = 0; i < models.size(); i++){
+        if(!models[i]){
+            models[i] = loadModel(_sources[i].path);
+        }
+        models[i]->_instanceMeshes = _sources[i].instanceMeshes;
+        models[i]->_instanceMinTriangles = _sources[i].instanceMinTriangles;
+    }
 
-        vertices.insert(std::end(vertices), std::begin(model->_vertices), std::end(model->_vertices));
-        indices.insert(std::end(indices), std::begin(model->_indices), std::end(model->_indices));
+    for(auto& model : models){
+        model->_optimizeGeometry = optimizeMeshes;
+        model->_mipMode = mipMode;
+        model->_streamTextures = streamTextures;
+        model->_keepTextureChains = !cacheFile.empty();
+        model->build(*uploads);
+        vertexCount += model->_vertexCount;
+        indexCount += model->_indexCount;
+        indexBytes += model->_indexBytes;
         textures.insert(std::end(textures), std::begin(model->_textures), std::end(model->_textures));
+    }
+    collectSkinnedPrimitives();
+    if(benchmarkLoad){
+        Model::benchmarkTransforms(100000);
+    }
+
+    bool hasColors = false;
+    bool hasSkin = false;
+    for(auto& model : models){
+        hasColors |= model->_hasColors;
+        hasSkin |= model->_hasSkin;
+    }
+    vertexLayout = vkutils::VertexLayout::create(vertexFormat, hasColors, hasSkin, splitVertexStreams);
+    uint32_t standardBytes = vkutils::VertexLayout::standard().bytesPerVertex();
+    std::cout << "Vertex layout " << vertexLayout.name() << ": " << vertexLayout.bytesPerVertex() << " bytes per vertex in " << vertexLayout.streamCount() << " streams (standard " << standardBytes << "), "
+        << static_cast<double>(vertexCount) * vertexLayout.bytesPerVertex() / (1024 * 1024) << " MB instead of " << static_cast<double>(vertexCount) * standardBytes / (1024 * 1024) << " MB" << std::endl;
+    std::cout << "Index buffer: " << static_cast<double>(indexBytes) / (1024 * 1024) << " MB instead of " << static_cast<double>(indexCount) * sizeof(uint32_t) / (1024 * 1024) << " MB with 32 bit indices" << std::endl;
+
+    // every model writes its accessors directly into its range of the staging buffers
+    std::vector<unsigned char*> vertexStreams;
+    for(uint32_t stream = 0; stream < vertexLayout.streamCount(); stream++){
+        vertexStagingBuffers.push_back(vkutils::createBuffer(*core, static_cast<vk::DeviceSize>(vertexCount) * vertexLayout.strides[stream], vk::BufferUsageFlagBits::eTransferSrc, vma::MemoryUsage::eAuto, vma::AllocationCreateFlagBits::eHostAccessRandom));
+        vertexStreams.push_back(static_cast<unsigned char*>(core->_allocator.mapMemory(vertexStagingBuffers.back()._allocation)));
+    }
+    indexStagingBuffer = vkutils::createBuffer(*core, indexBytes, vk::BufferUsageFlagBits::eTransferSrc, vma::MemoryUsage::eAuto, vma::AllocationCreateFlagBits::eHostAccessRandom);
+    unsigned char* indices = static_cast<unsigned char*>(core->_allocator.mapMemory(indexStagingBuffer._allocation));
+    writeGeometry(vertexStreams, indices);
+    // position is the first attribute of stream 0 in every layout
+    uint32_t positionStride = vertexLayout.strides[0];
+    uint32_t vertexOffset = 0;
+    uint32_t indexByteOffset = 0;
+    for(auto& model : models){
+        const unsigned char* modelPositions = vertexStreams[0] + static_cast<size_t>(vertexOffset) * positionStride;
+        const unsigned char* modelIndices = indices + indexByteOffset;
+        model->releaseSourceData();
+        vertexOffset += model->_vertexCount;
+        indexByteOffset += model->_indexBytes;
+        std::cout << "Loaded " << model->_filename << " with " << model->_vertexCount << " vertices, peak RSS: " << vkutils::peakResidentSetSize() / (1024 * 1024) << " MB" << std::endl;
         //process emissive geometry
         vkutils::LightProxy emptyLight;
         emptyLight.geoType = vkutils::LightProxy::EMPTY;
@@ -317,19 +804,19 @@ void Scene::build()
                     int32_t textureHeight = 0;
                     int32_t textureComponents = 0;
                     uint32_t indexCount = primitive->indexCount;
-                    std::vector<uint32_t>::iterator start = model->_indices.begin();
-                    std::advance(start, primitive->firstIndex);
-                    std::vector<uint32_t>::iterator end = model->_indices.begin();
-                    std::advance(end, primitive->firstIndex + primitive->indexCount);
-                    std::vector<uint32_t> primitiveIndexBuffer(start, end);
+                    std::vector<uint32_t> primitiveIndexBuffer(primitive->indexCount);
+                    const unsigned char* start = modelIndices + primitive->indexByteOffset;
+                    for (uint32_t i = 0; i < primitive->indexCount; i++) {
+                        primitiveIndexBuffer[i] = primitive->firstVertex + (primitive->indexType == vk::IndexType::eUint16 ? reinterpret_cast<const uint16_t*>(start)[i] : reinterpret_cast<const uint32_t*>(start)[i]);
+                    }
                     std::sort(primitiveIndexBuffer.begin(), primitiveIndexBuffer.end());
                     primitiveIndexBuffer.erase(std::unique(primitiveIndexBuffer.begin(), primitiveIndexBuffer.end()), primitiveIndexBuffer.end());
                     
                     glm::vec3 min = glm::vec3(1000000);
                     glm::vec3 max = glm::vec3(-1000000);
                     for (const auto index : primitiveIndexBuffer) {
-                        Vertex currentVertex = model->_vertices[index];
-                        glm::vec4 pos = modelMatrix * glm::vec4(currentVertex.pos, 1.0f);
+                        const glm::vec3& position = *reinterpret_cast<const glm::vec3*>(modelPositions + static_cast<size_t>(index) * positionStride);
+                        glm::vec4 pos = modelMatrix * glm::vec4(position, 1.0f);
                         min.x = pos.x < min.x ? pos.x : min.x;
                         min.y = pos.y < min.y ? pos.y : min.y;
                         min.z = pos.z < min.z ? pos.z : min.z;
@@ -340,8 +827,8 @@ void Scene::build()
                     glm::vec3 center((max + min) / 2.0f);
                     float radius = 0.0f;
                     for (const auto index : primitiveIndexBuffer) {
-                        Vertex currentVertex = model->_vertices[index];
-                        glm::vec4 pos = modelMatrix * glm::vec4(currentVertex.pos, 1.0f);
+                        const glm::vec3& position = *reinterpret_cast<const glm::vec3*>(modelPositions + static_cast<size_t>(index) * positionStride);
+                        glm::vec4 pos = modelMatrix * glm::vec4(position, 1.0f);
                         float distance_to_center = glm::distance(glm::vec3(pos), center);
                         if(distance_to_center > radius)
                             radius = distance_to_center;
@@ -380,8 +867,229 @@ void Scene::build()
         }
         lights[0].radiosity = static_cast<float>(lights.size());
     }
+    buildMaterials();
+    if(!cacheFile.empty()){
+        auto coldTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+        // the cache has no skins and animations, a skinned scene loads from the glTF files every time
+        if(skinnedPrimitives.empty()){
+            writeCache(cacheFile, key, vertexStreams, indices, static_cast<uint64_t>(coldTime));
+        }
+        for(auto& model : models){
+            model->_keepTextureChains = false;
+            if(!model->_streamTextures){
+                std::vector<TextureChain>().swap(model->_textureChains);
+            }
+        }
+    }
+    // random access staging is likely cached and not host coherent
+    for(auto& stagingBuffer : vertexStagingBuffers){
+        core->_allocator.flushAllocation(stagingBuffer._allocation, 0, VK_WHOLE_SIZE);
+        core->_allocator.unmapMemory(stagingBuffer._allocation);
+    }
+    core->_allocator.flushAllocation(indexStagingBuffer._allocation, 0, VK_WHOLE_SIZE);
+    core->_allocator.unmapMemory(indexStagingBuffer._allocation);
     _isBuilded = true;
-    std::cout << "Scene loaded with " << indices.size() / 3 << " Triangles and " << vertices.size() << " Vertices" << std::endl;
+    std::cout << "Scene loaded with " << indexCount / 3 << " Triangles and " << vertexCount << " Vertices in " << models.size() << " models, " << instanceModels.size() << " instances" << std::endl;
+}
+
+void Scene::collectSkinnedPrimitives()
+{
+    skinnedPrimitives.clear();
+    posedOffsets.clear();
+    std::vector<uint32_t> modelPosedVertices(models.size(), 0);
+    uint32_t vertexOffset = 0;
+    for(uint32_t m = 0; m < models.size(); m++){
+        for(auto node : models[m]->_linearNodes){
+            if(node->skin < 0){
+                continue;
+            }
+            for(auto primitive : node->primitives){
+                if(primitive->indexCount == 0){
+                    continue;
+                }
+                skinnedPrimitives.push_back({m, node, primitive, vertexOffset + primitive->firstVertex, modelPosedVertices[m]});
+                posedOffsets[primitive] = modelPosedVertices[m];
+                modelPosedVertices[m] += primitive->vertexCount;
+            }
+        }
+        vertexOffset += models[m]->_vertexCount;
+    }
+    // the posed ranges follow the rest pose of all models, one per instance of a skinned model
+    instancePosedVertices.assign(instanceModels.size(), UINT32_MAX);
+    posedVertexCount = 0;
+    for(uint32_t i = 0; i < instanceModels.size(); i++){
+        if(modelPosedVertices[instanceModels[i]] > 0){
+            instancePosedVertices[i] = vertexCount + posedVertexCount;
+            posedVertexCount += modelPosedVertices[instanceModels[i]];
+        }
+    }
+}
+
+void Scene::collectBlasSources()
+{
+    // per model its baked nodes first, then its instanced meshes and the skinned nodes of every instance,
+    // materials follow the same order
+    blasSources.clear();
+    uint32_t materialCount = 0;
+    auto addSource = [&](BlasSource source) {
+        uint32_t geometryCount = 0;
+        forEachGeometry(source, [&](Node*, Primitive* primitive) {
+            geometryCount++;
+            source.triangles += primitive->indexCount / 3;
+        });
+        if(geometryCount > 0){
+            blasSources.push_back(source);
+            materialCount += geometryCount;
+        }
+    };
+    for(uint32_t m = 0; m < models.size(); m++){
+        for(int32_t mesh = -1; mesh < static_cast<int32_t>(models[m]->_instancedMeshes.size()); mesh++){
+            addSource(BlasSource{m, mesh, materialCount, 0, -1});
+        }
+        for(uint32_t i = 0; i < instanceModels.size() && models[m]->skinned(); i++){
+            if(instanceModels[i] == m){
+                addSource(BlasSource{m, -1, materialCount, 0, static_cast<int32_t>(i)});
+            }
+        }
+    }
+}
+
+void Scene::forEachGeometry(const BlasSource& source, const std::function<void(Node*, Primitive*)>& function)
+{
+    // the loader drops the indices of primitives without vertices, so every geometry here has maxVertex >= 0
+    Model* model = models[source.model];
+    if(source.mesh >= 0){
+        Node* node = model->_instancedMeshes[source.mesh].node;
+        for (auto primitive : node->primitives) {
+            if (primitive->indexCount > 0) {
+                function(node, primitive);
+            }
+        }
+        return;
+    }
+    // the baked source leaves the skinned nodes to the sources of the instances
+    for (auto node : model->_linearNodes) {
+        if (node->mesh >= 0 || (node->skin >= 0) != (source.instance >= 0)) {
+            continue;
+        }
+        for (auto primitive : node->primitives) {
+            if (primitive->indexCount > 0) {
+                function(node, primitive);
+            }
+        }
+    }
+}
+
+void Scene::buildMaterials()
+{
+    // one material per BLAS geometry, in the order buildAccelerationStructure adds them, so the instance's
+    // custom index plus the geometry index finds it
+    collectBlasSources();
+    std::vector<uint32_t> modelIndexByteOffsets;
+    std::vector<uint32_t> modelVertexOffsets;
+    std::vector<uint32_t> modelTextureOffsets;
+    uint32_t indexByteOffset = 0;
+    uint32_t vertexOffset = 0;
+    uint32_t textureOffset = 0;
+    for(auto& model : models){
+        modelIndexByteOffsets.push_back(indexByteOffset);
+        modelVertexOffsets.push_back(vertexOffset);
+        modelTextureOffsets.push_back(textureOffset);
+        indexByteOffset += model->_indexBytes;
+        vertexOffset += model->_vertexCount;
+        textureOffset += (uint32_t) model->_textures.size();
+    }
+    for(auto& source : blasSources){
+        forEachGeometry(source, [&](Node* node, Primitive* primitive) {
+            vkutils::Material material{};
+            // ranges are 4 byte aligned, so the shaders address them in words of the index buffer
+            material.indexOffset = (modelIndexByteOffsets[source.model] + primitive->indexByteOffset) / 4;
+            material.vertexOffset = source.instance < 0 ? modelVertexOffsets[source.model] + primitive->firstVertex : posedVertex(source.instance, primitive);
+            material.indexType = static_cast<uint32_t>(primitive->indexType);
+            material.baseColorTexture = primitive->material.baseColorTexture > -1 ? modelTextureOffsets[source.model] + primitive->material.baseColorTexture : -1;
+            material.diffuseTexture = primitive->material.diffuseTexture > -1 ? modelTextureOffsets[source.model] + primitive->material.diffuseTexture : -1;
+            material.emissiveTexture = primitive->material.emissiveTexture > -1 ? modelTextureOffsets[source.model] + primitive->material.emissiveTexture : -1;
+            material.metallicRoughnessTexture = primitive->material.metallicRoughnessTexture > -1 ? modelTextureOffsets[source.model] + primitive->material.metallicRoughnessTexture : -1;
+            material.normalTexture = primitive->material.normalTexture > -1 ? modelTextureOffsets[source.model] + primitive->material.normalTexture : -1;
+            material.normalTwoChannel = primitive->material.normalTwoChannel ? 1 : 0;
+            material.occlusionTexture = primitive->material.occlusionTexture > -1 ? modelTextureOffsets[source.model] + primitive->material.occlusionTexture : -1;
+            material.metallicFactor = primitive->material.metallicFactor;
+            material.roughnessFactor = primitive->material.roughnessFactor;
+            material.alphaMode = primitive->material.alphaMode;
+            material.alphaCutoff = primitive->material.alphaCutoff;
+            material.baseColorFactor[0] = primitive->material.baseColorFactor.x;
+            material.baseColorFactor[1] = primitive->material.baseColorFactor.y;
+            material.baseColorFactor[2] = primitive->material.baseColorFactor.z;
+            material.baseColorFactor[3] = primitive->material.baseColorFactor.w;
+            material.emissiveFactor[0] = primitive->material.emissiveFactor.x;
+            material.emissiveFactor[1] = primitive->material.emissiveFactor.y;
+            material.emissiveFactor[2] = primitive->material.emissiveFactor.z;
+            material.emissiveFactor[3] = primitive->material.emissiveFactor.w;
+            material.emissiveStrength = primitive->material.emissiveStrength;
+            material.transmissionFactor = primitive->material.transmissionFactor;
+            material.ior = primitive->material.ior;
+            material.modelMatrix = source.mesh < 0 && source.instance < 0 ? node->getMatrix() : glm::mat4(1.0f);
+            materials.push_back(material);
+        });
+    }
+}
+
+void Scene::writeGeometry(const std::vector<unsigned char*>& vertexStreams, unsigned char* indices)
+{
+    // flatten the primitives of all models into one job list so small models don't serialize the load
+    struct Job {
+        size_t model;
+        size_t primitive;
+    };
+    std::vector<Job> jobs;
+    std::vector<std::vector<unsigned char*>> modelStreams;
+    std::vector<unsigned char*> modelIndices;
+    uint32_t vertexOffset = 0;
+    uint32_t indexByteOffset = 0;
+    for(size_t m = 0; m < models.size(); m++){
+        for(size_t i = 0; i < models[m]->primitiveCount(); i++){
+            jobs.push_back({m, i});
+        }
+        std::vector<unsigned char*> streams;
+        for(uint32_t stream = 0; stream < vertexLayout.streamCount(); stream++){
+            streams.push_back(vertexStreams[stream] + static_cast<size_t>(vertexOffset) * vertexLayout.strides[stream]);
+        }
+        modelStreams.push_back(streams);
+        modelIndices.push_back(indices + indexByteOffset);
+        vertexOffset += models[m]->_vertexCount;
+        indexByteOffset += models[m]->_indexBytes;
+    }
+    vkutils::ThreadPool& pool = vkutils::ThreadPool::shared();
+    auto start = std::chrono::high_resolution_clock::now();
+    pool.parallelFor(jobs.size(), [&](size_t i) {
+        const Job& job = jobs[i];
+        models[job.model]->writePrimitive(job.primitive, vertexLayout, modelStreams[job.model], modelIndices[job.model]);
+    });
+    auto parallelTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+    std::cout << "Wrote " << jobs.size() << " primitives on " << pool.size() << " threads in " << parallelTime / 1e6 << "s" << std::endl;
+
+    if(benchmarkLoad){
+        // redo the fill on this thread alone and make sure both paths produce the same bytes
+        std::vector<std::vector<unsigned char>> referenceStreams;
+        for(uint32_t stream = 0; stream < vertexLayout.streamCount(); stream++){
+            referenceStreams.emplace_back(static_cast<size_t>(vertexCount) * vertexLayout.strides[stream]);
+        }
+        std::vector<unsigned char> referenceIndices(indexBytes);
+        start = std::chrono::high_resolution_clock::now();
+        for(auto& job : jobs){
+            std::vector<unsigned char*> streams;
+            for(uint32_t stream = 0; stream < vertexLayout.streamCount(); stream++){
+                streams.push_back(referenceStreams[stream].data() + (modelStreams[job.model][stream] - vertexStreams[stream]));
+            }
+            models[job.model]->writePrimitive(job.primitive, vertexLayout, streams, referenceIndices.data() + (modelIndices[job.model] - indices));
+        }
+        auto serialTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+        bool identical = std::memcmp(referenceIndices.data(), indices, indexBytes) == 0;
+        for(uint32_t stream = 0; stream < vertexLayout.streamCount(); stream++){
+            identical &= std::memcmp(referenceStreams[stream].data(), vertexStreams[stream], referenceStreams[stream].size()) == 0;
+        }
+        std::cout << "Geometry load benchmark: single threaded " << serialTime / 1e6 << "s, parallel " << parallelTime / 1e6 << "s, speedup " << (parallelTime > 0 ? static_cast<double>(serialTime) / parallelTime : 0.0) << "x, output " << (identical ? "identical" : "MISMATCH") << std::endl;
+    }
 }
 
 void Scene::destroy()
@@ -391,21 +1099,32 @@ void Scene::destroy()
             model->destroy();
             delete model;
         }
-        core->_allocator.destroyBuffer(indexBuffer._buffer, indexBuffer._allocation);
-        core->_allocator.destroyBuffer(vertexBuffer._buffer, vertexBuffer._allocation);
-        core->_allocator.destroyBuffer(materialBuffer._buffer, materialBuffer._allocation);
-        core->_allocator.destroyBuffer(lightBuffer._buffer, lightBuffer._allocation);
+        arena.free(indexBuffer);
+        for(auto& buffer : vertexBuffers){
+            arena.free(buffer);
+        }
+        arena.free(materialBuffer);
+        arena.free(lightBuffer);
         core->_device.destroyImageView(textures.back().image._view);
-        core->_allocator.destroyImage(textures.back().image._image, textures.back().image._allocation);
+        vkutils::destroyImage(*core, textures.back().image);
         core->_device.destroySampler(sampler);
         for(auto buffer : blasBuffer){
-            core->_allocator.destroyBuffer(buffer._buffer, buffer._allocation);
+            vkutils::destroyBuffer(*core, buffer);
         }
-        core->_allocator.destroyBuffer(tlasBuffer._buffer, tlasBuffer._allocation);
+        vkutils::destroyBuffer(*core, tlasBuffer);
         for(auto as : blas){
             core->_device.destroyAccelerationStructureKHR(as);
         }
         core->_device.destroyAccelerationStructureKHR(tlas);
+        if(dynamicInstances){
+            arena.free(tlasInstanceBuffer);
+            arena.free(tlasScratchBuffer);
+            if(tlasStagingBuffer._buffer){
+                vkutils::destroyBuffer(*core, tlasStagingBuffer);
+            }
+        }
+        arena.free(skinnedScratchBuffer);
+        arena.destroy();
     } else {
         for(auto& model : models){
             delete model;
@@ -441,7 +1160,7 @@ void Scene::createEmptyTexture()
     imageCreateInfo.initialLayout = vk::ImageLayout::eUndefined;
     imageCreateInfo.extent = vk::Extent3D{ 1, 1, 1 };
     imageCreateInfo.usage = vk::ImageUsageFlagBits::eSampled;
-    emptyTexture.image = vkutils::imageFromData(*core, buffer, imageCreateInfo, vk::ImageAspectFlagBits::eColor, vma::MemoryUsage::eAutoPreferDevice);
+    emptyTexture.image = uploads->image(buffer, 4, imageCreateInfo, vk::ImageAspectFlagBits::eColor, vma::MemoryUsage::eAutoPreferDevice);
     emptyTexture.index = static_cast<uint32_t>(textures.size());
     vk::DescriptorImageInfo imageInfo;
     imageInfo.imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
@@ -2,33 +2,146 @@
 
 #include <Core.h>
 #include <vk_model.h>
+#include <unordered_map>
+#include <memory>
 
 class Scene {
 public:
     vk::AccelerationStructureKHR tlas;
-    vkutils::AllocatedBuffer vertexBuffer;
-    vkutils::AllocatedBuffer indexBuffer;
-    vkutils::AllocatedBuffer materialBuffer;
-    vkutils::AllocatedBuffer lightBuffer;
-    std::vector<Vertex> vertices{};
-    std::vector<uint32_t> indices{};
+    // one range per stream of vertexLayout, all of them sub-allocated from the scene's arena
+    std::vector<vkutils::BufferRange> vertexBuffers{};
+    vkutils::BufferRange indexBuffer;
+    vkutils::BufferRange materialBuffer;
+    vkutils::BufferRange lightBuffer;
+    uint32_t vertexCount{0};
+    uint32_t indexCount{0};
+    // size of the index buffer, primitives with few enough vertices use 16 bit indices
+    uint32_t indexBytes{0};
     std::vector<vkutils::Material> materials{};
     std::vector<vkutils::LightProxy> lights{};
     std::vector<Texture> textures{};
+    // every asset once, added again it becomes another instance of the same model, BLAS and material range
     std::vector<Model *> models{};
+    // per instance, index into models and the instance's transform
+    std::vector<uint32_t> instanceModels{};
     std::vector<glm::mat4> modelMatrices{};
-    
+    Model::LoadMode loadMode{Model::eMemoryMapped};
+    vkutils::VertexLayout::Format vertexFormat{vkutils::VertexLayout::eStandard};
+    bool splitVertexStreams{false};
+    bool optimizeMeshes{false};
+    Model::MipMode mipMode{Model::eBlitMips};
+    // models upload a coarse mip tier and keep their chains for TextureStreamer
+    bool streamTextures{false};
+    vkutils::VertexLayout vertexLayout;
+    bool benchmarkLoad{false};
+    // staging ring of the UploadContext build() and buildAccelerationStructure upload through
+    vk::DeviceSize uploadRingSize{64ull * 1024 * 1024};
+    // directory of the binary scene cache (see vk_scene_cache.h), empty disables it. Set before add(), models
+    // added by path are then only parsed when build() misses the cache.
+    std::string cacheDirectory{};
+    // meshes shared by several nodes get one BLAS instanced per node (see InstancedMesh), taken over by the
+    // models added while it is set
+    bool instanceMeshes{true};
+    uint32_t instanceMinTriangles{256};
+    // scratch memory BLAS builds may use at once, more BLASes build in batches that reuse it
+    vk::DeviceSize blasScratchBudget{256ull * 1024 * 1024};
+    // size of the arena blocks geometry, materials, lights, TLAS instances and build scratch are sub-allocated
+    // from, the first block is kept for the scene's lifetime and data that does not fit gets another one
+    vk::DeviceSize arenaBlockSize{256ull * 1024 * 1024};
+    // copies freshly built BLASes into buffers of their compacted size and frees the build sized ones
+    bool compactBlas{true};
+    // instances move after buildAccelerationStructure, the TLAS is built updatable and keeps its instance and
+    // scratch buffers. Refits loosen the TLAS, it is rebuilt once its instances moved tlasMaxRefits times on average.
+    bool dynamicInstances{false};
+    uint32_t tlasMaxRefits{16};
+    uint64_t tlasRefits{0};
+    uint64_t tlasRebuilds{0};
+    struct Bounds {
+        glm::vec3 min;
+        glm::vec3 max;
+    };
+    // model space bounds of every model, from the positions uploaded by buildAccelerationStructure
+    std::vector<Bounds> modelBounds{};
+    // A primitive of a skinned node. Every instance of its model has a posed copy of the primitive's vertices
+    // behind the vertexCount rest pose vertices, the skinning pass writes it and the instance's BLAS is refit.
+    // Skinned scenes bypass both caches and are always built with dynamicInstances.
+    struct SkinnedPrimitive {
+        uint32_t model;
+        Node* node;
+        Primitive* primitive;
+        // first rest pose vertex in the vertex buffers and the copy's offset in an instance's posed range
+        uint32_t restVertex;
+        uint32_t posedOffset;
+    };
+    std::vector<SkinnedPrimitive> skinnedPrimitives{};
+    // per instance the first vertex of its posed range, UINT32_MAX when its model has no skin
+    std::vector<uint32_t> instancePosedVertices{};
+    uint32_t posedVertexCount{0};
+
     Scene();
     Scene(vk::Core &core);
     void add(std::string path, glm::mat4 transform = glm::mat4(1.0));
     void add(Model* model, glm::mat4 transform = glm::mat4(1.0));
     void build();
     void buildAccelerationStructure();
+    // Moves an instance, they are numbered in the order of add(). Needs dynamicInstances, the TLAS follows with
+    // the next updateTopLevel.
+    void setInstanceTransform(uint32_t instance, const glm::mat4& transform);
+    Bounds instanceBounds(uint32_t instance) const;
+    // Records the upload of the moved instances and a refit or rebuild of the TLAS into cmd, returns false when
+    // nothing moved since the last call. Staging is split into framesInFlight ranges like the frame resources.
+    bool updateTopLevel(vk::CommandBuffer cmd, uint32_t frame, uint32_t framesInFlight);
+    // first posed vertex of a skinned primitive for instance
+    uint32_t posedVertex(uint32_t instance, const Primitive* primitive) const;
+    // Records a refit of every skinned BLAS from the posed vertices the skinning pass wrote before in cmd and
+    // marks their instances moved, so the next updateTopLevel refits the TLAS over the new bounds.
+    void refitSkinnedBlas(vk::CommandBuffer cmd);
     void destroy();
 private:
     vk::Core* core;
     vk::Sampler sampler;
     bool _isBuilded;
+    // asset registry, one entry per model
+    struct Source {
+        // canonical path, empty for models added as objects, those make the scene uncacheable
+        std::string path;
+        uint64_t size;
+        // hash of the whole file, only computed when two different paths have the same size
+        uint64_t contentHash;
+        bool instanceMeshes;
+        uint32_t instanceMinTriangles;
+    };
+    std::vector<Source> _sources{};
+    // what every BLAS holds, the baked nodes of a model, one of its instanced meshes or the skinned nodes of
+    // one of its instances, parallel to blas
+    struct BlasSource {
+        uint32_t model;
+        // index into the model's _instancedMeshes, -1 for the baked nodes
+        int32_t mesh;
+        // first material of its geometries, the custom index of the TLAS instances
+        uint32_t materialOffset;
+        uint64_t triangles;
+        // the skinned nodes of this one instance of the model, -1 for sources shared by every instance
+        int32_t instance;
+    };
+    std::vector<BlasSource> blasSources{};
+    // posed offset of every skinned primitive, see SkinnedPrimitive
+    std::unordered_map<const Primitive*, uint32_t> posedOffsets{};
+    // what a refit of a skinned BLAS needs again every frame
+    struct SkinnedBlas {
+        uint32_t blas;
+        uint32_t instance;
+        vk::BuildAccelerationStructureFlagsKHR flags;
+        std::vector<vk::AccelerationStructureGeometryKHR> geometries{};
+        std::vector<vk::AccelerationStructureBuildRangeInfoKHR> buildRangeInfos{};
+        vk::DeviceSize scratchOffset = 0;
+    };
+    std::vector<SkinnedBlas> skinnedBlas{};
+    vkutils::BufferRange skinnedScratchBuffer;
+    std::vector<vkutils::AllocatedBuffer> vertexStagingBuffers{};
+    vkutils::AllocatedBuffer indexStagingBuffer;
+    std::unique_ptr<vkutils::UploadContext> uploads;
+    vkutils::BufferArena arena;
     
     std::vector<vkutils::AllocatedBuffer> blasBuffer{};
     std::vector<vk::DeviceAddress> blasAddress{};
@@ -37,5 +150,34 @@ private:
     vk::DeviceAddress tlasAddress;
     
     std::vector<vk::TransformMatrixKHR> tlasTransforms{};
+    // kept with dynamicInstances: the TLAS instances in scene instance order, the node matrix every one adds
+    // to its scene instance's transform and the first TLAS instance of every scene instance
+    std::vector<vk::AccelerationStructureInstanceKHR> tlasInstances{};
+    std::vector<glm::mat4> tlasLocalMatrices{};
+    std::vector<uint32_t> instanceFirstTlas{};
+    vkutils::BufferRange tlasInstanceBuffer;
+    vkutils::AllocatedBuffer tlasStagingBuffer;
+    vkutils::BufferRange tlasScratchBuffer;
+    // range of TLAS instances moved since the last updateTopLevel
+    uint32_t tlasDirtyFirst{UINT32_MAX};
+    uint32_t tlasDirtyEnd{0};
+    uint64_t tlasMovedSinceBuild{0};
+    void computeBounds();
+    Model* loadModel(const std::string& path);
+    uint32_t findAsset(Source& source);
+    void addInstance(uint32_t model, const glm::mat4& transform);
+    void writeGeometry(const std::vector<unsigned char*>& vertexStreams, unsigned char* indices);
+    void collectSkinnedPrimitives();
+    void collectBlasSources();
+    void forEachGeometry(const BlasSource& source, const std::function<void(Node*, Primitive*)>& function);
+    void buildMaterials();
     void createEmptyTexture();
+    // implemented in vk_scene_cache.cpp
+    uint64_t cacheKey() const;
+    std::string cachePath(uint64_t key) const;
+    bool readCache(const std::string& path, uint64_t key);
+    void writeCache(const std::string& path, uint64_t key, const std::vector<unsigned char*>& vertexStreams, const unsigned char* indices, uint64_t coldMicroseconds);
+    std::string blasCachePath(uint64_t key) const;
+    bool readBlasCache(const std::string& path, uint64_t key);
+    void writeBlasCache(const std::string& path, uint64_t key);
 };
\ No newline at end of file
@@ -0,0 +1,704 @@
+#include <vk_scene.h>
+#include <vk_scene_cache.h>
+#include <vk_platform.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+uint64_t vkutils::scenecache::hash(const void *data, size_t size, uint64_t seed)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    uint64_t value = seed;
+    for (size_t i = 0; i < size; i++)
+    {
+        value ^= bytes[i];
+        value *= 1099511628211ull;
+    }
+    return value;
+}
+
+uint64_t vkutils::scenecache::hashGlbJson(const char *filename)
+{
+    vkutils::MappedFile file;
+    if (!file.open(filename) || file.size() < 20)
+    {
+        return 0;
+    }
+    // 12 byte glb header, then the JSON chunk with its length and type
+    uint32_t chunkLength;
+    uint32_t chunkType;
+    std::memcpy(&chunkLength, file.data() + 12, sizeof(uint32_t));
+    std::memcpy(&chunkType, file.data() + 16, sizeof(uint32_t));
+    if (std::memcmp(file.data(), "glTF", 4) != 0 || chunkType != 0x4E4F534A || 20 + static_cast<size_t>(chunkLength) > file.size())
+    {
+        return 0;
+    }
+    return hash(file.data() + 20, chunkLength);
+}
+
+uint64_t Scene::cacheKey() const
+{
+    using namespace vkutils::scenecache;
+    uint64_t key = hash(&version, sizeof(version));
+    for (const Source& source : _sources)
+    {
+        if (source.path.empty())
+        {
+            return 0;
+        }
+        // size and modification time catch edits of the binary chunk, the json hash survives copying the file around
+        std::error_code error;
+        uint64_t size = std::filesystem::file_size(source.path, error);
+        if (error)
+        {
+            return 0;
+        }
+        int64_t modified = static_cast<int64_t>(std::filesystem::last_write_time(source.path, error).time_since_epoch().count());
+        uint64_t json = hashGlbJson(source.path.c_str());
+        key = hash(source.path.data(), source.path.size(), key);
+        key = hash(&size, sizeof(size), key);
+        key = hash(&modified, sizeof(modified), key);
+        key = hash(&json, sizeof(json), key);
+        key = hash(&source.instanceMeshes, sizeof(bool), key);
+        key = hash(&source.instanceMinTriangles, sizeof(uint32_t), key);
+    }
+    key = hash(instanceModels.data(), instanceModels.size() * sizeof(uint32_t), key);
+    key = hash(modelMatrices.data(), modelMatrices.size() * sizeof(glm::mat4), key);
+    // settings that change the cached bytes
+    uint32_t settings[] = {static_cast<uint32_t>(vertexFormat), splitVertexStreams ? 1u : 0u, optimizeMeshes ? 1u : 0u};
+    key = hash(settings, sizeof(settings), key);
+    return key != 0 ? key : 1;
+}
+
+std::string Scene::cachePath(uint64_t key) const
+{
+    std::ostringstream path;
+    path << cacheDirectory << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".vkscene";
+    return path.str();
+}
+
+bool Scene::readCache(const std::string& path, uint64_t key)
+{
+    using namespace vkutils::scenecache;
+    auto start = std::chrono::high_resolution_clock::now();
+    vkutils::MappedFile file;
+    if (!file.open(path.c_str()))
+    {
+        std::cout << "Scene cache miss: " << path << std::endl;
+        return false;
+    }
+    Header header;
+    if (file.size() < sizeof(Header))
+    {
+        std::cerr << "Scene cache " << path << " is truncated, rebuilding it" << std::endl;
+        return false;
+    }
+    std::memcpy(&header, file.data(), sizeof(Header));
+    auto inFile = [&](const Section& section) {
+        return section.offset <= file.size() && section.size <= file.size() - section.offset;
+    };
+    bool valid = std::memcmp(header.magic, magic, sizeof(magic)) == 0 && header.version == version && header.headerSize == sizeof(Header)
+        && header.materialSize == sizeof(vkutils::Material) && header.modelMaterialSize == sizeof(Material) && header.lightSize == sizeof(vkutils::LightProxy)
+        && header.key == key && header.modelCount == models.size() && header.streamCount <= maxStreams;
+    for (const Section* section : {&header.indices, &header.materials, &header.lights, &header.models, &header.nodes, &header.primitives, &header.modelMaterials, &header.textures, &header.levelOffsets, &header.names})
+    {
+        valid = valid && inFile(*section);
+    }
+    for (uint32_t stream = 0; valid && stream < header.streamCount; stream++)
+    {
+        valid = inFile(header.streams[stream]);
+    }
+    if (!valid)
+    {
+        std::cerr << "Scene cache " << path << " was written by a different build or for other sources, rebuilding it" << std::endl;
+        return false;
+    }
+
+    const ModelRecord* modelRecords = reinterpret_cast<const ModelRecord*>(file.data() + header.models.offset);
+    const NodeRecord* nodeRecords = reinterpret_cast<const NodeRecord*>(file.data() + header.nodes.offset);
+    const PrimitiveRecord* primitiveRecords = reinterpret_cast<const PrimitiveRecord*>(file.data() + header.primitives.offset);
+    const Material* modelMaterials = reinterpret_cast<const Material*>(file.data() + header.modelMaterials.offset);
+    const TextureRecord* textureRecords = reinterpret_cast<const TextureRecord*>(file.data() + header.textures.offset);
+    const uint64_t* levelOffsets = reinterpret_cast<const uint64_t*>(file.data() + header.levelOffsets.offset);
+    const char* names = reinterpret_cast<const char*>(file.data() + header.names.offset);
+    size_t textureCount = header.textures.size / sizeof(TextureRecord);
+    size_t levelOffsetCount = header.levelOffsets.size / sizeof(uint64_t);
+    size_t nodeCount = header.nodes.size / sizeof(NodeRecord);
+    size_t primitiveCount = header.primitives.size / sizeof(PrimitiveRecord);
+    size_t modelMaterialCount = header.modelMaterials.size / sizeof(Material);
+    // every record is checked before anything is read through it, a valid header says nothing about the rest
+    auto inRange = [](uint64_t first, uint64_t count, uint64_t total) {
+        return first <= total && count <= total - first;
+    };
+    auto corrupt = [&]() {
+        std::cerr << "Scene cache " << path << " is corrupt, rebuilding it" << std::endl;
+        return false;
+    };
+    for (size_t t = 0; t < textureCount; t++)
+    {
+        const TextureRecord& record = textureRecords[t];
+        if (!inRange(record.firstLevelOffset, static_cast<uint64_t>(record.mipLevels) + 1, levelOffsetCount))
+        {
+            return corrupt();
+        }
+        for (uint32_t l = 0; l < record.mipLevels; l++)
+        {
+            if (levelOffsets[record.firstLevelOffset + l] > levelOffsets[record.firstLevelOffset + l + 1])
+            {
+                return corrupt();
+            }
+        }
+        if (!inFile(Section{record.dataOffset, levelOffsets[record.firstLevelOffset + record.mipLevels]}))
+        {
+            return corrupt();
+        }
+        // block compressed chains are stored as they came from the file, a device without the format needs the fallback
+        if (!(core->_chosenGPU.getFormatProperties(static_cast<vk::Format>(record.format)).optimalTilingFeatures & vk::FormatFeatureFlagBits::eSampledImage))
+        {
+            std::cerr << "Scene cache " << path << " holds textures in a format the device can't sample, rebuilding it" << std::endl;
+            return false;
+        }
+    }
+
+    if (header.models.size / sizeof(ModelRecord) < models.size())
+    {
+        return corrupt();
+    }
+    for (size_t m = 0; m < models.size(); m++)
+    {
+        const ModelRecord& record = modelRecords[m];
+        if (!inRange(record.nameOffset, record.nameSize, header.names.size) || !inRange(record.firstMaterial, record.materialCount, modelMaterialCount)
+            || !inRange(record.firstNode, record.nodeCount, nodeCount) || !inRange(record.firstTexture, record.textureCount, textureCount))
+        {
+            return corrupt();
+        }
+        for (uint32_t n = record.firstNode; n < record.firstNode + record.nodeCount; n++)
+        {
+            const NodeRecord& nodeRecord = nodeRecords[n];
+            // an instanced mesh is shared by several of the model's nodes, so there are fewer of them than nodes
+            if (!inRange(nodeRecord.firstPrimitive, nodeRecord.primitiveCount, primitiveCount) || nodeRecord.mesh >= static_cast<int64_t>(record.nodeCount))
+            {
+                return corrupt();
+            }
+            for (uint32_t p = nodeRecord.firstPrimitive; p < nodeRecord.firstPrimitive + nodeRecord.primitiveCount; p++)
+            {
+                // the loader never indexes a primitive without vertices, a BLAS geometry of it would underflow maxVertex
+                if (primitiveRecords[p].material >= record.materialCount || (primitiveRecords[p].indexCount > 0 && primitiveRecords[p].vertexCount == 0))
+                {
+                    return corrupt();
+                }
+            }
+        }
+    }
+
+    vertexLayout = vkutils::VertexLayout::create(static_cast<vkutils::VertexLayout::Format>(header.vertexFormat), header.hasColors != 0, header.hasSkin != 0, header.splitStreams != 0);
+    if (vertexLayout.streamCount() != header.streamCount)
+    {
+        std::cerr << "Scene cache " << path << " does not match the vertex layout, rebuilding it" << std::endl;
+        return false;
+    }
+    // buildAccelerationStructure copies whole streams and the index buffer to the device
+    for (uint32_t stream = 0; stream < vertexLayout.streamCount(); stream++)
+    {
+        if (header.streams[stream].size < static_cast<uint64_t>(header.vertexCount) * vertexLayout.strides[stream])
+        {
+            return corrupt();
+        }
+    }
+    if (header.indices.size < header.indexBytes)
+    {
+        return corrupt();
+    }
+    vertexCount = header.vertexCount;
+    indexCount = header.indexCount;
+    indexBytes = header.indexBytes;
+
+    vk::DeviceSize textureBytes = 0;
+    for (size_t m = 0; m < models.size(); m++)
+    {
+        const ModelRecord& record = modelRecords[m];
+        Model* model = new Model(*core);
+        model->_filename = std::string(names + record.nameOffset, record.nameSize);
+        model->_optimizeGeometry = optimizeMeshes;
+        model->_mipMode = mipMode;
+        model->_streamTextures = streamTextures;
+        model->_vertexCount = record.vertexCount;
+        model->_indexCount = record.indexCount;
+        model->_indexBytes = record.indexBytes;
+        model->_hasColors = record.hasColors != 0;
+        model->_hasSkin = record.hasSkin != 0;
+        // primitives keep references into _materials, it must not grow afterwards
+        model->_materials.assign(modelMaterials + record.firstMaterial, modelMaterials + record.firstMaterial + record.materialCount);
+        for (uint32_t n = record.firstNode; n < record.firstNode + record.nodeCount; n++)
+        {
+            const NodeRecord& nodeRecord = nodeRecords[n];
+            Node* node = new Node{};
+            node->parent = nullptr;
+            node->matrix = glm::make_mat4(nodeRecord.matrix);
+            node->mesh = nodeRecord.mesh;
+            if (node->mesh >= 0)
+            {
+                if (model->_instancedMeshes.size() <= static_cast<size_t>(node->mesh))
+                {
+                    model->_instancedMeshes.resize(node->mesh + 1);
+                }
+                // nodes are stored in _linearNodes order, the first one of a mesh is the one that owned it
+                InstancedMesh& mesh = model->_instancedMeshes[node->mesh];
+                if (!mesh.node)
+                {
+                    mesh.node = node;
+                }
+                mesh.nodes.push_back(node);
+            }
+            for (uint32_t p = nodeRecord.firstPrimitive; p < nodeRecord.firstPrimitive + nodeRecord.primitiveCount; p++)
+            {
+                const PrimitiveRecord& primitiveRecord = primitiveRecords[p];
+                Primitive* primitive = new Primitive(primitiveRecord.firstIndex, primitiveRecord.indexCount, primitiveRecord.firstVertex, primitiveRecord.vertexCount, model->_materials[primitiveRecord.material]);
+                primitive->indexByteOffset = primitiveRecord.indexByteOffset;
+                primitive->indexType = static_cast<vk::IndexType>(primitiveRecord.indexType);
+                node->primitives.push_back(primitive);
+                if (primitive->indexCount > 0)
+                {
+                    model->_transforms.push_back(vkutils::getTransformMatrixKHR(node->matrix));
+                }
+            }
+            model->_nodes.push_back(node);
+            model->_linearNodes.push_back(node);
+        }
+        model->buildTransforms();
+
+        std::vector<TextureChain> chains(record.textureCount);
+        std::vector<const unsigned char*> data(record.textureCount);
+        for (uint32_t t = 0; t < record.textureCount; t++)
+        {
+            const TextureRecord& textureRecord = textureRecords[record.firstTexture + t];
+            TextureChain& chain = chains[t];
+            chain.format = static_cast<vk::Format>(textureRecord.format);
+            chain.width = textureRecord.width;
+            chain.height = textureRecord.height;
+            chain.mipLevels = textureRecord.mipLevels;
+            chain.levelOffsets.assign(levelOffsets + textureRecord.firstLevelOffset, levelOffsets + textureRecord.firstLevelOffset + textureRecord.mipLevels + 1);
+            data[t] = file.data() + textureRecord.dataOffset;
+            textureBytes += chain.levelOffsets.back();
+        }
+        model->restoreTextures(*uploads, chains, data);
+        models[m] = model;
+        textures.insert(std::end(textures), std::begin(model->_textures), std::end(model->_textures));
+    }
+
+    // straight from the mapping into the staging buffers buildAccelerationStructure copies to the device
+    for (uint32_t stream = 0; stream < vertexLayout.streamCount(); stream++)
+    {
+        vertexStagingBuffers.push_back(vkutils::createBuffer(*core, header.streams[stream].size, vk::BufferUsageFlagBits::eTransferSrc, vma::MemoryUsage::eAuto, vma::AllocationCreateFlagBits::eHostAccessSequentialWrite));
+        void* mapped = core->_allocator.mapMemory(vertexStagingBuffers.back()._allocation);
+        std::memcpy(mapped, file.data() + header.streams[stream].offset, header.streams[stream].size);
+        // the staging memory may not be host coherent
+        core->_allocator.flushAllocation(vertexStagingBuffers.back()._allocation, 0, header.streams[stream].size);
+        core->_allocator.unmapMemory(vertexStagingBuffers.back()._allocation);
+    }
+    indexStagingBuffer = vkutils::createBuffer(*core, header.indices.size, vk::BufferUsageFlagBits::eTransferSrc, vma::MemoryUsage::eAuto, vma::AllocationCreateFlagBits::eHostAccessSequentialWrite);
+    void* mapped = core->_allocator.mapMemory(indexStagingBuffer._allocation);
+    std::memcpy(mapped, file.data() + header.indices.offset, header.indices.size);
+    core->_allocator.flushAllocation(indexStagingBuffer._allocation, 0, header.indices.size);
+    core->_allocator.unmapMemory(indexStagingBuffer._allocation);
+
+    const vkutils::LightProxy* cachedLights = reinterpret_cast<const vkutils::LightProxy*>(file.data() + header.lights.offset);
+    lights.assign(cachedLights, cachedLights + header.lights.size / sizeof(vkutils::LightProxy));
+    const vkutils::Material* cachedMaterials = reinterpret_cast<const vkutils::Material*>(file.data() + header.materials.offset);
+    materials.assign(cachedMaterials, cachedMaterials + header.materials.size / sizeof(vkutils::Material));
+    // the material ranges of the BLASes follow from the restored nodes
+    collectBlasSources();
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+    double megabytes = file.size() / (1024.0 * 1024.0);
+    std::cout << "Scene cache hit: " << path << ", " << megabytes << " MB (" << textureBytes / (1024.0 * 1024.0) << " MB textures) in " << elapsed / 1e6 << "s, " << (elapsed > 0 ? megabytes / (elapsed / 1e6) : 0.0) << " MB/s" << std::endl;
+    std::cout << "Scene load benchmark: cold " << header.coldMicroseconds / 1e6 << "s, cached " << elapsed / 1e6 << "s, speedup " << (elapsed > 0 ? static_cast<double>(header.coldMicroseconds) / elapsed : 0.0) << "x" << std::endl;
+    std::cout << "Scene loaded with " << indexCount / 3 << " Triangles and " << vertexCount << " Vertices in " << models.size() << " models, " << instanceModels.size() << " instances" << std::endl;
+    return true;
+}
+
+void Scene::writeCache(const std::string& path, uint64_t key, const std::vector<unsigned char*>& vertexStreams, const unsigned char* indices, uint64_t coldMicroseconds)
+{
+    using namespace vkutils::scenecache;
+    auto start = std::chrono::high_resolution_clock::now();
+    Header header{};
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.version = version;
+    header.headerSize = sizeof(Header);
+    header.materialSize = sizeof(vkutils::Material);
+    header.modelMaterialSize = sizeof(Material);
+    header.lightSize = sizeof(vkutils::LightProxy);
+    header.streamCount = vertexLayout.streamCount();
+    header.key = key;
+    header.coldMicroseconds = coldMicroseconds;
+    header.vertexFormat = static_cast<uint32_t>(vertexLayout.format);
+    header.splitStreams = vertexLayout.splitStreams ? 1 : 0;
+    header.vertexCount = vertexCount;
+    header.indexCount = indexCount;
+    header.indexBytes = indexBytes;
+    header.modelCount = static_cast<uint32_t>(models.size());
+
+    std::vector<ModelRecord> modelRecords;
+    std::vector<NodeRecord> nodeRecords;
+    std::vector<PrimitiveRecord> primitiveRecords;
+    std::vector<Material> modelMaterials;
+    std::vector<TextureRecord> textureRecords;
+    std::vector<uint64_t> levelOffsets;
+    std::vector<const unsigned char*> textureData;
+    std::string names;
+    uint64_t textureBytes = 0;
+    for (size_t m = 0; m < models.size(); m++)
+    {
+        Model* model = models[m];
+        if (model->_textureChains.size() != model->_textures.size())
+        {
+            std::cerr << "Textures of " << model->_filename << " were not kept, the scene cache is not written" << std::endl;
+            return;
+        }
+        header.hasColors |= model->_hasColors ? 1 : 0;
+        header.hasSkin |= model->_hasSkin ? 1 : 0;
+        ModelRecord record{};
+        record.vertexCount = model->_vertexCount;
+        record.indexCount = model->_indexCount;
+        record.indexBytes = model->_indexBytes;
+        record.hasColors = model->_hasColors ? 1 : 0;
+        record.hasSkin = model->_hasSkin ? 1 : 0;
+        record.firstNode = static_cast<uint32_t>(nodeRecords.size());
+        record.firstMaterial = static_cast<uint32_t>(modelMaterials.size());
+        record.materialCount = static_cast<uint32_t>(model->_materials.size());
+        record.firstTexture = static_cast<uint32_t>(textureRecords.size());
+        record.textureCount = static_cast<uint32_t>(model->_textureChains.size());
+        record.nameOffset = names.size();
+        record.nameSize = model->_filename.size();
+        names += model->_filename;
+        modelMaterials.insert(modelMaterials.end(), model->_materials.begin(), model->_materials.end());
+        for (auto node : model->_linearNodes)
+        {
+            if (node->primitives.empty())
+            {
+                continue;
+            }
+            NodeRecord nodeRecord{};
+            glm::mat4 matrix = node->getMatrix();
+            std::memcpy(nodeRecord.matrix, glm::value_ptr(matrix), sizeof(nodeRecord.matrix));
+            nodeRecord.firstPrimitive = static_cast<uint32_t>(primitiveRecords.size());
+            nodeRecord.primitiveCount = static_cast<uint32_t>(node->primitives.size());
+            nodeRecord.mesh = node->mesh;
+            for (auto primitive : node->primitives)
+            {
+                PrimitiveRecord primitiveRecord{};
+                primitiveRecord.firstIndex = primitive->firstIndex;
+                primitiveRecord.indexCount = primitive->indexCount;
+                primitiveRecord.firstVertex = primitive->firstVertex;
+                primitiveRecord.vertexCount = primitive->vertexCount;
+                primitiveRecord.material = static_cast<uint32_t>(&primitive->material - model->_materials.data());
+                primitiveRecord.indexByteOffset = primitive->indexByteOffset;
+                primitiveRecord.indexType = static_cast<uint32_t>(primitive->indexType);
+                primitiveRecords.push_back(primitiveRecord);
+            }
+            nodeRecords.push_back(nodeRecord);
+        }
+        record.nodeCount = static_cast<uint32_t>(nodeRecords.size()) - record.firstNode;
+        for (const TextureChain& chain : model->_textureChains)
+        {
+            TextureRecord textureRecord{};
+            textureRecord.format = static_cast<uint32_t>(chain.format);
+            textureRecord.width = chain.width;
+            textureRecord.height = chain.height;
+            textureRecord.mipLevels = chain.mipLevels;
+            textureRecord.firstLevelOffset = levelOffsets.size();
+            // relative to the texture data section until its offset is known
+            textureRecord.dataOffset = textureBytes;
+            levelOffsets.insert(levelOffsets.end(), chain.levelOffsets.begin(), chain.levelOffsets.end());
+            textureRecords.push_back(textureRecord);
+            textureData.push_back(chain.data.data());
+            textureBytes = align(textureBytes + chain.levelOffsets.back());
+        }
+        modelRecords.push_back(record);
+    }
+
+    // sections in file order, each one starts aligned
+    uint64_t offset = align(sizeof(Header));
+    auto place = [&](Section& section, uint64_t size) {
+        section.offset = offset;
+        section.size = size;
+        offset = align(offset + size);
+    };
+    for (uint32_t stream = 0; stream < vertexLayout.streamCount(); stream++)
+    {
+        place(header.streams[stream], static_cast<uint64_t>(vertexCount) * vertexLayout.strides[stream]);
+    }
+    place(header.indices, indexBytes);
+    place(header.materials, materials.size() * sizeof(vkutils::Material));
+    place(header.lights, lights.size() * sizeof(vkutils::LightProxy));
+    place(header.models, modelRecords.size() * sizeof(ModelRecord));
+    place(header.nodes, nodeRecords.size() * sizeof(NodeRecord));
+    place(header.primitives, primitiveRecords.size() * sizeof(PrimitiveRecord));
+    place(header.modelMaterials, modelMaterials.size() * sizeof(Material));
+    place(header.textures, textureRecords.size() * sizeof(TextureRecord));
+    place(header.levelOffsets, levelOffsets.size() * sizeof(uint64_t));
+    place(header.names, names.size());
+    uint64_t textureSection = offset;
+    for (TextureRecord& textureRecord : textureRecords)
+    {
+        textureRecord.dataOffset += textureSection;
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(cacheDirectory, error);
+    // written next to the target and renamed, a crash while writing never leaves a valid looking cache behind
+    std::string temporaryPath = path + ".tmp";
+    std::ofstream out(temporaryPath, std::ios::binary | std::ios::trunc);
+    if (!out)
+    {
+        std::cerr << "Could not write scene cache " << path << std::endl;
+        return;
+    }
+    uint64_t written = 0;
+    auto write = [&](uint64_t at, const void* data, uint64_t size) {
+        static const char zeros[alignment] = {};
+        while (written < at)
+        {
+            uint64_t padding = std::min<uint64_t>(at - written, alignment);
+            out.write(zeros, padding);
+            written += padding;
+        }
+        out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+        written += size;
+    };
+    write(0, &header, sizeof(Header));
+    for (uint32_t stream = 0; stream < vertexLayout.streamCount(); stream++)
+    {
+        write(header.streams[stream].offset, vertexStreams[stream], header.streams[stream].size);
+    }
+    write(header.indices.offset, indices, header.indices.size);
+    write(header.materials.offset, materials.data(), header.materials.size);
+    write(header.lights.offset, lights.data(), header.lights.size);
+    write(header.models.offset, modelRecords.data(), header.models.size);
+    write(header.nodes.offset, nodeRecords.data(), header.nodes.size);
+    write(header.primitives.offset, primitiveRecords.data(), header.primitives.size);
+    write(header.modelMaterials.offset, modelMaterials.data(), header.modelMaterials.size);
+    write(header.textures.offset, textureRecords.data(), header.textures.size);
+    write(header.levelOffsets.offset, levelOffsets.data(), header.levelOffsets.size);
+    write(header.names.offset, names.data(), header.names.size);
+    for (size_t t = 0; t < textureRecords.size(); t++)
+    {
+        write(textureRecords[t].dataOffset, textureData[t], levelOffsets[textureRecords[t].firstLevelOffset + textureRecords[t].mipLevels]);
+    }
+    out.close();
+    if (!out)
+    {
+        std::cerr << "Could not write scene cache " << path << std::endl;
+        std::filesystem::remove(temporaryPath, error);
+        return;
+    }
+    std::filesystem::rename(temporaryPath, path, error);
+    if (error)
+    {
+        std::cerr << "Could not write scene cache " << path << ": " << error.message() << std::endl;
+        std::filesystem::remove(temporaryPath, error);
+        return;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+    std::cout << "Scene cache written: " << path << ", " << written / (1024.0 * 1024.0) << " MB in " << elapsed / 1e6 << "s (cold load " << coldMicroseconds / 1e6 << "s)" << std::endl;
+}
+
+std::string Scene::blasCachePath(uint64_t key) const
+{
+    // serialized acceleration structures only load on the driver that wrote them, every driver gets its own file
+    auto idProperties = core->_chosenGPU.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceIDProperties>().get<vk::PhysicalDeviceIDProperties>();
+    uint64_t driverKey = vkutils::scenecache::hash(idProperties.driverUUID.data(), VK_UUID_SIZE, key);
+    std::ostringstream path;
+    path << cacheDirectory << "/" << std::hex << std::setw(16) << std::setfill('0') << driverKey << ".vkblas";
+    return path.str();
+}
+
+bool Scene::readBlasCache(const std::string& path, uint64_t key)
+{
+    using namespace vkutils::scenecache;
+    auto start = std::chrono::high_resolution_clock::now();
+    vkutils::MappedFile file;
+    if (!file.open(path.c_str()))
+    {
+        std::cout << "BLAS cache miss: " << path << std::endl;
+        return false;
+    }
+    BlasHeader header;
+    if (file.size() < sizeof(BlasHeader))
+    {
+        std::cerr << "BLAS cache " << path << " is truncated, rebuilding it" << std::endl;
+        return false;
+    }
+    std::memcpy(&header, file.data(), sizeof(BlasHeader));
+    auto idProperties = core->_chosenGPU.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceIDProperties>().get<vk::PhysicalDeviceIDProperties>();
+    bool valid = std::memcmp(header.magic, blasMagic, sizeof(blasMagic)) == 0 && header.version == blasVersion && header.key == key && header.blasCount == blasSources.size()
+        && std::memcmp(header.driverUUID, idProperties.driverUUID.data(), VK_UUID_SIZE) == 0 && sizeof(BlasHeader) + header.blasCount * sizeof(BlasRecord) <= file.size();
+    if (!valid)
+    {
+        std::cerr << "BLAS cache " << path << " was written for another scene or driver, rebuilding it" << std::endl;
+        return false;
+    }
+    std::vector<BlasRecord> records(header.blasCount);
+    std::memcpy(records.data(), file.data() + sizeof(BlasHeader), records.size() * sizeof(BlasRecord));
+    vk::DeviceSize stagingSize = 0;
+    for (const BlasRecord& record : records)
+    {
+        if (record.offset > file.size() || record.serializedSize > file.size() - record.offset || record.serializedSize < 2 * VK_UUID_SIZE || record.offset % blasAlignment != 0)
+        {
+            std::cerr << "BLAS cache " << path << " is corrupt, rebuilding it" << std::endl;
+            return false;
+        }
+        // the driver decides, a driver update with the same UUID can still reject the blobs
+        vk::AccelerationStructureVersionInfoKHR versionInfo(file.data() + record.offset);
+        if (core->_device.getAccelerationStructureCompatibilityKHR(versionInfo) != vk::AccelerationStructureCompatibilityKHR::eCompatible)
+        {
+            std::cerr << "BLAS cache " << path << " is not compatible with the driver, rebuilding it" << std::endl;
+            return false;
+        }
+        stagingSize = align(stagingSize, blasAlignment) + record.serializedSize;
+    }
+
+    // the file is laid out like the staging buffer, blobs at the same 256 byte aligned offsets. VMA does not align
+    // host buffers that much by itself, the copies need aligned device addresses.
+    vkutils::AllocatedBuffer staging = vkutils::createBuffer(*core, stagingSize, vk::BufferUsageFlagBits::eShaderDeviceAddress, vma::MemoryUsage::eAuto, vma::AllocationCreateFlagBits::eHostAccessSequentialWrite, false, vkutils::MemoryCategory::eStaging, blasAlignment);
+    unsigned char* mapped = static_cast<unsigned char*>(core->_allocator.mapMemory(staging._allocation));
+    vk::DeviceAddress stagingAddress = core->_device.getBufferAddress(vk::BufferDeviceAddressInfo(staging._buffer));
+    vk::CommandBuffer cmd = vkutils::getCommandBuffer(*core);
+    vk::CommandBufferBeginInfo beginInfo{};
+    beginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+    cmd.begin(beginInfo);
+    vk::DeviceSize stagingOffset = 0;
+    vk::DeviceSize deserializedBytes = 0;
+    for (const BlasRecord& record : records)
+    {
+        stagingOffset = align(stagingOffset, blasAlignment);
+        std::memcpy(mapped + stagingOffset, file.data() + record.offset, record.serializedSize);
+
+        blasBuffer.push_back(vkutils::createBuffer(*core, record.deserializedSize, vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR, vma::MemoryUsage::eAutoPreferDevice, {}, true));
+        vk::AccelerationStructureCreateInfoKHR accelerationStructureCreateInfo;
+        accelerationStructureCreateInfo.type = vk::AccelerationStructureTypeKHR::eBottomLevel;
+        accelerationStructureCreateInfo.buffer = blasBuffer.back()._buffer;
+        accelerationStructureCreateInfo.size = record.deserializedSize;
+        blas.push_back(core->_device.createAccelerationStructureKHR(accelerationStructureCreateInfo));
+
+        vk::CopyMemoryToAccelerationStructureInfoKHR copyInfo;
+        copyInfo.src.deviceAddress = stagingAddress + stagingOffset;
+        copyInfo.dst = blas.back();
+        copyInfo.mode = vk::CopyAccelerationStructureModeKHR::eDeserialize;
+        cmd.copyMemoryToAccelerationStructureKHR(copyInfo);
+        stagingOffset += record.serializedSize;
+        deserializedBytes += record.deserializedSize;
+    }
+    cmd.end();
+    // the staging memory may not be host coherent
+    core->_allocator.flushAllocation(staging._allocation, 0, stagingSize);
+    core->_allocator.unmapMemory(staging._allocation);
+    core->submitLoadAndWait(cmd);
+    vkutils::destroyBuffer(*core, staging);
+
+    for (auto& accelerationStructure : blas)
+    {
+        vk::AccelerationStructureDeviceAddressInfoKHR accelerationDeviceAddressInfo;
+        accelerationDeviceAddressInfo.accelerationStructure = accelerationStructure;
+        blasAddress.push_back(core->_device.getAccelerationStructureAddressKHR(accelerationDeviceAddressInfo));
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+    std::cout << "BLAS cache hit: " << blas.size() << " BLAS, " << stagingSize / (1024.0 * 1024.0) << " MB serialized, " << deserializedBytes / (1024.0 * 1024.0) << " MB on the device in " << elapsed / 1e6 << "s" << std::endl;
+    return true;
+}
+
+void Scene::writeBlasCache(const std::string& path, uint64_t key)
+{
+    using namespace vkutils::scenecache;
+    auto start = std::chrono::high_resolution_clock::now();
+    uint32_t count = static_cast<uint32_t>(blas.size());
+    if (count == 0)
+    {
+        return;
+    }
+    vk::QueryPool queryPool = core->_device.createQueryPool(vk::QueryPoolCreateInfo({}, vk::QueryType::eAccelerationStructureSerializationSizeKHR, count));
+    vk::CommandBufferBeginInfo beginInfo{};
+    beginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+
+    vk::CommandBuffer cmd = vkutils::getCommandBuffer(*core);
+    cmd.begin(beginInfo);
+        cmd.resetQueryPool(queryPool, 0, count);
+        cmd.writeAccelerationStructuresPropertiesKHR(blas, vk::QueryType::eAccelerationStructureSerializationSizeKHR, queryPool, 0);
+    cmd.end();
+    core->submitLoadAndWait(cmd);
+    std::vector<vk::DeviceSize> serializedSizes = core->_device.getQueryPoolResults<vk::DeviceSize>(queryPool, 0, count, count * sizeof(vk::DeviceSize), sizeof(vk::DeviceSize), vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait).value;
+    core->_device.destroyQueryPool(queryPool);
+
+    // blobs go to the file at the offsets they have in the readback buffer, shifted past the header and records
+    uint64_t dataOffset = align(sizeof(BlasHeader) + count * sizeof(BlasRecord), blasAlignment);
+    std::vector<BlasRecord> records(count);
+    vk::DeviceSize readbackSize = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        readbackSize = align(readbackSize, blasAlignment);
+        records[i].offset = dataOffset + readbackSize;
+        records[i].serializedSize = serializedSizes[i];
+        readbackSize += serializedSizes[i];
+    }
+    vkutils::AllocatedBuffer readback = vkutils::createBuffer(*core, readbackSize, vk::BufferUsageFlagBits::eShaderDeviceAddress, vma::MemoryUsage::eAuto, vma::AllocationCreateFlagBits::eHostAccessRandom, false, vkutils::MemoryCategory::eStaging, blasAlignment);
+    vk::DeviceAddress readbackAddress = core->_device.getBufferAddress(vk::BufferDeviceAddressInfo(readback._buffer));
+    cmd = vkutils::getCommandBuffer(*core);
+    cmd.begin(beginInfo);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        vk::CopyAccelerationStructureToMemoryInfoKHR copyInfo;
+        copyInfo.src = blas[i];
+        copyInfo.dst.deviceAddress = readbackAddress + (records[i].offset - dataOffset);
+        copyInfo.mode = vk::CopyAccelerationStructureModeKHR::eSerialize;
+        cmd.copyAccelerationStructureToMemoryKHR(copyInfo);
+    }
+    cmd.end();
+    core->submitLoadAndWait(cmd);
+
+    const unsigned char* data = static_cast<const unsigned char*>(core->_allocator.mapMemory(readback._allocation));
+    core->_allocator.invalidateAllocation(readback._allocation, 0, VK_WHOLE_SIZE);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        // the serialization header holds the driver and compatibility UUIDs, then the serialized and deserialized size
+        std::memcpy(&records[i].deserializedSize, data + (records[i].offset - dataOffset) + 2 * VK_UUID_SIZE + sizeof(uint64_t), sizeof(uint64_t));
+    }
+    BlasHeader header{};
+    std::memcpy(header.magic, blasMagic, sizeof(blasMagic));
+    header.version = blasVersion;
+    header.blasCount = count;
+    header.key = key;
+    auto idProperties = core->_chosenGPU.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceIDProperties>().get<vk::PhysicalDeviceIDProperties>();
+    std::memcpy(header.driverUUID, idProperties.driverUUID.data(), VK_UUID_SIZE);
+
+    std::error_code error;
+    std::filesystem::create_directories(cacheDirectory, error);
+    std::string temporaryPath = path + ".tmp";
+    std::ofstream out(temporaryPath, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(BlasHeader));
+    out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(BlasRecord));
+    std::vector<char> padding(dataOffset - sizeof(BlasHeader) - records.size() * sizeof(BlasRecord), 0);
+    out.write(padding.data(), padding.size());
+    out.write(reinterpret_cast<const char*>(data), readbackSize);
+    out.close();
+    core->_allocator.unmapMemory(readback._allocation);
+    vkutils::destroyBuffer(*core, readback);
+    if (!out)
+    {
+        std::cerr << "Could not write BLAS cache " << path << std::endl;
+        std::filesystem::remove(temporaryPath, error);
+        return;
+    }
+    std::filesystem::rename(temporaryPath, path, error);
+    if (error)
+    {
+        std::cerr << "Could not write BLAS cache " << path << ": " << error.message() << std::endl;
+        std::filesystem::remove(temporaryPath, error);
+        return;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+    std::cout << "BLAS cache written: " << path << ", " << (dataOffset + readbackSize) / (1024.0 * 1024.0) << " MB in " << elapsed / 1e6 << "s" << std::endl;
+}
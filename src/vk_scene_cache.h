@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace vkutils
+{
+	// Binary scene cache, written by Scene::build after a cold load and read back instead of parsing the glTF files.
+	// The file is a Header followed by sections at 64 byte aligned offsets in native byte order and struct layout.
+	// Vertex streams and indices are stored exactly as the staging buffers hold them and every texture as the mip
+	// chain that is uploaded, so a hit maps the file and copies each section straight into its staging memory.
+	namespace scenecache
+	{
+		constexpr char magic[8] = {'V', 'K', 'S', 'C', 'E', 'N', 'E', '\0'};
+		// bump whenever a record changes or the load pipeline produces different bytes for the same input
+		constexpr uint32_t version = 3;
+		constexpr uint64_t alignment = 64;
+		constexpr uint32_t maxStreams = 8;
+
+		struct Section
+		{
+			uint64_t offset = 0;
+			uint64_t size = 0;
+		};
+
+		struct Header
+		{
+			char magic[8];
+			uint32_t version;
+			uint32_t headerSize;
+			// sizes of the structs stored as they are, a build with a different layout misses instead of misreading
+			uint32_t materialSize;
+			uint32_t modelMaterialSize;
+			uint32_t lightSize;
+			uint32_t streamCount;
+			uint64_t key;
+			// duration of the load that wrote the cache, for the cold versus cached comparison
+			uint64_t coldMicroseconds;
+			uint32_t vertexFormat;
+			uint32_t hasColors;
+			uint32_t hasSkin;
+			uint32_t splitStreams;
+			uint32_t vertexCount;
+			uint32_t indexCount;
+			uint32_t indexBytes;
+			uint32_t modelCount;
+			Section streams[maxStreams];
+			Section indices;
+			// vkutils::Material, the table the hit shaders index
+			Section materials;
+			// vkutils::LightProxy
+			Section lights;
+			Section models;
+			Section nodes;
+			Section primitives;
+			// Material of every model, primitives reference them by index
+			Section modelMaterials;
+			Section textures;
+			// mipLevels + 1 entries per texture, relative to the texture's data
+			Section levelOffsets;
+			Section names;
+		};
+
+		struct ModelRecord
+		{
+			uint32_t vertexCount;
+			uint32_t indexCount;
+			uint32_t indexBytes;
+			uint32_t hasColors;
+			uint32_t hasSkin;
+			uint32_t firstNode;
+			uint32_t nodeCount;
+			uint32_t firstMaterial;
+			uint32_t materialCount;
+			uint32_t firstTexture;
+			uint32_t textureCount;
+			uint32_t pad;
+			uint64_t nameOffset;
+			uint64_t nameSize;
+		};
+
+		// Only nodes with primitives are stored, flattened with their world matrix.
+		struct NodeRecord
+		{
+			float matrix[16];
+			uint32_t firstPrimitive;
+			uint32_t primitiveCount;
+			// Node::mesh, the instanced mesh whose primitives the node shares
+			int32_t mesh;
+			uint32_t pad;
+		};
+
+		struct PrimitiveRecord
+		{
+			uint32_t firstIndex;
+			uint32_t indexCount;
+			uint32_t firstVertex;
+			uint32_t vertexCount;
+			// index into the model's materials
+			uint32_t material;
+			uint32_t indexByteOffset;
+			uint32_t indexType;
+			uint32_t pad;
+		};
+
+		struct TextureRecord
+		{
+			// vk::Format of the chain, rgba8 or one of the BCn formats
+			uint32_t format;
+			uint32_t width;
+			uint32_t height;
+			uint32_t mipLevels;
+			uint64_t firstLevelOffset;
+			uint64_t dataOffset;
+		};
+
+		// Bottom level acceleration structures of a scene in the driver's serialization format, written after a
+		// build and copied back with a deserializing copy. The blobs are only valid for the driver that wrote them,
+		// so the driver UUID is part of the file name and every blob is checked for compatibility before use.
+		constexpr char blasMagic[8] = {'V', 'K', 'B', 'L', 'A', 'S', '\0', '\0'};
+		constexpr uint32_t blasVersion = 1;
+		// serialized data has to start 256 byte aligned in device memory, the file keeps that alignment
+		constexpr uint64_t blasAlignment = 256;
+
+		struct BlasHeader
+		{
+			char magic[8];
+			uint32_t version;
+			uint32_t blasCount;
+			uint64_t key;
+			uint8_t driverUUID[16];
+		};
+
+		// one per BLAS, in the order of Scene::blasSources
+		struct BlasRecord
+		{
+			uint64_t offset;
+			uint64_t serializedSize;
+			uint64_t deserializedSize;
+		};
+
+		// 64 bit FNV-1a, chain calls through seed.
+		uint64_t hash(const void *data, size_t size, uint64_t seed = 14695981039346656037ull);
+		// Hash of the JSON chunk of a .glb, cheap to compute and it changes with every structural edit of the file.
+		uint64_t hashGlbJson(const char *filename);
+		inline uint64_t align(uint64_t offset, uint64_t to = alignment) { return (offset + to - 1) & ~(to - 1); }
+	}
+}
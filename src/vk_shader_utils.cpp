@@ -1,14 +1,55 @@
 #include <vk_shader_utils.h>
 
+namespace {
+  // keeps name and content alive until shaderc releases the include
+  struct IncludeResult {
+    shaderc_include_result result;
+    std::string name;
+    std::string content;
+  };
+}
+
+vkshader::Includer::Includer(const std::map<std::string, std::string>& includes) : _includes(includes) {}
+
+shaderc_include_result* vkshader::Includer::GetInclude(const char* requested_source, shaderc_include_type type, const char* requesting_source, size_t include_depth) {
+  IncludeResult* include = new IncludeResult();
+  auto generated = _includes.find(requested_source);
+  if (generated != _includes.end()) {
+    include->name = requested_source;
+    include->content = generated->second;
+  } else {
+    std::string path = std::string(SHADER_PATH) + "/" + requested_source;
+    std::ifstream file(path);
+    if (file.is_open()) {
+      include->name = path;
+      include->content = std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    } else {
+      // an empty name tells shaderc the include failed, content carries the message
+      include->content = "Could not open include '" + std::string(requested_source) + "'";
+    }
+  }
+  include->result.source_name = include->name.c_str();
+  include->result.source_name_length = include->name.size();
+  include->result.content = include->content.c_str();
+  include->result.content_length = include->content.size();
+  include->result.user_data = include;
+  return &include->result;
+}
+
+void vkshader::Includer::ReleaseInclude(shaderc_include_result* data) {
+  delete static_cast<IncludeResult*>(data->user_data);
+}
+
 
 // Returns GLSL shader source text after preprocessing.
-std::string vkshader::preprocess_shader(const std::string& source_name, shaderc_shader_kind kind, const std::string& source, shaderc_optimization_level optimization) {
+std::string vkshader::preprocess_shader(const std::string& source_name, shaderc_shader_kind kind, const std::string& source, shaderc_optimization_level optimization, const std::map<std::string, std::string>& includes) {
   shaderc::Compiler compiler;
   shaderc::CompileOptions options;
   options.SetTargetEnvironment(shaderc_target_env_vulkan, shaderc_env_version_vulkan_1_2);
   options.SetTargetSpirv(shaderc_spirv_version_1_4);
   options.SetOptimizationLevel(optimization);
   options.SetGenerateDebugInfo();
+  options.SetIncluder(std::make_unique<Includer>(includes));
 
   shaderc::PreprocessedSourceCompilationResult result = compiler.PreprocessGlsl(source, kind, source_name.c_str(), options);
 
@@ -24,13 +65,14 @@ std::string vkshader::preprocess_shader(const std::string& source_name, shaderc_
 
 // Compiles a shader to a SPIR-V binary. Returns the binary as
 // a vector of 32-bit words.
-std::vector<uint32_t> vkshader::compile_file(const std::string& source_name, shaderc_shader_kind kind, const std::string& source, shaderc_optimization_level optimization) {
+std::vector<uint32_t> vkshader::compile_file(const std::string& source_name, shaderc_shader_kind kind, const std::string& source, shaderc_optimization_level optimization, const std::map<std::string, std::string>& includes) {
   shaderc::Compiler compiler;
   shaderc::CompileOptions options;
   options.SetTargetEnvironment(shaderc_target_env_vulkan, shaderc_env_version_vulkan_1_2);
   options.SetTargetSpirv(shaderc_spirv_version_1_4);
   options.SetOptimizationLevel(optimization);
   options.SetGenerateDebugInfo();
+  options.SetIncluder(std::make_unique<Includer>(includes));
   shaderc::SpvCompilationResult module = compiler.CompileGlslToSpv(source, kind, source_name.c_str(), options);
 
   if (module.GetCompilationStatus() != shaderc_compilation_status_success) {
@@ -6,10 +6,22 @@
 #include <vector>
 #include <sstream>
 #include <fstream>
+#include <map>
+#include <memory>
 #include <shaderc/shaderc.hpp>
 
 namespace vkshader
 {
-    std::string preprocess_shader(const std::string& source_name, shaderc_shader_kind kind, const std::string& source, shaderc_optimization_level optimization = shaderc_optimization_level_zero);
-    std::vector<uint32_t> compile_file(const std::string& source_name, shaderc_shader_kind kind,  const std::string& source, shaderc_optimization_level optimization = shaderc_optimization_level_zero);
+    // Resolves #include first against the generated sources in includes, then against files in SHADER_PATH.
+    class Includer : public shaderc::CompileOptions::IncluderInterface {
+    public:
+        Includer(const std::map<std::string, std::string>& includes);
+        shaderc_include_result* GetInclude(const char* requested_source, shaderc_include_type type, const char* requesting_source, size_t include_depth) override;
+        void ReleaseInclude(shaderc_include_result* data) override;
+    private:
+        std::map<std::string, std::string> _includes;
+    };
+
+    std::string preprocess_shader(const std::string& source_name, shaderc_shader_kind kind, const std::string& source, shaderc_optimization_level optimization = shaderc_optimization_level_zero, const std::map<std::string, std::string>& includes = {});
+    std::vector<uint32_t> compile_file(const std::string& source_name, shaderc_shader_kind kind,  const std::string& source, shaderc_optimization_level optimization = shaderc_optimization_level_zero, const std::map<std::string, std::string>& includes = {});
 };
\ No newline at end of file
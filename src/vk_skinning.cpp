@@ -0,0 +1,180 @@
+#include <vk_skinning.h>
+#include <vk_initializers.h>
+#include <array>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+
+namespace
+{
+    constexpr uint32_t groupSize = 64;
+}
+
+Skinning::Skinning()
+{
+}
+
+bool Skinning::init(vk::Core &core, Scene &scene, vk::ShaderModule shader, uint32_t framesInFlight)
+{
+    std::vector<Instance> instances;
+    uint32_t joints = 0;
+    for (uint32_t i = 0; i < scene.instancePosedVertices.size(); i++)
+    {
+        if (scene.instancePosedVertices[i] == UINT32_MAX)
+        {
+            continue;
+        }
+        Instance instance;
+        instance.instance = i;
+        instance.model = scene.models[scene.instanceModels[i]];
+        instance.firstJoint = joints;
+        instance.timeOffset = 0.37f * static_cast<float>(instances.size());
+        instance.pose = instance.model->restPose();
+        joints += instance.model->_jointCount;
+        instances.push_back(instance);
+    }
+    if (instances.empty() || joints == 0)
+    {
+        return false;
+    }
+
+    std::vector<vk::DescriptorSetLayoutBinding> bindings = {
+        {0, vk::DescriptorType::eStorageBuffer, scene.vertexLayout.streamCount(), vk::ShaderStageFlagBits::eCompute},
+        {1, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute},
+    };
+    vk::DescriptorSetLayoutCreateInfo setInfo;
+    setInfo.setBindings(bindings);
+    _setLayout = core._device.createDescriptorSetLayout(setInfo);
+
+    vk::PushConstantRange pushConstants{vk::ShaderStageFlagBits::eCompute, 0, sizeof(PushConstants)};
+    vk::PipelineLayoutCreateInfo pipelineLayoutInfo({}, _setLayout);
+    pipelineLayoutInfo.setPushConstantRanges(pushConstants);
+    _pipelineLayout = core._device.createPipelineLayout(pipelineLayoutInfo);
+    vk::ComputePipelineCreateInfo pipelineInfo({}, vkinit::pipeline_shader_stage_create_info(vk::ShaderStageFlagBits::eCompute, shader), _pipelineLayout);
+    vk::Result result;
+    std::tie(result, _pipeline) = core._device.createComputePipeline({}, pipelineInfo);
+    if (result != vk::Result::eSuccess)
+    {
+        throw std::runtime_error("failed to create the skinning pipeline!");
+    }
+
+    std::vector<vk::DescriptorPoolSize> poolSizes = {
+        {vk::DescriptorType::eStorageBuffer, (scene.vertexLayout.streamCount() + 1) * framesInFlight}
+    };
+    vk::DescriptorPoolCreateInfo poolInfo;
+    poolInfo.setMaxSets(framesInFlight);
+    poolInfo.setPoolSizes(poolSizes);
+    _descriptorPool = core._device.createDescriptorPool(poolInfo);
+
+    std::vector<vk::DescriptorBufferInfo> streamInfos;
+    for (const vkutils::BufferRange &range : scene.vertexBuffers)
+    {
+        streamInfos.push_back(range.descriptor());
+    }
+    for (uint32_t f = 0; f < framesInFlight; f++)
+    {
+        _jointBuffers.push_back(vkutils::createBuffer(core, static_cast<vk::DeviceSize>(joints) * sizeof(glm::mat4), vk::BufferUsageFlagBits::eStorageBuffer, vma::MemoryUsage::eAuto, vma::AllocationCreateFlagBits::eHostAccessSequentialWrite));
+        vk::DescriptorSetAllocateInfo allocInfo;
+        allocInfo.descriptorPool = _descriptorPool;
+        allocInfo.setSetLayouts(_setLayout);
+        _descriptorSets.push_back(core._device.allocateDescriptorSets(allocInfo).front());
+
+        vk::DescriptorBufferInfo jointInfo(_jointBuffers.back()._buffer, 0, VK_WHOLE_SIZE);
+        std::array<vk::WriteDescriptorSet, 2> writes;
+        writes[0].dstSet = _descriptorSets.back();
+        writes[0].dstBinding = 0;
+        writes[0].descriptorType = vk::DescriptorType::eStorageBuffer;
+        writes[0].setBufferInfo(streamInfos);
+        writes[1].dstSet = _descriptorSets.back();
+        writes[1].dstBinding = 1;
+        writes[1].descriptorType = vk::DescriptorType::eStorageBuffer;
+        writes[1].setBufferInfo(jointInfo);
+        core._device.updateDescriptorSets(writes, {});
+    }
+
+    _core = &core;
+    _scene = &scene;
+    _instances.swap(instances);
+    _time = 0.0f;
+    _stats = Stats{};
+    _stats.instances = static_cast<uint32_t>(_instances.size());
+    _stats.joints = joints;
+    _stats.vertices = scene.posedVertexCount;
+    std::cout << "Skinning " << _stats.instances << " instances with " << joints << " joints and " << scene.posedVertexCount << " posed vertices" << std::endl;
+    return true;
+}
+
+void Skinning::destroy()
+{
+    if (!active())
+    {
+        return;
+    }
+    for (vkutils::AllocatedBuffer &buffer : _jointBuffers)
+    {
+        vkutils::destroyBuffer(*_core, buffer);
+    }
+    _jointBuffers.clear();
+    _descriptorSets.clear();
+    _core->_device.destroyDescriptorPool(_descriptorPool);
+    _core->_device.destroyPipeline(_pipeline);
+    _core->_device.destroyPipelineLayout(_pipelineLayout);
+    _core->_device.destroyDescriptorSetLayout(_setLayout);
+    _instances.clear();
+    _core = nullptr;
+}
+
+void Skinning::update(vk::CommandBuffer cmd, uint32_t frame, float deltaTime)
+{
+    if (!active())
+    {
+        return;
+    }
+    _time += deltaTime;
+    uint32_t slot = frame % static_cast<uint32_t>(_jointBuffers.size());
+    vkutils::AllocatedBuffer &jointBuffer = _jointBuffers[slot];
+    glm::mat4 *joints = static_cast<glm::mat4 *>(_core->_allocator.mapMemory(jointBuffer._allocation));
+    for (Instance &instance : _instances)
+    {
+        const Model *model = instance.model;
+        if (!model->_animations.empty())
+        {
+            const Animation &animation = model->_animations.front();
+            float duration = animation.end - animation.start;
+            model->animate(instance.pose, animation, duration > 0.0f ? std::fmod(_time + instance.timeOffset, duration) : 0.0f);
+        }
+        model->updatePose(instance.pose);
+        model->jointMatrices(instance.pose, joints + instance.firstJoint);
+    }
+    _core->_allocator.unmapMemory(jointBuffer._allocation);
+    _core->_allocator.flushAllocation(jointBuffer._allocation, 0, VK_WHOLE_SIZE);
+
+    // the posed vertices are still read by the frames in flight, through the BLASes and the hit shaders
+    vk::MemoryBarrier readBarrier(vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eVertexAttributeRead, vk::AccessFlagBits::eShaderWrite);
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eRayTracingShaderKHR | vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR | vk::PipelineStageFlagBits::eVertexInput, vk::PipelineStageFlagBits::eComputeShader, {}, readBarrier, {}, {});
+    cmd.bindPipeline(vk::PipelineBindPoint::eCompute, _pipeline);
+    cmd.bindDescriptorSets(vk::PipelineBindPoint::eCompute, _pipelineLayout, 0, _descriptorSets[slot], {});
+    _stats.dispatches = 0;
+    for (const Instance &instance : _instances)
+    {
+        for (const Scene::SkinnedPrimitive &skinned : _scene->skinnedPrimitives)
+        {
+            if (skinned.model != _scene->instanceModels[instance.instance])
+            {
+                continue;
+            }
+            PushConstants constants;
+            constants.source = skinned.restVertex;
+            constants.target = _scene->posedVertex(instance.instance, skinned.primitive);
+            constants.count = skinned.primitive->vertexCount;
+            constants.firstJoint = instance.firstJoint + instance.model->_skinJointOffsets[skinned.node->skin];
+            cmd.pushConstants(_pipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, sizeof(PushConstants), &constants);
+            cmd.dispatch((constants.count + groupSize - 1) / groupSize, 1, 1);
+            _stats.dispatches++;
+        }
+    }
+    // the rasterizer draws the posed vertices as well
+    vk::MemoryBarrier writeBarrier(vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eVertexAttributeRead);
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eVertexInput | vk::PipelineStageFlagBits::eRayTracingShaderKHR, {}, writeBarrier, {}, {});
+    _scene->refitSkinnedBlas(cmd);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <Core.h>
+#include <vk_scene.h>
+
+// Poses the skinned models of a scene every frame. The cpu samples the first animation of every skinned
+// instance and flattens its node matrices into joint matrices, a compute pass skins the rest pose vertices
+// into the instance's posed range (see Scene::SkinnedPrimitive) and the scene refits the BLASes built from them.
+class Skinning {
+public:
+    class Stats {
+    public:
+        uint32_t instances = 0;
+        uint32_t joints = 0;
+        uint32_t vertices = 0;
+        uint32_t dispatches = 0;
+    };
+    Skinning();
+    // shader is skinning.comp compiled against the scene's vertex layout, returns false without skinned instances
+    bool init(vk::Core &core, Scene &scene, vk::ShaderModule shader, uint32_t framesInFlight);
+    void destroy();
+    // Advances the animations by deltaTime and records the skinning pass and the BLAS refits into cmd.
+    // The joint matrices go through the frame's own buffer, the one of framesInFlight frames ago is free again.
+    void update(vk::CommandBuffer cmd, uint32_t frame, float deltaTime);
+    const Stats &stats() const { return _stats; }
+    bool active() const { return _core != nullptr; }
+private:
+    struct Instance {
+        uint32_t instance = 0;
+        Model *model = nullptr;
+        // first of the instance's joint matrices in the joint buffer
+        uint32_t firstJoint = 0;
+        // instances of one model start at different points of the animation
+        float timeOffset = 0.0f;
+        Pose pose{};
+    };
+    struct PushConstants {
+        uint32_t source;
+        uint32_t target;
+        uint32_t count;
+        uint32_t firstJoint;
+    };
+    vk::Core *_core = nullptr;
+    Scene *_scene = nullptr;
+    std::vector<Instance> _instances{};
+    std::vector<vkutils::AllocatedBuffer> _jointBuffers{};
+    std::vector<vk::DescriptorSet> _descriptorSets{};
+    vk::DescriptorPool _descriptorPool;
+    vk::DescriptorSetLayout _setLayout;
+    vk::PipelineLayout _pipelineLayout;
+    vk::Pipeline _pipeline;
+    float _time = 0.0f;
+    Stats _stats{};
+};
@@ -0,0 +1,508 @@
+#include <vk_texture_streamer.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+namespace
+{
+    constexpr uint32_t neverUsed = UINT32_MAX;
+}
+
+TextureStreamer::TextureStreamer()
+{
+}
+
+bool TextureStreamer::init(vk::Core &core, Scene &scene, vk::DeviceSize budget)
+{
+    // scene.textures is the concatenation of the model textures followed by the scene's empty texture
+    std::vector<State> states(scene.textures.size());
+    size_t textureIndex = 0;
+    vk::DeviceSize residentBytes = 0;
+    vk::DeviceSize totalBytes = 0;
+    bool streamed = false;
+    for (Model *model : scene.models)
+    {
+        for (size_t t = 0; t < model->_textures.size(); t++, textureIndex++)
+        {
+            State &state = states[textureIndex];
+            state.owner = &model->_textures[t];
+            if (t >= model->_textureChains.size() || model->_textureChains[t].mipLevels < 2)
+            {
+                continue;
+            }
+            state.chain = &model->_textureChains[t];
+            state.residentLevel = state.owner->residentLevel;
+            state.baseLevel = state.residentLevel;
+            state.lastUsed.assign(state.chain->mipLevels, neverUsed);
+            residentBytes += state.chain->bytesFrom(state.residentLevel);
+            totalBytes += state.chain->bytesFrom(0);
+            streamed = true;
+        }
+    }
+    if (!streamed)
+    {
+        return false;
+    }
+
+    vk::PhysicalDeviceMemoryProperties memoryProperties = core._chosenGPU.getMemoryProperties();
+    for (uint32_t heap = 0; heap < memoryProperties.memoryHeapCount; heap++)
+    {
+        if (memoryProperties.memoryHeaps[heap].flags & vk::MemoryHeapFlagBits::eDeviceLocal)
+        {
+            _deviceLocalHeaps.push_back(heap);
+        }
+    }
+    if (core._transferQueueFamily != core._graphicsQueueFamily)
+    {
+        _transferPool = core._device.createCommandPool(vkinit::command_pool_create_info(core._transferQueueFamily));
+    }
+    _core = &core;
+    _scene = &scene;
+    _states.swap(states);
+    _budget = budget;
+    _residentBytes = residentBytes;
+    _stats.totalBytes = totalBytes;
+    _stop = false;
+    _thread = std::thread(&TextureStreamer::run, this);
+    std::cout << "Texture streaming: " << residentBytes / (1024.0 * 1024.0) << " MB of " << totalBytes / (1024.0 * 1024.0) << " MB resident, budget " << budget / (1024.0 * 1024.0) << " MB" << std::endl;
+    return true;
+}
+
+void TextureStreamer::destroy()
+{
+    if (!active())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _wake.notify_all();
+    _thread.join();
+    // runs once the frames of the scene passed the timeline, no frame references the queued jobs or replaced
+    // images anymore. Copies of queued jobs may still run on the transfer queue, release waits for them.
+    for (Job &job : _ready)
+    {
+        release(job);
+    }
+    _ready.clear();
+    for (Retired &retired : _retired)
+    {
+        _core->_device.destroyImageView(retired.image._view);
+        vkutils::destroyImage(*_core, retired.image);
+        vkutils::destroyBuffer(*_core, retired.staging);
+        releaseTransfer(retired.cmd, retired.semaphore, retired.fence);
+    }
+    _retired.clear();
+    if (_transferPool)
+    {
+        _core->_device.destroyCommandPool(_transferPool);
+        _transferPool = vk::CommandPool();
+    }
+    _core = nullptr;
+}
+
+void TextureStreamer::setBudget(vk::DeviceSize budget)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_budget != budget)
+    {
+        _budget = budget;
+        _wake.notify_one();
+    }
+}
+
+void TextureStreamer::setPaused(bool paused)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _paused = paused;
+}
+
+void TextureStreamer::update(const std::vector<uint32_t> &finestLevels, uint32_t frame)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _frame = frame;
+    bool wanted = false;
+    for (size_t t = 0; t < finestLevels.size() && t < _states.size(); t++)
+    {
+        State &state = _states[t];
+        if (!state.chain || finestLevels[t] == neverUsed)
+        {
+            continue;
+        }
+        uint32_t level = std::min(finestLevels[t], state.chain->mipLevels - 1);
+        state.lastUsed[level] = frame;
+        wanted |= level < state.residentLevel;
+    }
+    if (wanted)
+    {
+        _wake.notify_one();
+    }
+}
+
+std::vector<uint32_t> TextureStreamer::apply(vk::CommandBuffer cmd, uint32_t frame, uint32_t framesInFlight, std::vector<vk::Semaphore> &waitSemaphores)
+{
+    std::vector<uint32_t> changed;
+    if (!active())
+    {
+        return changed;
+    }
+    // images replaced framesInFlight frames ago are no longer referenced by a pending submission
+    for (auto it = _retired.begin(); it != _retired.end();)
+    {
+        if (frame - it->frame >= framesInFlight)
+        {
+            _core->_device.destroyImageView(it->image._view);
+            vkutils::destroyImage(*_core, it->image);
+            vkutils::destroyBuffer(*_core, it->staging);
+            releaseTransfer(it->cmd, it->semaphore, it->fence);
+            it = _retired.erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+
+    std::deque<Job> ready;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        ready.swap(_ready);
+    }
+    if (ready.empty())
+    {
+        return changed;
+    }
+    for (Job &job : ready)
+    {
+        uint32_t mipLevels = static_cast<uint32_t>(job.regions.size());
+        if (job.cmd)
+        {
+            // the acquire half of the release prepare recorded, it also finishes the layout transition. Its source
+            // stage is the one the frame submit waits for the copy's semaphore at, so the two chain
+            vk::ImageMemoryBarrier acquire({}, vk::AccessFlagBits::eShaderRead, vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eShaderReadOnlyOptimal, _core->_transferQueueFamily, _core->_graphicsQueueFamily, job.image._image, {vk::ImageAspectFlagBits::eColor, 0, mipLevels, 0, 1});
+            cmd.pipelineBarrier(vk::PipelineStageFlagBits::eRayTracingShaderKHR, vk::PipelineStageFlagBits::eRayTracingShaderKHR, {}, {}, {}, acquire);
+            waitSemaphores.push_back(job.semaphore);
+        }
+        else
+        {
+            vkutils::setImageLayout(cmd, job.image._image, vk::ImageLayout::eUndefined, vk::ImageLayout::eTransferDstOptimal, {vk::ImageAspectFlagBits::eColor, 0, mipLevels, 0, 1}, vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eTransfer);
+            cmd.copyBufferToImage(job.staging._buffer, job.image._image, vk::ImageLayout::eTransferDstOptimal, job.regions);
+            vkutils::setImageLayout(cmd, job.image._image, vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eShaderReadOnlyOptimal, {vk::ImageAspectFlagBits::eColor, 0, mipLevels, 0, 1}, vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eRayTracingShaderKHR);
+        }
+
+        State &state = _states[job.texture];
+        Texture &texture = *state.owner;
+        _retired.push_back(Retired{texture.image, job.staging, job.cmd, job.semaphore, job.fence, frame});
+        texture.image = job.image;
+        texture.descriptor.imageView = job.image._view;
+        texture.residentLevel = job.level;
+        _scene->textures[job.texture] = texture;
+        changed.push_back(job.texture);
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (Job &job : ready)
+    {
+        State &state = _states[job.texture];
+        if (job.level < state.residentLevel)
+        {
+            vk::DeviceSize bytes = levelBytes(state, job.level);
+            _residentBytes += bytes;
+            _incomingBytes -= bytes;
+            _stats.streamedLevels++;
+        }
+        else
+        {
+            vk::DeviceSize bytes = levelBytes(state, state.residentLevel);
+            _residentBytes -= bytes;
+            _outgoingBytes -= bytes;
+            _stats.evictedLevels++;
+        }
+        state.residentLevel = job.level;
+        state.pending = false;
+    }
+    _wake.notify_one();
+    return changed;
+}
+
+TextureStreamer::Stats TextureStreamer::stats()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    Stats stats = _stats;
+    stats.textures = 0;
+    stats.residentLevels = 0;
+    stats.totalLevels = 0;
+    stats.pending = 0;
+    for (const State &state : _states)
+    {
+        if (state.chain)
+        {
+            stats.textures++;
+            stats.residentLevels += state.chain->mipLevels - state.residentLevel;
+            stats.totalLevels += state.chain->mipLevels;
+            stats.pending += state.pending ? 1 : 0;
+        }
+    }
+    stats.residentBytes = _residentBytes;
+    return stats;
+}
+
+void TextureStreamer::run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_stop)
+    {
+        uint32_t texture;
+        uint32_t level;
+        if (_ready.size() >= maxReady || !plan(texture, level))
+        {
+            // also wakes up periodically, the heap budget changes without anyone telling
+            _wake.wait_for(lock, std::chrono::milliseconds(50));
+            continue;
+        }
+        lock.unlock();
+        Job job;
+        bool prepared = true;
+        try
+        {
+            job = prepare(texture, level);
+        }
+        catch (std::exception &e)
+        {
+            std::cerr << "Exception Thrown: " << e.what() << std::endl;
+            prepared = false;
+        }
+        lock.lock();
+        if (prepared)
+        {
+            _ready.push_back(std::move(job));
+            continue;
+        }
+        // out of memory most likely, undo the plan and back off before trying again
+        State &state = _states[texture];
+        if (level < state.residentLevel)
+        {
+            _incomingBytes -= levelBytes(state, level);
+        }
+        else
+        {
+            _outgoingBytes -= levelBytes(state, state.residentLevel);
+        }
+        state.pending = false;
+        _wake.wait_for(lock, std::chrono::seconds(1));
+    }
+}
+
+vk::DeviceSize TextureStreamer::limit()
+{
+    vk::DeviceSize target = _budget;
+    if (_deviceLocalHeaps.empty())
+    {
+        return target;
+    }
+    std::vector<vma::Budget> budgets = _core->_allocator.getHeapBudgets();
+    vk::DeviceSize usage = 0;
+    vk::DeviceSize heapBudget = 0;
+    for (uint32_t heap : _deviceLocalHeaps)
+    {
+        usage += budgets[heap].usage;
+        heapBudget += budgets[heap].budget;
+    }
+    _stats.heapUsage = usage;
+    _stats.heapBudget = heapBudget;
+    // leave a tenth of what the driver grants to the rest of the renderer and other applications
+    vk::DeviceSize usable = heapBudget - heapBudget / 10;
+    if (usage > usable)
+    {
+        vk::DeviceSize over = usage - usable;
+        return std::min(target, _residentBytes > over ? _residentBytes - over : 0);
+    }
+    return std::min(target, _residentBytes + _incomingBytes + (usable - usage));
+}
+
+bool TextureStreamer::plan(uint32_t &texture, uint32_t &level)
+{
+    if (_paused)
+    {
+        return false;
+    }
+    vk::DeviceSize target = limit();
+    _stats.budgetBytes = target;
+    vk::DeviceSize planned = _residentBytes + _incomingBytes - _outgoingBytes;
+    if (planned > target)
+    {
+        if (!pickEviction(false, texture))
+        {
+            return false;
+        }
+        State &state = _states[texture];
+        level = state.residentLevel + 1;
+        _outgoingBytes += levelBytes(state, state.residentLevel);
+        state.pending = true;
+        return true;
+    }
+
+    // the texture that most recently sampled a level finer than it holds goes first
+    uint32_t best = neverUsed;
+    uint32_t bestFrame = 0;
+    for (uint32_t t = 0; t < _states.size(); t++)
+    {
+        const State &state = _states[t];
+        if (!state.chain || state.pending || state.residentLevel == 0)
+        {
+            continue;
+        }
+        for (uint32_t l = 0; l < state.residentLevel; l++)
+        {
+            uint32_t used = state.lastUsed[l];
+            if (used != neverUsed && _frame - used <= keepFrames && (best == neverUsed || used > bestFrame || (used == bestFrame && state.residentLevel > _states[best].residentLevel)))
+            {
+                best = t;
+                bestFrame = used;
+            }
+        }
+    }
+    if (best == neverUsed)
+    {
+        return false;
+    }
+    State &state = _states[best];
+    vk::DeviceSize bytes = levelBytes(state, state.residentLevel - 1);
+    if (planned + bytes > target)
+    {
+        // make room with levels nobody sampled for a while
+        uint32_t victim;
+        if (!pickEviction(true, victim) || victim == best)
+        {
+            return false;
+        }
+        State &victimState = _states[victim];
+        texture = victim;
+        level = victimState.residentLevel + 1;
+        _outgoingBytes += levelBytes(victimState, victimState.residentLevel);
+        victimState.pending = true;
+        return true;
+    }
+    texture = best;
+    level = state.residentLevel - 1;
+    _incomingBytes += bytes;
+    state.pending = true;
+    return true;
+}
+
+bool TextureStreamer::pickEviction(bool staleOnly, uint32_t &texture)
+{
+    // least recently used finest resident level, a finer request keeps the resident top in use as well
+    bool found = false;
+    uint32_t oldestAge = 0;
+    for (uint32_t t = 0; t < _states.size(); t++)
+    {
+        const State &state = _states[t];
+        if (!state.chain || state.pending || state.residentLevel >= state.baseLevel)
+        {
+            continue;
+        }
+        uint32_t lastUse = neverUsed;
+        for (uint32_t l = 0; l <= state.residentLevel; l++)
+        {
+            if (state.lastUsed[l] != neverUsed && (lastUse == neverUsed || state.lastUsed[l] > lastUse))
+            {
+                lastUse = state.lastUsed[l];
+            }
+        }
+        uint32_t age = lastUse == neverUsed ? neverUsed : _frame - lastUse;
+        if (staleOnly && age <= keepFrames)
+        {
+            continue;
+        }
+        if (!found || age > oldestAge)
+        {
+            found = true;
+            oldestAge = age;
+            texture = t;
+        }
+    }
+    return found;
+}
+
+TextureStreamer::Job TextureStreamer::prepare(uint32_t texture, uint32_t level)
+{
+    // the chain is never modified after loading, only the allocations need the (internally synchronized) allocator
+    const TextureChain &chain = *_states[texture].chain;
+    Job job;
+    job.texture = texture;
+    job.level = level;
+    vk::ImageCreateInfo imageInfo = chain.imageInfo(level);
+    imageInfo.usage |= vk::ImageUsageFlagBits::eTransferDst;
+    job.image = vkutils::createImage(*_core, imageInfo, vk::ImageAspectFlagBits::eColor, vma::MemoryUsage::eAutoPreferDevice);
+    try
+    {
+        job.staging = vkutils::hostBufferFromData(*_core, const_cast<unsigned char *>(chain.data.data() + chain.levelOffsets[level]), chain.bytesFrom(level), vk::BufferUsageFlagBits::eTransferSrc, vma::MemoryUsage::eAutoPreferHost, vma::AllocationCreateFlagBits::eHostAccessSequentialWrite);
+    }
+    catch (...)
+    {
+        _core->_device.destroyImageView(job.image._view);
+        vkutils::destroyImage(*_core, job.image);
+        throw;
+    }
+    std::vector<size_t> offsets = chain.offsetsFrom(level);
+    for (uint32_t l = 0; l < imageInfo.mipLevels; l++)
+    {
+        vk::BufferImageCopy region;
+        region.bufferOffset = offsets[l];
+        region.imageSubresource = vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, l, 0, 1);
+        region.imageExtent = vk::Extent3D{std::max(imageInfo.extent.width >> l, 1u), std::max(imageInfo.extent.height >> l, 1u), 1};
+        job.regions.push_back(region);
+    }
+    if (_transferPool)
+    {
+        // the copy runs on the transfer queue while frames render, the image is released to the graphics family
+        std::lock_guard<std::mutex> lock(_poolMutex);
+        job.cmd = vkutils::getCommandBuffer(*_core, vk::CommandBufferLevel::ePrimary, 1, _transferPool);
+        job.cmd.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+        vkutils::setImageLayout(job.cmd, job.image._image, vk::ImageLayout::eUndefined, vk::ImageLayout::eTransferDstOptimal, {vk::ImageAspectFlagBits::eColor, 0, imageInfo.mipLevels, 0, 1}, vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eTransfer);
+        job.cmd.copyBufferToImage(job.staging._buffer, job.image._image, vk::ImageLayout::eTransferDstOptimal, job.regions);
+        vk::ImageMemoryBarrier releaseBarrier(vk::AccessFlagBits::eTransferWrite, {}, vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eShaderReadOnlyOptimal, _core->_transferQueueFamily, _core->_graphicsQueueFamily, job.image._image, {vk::ImageAspectFlagBits::eColor, 0, imageInfo.mipLevels, 0, 1});
+        job.cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe, {}, {}, {}, releaseBarrier);
+        job.cmd.end();
+        job.semaphore = _core->_device.createSemaphore(vk::SemaphoreCreateInfo());
+        job.fence = _core->_device.createFence(vk::FenceCreateInfo());
+        vk::SubmitInfo submitInfo{};
+        submitInfo.setCommandBuffers(job.cmd);
+        submitInfo.setSignalSemaphores(job.semaphore);
+        _core->submit(_core->_transferQueue, submitInfo, job.fence);
+    }
+    return job;
+}
+
+vk::DeviceSize TextureStreamer::levelBytes(const State &state, uint32_t level) const
+{
+    return state.chain->levelOffsets[level + 1] - state.chain->levelOffsets[level];
+}
+
+void TextureStreamer::release(Job &job)
+{
+    _core->_device.destroyImageView(job.image._view);
+    vkutils::destroyImage(*_core, job.image);
+    vkutils::destroyBuffer(*_core, job.staging);
+    releaseTransfer(job.cmd, job.semaphore, job.fence);
+}
+
+void TextureStreamer::releaseTransfer(vk::CommandBuffer cmd, vk::Semaphore semaphore, vk::Fence fence)
+{
+    if (!cmd)
+    {
+        return;
+    }
+    // retired copies were waited on by a frame that completed, their fence is long signaled
+    if (_core->_device.waitForFences(fence, VK_TRUE, UINT64_MAX) != vk::Result::eSuccess)
+    {
+        std::cerr << "Waiting for a texture streaming copy failed" << std::endl;
+    }
+    _core->_device.destroyFence(fence);
+    std::lock_guard<std::mutex> lock(_poolMutex);
+    _core->_device.freeCommandBuffers(_transferPool, cmd);
+    _core->_device.destroySemaphore(semaphore);
+}
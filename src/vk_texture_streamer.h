@@ -0,0 +1,114 @@
+#pragma once
+
+#include <Core.h>
+#include <vk_scene.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// Streams the finer mip levels of a scene's textures in the background. Models built with _streamTextures
+// upload only a coarse tail of every chain, the texture feedback of the path tracer tells which levels were
+// sampled and a worker thread prepares images with those levels while the resident bytes stay under the budget.
+// Without sparse residency the levels of a texture are always one image, so streaming a level in or evicting
+// one recreates the image with one level more or less and swaps it in between frames.
+// With a dedicated transfer queue the worker also records and submits the copies there and releases the images
+// to the graphics family, the frame that swaps them in acquires them and waits for the copy's semaphore.
+class TextureStreamer {
+public:
+    class Stats {
+    public:
+        uint32_t textures = 0;
+        // levels on the gpu out of all levels of all streamed chains
+        uint32_t residentLevels = 0;
+        uint32_t totalLevels = 0;
+        vk::DeviceSize residentBytes = 0;
+        vk::DeviceSize totalBytes = 0;
+        vk::DeviceSize budgetBytes = 0;
+        // device local heaps as reported by VK_EXT_memory_budget
+        vk::DeviceSize heapUsage = 0;
+        vk::DeviceSize heapBudget = 0;
+        uint32_t pending = 0;
+        uint64_t streamedLevels = 0;
+        uint64_t evictedLevels = 0;
+    };
+    // a level that was not sampled for this many frames is stale and the first to be evicted
+    uint32_t keepFrames = 120;
+    // finished images waiting for apply, the worker idles once this many are queued
+    uint32_t maxReady = 4;
+    TextureStreamer();
+    // Picks up every texture of scene whose model kept its chain, returns false when there is none.
+    bool init(vk::Core &core, Scene &scene, vk::DeviceSize budget);
+    void destroy();
+    void setBudget(vk::DeviceSize budget);
+    void setPaused(bool paused);
+    // finestLevels[t] is the finest level of texture t sampled in frame, UINT32_MAX when it was not sampled
+    void update(const std::vector<uint32_t> &finestLevels, uint32_t frame);
+    // Records the copies of finished images, or their acquires, into cmd and swaps them into the scene and its
+    // models. Returns the textures whose descriptor changed, the replaced images are destroyed once framesInFlight
+    // frames passed. The submit of cmd has to wait for the semaphores added to waitSemaphores.
+    std::vector<uint32_t> apply(vk::CommandBuffer cmd, uint32_t frame, uint32_t framesInFlight, std::vector<vk::Semaphore> &waitSemaphores);
+    Stats stats();
+    bool active() const { return _core != nullptr; }
+private:
+    struct State {
+        // the model's texture, the scene holds a copy that apply keeps in sync
+        Texture *owner = nullptr;
+        const TextureChain *chain = nullptr;
+        uint32_t residentLevel = 0;
+        // level the model loaded, eviction never goes coarser
+        uint32_t baseLevel = 0;
+        bool pending = false;
+        // frame every level was last sampled in, UINT32_MAX when never
+        std::vector<uint32_t> lastUsed{};
+    };
+    struct Job {
+        uint32_t texture = 0;
+        uint32_t level = 0;
+        vkutils::AllocatedImage image{};
+        vkutils::AllocatedBuffer staging{};
+        std::vector<vk::BufferImageCopy> regions{};
+        // copy submitted to the transfer queue, signals semaphore and fence
+        vk::CommandBuffer cmd{};
+        vk::Semaphore semaphore{};
+        vk::Fence fence{};
+    };
+    struct Retired {
+        vkutils::AllocatedImage image{};
+        vkutils::AllocatedBuffer staging{};
+        vk::CommandBuffer cmd{};
+        vk::Semaphore semaphore{};
+        vk::Fence fence{};
+        uint32_t frame = 0;
+    };
+    vk::Core *_core = nullptr;
+    Scene *_scene = nullptr;
+    std::vector<State> _states{};
+    std::vector<uint32_t> _deviceLocalHeaps{};
+    std::deque<Job> _ready{};
+    std::vector<Retired> _retired{};
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    // only with a dedicated transfer family, the worker records into it and apply frees, both under _poolMutex
+    vk::CommandPool _transferPool{};
+    std::mutex _poolMutex;
+    bool _stop = false;
+    bool _paused = false;
+    uint32_t _frame = 0;
+    vk::DeviceSize _budget = 0;
+    vk::DeviceSize _residentBytes = 0;
+    // planned but not yet applied, so the worker does not overshoot while jobs wait for apply
+    vk::DeviceSize _incomingBytes = 0;
+    vk::DeviceSize _outgoingBytes = 0;
+    Stats _stats{};
+    void run();
+    bool plan(uint32_t &texture, uint32_t &level);
+    bool pickEviction(bool staleOnly, uint32_t &texture);
+    vk::DeviceSize limit();
+    Job prepare(uint32_t texture, uint32_t level);
+    vk::DeviceSize levelBytes(const State &state, uint32_t level) const;
+    void release(Job &job);
+    // waits for the copy's fence first, jobs destroyed before apply were never waited on by a frame
+    void releaseTransfer(vk::CommandBuffer cmd, vk::Semaphore semaphore, vk::Fence fence);
+};
@@ -0,0 +1,154 @@
+#include <vk_threadpool.h>
+#include <algorithm>
+
+namespace
+{
+    // index of the worker queue owned by the current thread, threads outside the pool have none
+    thread_local size_t currentQueue = SIZE_MAX;
+}
+
+vkutils::ThreadPool::ThreadPool(uint32_t threadCount)
+{
+    if (threadCount == 0)
+    {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (uint32_t i = 0; i < threadCount; i++)
+    {
+        _queues.push_back(std::make_unique<Queue>());
+    }
+    for (uint32_t i = 0; i < threadCount; i++)
+    {
+        _workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+vkutils::ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_wakeMutex);
+        _stop = true;
+    }
+    _wake.notify_all();
+    for (auto& worker : _workers)
+    {
+        worker.join();
+    }
+}
+
+uint32_t vkutils::ThreadPool::size() const
+{
+    return static_cast<uint32_t>(_workers.size());
+}
+
+vkutils::ThreadPool& vkutils::ThreadPool::shared()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+void vkutils::ThreadPool::submit(std::function<void()> task)
+{
+    size_t queue = currentQueue != SIZE_MAX ? currentQueue : _nextQueue++ % _queues.size();
+    push(queue, std::move(task));
+}
+
+void vkutils::ThreadPool::parallelFor(size_t count, const std::function<void(size_t)>& task, size_t grain)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    grain = std::max<size_t>(grain, 1);
+    size_t chunks = (count + grain - 1) / grain;
+    std::atomic<size_t> remaining{chunks};
+    // spread the chunks round robin so every worker starts with local work, stealing evens out the rest
+    for (size_t chunk = 0; chunk < chunks; chunk++)
+    {
+        size_t begin = chunk * grain;
+        size_t end = std::min(begin + grain, count);
+        push(chunk % _queues.size(), [&task, &remaining, begin, end]() {
+            for (size_t i = begin; i < end; i++)
+            {
+                task(i);
+            }
+            remaining--;
+        });
+    }
+    size_t home = currentQueue != SIZE_MAX ? currentQueue : 0;
+    std::function<void()> work;
+    while (remaining > 0)
+    {
+        if (pop(home, work))
+        {
+            work();
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void vkutils::ThreadPool::push(size_t queue, std::function<void()> task)
+{
+    // counted before it is visible, a worker that takes it right away must not decrement below zero
+    {
+        std::lock_guard<std::mutex> lock(_wakeMutex);
+        _pending++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_queues[queue]->mutex);
+        _queues[queue]->tasks.push_back(std::move(task));
+    }
+    _wake.notify_one();
+}
+
+bool vkutils::ThreadPool::pop(size_t queue, std::function<void()>& task)
+{
+    {
+        Queue& own = *_queues[queue];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            _pending--;
+            return true;
+        }
+    }
+    for (size_t i = 1; i < _queues.size(); i++)
+    {
+        Queue& victim = *_queues[(queue + i) % _queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            _pending--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void vkutils::ThreadPool::workerLoop(size_t index)
+{
+    currentQueue = index;
+    std::function<void()> task;
+    while (true)
+    {
+        if (pop(index, task))
+        {
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(_wakeMutex);
+        _wake.wait(lock, [this]() { return _stop || _pending > 0; });
+        if (_stop && _pending == 0)
+        {
+            return;
+        }
+    }
+}
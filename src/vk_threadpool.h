@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace vkutils
+{
+    // Fixed size pool with one task deque per worker. Workers pop their own deque from the back
+    // and steal from the front of the others when it runs dry.
+    class ThreadPool {
+    public:
+        explicit ThreadPool(uint32_t threadCount = 0);
+        ~ThreadPool();
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+        uint32_t size() const;
+        void submit(std::function<void()> task);
+        // Runs task(i) for every i in [0, count) and blocks until all are done. The calling thread helps out,
+        // so this may also be called from inside a task.
+        void parallelFor(size_t count, const std::function<void(size_t)>& task, size_t grain = 1);
+        static ThreadPool& shared();
+    private:
+        struct Queue {
+            std::mutex mutex;
+            std::deque<std::function<void()>> tasks;
+        };
+        std::vector<std::thread> _workers;
+        std::vector<std::unique_ptr<Queue>> _queues;
+        std::mutex _wakeMutex;
+        std::condition_variable _wake;
+        std::atomic<size_t> _pending{0};
+        std::atomic<uint32_t> _nextQueue{0};
+        bool _stop{false};
+        void push(size_t queue, std::function<void()> task);
+        bool pop(size_t queue, std::function<void()>& task);
+        void workerLoop(size_t index);
+    };
+}
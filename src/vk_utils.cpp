@@ -60,6 +60,34 @@ void vkutils::DeletionQueue::flush()
     deletors.clear();
 }
 
+void vkutils::DeferredDeletionQueue::push(uint64_t value, DeletionQueue &&queue)
+{
+    if (queue.deletors.empty())
+    {
+        return;
+    }
+    queues.emplace_back(value, std::move(queue));
+    queue.deletors.clear();
+}
+
+void vkutils::DeferredDeletionQueue::collect(uint64_t completedValue)
+{
+    while (!queues.empty() && queues.front().first <= completedValue)
+    {
+        queues.front().second.flush();
+        queues.pop_front();
+    }
+}
+
+void vkutils::DeferredDeletionQueue::flush()
+{
+    for (auto it = queues.rbegin(); it != queues.rend(); it++)
+    {
+        it->second.flush();
+    }
+    queues.clear();
+}
+
 bool vkutils::QueueFamilyIndices::isComplete()
 {
     return graphicsFamily.has_value() && presentFamily.has_value();
@@ -155,13 +183,14 @@ bool vkutils::isDeviceSuitable(vk::PhysicalDevice &physicalDevice, vk::SurfaceKH
     }
 
     // auto m_deviceProperties2 = pDevice.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceRayTracingPipelinePropertiesKHR, vk::PhysicalDeviceAccelerationStructurePropertiesKHR, vk::PhysicalDeviceDescriptorIndexingProperties>();
-    auto m_deviceFeatures2 = physicalDevice.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceRayTracingPipelineFeaturesKHR, vk::PhysicalDeviceAccelerationStructureFeaturesKHR, vk::PhysicalDeviceBufferDeviceAddressFeatures, vk::PhysicalDeviceDescriptorIndexingFeatures, vk::PhysicalDeviceShaderAtomicFloatFeaturesEXT>();
+    auto m_deviceFeatures2 = physicalDevice.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceRayTracingPipelineFeaturesKHR, vk::PhysicalDeviceAccelerationStructureFeaturesKHR, vk::PhysicalDeviceBufferDeviceAddressFeatures, vk::PhysicalDeviceDescriptorIndexingFeatures, vk::PhysicalDeviceShaderAtomicFloatFeaturesEXT, vk::PhysicalDeviceTimelineSemaphoreFeatures>();
     bool supportsAllEssentialFeatures =
         m_deviceFeatures2.get<vk::PhysicalDeviceFeatures2>().features.samplerAnisotropy &&
         m_deviceFeatures2.get<vk::PhysicalDeviceRayTracingPipelineFeaturesKHR>().rayTracingPipeline &&
         m_deviceFeatures2.get<vk::PhysicalDeviceAccelerationStructureFeaturesKHR>().accelerationStructure &&
         m_deviceFeatures2.get<vk::PhysicalDeviceBufferDeviceAddressFeatures>().bufferDeviceAddress &&
         m_deviceFeatures2.get<vk::PhysicalDeviceDescriptorIndexingFeatures>().runtimeDescriptorArray &&
+        m_deviceFeatures2.get<vk::PhysicalDeviceTimelineSemaphoreFeatures>().timelineSemaphore &&
         m_deviceFeatures2.get<vk::PhysicalDeviceShaderAtomicFloatFeaturesEXT>().shaderBufferFloat32Atomics && 
         m_deviceFeatures2.get<vk::PhysicalDeviceShaderAtomicFloatFeaturesEXT>().shaderBufferFloat32AtomicAdd;
 
@@ -187,6 +216,22 @@ vkutils::QueueFamilyIndices vkutils::findQueueFamilies(vk::PhysicalDevice &physi
             break;
         }
     }
+    for (uint32_t i = 0; i < queueFamilies.size(); i++)
+    {
+        vk::QueueFlags flags = queueFamilies[i].queueFlags;
+        if (flags & vk::QueueFlagBits::eGraphics)
+        {
+            continue;
+        }
+        if ((flags & vk::QueueFlagBits::eCompute) && !indices.computeFamily)
+        {
+            indices.computeFamily = i;
+        }
+        else if ((flags & vk::QueueFlagBits::eTransfer) && !(flags & vk::QueueFlagBits::eCompute) && !indices.transferFamily)
+        {
+            indices.transferFamily = i;
+        }
+    }
     return indices;
 }
 
@@ -254,17 +299,17 @@ vk::Extent2D vkutils::chooseSwapExtent(const vk::SurfaceCapabilitiesKHR &capabil
     }
 }
 
-vk::CommandBuffer vkutils::getCommandBuffer(vk::Core &core, vk::CommandBufferLevel level, uint32_t count){
+vk::CommandBuffer vkutils::getCommandBuffer(vk::Core &core, vk::CommandBufferLevel level, uint32_t count, vk::CommandPool pool){
     vk::CommandBufferAllocateInfo allocInfo;
     allocInfo.level = vk::CommandBufferLevel::ePrimary;
-    allocInfo.commandPool = core._cmdPool;
+    allocInfo.commandPool = pool ? pool : core._loadCmdPool;
     allocInfo.commandBufferCount = 1;
     return core._device.allocateCommandBuffers(allocInfo).front();
 }
 
-vk::ImageView vkutils::createImageView(vk::Core &core, vk::Image &image, vk::Format &format, vk::ImageAspectFlags aspectFlags)
+vk::ImageView vkutils::createImageView(vk::Core &core, vk::Image &image, vk::Format &format, vk::ImageAspectFlags aspectFlags, uint32_t mipLevels)
 {
-    vk::ImageViewCreateInfo createInfo({}, image, vk::ImageViewType::e2D, format, {}, vk::ImageSubresourceRange(aspectFlags, 0, 1, 0, 1));
+    vk::ImageViewCreateInfo createInfo({}, image, vk::ImageViewType::e2D, format, {}, vk::ImageSubresourceRange(aspectFlags, 0, mipLevels, 0, 1));
     vk::ImageView imageView;
     try
     {
@@ -277,35 +322,37 @@ vk::ImageView vkutils::createImageView(vk::Core &core, vk::Image &image, vk::For
     return imageView;
 }
 
-vkutils::AllocatedBuffer vkutils::createBuffer(vk::Core &core, vk::DeviceSize size, vk::BufferUsageFlags bufferUsage, vma::MemoryUsage memoryUsage, vma::AllocationCreateFlags memoryFlags)
+vkutils::AllocatedBuffer vkutils::createBuffer(vk::Core &core, vk::DeviceSize size, vk::BufferUsageFlags bufferUsage, vma::MemoryUsage memoryUsage, vma::AllocationCreateFlags memoryFlags, bool queueShared, MemoryCategory category, vk::DeviceSize minAlignment)
 {
     vk::BufferCreateInfo bufferInfo;
 	bufferInfo.size = size;
 	bufferInfo.usage = bufferUsage;
+    std::vector<uint32_t> queueFamilies = core.queueFamilies();
+    if (queueShared && queueFamilies.size() > 1)
+    {
+        bufferInfo.sharingMode = vk::SharingMode::eConcurrent;
+        bufferInfo.setQueueFamilyIndices(queueFamilies);
+    }
 	
 	vma::AllocationCreateInfo bufferAllocInfo;
 	bufferAllocInfo.usage = memoryUsage;
 	bufferAllocInfo.flags = memoryFlags;
 
     vkutils::AllocatedBuffer allocatedBuffer;
-	std::pair<vma::Allocation, vk::Buffer> result = core._allocator.createBuffer(bufferInfo, bufferAllocInfo);
+	std::pair<vma::Allocation, vk::Buffer> result = minAlignment ? core._allocator.createBufferWithAlignment(bufferInfo, bufferAllocInfo, minAlignment)
+                                                                 : core._allocator.createBuffer(bufferInfo, bufferAllocInfo);
     allocatedBuffer._allocation = result.first;
     allocatedBuffer._buffer = result.second;
+    core._memoryTelemetry.track(allocatedBuffer._allocation, category == MemoryCategory::eInferred ? MemoryTelemetry::categorize(bufferUsage) : category);
     return allocatedBuffer;
 }
 
 vkutils::AllocatedBuffer vkutils::deviceBufferFromData(vk::Core &core, void* data, vk::DeviceSize size, vk::BufferUsageFlags bufferUsage, vma::MemoryUsage memoryUsage, vma::AllocationCreateFlags memoryFlags)
 {
-    vkutils::AllocatedBuffer stagingBuffer = vkutils::createBuffer(core, size, vk::BufferUsageFlagBits::eTransferSrc, vma::MemoryUsage::eAuto, vma::AllocationCreateFlagBits::eHostAccessSequentialWrite);
-
-    void* mapped = core._allocator.mapMemory(stagingBuffer._allocation);
-	    memcpy(mapped, data, size);
-	core._allocator.unmapMemory(stagingBuffer._allocation);
-
-    vkutils::AllocatedBuffer buffer = vkutils::createBuffer(core, size, vk::BufferUsageFlagBits::eTransferDst | bufferUsage, memoryUsage, memoryFlags);
-    vkutils::copyBuffer(core, stagingBuffer._buffer, buffer._buffer, size);
-    core._allocator.destroyBuffer(stagingBuffer._buffer, stagingBuffer._allocation);
-
+    // a ring of exactly the data's size, loaders with many buffers keep one UploadContext instead
+    UploadContext upload(core, size);
+    vkutils::AllocatedBuffer buffer = upload.buffer(data, size, bufferUsage, memoryUsage, memoryFlags);
+    upload.finish();
     return buffer;
 }
 
@@ -320,7 +367,7 @@ vkutils::AllocatedBuffer vkutils::hostBufferFromData(vk::Core &core, void* data,
     return buffer;
 }
 
-vkutils::AllocatedImage vkutils::createImage(vk::Core &core, vk::ImageCreateInfo imageInfo, vk::ImageAspectFlags aspectFlags, vma::MemoryUsage memoryUsage, vma::AllocationCreateFlags memoryFlags)
+vkutils::AllocatedImage vkutils::createImage(vk::Core &core, vk::ImageCreateInfo imageInfo, vk::ImageAspectFlags aspectFlags, vma::MemoryUsage memoryUsage, vma::AllocationCreateFlags memoryFlags, MemoryCategory category)
 {
     vma::AllocationCreateInfo imageAllocInfo;
 	imageAllocInfo.usage = memoryUsage;
@@ -330,11 +377,24 @@ vkutils::AllocatedImage vkutils::createImage(vk::Core &core, vk::ImageCreateInfo
 	std::pair<vma::Allocation, vk::Image> result = core._allocator.createImage(imageInfo, imageAllocInfo);
     allocatedImage._allocation = result.first;
     allocatedImage._image = result.second;
-    allocatedImage._view = vkutils::createImageView(core, allocatedImage._image, imageInfo.format, aspectFlags);
+    allocatedImage._view = vkutils::createImageView(core, allocatedImage._image, imageInfo.format, aspectFlags, imageInfo.mipLevels);
+    core._memoryTelemetry.track(allocatedImage._allocation, category == MemoryCategory::eInferred ? MemoryTelemetry::categorize(imageInfo.usage) : category);
 
     return allocatedImage;
 }
 
+void vkutils::destroyBuffer(vk::Core &core, const AllocatedBuffer &buffer)
+{
+    core._memoryTelemetry.untrack(buffer._allocation);
+    core._allocator.destroyBuffer(buffer._buffer, buffer._allocation);
+}
+
+void vkutils::destroyImage(vk::Core &core, const AllocatedImage &image)
+{
+    core._memoryTelemetry.untrack(image._allocation);
+    core._allocator.destroyImage(image._image, image._allocation);
+}
+
 vkutils::AllocatedImage vkutils::imageFromData(vk::Core &core, void* data, vk::ImageCreateInfo imageInfo, vk::ImageAspectFlags aspectFlags, vma::MemoryUsage memoryUsage, vma::AllocationCreateFlags memoryFlags)
 {
     vk::DeviceSize pixelSize = 4;
@@ -353,27 +413,419 @@ vkutils::AllocatedImage vkutils::imageFromData(vk::Core &core, void* data, vk::I
             pixelSize = 6;
             break;
     }
-    vkutils::AllocatedBuffer srcBuffer = hostBufferFromData(core, data, imageInfo.extent.width * imageInfo.extent.height * pixelSize, vk::BufferUsageFlagBits::eTransferSrc, vma::MemoryUsage::eAutoPreferHost, vma::AllocationCreateFlagBits::eHostAccessSequentialWrite);
-    
+    vk::DeviceSize size = static_cast<vk::DeviceSize>(imageInfo.extent.width) * imageInfo.extent.height * pixelSize;
+    UploadContext upload(core, size);
+    vkutils::AllocatedImage image = upload.image(data, size, imageInfo, aspectFlags, memoryUsage, memoryFlags);
+    upload.finish();
+    return image;
+}
+
+vkutils::AllocatedImage vkutils::imageFromMipChain(vk::Core &core, void* data, const std::vector<size_t> &levelOffsets, vk::ImageCreateInfo imageInfo, vk::ImageAspectFlags aspectFlags, vma::MemoryUsage memoryUsage, vma::AllocationCreateFlags memoryFlags)
+{
+    UploadContext upload(core, levelOffsets.back());
+    vkutils::AllocatedImage image = upload.mipChain(data, levelOffsets, imageInfo, aspectFlags, memoryUsage, memoryFlags);
+    upload.finish();
+    return image;
+}
+
+void vkutils::BufferArena::init(vk::Core &core, vk::BufferUsageFlags usage, vk::DeviceSize blockSize, vk::DeviceSize alignment)
+{
+    this->core = &core;
+    this->usage = usage | vk::BufferUsageFlagBits::eShaderDeviceAddress;
+    this->blockSize = blockSize;
+    this->alignment = alignment;
+}
+
+bool vkutils::BufferArena::allocateFrom(uint32_t block, vk::DeviceSize size, BufferRange &range)
+{
+    vma::VirtualAllocationCreateInfo createInfo;
+    createInfo.size = size;
+    createInfo.alignment = alignment;
+    vk::DeviceSize offset = 0;
+    try
+    {
+        range.allocation = _blocks[block].virtualBlock.virtualAllocate(createInfo, &offset);
+    }
+    catch (vk::SystemError &)
+    {
+        return false;
+    }
+    range.buffer = _blocks[block].buffer._buffer;
+    range.offset = offset;
+    range.size = size;
+    range.address = _blocks[block].address + offset;
+    range.block = block;
+    return true;
+}
+
+vkutils::BufferRange vkutils::BufferArena::allocate(vk::DeviceSize size, MemoryCategory category)
+{
+    BufferRange range;
+    if (size == 0)
+    {
+        return range;
+    }
+    bool allocated = false;
+    for (uint32_t b = 0; b < _blocks.size() && !allocated; b++)
+    {
+        allocated = _blocks[b].buffer._buffer && allocateFrom(b, size, range);
+    }
+    if (!allocated)
+    {
+        Block block;
+        block.size = std::max(blockSize, size);
+        block.buffer = createBuffer(*core, block.size, usage, vma::MemoryUsage::eAutoPreferDevice, {}, true, MemoryCategory::eArena, alignment);
+        block.address = core->_device.getBufferAddress(vk::BufferDeviceAddressInfo(block.buffer._buffer));
+        block.virtualBlock = vma::createVirtualBlock(vma::VirtualBlockCreateInfo(block.size));
+        uint32_t index = 0;
+        while (index < _blocks.size() && _blocks[index].buffer._buffer)
+        {
+            index++;
+        }
+        if (index == _blocks.size())
+        {
+            _blocks.push_back(block);
+        }
+        else
+        {
+            _blocks[index] = block;
+        }
+        if (!allocateFrom(index, size, range))
+        {
+            throw std::runtime_error("failed to allocate from a new arena block!");
+        }
+    }
+    range.category = category;
+    _ranges++;
+    _usedBytes += size;
+    core->_memoryTelemetry.transfer(MemoryCategory::eArena, category, size);
+    return range;
+}
+
+void vkutils::BufferArena::free(BufferRange &range)
+{
+    if (!range)
+    {
+        return;
+    }
+    Block &block = _blocks[range.block];
+    block.virtualBlock.virtualFree(range.allocation);
+    _ranges--;
+    _usedBytes -= range.size;
+    core->_memoryTelemetry.transfer(range.category, MemoryCategory::eArena, range.size);
+    // the first block stays until destroy, so the owner's later ranges like build scratch reuse it, the others were
+    // only needed for a peak. The arena belongs to one Scene and goes with it, nothing carries over to the next load.
+    if (range.block != 0 && block.virtualBlock.isVirtualBlockEmpty())
+    {
+        block.virtualBlock.destroy();
+        destroyBuffer(*core, block.buffer);
+        block = Block{};
+    }
+    range = BufferRange{};
+}
+
+void vkutils::BufferArena::destroy()
+{
+    for (Block &block : _blocks)
+    {
+        if (block.buffer._buffer)
+        {
+            block.virtualBlock.clearVirtualBlock();
+            block.virtualBlock.destroy();
+            destroyBuffer(*core, block.buffer);
+        }
+    }
+    _blocks.clear();
+    _ranges = 0;
+    _usedBytes = 0;
+}
+
+uint32_t vkutils::BufferArena::blockCount() const
+{
+    uint32_t count = 0;
+    for (const Block &block : _blocks)
+    {
+        count += block.buffer._buffer ? 1 : 0;
+    }
+    return count;
+}
+
+vk::DeviceSize vkutils::BufferArena::blockBytes() const
+{
+    vk::DeviceSize bytes = 0;
+    for (const Block &block : _blocks)
+    {
+        bytes += block.buffer._buffer ? block.size : 0;
+    }
+    return bytes;
+}
+
+vkutils::UploadContext::UploadContext(vk::Core &core, vk::DeviceSize ringSize) : core(&core), ringSize(std::max<vk::DeviceSize>(ringSize, 256)), _start(std::chrono::high_resolution_clock::now())
+{
+    ring = createBuffer(core, this->ringSize, vk::BufferUsageFlagBits::eTransferSrc, vma::MemoryUsage::eAutoPreferHost, vma::AllocationCreateFlagBits::eHostAccessSequentialWrite);
+    _ringData = static_cast<unsigned char *>(core._allocator.mapMemory(ring._allocation));
+}
+
+vkutils::UploadContext::~UploadContext()
+{
+    finish();
+    core->_allocator.unmapMemory(ring._allocation);
+    vkutils::destroyBuffer(*core, ring);
+}
+
+vk::CommandBuffer vkutils::UploadContext::commandBuffer()
+{
+    if (!recording._cmd)
+    {
+        recording._cmd = getCommandBuffer(*core, vk::CommandBufferLevel::ePrimary, 1, core->_transferCmdPool);
+        vk::CommandBufferBeginInfo beginInfo{};
+        beginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+        recording._cmd.begin(beginInfo);
+    }
+    return recording._cmd;
+}
+
+vk::CommandBuffer vkutils::UploadContext::toGraphics(vk::Image image, uint32_t mipLevels)
+{
+    if (core->_transferQueueFamily == core->_graphicsQueueFamily)
+    {
+        return recording._cmd;
+    }
+    if (!recording._acquireCmd)
+    {
+        recording._acquireCmd = getCommandBuffer(*core);
+        vk::CommandBufferBeginInfo beginInfo{};
+        beginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+        recording._acquireCmd.begin(beginInfo);
+    }
+    // the layout stays, the graphics side transitions it after the acquire
+    vk::ImageMemoryBarrier barrier({}, {}, vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eTransferDstOptimal, core->_transferQueueFamily, core->_graphicsQueueFamily, image, {vk::ImageAspectFlagBits::eColor, 0, mipLevels, 0, 1});
+    barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+    recording._cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe, {}, {}, {}, barrier);
+    barrier.srcAccessMask = {};
+    barrier.dstAccessMask = vk::AccessFlagBits::eTransferRead | vk::AccessFlagBits::eTransferWrite;
+    // from the stage the acquire submit waits for the transfer semaphore at, so the wait and the acquire chain
+    recording._acquireCmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer, {}, {}, {}, barrier);
+    return recording._acquireCmd;
+}
+
+void vkutils::UploadContext::release(AllocatedBuffer buffer)
+{
+    commandBuffer();
+    recording._staging.push_back(buffer);
+}
+
+vk::DeviceSize vkutils::UploadContext::stage(const void *data, vk::DeviceSize size, vk::DeviceSize alignment, vk::Buffer &stagingBuffer)
+{
+    uploadedBytes += size;
+    if (size > ringSize)
+    {
+        vkutils::AllocatedBuffer staging = hostBufferFromData(*core, const_cast<void *>(data), size, vk::BufferUsageFlagBits::eTransferSrc, vma::MemoryUsage::eAutoPreferHost, vma::AllocationCreateFlagBits::eHostAccessSequentialWrite);
+        release(staging);
+        stagingBuffer = staging._buffer;
+        return 0;
+    }
+    // the free bytes run from _ringHead around to the oldest submission's range, a copy that does not fit
+    // before the end of the ring skips the rest and starts at 0
+    vk::DeviceSize offset;
+    vk::DeviceSize taken;
+    while (true)
+    {
+        if (_ringUsed == 0)
+        {
+            _ringHead = 0;
+        }
+        offset = (_ringHead + alignment - 1) / alignment * alignment;
+        if (offset + size > ringSize)
+        {
+            offset = 0;
+            taken = ringSize - _ringHead + size;
+        }
+        else
+        {
+            taken = offset + size - _ringHead;
+        }
+        if (taken <= ringSize - _ringUsed)
+        {
+            break;
+        }
+        if (inFlight.empty())
+        {
+            submit();
+        }
+        retire(inFlight.front());
+        inFlight.pop_front();
+    }
+    memcpy(_ringData + offset, data, size);
+    core->_allocator.flushAllocation(ring._allocation, offset, size);
+    _ringHead = (offset + size) % ringSize;
+    _ringUsed += taken;
+    commandBuffer();
+    recording._ringBytes += taken;
+    stagingBuffer = ring._buffer;
+    return offset;
+}
+
+vkutils::AllocatedBuffer vkutils::UploadContext::buffer(const void *data, vk::DeviceSize size, vk::BufferUsageFlags bufferUsage, vma::MemoryUsage memoryUsage, vma::AllocationCreateFlags memoryFlags)
+{
+    vkutils::AllocatedBuffer buffer = createBuffer(*core, size, vk::BufferUsageFlagBits::eTransferDst | bufferUsage, memoryUsage, memoryFlags, true);
+    copy(data, size, buffer._buffer);
+    return buffer;
+}
+
+void vkutils::UploadContext::copy(const void *data, vk::DeviceSize size, vk::Buffer dstBuffer, vk::DeviceSize dstOffset)
+{
+    if (size == 0)
+    {
+        return;
+    }
+    vk::Buffer stagingBuffer;
+    vk::DeviceSize offset = stage(data, size, 16, stagingBuffer);
+    recording._cmd.copyBuffer(stagingBuffer, dstBuffer, vk::BufferCopy(offset, dstOffset, size));
+    if (recording._ringBytes >= ringSize / 2)
+    {
+        submit();
+    }
+}
+
+vkutils::AllocatedImage vkutils::UploadContext::image(const void *data, vk::DeviceSize size, vk::ImageCreateInfo imageInfo, vk::ImageAspectFlags aspectFlags, vma::MemoryUsage memoryUsage, vma::AllocationCreateFlags memoryFlags)
+{
+    imageInfo.usage |= vk::ImageUsageFlagBits::eTransferDst;
+    if (imageInfo.mipLevels > 1)
+    {
+        imageInfo.usage |= vk::ImageUsageFlagBits::eTransferSrc;
+    }
+    vkutils::AllocatedImage dstImage = createImage(*core, imageInfo, aspectFlags, memoryUsage, memoryFlags);
+
+    // buffer offsets of image copies have to be a multiple of the texel size
+    vk::DeviceSize texelSize = std::max<vk::DeviceSize>(size / (static_cast<vk::DeviceSize>(imageInfo.extent.width) * imageInfo.extent.height), 4);
+    vk::Buffer stagingBuffer;
+    vk::BufferImageCopy copyRegion;
+    copyRegion.bufferOffset = stage(data, size, texelSize, stagingBuffer);
+    copyRegion.imageSubresource = vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0, 1);
+    copyRegion.imageExtent = vk::Extent3D{imageInfo.extent.width, imageInfo.extent.height, 1};
+    vk::CommandBuffer cmd = recording._cmd;
+    setImageLayout(cmd, dstImage._image, vk::ImageLayout::eUndefined, vk::ImageLayout::eTransferDstOptimal, {vk::ImageAspectFlagBits::eColor, 0, imageInfo.mipLevels, 0, 1});
+    cmd.copyBufferToImage(stagingBuffer, dstImage._image, vk::ImageLayout::eTransferDstOptimal, copyRegion);
+    // blits need a graphics queue
+    cmd = toGraphics(dstImage._image, imageInfo.mipLevels);
+    if (imageInfo.mipLevels > 1)
+    {
+        generateMipmaps(cmd, dstImage._image, imageInfo.extent.width, imageInfo.extent.height, imageInfo.mipLevels);
+    }
+    else
+    {
+        setImageLayout(cmd, dstImage._image, vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eShaderReadOnlyOptimal, {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1});
+    }
+    if (recording._ringBytes >= ringSize / 2)
+    {
+        submit();
+    }
+    return dstImage;
+}
+
+vkutils::AllocatedImage vkutils::UploadContext::mipChain(const void *data, const std::vector<size_t> &levelOffsets, vk::ImageCreateInfo imageInfo, vk::ImageAspectFlags aspectFlags, vma::MemoryUsage memoryUsage, vma::AllocationCreateFlags memoryFlags)
+{
+    // levelOffsets has one entry per level plus the total size of the chain, every level comes from the cpu (filtered or read from a file)
     imageInfo.usage |= vk::ImageUsageFlagBits::eTransferDst;
-    vkutils::AllocatedImage dstImage = createImage(core, imageInfo, aspectFlags, memoryUsage, memoryFlags);
+    vkutils::AllocatedImage dstImage = createImage(*core, imageInfo, aspectFlags, memoryUsage, memoryFlags);
 
-    copyImageBuffer(core, srcBuffer._buffer, dstImage._image, imageInfo.extent.width, imageInfo.extent.height);
+    // 16 covers rgba8 texels and both BCn block sizes
+    vk::Buffer stagingBuffer;
+    vk::DeviceSize offset = stage(data, levelOffsets.back(), 16, stagingBuffer);
+    std::vector<vk::BufferImageCopy> copyRegions;
+    for (uint32_t level = 0; level < imageInfo.mipLevels; level++)
+    {
+        vk::BufferImageCopy copyRegion;
+        copyRegion.bufferOffset = offset + levelOffsets[level];
+        copyRegion.imageSubresource = vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, level, 0, 1);
+        copyRegion.imageExtent = vk::Extent3D{std::max(imageInfo.extent.width >> level, 1u), std::max(imageInfo.extent.height >> level, 1u), 1};
+        copyRegions.push_back(copyRegion);
+    }
 
-    core._allocator.destroyBuffer(srcBuffer._buffer, srcBuffer._allocation);
+    vk::CommandBuffer cmd = recording._cmd;
+    setImageLayout(cmd, dstImage._image, vk::ImageLayout::eUndefined, vk::ImageLayout::eTransferDstOptimal, {vk::ImageAspectFlagBits::eColor, 0, imageInfo.mipLevels, 0, 1});
+    cmd.copyBufferToImage(stagingBuffer, dstImage._image, vk::ImageLayout::eTransferDstOptimal, copyRegions);
+    cmd = toGraphics(dstImage._image, imageInfo.mipLevels);
+    setImageLayout(cmd, dstImage._image, vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eShaderReadOnlyOptimal, {vk::ImageAspectFlagBits::eColor, 0, imageInfo.mipLevels, 0, 1});
+    if (recording._ringBytes >= ringSize / 2)
+    {
+        submit();
+    }
     return dstImage;
 }
 
-void vkutils::copyBuffer(vk::Core &core, vk::Buffer srcBuffer, vk::Buffer dstBuffer, vk::DeviceSize size)
+void vkutils::UploadContext::submit()
 {
-    vk::CommandBufferAllocateInfo allocInfo{};
-    allocInfo.level = vk::CommandBufferLevel::ePrimary;
-    allocInfo.commandPool = core._cmdPool;
-    allocInfo.commandBufferCount = 1;
+    if (!recording._cmd)
+    {
+        return;
+    }
+    recording._cmd.end();
+    recording._fence = core->_device.createFence(vk::FenceCreateInfo());
+    vk::SubmitInfo submitInfo{};
+    submitInfo.setCommandBuffers(recording._cmd);
+    if (recording._acquireCmd)
+    {
+        recording._acquireCmd.end();
+        recording._semaphore = core->_device.createSemaphore(vk::SemaphoreCreateInfo());
+        submitInfo.setSignalSemaphores(recording._semaphore);
+        core->submit(core->_transferQueue, submitInfo, {});
+        vk::PipelineStageFlags waitStage = vk::PipelineStageFlagBits::eTransfer;
+        vk::SubmitInfo acquireInfo{};
+        acquireInfo.setWaitSemaphores(recording._semaphore);
+        acquireInfo.setWaitDstStageMask(waitStage);
+        acquireInfo.setCommandBuffers(recording._acquireCmd);
+        core->submit(core->_loadQueue, acquireInfo, recording._fence);
+    }
+    else
+    {
+        core->submit(core->_transferQueue, submitInfo, recording._fence);
+    }
+    inFlight.push_back(std::move(recording));
+    recording = Submission();
+    submitCount++;
+}
+
+void vkutils::UploadContext::finish()
+{
+    submit();
+    while (!inFlight.empty())
+    {
+        retire(inFlight.front());
+        inFlight.pop_front();
+    }
+    _seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - _start).count();
+}
 
-    vk::CommandBuffer commandBuffer;
-    std::vector<vk::CommandBuffer> commandBuffers = core._device.allocateCommandBuffers(allocInfo);
-    commandBuffer = commandBuffers[0];
+double vkutils::UploadContext::megabytesPerSecond() const
+{
+    return _seconds > 0.0 ? uploadedBytes / (1024.0 * 1024.0) / _seconds : 0.0;
+}
+
+void vkutils::UploadContext::retire(Submission &submission)
+{
+    if (core->_device.waitForFences(submission._fence, true, UINT64_MAX) != vk::Result::eSuccess)
+    {
+        std::cerr << "Upload fence wait failed" << std::endl;
+    }
+    core->_device.destroyFence(submission._fence);
+    core->_device.freeCommandBuffers(core->_transferCmdPool, submission._cmd);
+    if (submission._acquireCmd)
+    {
+        core->_device.freeCommandBuffers(core->_loadCmdPool, submission._acquireCmd);
+        core->_device.destroySemaphore(submission._semaphore);
+    }
+    for (auto &staging : submission._staging)
+    {
+        vkutils::destroyBuffer(*core, staging);
+    }
+    _ringUsed -= submission._ringBytes;
+}
+
+void vkutils::copyBuffer(vk::Core &core, vk::Buffer srcBuffer, vk::Buffer dstBuffer, vk::DeviceSize size)
+{
+    vk::CommandBuffer commandBuffer = getCommandBuffer(core);
 
     vk::CommandBufferBeginInfo beginInfo{};
     beginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
@@ -386,31 +838,19 @@ void vkutils::copyBuffer(vk::Core &core, vk::Buffer srcBuffer, vk::Buffer dstBuf
 
     commandBuffer.end();
 
-    vk::SubmitInfo submitInfo{};
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffer;
-
-    core._graphicsQueue.submit(submitInfo, nullptr);
-    core._graphicsQueue.waitIdle();
-
-    core._device.freeCommandBuffers(core._cmdPool, 1, &commandBuffer);
+    core.submitLoadAndWait(commandBuffer);
 }
 
-void vkutils::copyImageBuffer(vk::Core &core, vk::Buffer srcBuffer, vk::Image dstImage, uint32_t width, uint32_t height)
+void vkutils::copyImageBuffer(vk::Core &core, vk::Buffer srcBuffer, vk::Image dstImage, uint32_t width, uint32_t height, uint32_t mipLevels)
 {
-    vk::CommandBufferAllocateInfo allocInfo{};
-    allocInfo.level = vk::CommandBufferLevel::ePrimary;
-    allocInfo.commandPool = core._cmdPool;
-    allocInfo.commandBufferCount = 1;
-
-    vk::CommandBuffer cmd = core._device.allocateCommandBuffers(allocInfo).front();
+    vk::CommandBuffer cmd = getCommandBuffer(core);
 
     vk::CommandBufferBeginInfo beginInfo{};
     beginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
 
     cmd.begin(beginInfo);
 
-        setImageLayout(cmd, dstImage, vk::ImageLayout::eUndefined,  vk::ImageLayout::eTransferDstOptimal, {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1});
+        setImageLayout(cmd, dstImage, vk::ImageLayout::eUndefined,  vk::ImageLayout::eTransferDstOptimal, {vk::ImageAspectFlagBits::eColor, 0, mipLevels, 0, 1});
 
         vk::BufferImageCopy copyRegion;
         copyRegion.bufferOffset = 0;
@@ -424,18 +864,18 @@ void vkutils::copyImageBuffer(vk::Core &core, vk::Buffer srcBuffer, vk::Image ds
         copyRegion.imageExtent = vk::Extent3D{width, height, 1};
         cmd.copyBufferToImage(srcBuffer, dstImage,vk::ImageLayout::eTransferDstOptimal, 1, &copyRegion);
 
-        setImageLayout(cmd, dstImage, vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eShaderReadOnlyOptimal, {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1});
+        if (mipLevels > 1)
+        {
+            generateMipmaps(cmd, dstImage, width, height, mipLevels);
+        }
+        else
+        {
+            setImageLayout(cmd, dstImage, vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eShaderReadOnlyOptimal, {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1});
+        }
 
     cmd.end();
 
-    vk::SubmitInfo submitInfo{};
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &cmd;
-
-    core._graphicsQueue.submit(submitInfo, nullptr);
-    core._graphicsQueue.waitIdle();
-
-    core._device.freeCommandBuffers(core._cmdPool, 1, &cmd);
+    core.submitLoadAndWait(cmd);
 }
 
 void vkutils::setImageLayout(vk::CommandBuffer cmd, vk::Image image, vk::ImageLayout oldLayout, vk::ImageLayout newLayout, vk::ImageSubresourceRange subresourceRange, vk::PipelineStageFlags srcMask, vk::PipelineStageFlags dstMask)
@@ -512,6 +952,29 @@ void vkutils::setImageLayout(vk::CommandBuffer cmd, vk::Image image, vk::ImageLa
     cmd.pipelineBarrier(srcMask, dstMask, {}, {}, {}, barrier);
 }
 
+void vkutils::generateMipmaps(vk::CommandBuffer cmd, vk::Image image, uint32_t width, uint32_t height, uint32_t mipLevels)
+{
+    // expects every level in eTransferDstOptimal with level 0 filled, leaves every level in eShaderReadOnlyOptimal
+    int32_t levelWidth = static_cast<int32_t>(width);
+    int32_t levelHeight = static_cast<int32_t>(height);
+    for (uint32_t level = 1; level < mipLevels; level++)
+    {
+        setImageLayout(cmd, image, vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eTransferSrcOptimal, {vk::ImageAspectFlagBits::eColor, level - 1, 1, 0, 1}, vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer);
+
+        vk::ImageBlit blit;
+        blit.srcSubresource = vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, level - 1, 0, 1);
+        blit.srcOffsets[1] = vk::Offset3D{levelWidth, levelHeight, 1};
+        levelWidth = std::max(levelWidth / 2, 1);
+        levelHeight = std::max(levelHeight / 2, 1);
+        blit.dstSubresource = vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, level, 0, 1);
+        blit.dstOffsets[1] = vk::Offset3D{levelWidth, levelHeight, 1};
+        cmd.blitImage(image, vk::ImageLayout::eTransferSrcOptimal, image, vk::ImageLayout::eTransferDstOptimal, blit, vk::Filter::eLinear);
+
+        setImageLayout(cmd, image, vk::ImageLayout::eTransferSrcOptimal, vk::ImageLayout::eShaderReadOnlyOptimal, {vk::ImageAspectFlagBits::eColor, level - 1, 1, 0, 1}, vk::PipelineStageFlagBits::eTransfer);
+    }
+    setImageLayout(cmd, image, vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eShaderReadOnlyOptimal, {vk::ImageAspectFlagBits::eColor, mipLevels - 1, 1, 0, 1}, vk::PipelineStageFlagBits::eTransfer);
+}
+
 vk::TransformMatrixKHR vkutils::getTransformMatrixKHR(glm::mat4 mat)
 {
     vk::TransformMatrixKHR transformMatrix{};
@@ -520,6 +983,23 @@ vk::TransformMatrixKHR vkutils::getTransformMatrixKHR(glm::mat4 mat)
     return transformMatrix;
 }
 
+bool vkutils::boxInFrustum(const glm::mat4 &viewProjection, const glm::vec3 &min, const glm::vec3 &max)
+{
+    // planes from the rows of the matrix, near uses w + z so it holds for both depth ranges
+    glm::mat4 rows = glm::transpose(viewProjection);
+    glm::vec4 planes[6] = {rows[3] + rows[0], rows[3] - rows[0], rows[3] + rows[1], rows[3] - rows[1], rows[3] + rows[2], rows[3] - rows[2]};
+    for (const glm::vec4 &plane : planes)
+    {
+        // the corner furthest along the plane normal
+        glm::vec3 corner(plane.x >= 0.0f ? max.x : min.x, plane.y >= 0.0f ? max.y : min.y, plane.z >= 0.0f ? max.z : min.z);
+        if (glm::dot(glm::vec3(plane), corner) + plane.w < 0.0f)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
 uint32_t vkutils::alignedSize(uint32_t value, uint32_t alignment)
 {
     return (value + alignment - 1) & ~(alignment - 1);
@@ -4,6 +4,7 @@
 #include <set>
 #include <functional>
 #include <deque>
+#include <chrono>
 
 namespace vkutils
 {
@@ -30,6 +31,32 @@ namespace vkutils
         // Sampling
         bool mips;
         float mips_sensitivity;
+        // Textures
+        bool texture_lod;
+        bool texture_feedback;
+        uint64_t texture_bytes_touched;
+        bool texture_streaming;
+        uint32_t texture_budget_mb;
+        // residency of the streamed textures, filled in by the engine every frame
+        bool texture_streaming_active;
+        uint32_t texture_resident_levels;
+        uint32_t texture_total_levels;
+        uint32_t texture_pending;
+        uint64_t texture_resident_bytes;
+        uint64_t texture_total_bytes;
+        uint64_t texture_limit_bytes;
+        uint64_t texture_heap_usage;
+        uint64_t texture_heap_budget;
+        uint64_t texture_streamed_levels;
+        uint64_t texture_evicted_levels;
+        // Memory
+        bool memory_dump_at_exit;
+        // Scene
+        bool animate_instances;
+        // set by the GUI's benchmark button, the engine loads the benchmark scene and clears it
+        bool load_instance_benchmark;
+        // set by the engine when the scene was built with dynamic instances
+        bool dynamic_instances_active;
         //Tonemapping
         uint32_t tm_operator;
         float tm_param_linear;
@@ -56,6 +83,7 @@ namespace vkutils
         float exposure;
         uint32_t mips;
         float mips_sensitivity;
+        uint32_t texture_lod;
         uint32_t tonemapper;
         float tonemapper_param_1;
         float tonemapper_param_2;
@@ -86,7 +114,6 @@ namespace vkutils
     class FrameData {
     public: 
         vk::Semaphore _presentSemaphore, _renderSemaphore;
-        vk::Fence _renderFence;	
         vk::CommandPool _commandPool;
         vk::CommandBuffer _mainCommandBuffer;
 	    vk::DescriptorSet _rasterizerDescriptor;
@@ -94,6 +121,7 @@ namespace vkutils
         vk::DescriptorSet _computeDescriptor;
         AllocatedImage _storageImage;
         AllocatedBuffer _imageStats;
+        AllocatedBuffer _textureFeedback;
     };
     class PushConstants {
     public:
@@ -128,11 +156,25 @@ namespace vkutils
         void push_function(std::function<void()>&& function);
         void flush();
     };
+    // DeletionQueues held back until a timeline semaphore reached the value they were pushed with, the value of
+    // the last submission that used their resources. Values have to be pushed in increasing order.
+    class DeferredDeletionQueue
+    {
+    public:
+        std::deque<std::pair<uint64_t, DeletionQueue>> queues;
+        void push(uint64_t value, DeletionQueue &&queue);
+        // flushes every queue whose value the semaphore has reached
+        void collect(uint64_t completedValue);
+        void flush();
+    };
     class QueueFamilyIndices
     {
     public:
         std::optional<uint32_t> graphicsFamily;
         std::optional<uint32_t> presentFamily;
+        // families without graphics, transfer only and compute without graphics, empty when the device has none
+        std::optional<uint32_t> transferFamily;
+        std::optional<uint32_t> computeFamily;
         bool isComplete();
     };
     class SwapChainSupportDetails
@@ -162,6 +204,11 @@ namespace vkutils
         float transmissionFactor;
 	    float ior;
         uint32_t alphaMode;
+        // vk::IndexType of the primitive's index range, padded so modelMatrix keeps its std430 alignment
+        uint32_t indexType;
+        // 1 when normalTexture is a two channel map, the shaders rebuild its z from x and y
+        uint32_t normalTwoChannel;
+        uint32_t pad[2];
         glm::mat4 modelMatrix;
 	};
     class LightProxy {
@@ -179,6 +226,116 @@ namespace vkutils
         float center[3];
         float radiosity;
     };
+    // an aligned range of one of a BufferArena's blocks
+    class BufferRange {
+    public:
+        vk::Buffer buffer;
+        vk::DeviceSize offset = 0;
+        vk::DeviceSize size = 0;
+        vk::DeviceAddress address = 0;
+        uint32_t block = 0;
+        vma::VirtualAllocation allocation;
+        MemoryCategory category = MemoryCategory::eOther;
+        explicit operator bool() const { return static_cast<bool>(buffer); }
+        vk::DescriptorBufferInfo descriptor() const { return vk::DescriptorBufferInfo(buffer, offset, size); }
+    };
+    // Sub-allocates device buffers out of a few large ones instead of one VMA allocation each. Every block is a
+    // queueShared buffer with all of the arena's usages and a vma::VirtualBlock hands out ranges of it, so ranges
+    // share one buffer, one allocation and one device address base. A block is blockSize or as large as the
+    // request that did not fit elsewhere, blocks besides the first are freed together with their last range.
+    // Ranges have to be freed only once the gpu is done with them, like any buffer.
+    class BufferArena {
+    public:
+        vk::Core *core = nullptr;
+        vk::BufferUsageFlags usage;
+        vk::DeviceSize blockSize = 0;
+        // power of two every range offset and every block's memory is aligned to, so device addresses are as well.
+        // Has to cover the scratch offset alignment of acceleration structure builds.
+        vk::DeviceSize alignment = 256;
+        void init(vk::Core &core, vk::BufferUsageFlags usage, vk::DeviceSize blockSize, vk::DeviceSize alignment = 256);
+        BufferRange allocate(vk::DeviceSize size, MemoryCategory category);
+        void free(BufferRange &range);
+        void destroy();
+        uint32_t blockCount() const;
+        uint32_t rangeCount() const { return _ranges; }
+        vk::DeviceSize blockBytes() const;
+        vk::DeviceSize usedBytes() const { return _usedBytes; }
+    private:
+        struct Block {
+            AllocatedBuffer buffer;
+            vk::DeviceSize size = 0;
+            vk::DeviceAddress address = 0;
+            vma::VirtualBlock virtualBlock;
+        };
+        // freed blocks stay as empty entries, ranges refer to their block by index
+        std::vector<Block> _blocks{};
+        uint32_t _ranges = 0;
+        vk::DeviceSize _usedBytes = 0;
+        bool allocateFrom(uint32_t block, vk::DeviceSize size, BufferRange &range);
+    };
+    // Uploads through one persistently mapped staging ring instead of a staging buffer and a queue drain per
+    // resource. Copies are recorded into the current command buffer, which is submitted with a fence once it
+    // staged half the ring or when the ring runs short. A submission owns the ring range it staged from until
+    // its fence signaled, uploads bigger than the whole ring get a staging buffer of their own.
+    // The copies run on the transfer queue. With a dedicated transfer family every image is released to the
+    // graphics family, which acquires it in a second command buffer on the load queue behind a semaphore and
+    // also generates the blitted mips there. Buffers are created queueShared and need no ownership transfer.
+    class UploadContext {
+    public:
+        class Submission {
+        public:
+            vk::CommandBuffer _cmd;
+            // acquires and mip blits on the load queue, only with a dedicated transfer family
+            vk::CommandBuffer _acquireCmd;
+            vk::Semaphore _semaphore;
+            vk::Fence _fence;
+            // buffers destroyed once the submission retired, oversized staging and release()d ones
+            std::vector<AllocatedBuffer> _staging;
+            // ring bytes taken including alignment and the padding skipped at a wrap
+            vk::DeviceSize _ringBytes = 0;
+        };
+        vk::Core *core;
+        vk::DeviceSize ringSize;
+        AllocatedBuffer ring;
+        Submission recording;
+        std::deque<Submission> inFlight;
+        uint32_t submitCount = 0;
+        vk::DeviceSize uploadedBytes = 0;
+        UploadContext(vk::Core &core, vk::DeviceSize ringSize = 64 * 1024 * 1024);
+        UploadContext(const UploadContext &) = delete;
+        UploadContext &operator=(const UploadContext &) = delete;
+        // finishes and frees the ring
+        ~UploadContext();
+        AllocatedBuffer buffer(const void *data, vk::DeviceSize size, vk::BufferUsageFlags bufferUsage, vma::MemoryUsage memoryUsage = vma::MemoryUsage::eAuto, vma::AllocationCreateFlags memoryFlags = {});
+        // into a range of an existing buffer, which needs eTransferDst and has to be queueShared
+        void copy(const void *data, vk::DeviceSize size, vk::Buffer dstBuffer, vk::DeviceSize dstOffset = 0);
+        // level 0 is copied from data, further levels are blitted like in imageFromData
+        AllocatedImage image(const void *data, vk::DeviceSize size, vk::ImageCreateInfo imageInfo, vk::ImageAspectFlags aspectFlags, vma::MemoryUsage memoryUsage, vma::AllocationCreateFlags memoryFlags = {});
+        // every level is copied, levelOffsets as in imageFromMipChain
+        AllocatedImage mipChain(const void *data, const std::vector<size_t> &levelOffsets, vk::ImageCreateInfo imageInfo, vk::ImageAspectFlags aspectFlags, vma::MemoryUsage memoryUsage, vma::AllocationCreateFlags memoryFlags = {});
+        // the transfer command buffer being recorded, for copies between queueShared device buffers that run in
+        // order with the uploads
+        vk::CommandBuffer commandBuffer();
+        // destroys buffer once the commands recorded so far completed
+        void release(AllocatedBuffer buffer);
+        void submit();
+        // submits what is left and waits for every submission, everything uploaded is ready to use afterwards
+        void finish();
+        // over the time since construction until the last finish()
+        double megabytesPerSecond() const;
+    private:
+        unsigned char *_ringData = nullptr;
+        // next free ring byte and the bytes between the oldest unretired submission and it
+        vk::DeviceSize _ringHead = 0;
+        vk::DeviceSize _ringUsed = 0;
+        std::chrono::high_resolution_clock::time_point _start;
+        double _seconds = 0.0;
+        // copies data into the ring, returns the buffer and offset the copy reads from
+        vk::DeviceSize stage(const void *data, vk::DeviceSize size, vk::DeviceSize alignment, vk::Buffer &stagingBuffer);
+        // records the release of image to the graphics family and returns the command buffer that acquired it
+        vk::CommandBuffer toGraphics(vk::Image image, uint32_t mipLevels);
+        void retire(Submission &submission);
+    };
     VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity, VkDebugUtilsMessageTypeFlagsEXT messageTypes, const VkDebugUtilsMessengerCallbackDataEXT *pCallbackData, void *pUserData);
     bool checkValidationLayerSupport(std::vector<const char *> &instanceLayers);
     bool isDeviceSuitable(vk::PhysicalDevice &physicalDevice, vk::SurfaceKHR &surface, std::vector<const char *> &device_extensions);
@@ -188,16 +345,25 @@ namespace vkutils
     vk::SurfaceFormatKHR chooseSwapSurfaceFormat(const std::vector<vk::SurfaceFormatKHR> &availableFormats);
     vk::PresentModeKHR chooseSwapPresentMode(const vk::PresentModeKHR preferedPresentMode, const std::vector<vk::PresentModeKHR> &availablePresentModes);
     vk::Extent2D chooseSwapExtent(const vk::SurfaceCapabilitiesKHR &capabilities, vk::Extent2D &currentExtend);
-    vk::CommandBuffer getCommandBuffer(vk::Core &core, vk::CommandBufferLevel level = vk::CommandBufferLevel::ePrimary, uint32_t count = 1);
-    vk::ImageView createImageView(vk::Core &core, vk::Image &image, vk::Format &format, vk::ImageAspectFlags aspectFlags);
-    AllocatedBuffer createBuffer(vk::Core &core, vk::DeviceSize size, vk::BufferUsageFlags bufferUsage, vma::MemoryUsage memoryUsage = vma::MemoryUsage::eAuto, vma::AllocationCreateFlags memoryFlags = {});
+    // from pool, _loadCmdPool when it is null
+    vk::CommandBuffer getCommandBuffer(vk::Core &core, vk::CommandBufferLevel level = vk::CommandBufferLevel::ePrimary, uint32_t count = 1, vk::CommandPool pool = {});
+    vk::ImageView createImageView(vk::Core &core, vk::Image &image, vk::Format &format, vk::ImageAspectFlags aspectFlags, uint32_t mipLevels = 1);
+    // queueShared buffers are used concurrently by the graphics, transfer and compute queues, see vk::Core
+    AllocatedBuffer createBuffer(vk::Core &core, vk::DeviceSize size, vk::BufferUsageFlags bufferUsage, vma::MemoryUsage memoryUsage = vma::MemoryUsage::eAuto, vma::AllocationCreateFlags memoryFlags = {}, bool queueShared = false, MemoryCategory category = MemoryCategory::eInferred, vk::DeviceSize minAlignment = 0);
     AllocatedBuffer deviceBufferFromData(vk::Core &core, void* data, vk::DeviceSize size, vk::BufferUsageFlags bufferUsage, vma::MemoryUsage memoryUsage = vma::MemoryUsage::eAuto, vma::AllocationCreateFlags memoryFlags = {});
     AllocatedBuffer hostBufferFromData(vk::Core &core, void* data, vk::DeviceSize size, vk::BufferUsageFlags bufferUsage, vma::MemoryUsage memoryUsage = vma::MemoryUsage::eAuto, vma::AllocationCreateFlags memoryFlags = {});
-    AllocatedImage createImage(vk::Core &core, vk::ImageCreateInfo imageInfo, vk::ImageAspectFlags aspectFlags, vma::MemoryUsage memoryUsage = vma::MemoryUsage::eAuto, vma::AllocationCreateFlags memoryFlags = {});
+    AllocatedImage createImage(vk::Core &core, vk::ImageCreateInfo imageInfo, vk::ImageAspectFlags aspectFlags, vma::MemoryUsage memoryUsage = vma::MemoryUsage::eAuto, vma::AllocationCreateFlags memoryFlags = {}, MemoryCategory category = MemoryCategory::eInferred);
+    // free what createBuffer and createImage allocated and drop it from core._memoryTelemetry, the view stays
+    void destroyBuffer(vk::Core &core, const AllocatedBuffer &buffer);
+    void destroyImage(vk::Core &core, const AllocatedImage &image);
     vkutils::AllocatedImage imageFromData(vk::Core &core, void* data, vk::ImageCreateInfo imageInfo, vk::ImageAspectFlags aspectFlags, vma::MemoryUsage memoryUsage, vma::AllocationCreateFlags memoryFlags = {});
+    vkutils::AllocatedImage imageFromMipChain(vk::Core &core, void* data, const std::vector<size_t> &levelOffsets, vk::ImageCreateInfo imageInfo, vk::ImageAspectFlags aspectFlags, vma::MemoryUsage memoryUsage, vma::AllocationCreateFlags memoryFlags = {});
     void copyBuffer(vk::Core &core, vk::Buffer srcBuffer, vk::Buffer dstBuffer, vk::DeviceSize size);
-    void copyImageBuffer(vk::Core &core, vk::Buffer srcBuffer, vk::Image dstImage, uint32_t width, uint32_t height);
+    void copyImageBuffer(vk::Core &core, vk::Buffer srcBuffer, vk::Image dstImage, uint32_t width, uint32_t height, uint32_t mipLevels = 1);
+    void generateMipmaps(vk::CommandBuffer cmd, vk::Image image, uint32_t width, uint32_t height, uint32_t mipLevels);
     void setImageLayout(vk::CommandBuffer cmd, vk::Image image, vk::ImageLayout oldLayout, vk::ImageLayout newLayout, vk::ImageSubresourceRange subresourceRange, vk::PipelineStageFlags srcMask = vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlags dstMask = vk::PipelineStageFlagBits::eAllCommands);
     vk::TransformMatrixKHR getTransformMatrixKHR(glm::mat4 mat);
+    // conservative, a box behind a frustum corner can still count as inside
+    bool boxInFrustum(const glm::mat4 &viewProjection, const glm::vec3 &min, const glm::vec3 &max);
     uint32_t alignedSize(uint32_t value, uint32_t alignment);
 }
\ No newline at end of file
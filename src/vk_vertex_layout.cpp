@@ -0,0 +1,379 @@
+#include <vk_vertex_layout.h>
+#include <glm/gtc/packing.hpp>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+namespace
+{
+	// members of the decoded glsl Vertex and the value they take when a layout does not provide them
+	struct DecodedMember
+	{
+		const char *type;
+		const char *name;
+		const char *fallback;
+	};
+	const DecodedMember decodedMembers[] = {
+		{"vec3", "pos", "vec3(0.0)"},
+		{"vec3", "normal", "vec3(0.0, 0.0, 1.0)"},
+		{"vec2", "uv", "vec2(0.0)"},
+		{"vec4", "color", "vec4(1.0)"},
+		{"vec4", "joint0", "vec4(0.0)"},
+		{"vec4", "weight0", "vec4(0.0)"},
+		{"vec4", "tangent", "vec4(0.0)"},
+	};
+
+	const char *octahedralGlsl =
+		"vec3 octDecode(vec2 e) {\n"
+		"    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));\n"
+		"    float t = max(-n.z, 0.0);\n"
+		"    n.x += n.x >= 0.0 ? -t : t;\n"
+		"    n.y += n.y >= 0.0 ? -t : t;\n"
+		"    return normalize(n);\n"
+		"}\n"
+		"vec4 decodeTangent(uint t) {\n"
+		"    return vec4(octDecode(unpackSnorm2x16(t)), (t & 1u) != 0u ? -1.0 : 1.0);\n"
+		"}\n"
+		"vec2 octEncode(vec3 n) {\n"
+		"    n /= max(abs(n.x) + abs(n.y) + abs(n.z), 1e-20);\n"
+		"    vec2 e = n.xy;\n"
+		"    if (n.z < 0.0) {\n"
+		"        e = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);\n"
+		"    }\n"
+		"    return e;\n"
+		"}\n"
+		"uint encodeTangent(vec4 t) {\n"
+		"    return (packSnorm2x16(octEncode(t.xyz)) & ~1u) | (t.w < 0.0 ? 1u : 0u);\n"
+		"}\n";
+
+	// How an attribute of a given format is rebuilt from the 32 bit words of a storage buffer,
+	// yielding the same value the vertex input stage would produce for that format, and how a value "x"
+	// of that input type is packed back into the words.
+	struct WordFormat
+	{
+		vk::Format format;
+		uint32_t words;
+		const char *decode;
+		const char *encode;
+	};
+	const WordFormat wordFormats[] = {
+		{vk::Format::eR32G32B32A32Sfloat, 4, "uintBitsToFloat(w)", "floatBitsToUint(x)"},
+		{vk::Format::eR32G32B32Sfloat, 3, "uintBitsToFloat(w.xyz)", "uvec4(floatBitsToUint(x), 0u)"},
+		{vk::Format::eR32G32Sfloat, 2, "uintBitsToFloat(w.xy)", "uvec4(floatBitsToUint(x), 0u, 0u)"},
+		{vk::Format::eR32Uint, 1, "w.x", "uvec4(x, 0u, 0u, 0u)"},
+		{vk::Format::eR16G16Snorm, 1, "unpackSnorm2x16(w.x)", "uvec4(packSnorm2x16(x), 0u, 0u, 0u)"},
+		{vk::Format::eR16G16Sfloat, 1, "unpackHalf2x16(w.x)", "uvec4(packHalf2x16(x), 0u, 0u, 0u)"},
+		{vk::Format::eR8G8B8A8Unorm, 1, "unpackUnorm4x8(w.x)", "uvec4(packUnorm4x8(x), 0u, 0u, 0u)"},
+		{vk::Format::eR16G16B16A16Uint, 2, "uvec4(w.x & 0xFFFFu, w.x >> 16, w.y & 0xFFFFu, w.y >> 16)", "uvec4(x.x | (x.y << 16), x.z | (x.w << 16), 0u, 0u)"},
+		{vk::Format::eR16G16B16A16Unorm, 2, "vec4(unpackUnorm2x16(w.x), unpackUnorm2x16(w.y))", "uvec4(packUnorm2x16(x.xy), packUnorm2x16(x.zw), 0u, 0u)"},
+	};
+
+	const WordFormat &wordFormat(vk::Format format)
+	{
+		for (const WordFormat &entry : wordFormats)
+		{
+			if (entry.format == format)
+			{
+				return entry;
+			}
+		}
+		throw std::runtime_error("vertex attribute format without a storage buffer decoder");
+	}
+
+	glm::vec2 octEncode(glm::vec3 n)
+	{
+		float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+		if (l1 == 0.0f)
+		{
+			return glm::vec2(0.0f);
+		}
+		n /= l1;
+		glm::vec2 e(n.x, n.y);
+		if (n.z < 0.0f)
+		{
+			e = (1.0f - glm::abs(glm::vec2(n.y, n.x))) * glm::vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+		}
+		return e;
+	}
+
+	template <typename T>
+	void store(unsigned char *dst, const T &value)
+	{
+		std::memcpy(dst, &value, sizeof(T));
+	}
+
+	void encodePosition(const Vertex &v, unsigned char *dst) { store(dst, v.pos); }
+	void encodeNormal(const Vertex &v, unsigned char *dst) { store(dst, v.normal); }
+	void encodeUV(const Vertex &v, unsigned char *dst) { store(dst, v.uv); }
+	void encodeColor(const Vertex &v, unsigned char *dst) { store(dst, v.color); }
+	void encodeJoint(const Vertex &v, unsigned char *dst) { store(dst, v.joint0); }
+	void encodeWeight(const Vertex &v, unsigned char *dst) { store(dst, v.weight0); }
+	void encodeTangent(const Vertex &v, unsigned char *dst) { store(dst, v.tangent); }
+
+	void encodeOctNormal(const Vertex &v, unsigned char *dst)
+	{
+		store(dst, glm::packSnorm2x16(octEncode(v.normal)));
+	}
+	void encodeOctTangent(const Vertex &v, unsigned char *dst)
+	{
+		// the lowest bit of x carries the bitangent sign, costs one lsb of precision
+		uint32_t packed = glm::packSnorm2x16(octEncode(glm::vec3(v.tangent))) & ~1u;
+		store(dst, packed | (v.tangent.w < 0.0f ? 1u : 0u));
+	}
+	void encodeHalfUV(const Vertex &v, unsigned char *dst)
+	{
+		store(dst, glm::packHalf2x16(v.uv));
+	}
+	void encodeUnormColor(const Vertex &v, unsigned char *dst)
+	{
+		store(dst, glm::packUnorm4x8(glm::clamp(v.color, 0.0f, 1.0f)));
+	}
+	void encodeU16Joint(const Vertex &v, unsigned char *dst)
+	{
+		glm::u16vec4 joint(v.joint0);
+		store(dst, joint);
+	}
+	void encodeUnormWeight(const Vertex &v, unsigned char *dst)
+	{
+		store(dst, glm::packUnorm4x16(glm::clamp(v.weight0, 0.0f, 1.0f)));
+	}
+}
+
+vkutils::VertexLayout vkutils::VertexLayout::standard()
+{
+	VertexLayout layout;
+	layout.format = eStandard;
+	layout.strides = {sizeof(Vertex)};
+	layout.attributes = {
+		{"pos", 0, 0, offsetof(Vertex, pos), vk::Format::eR32G32B32Sfloat, "vec3", "in_pos", encodePosition},
+		{"normal", 1, 0, offsetof(Vertex, normal), vk::Format::eR32G32B32Sfloat, "vec3", "in_normal", encodeNormal},
+		{"uv", 2, 0, offsetof(Vertex, uv), vk::Format::eR32G32Sfloat, "vec2", "in_uv", encodeUV},
+		{"color", 3, 0, offsetof(Vertex, color), vk::Format::eR32G32B32A32Sfloat, "vec4", "in_color", encodeColor},
+		{"joint0", 4, 0, offsetof(Vertex, joint0), vk::Format::eR32G32B32A32Sfloat, "vec4", "in_joint0", encodeJoint},
+		{"weight0", 5, 0, offsetof(Vertex, weight0), vk::Format::eR32G32B32A32Sfloat, "vec4", "in_weight0", encodeWeight},
+		{"tangent", 6, 0, offsetof(Vertex, tangent), vk::Format::eR32G32B32A32Sfloat, "vec4", "in_tangent", encodeTangent},
+	};
+	return layout;
+}
+
+vkutils::VertexLayout vkutils::VertexLayout::compact(bool colorStream, bool skinStream)
+{
+	VertexLayout layout;
+	layout.format = eCompact;
+	// stream 0 is everything the hit shaders need: position stays full precision since it is also the AS build input
+	layout.strides = {24};
+	layout.attributes = {
+		{"pos", 0, 0, 0, vk::Format::eR32G32B32Sfloat, "vec3", "in_pos", encodePosition},
+		{"normal", 1, 0, 12, vk::Format::eR16G16Snorm, "vec2", "octDecode(in_normal)", encodeOctNormal, "octEncode(v)"},
+		{"tangent", 6, 0, 16, vk::Format::eR32Uint, "uint", "decodeTangent(in_tangent)", encodeOctTangent, "encodeTangent(v)"},
+		{"uv", 2, 0, 20, vk::Format::eR16G16Sfloat, "vec2", "in_uv", encodeHalfUV},
+	};
+	if (colorStream)
+	{
+		uint32_t stream = static_cast<uint32_t>(layout.strides.size());
+		layout.strides.push_back(4);
+		layout.attributes.push_back({"color", 3, stream, 0, vk::Format::eR8G8B8A8Unorm, "vec4", "in_color", encodeUnormColor});
+	}
+	if (skinStream)
+	{
+		uint32_t stream = static_cast<uint32_t>(layout.strides.size());
+		layout.strides.push_back(16);
+		layout.attributes.push_back({"joint0", 4, stream, 0, vk::Format::eR16G16B16A16Uint, "uvec4", "vec4(in_joint0)", encodeU16Joint, "uvec4(v)"});
+		layout.attributes.push_back({"weight0", 5, stream, 8, vk::Format::eR16G16B16A16Unorm, "vec4", "in_weight0", encodeUnormWeight});
+	}
+	return layout;
+}
+
+vkutils::VertexLayout vkutils::VertexLayout::create(Format format, bool colorStream, bool skinStream, bool splitStreams)
+{
+	VertexLayout layout = format == eCompact ? compact(colorStream, skinStream) : standard();
+	return splitStreams ? layout.split() : layout;
+}
+
+vkutils::VertexLayout vkutils::VertexLayout::split() const
+{
+	// structure of arrays: every attribute gets a tightly packed stream of its own, in table order,
+	// so position always ends up as stream 0 with a 12 byte stride for the AS builds
+	VertexLayout layout;
+	layout.format = format;
+	layout.splitStreams = true;
+	for (const VertexAttribute &attribute : attributes)
+	{
+		VertexAttribute streamAttribute = attribute;
+		streamAttribute.stream = static_cast<uint32_t>(layout.strides.size());
+		streamAttribute.offset = 0;
+		layout.strides.push_back(wordFormat(attribute.format).words * 4);
+		layout.attributes.push_back(streamAttribute);
+	}
+	return layout;
+}
+
+uint32_t vkutils::VertexLayout::streamCount() const
+{
+	return static_cast<uint32_t>(strides.size());
+}
+
+uint32_t vkutils::VertexLayout::bytesPerVertex() const
+{
+	uint32_t bytes = 0;
+	for (uint32_t stride : strides)
+	{
+		bytes += stride;
+	}
+	return bytes;
+}
+
+const char *vkutils::VertexLayout::name() const
+{
+	if (format == eCompact)
+	{
+		return splitStreams ? "compact split" : "compact";
+	}
+	return splitStreams ? "standard split" : "standard";
+}
+
+void vkutils::VertexLayout::write(const Vertex &vertex, const std::vector<unsigned char *> &streams, size_t index) const
+{
+	for (uint32_t stream = 0; stream < streamCount(); stream++)
+	{
+		std::memset(streams[stream] + index * strides[stream], 0, strides[stream]);
+	}
+	for (const VertexAttribute &attribute : attributes)
+	{
+		attribute.encode(vertex, streams[attribute.stream] + index * strides[attribute.stream] + attribute.offset);
+	}
+}
+
+VertexInputDescription vkutils::VertexLayout::inputDescription() const
+{
+	VertexInputDescription description;
+	// one binding per stream, all with a per-vertex rate
+	for (uint32_t stream = 0; stream < streamCount(); stream++)
+	{
+		vk::VertexInputBindingDescription binding = {};
+		binding.binding = stream;
+		binding.stride = strides[stream];
+		binding.inputRate = vk::VertexInputRate::eVertex;
+		description.bindings.push_back(binding);
+	}
+	for (const VertexAttribute &attribute : attributes)
+	{
+		vk::VertexInputAttributeDescription input = {};
+		input.binding = attribute.stream;
+		input.location = attribute.location;
+		input.format = attribute.format;
+		input.offset = attribute.offset;
+		description.attributes.push_back(input);
+	}
+	return description;
+}
+
+std::string vkutils::VertexLayout::glsl() const
+{
+	auto find = [this](const char *name) -> const VertexAttribute * {
+		for (const VertexAttribute &attribute : attributes)
+		{
+			if (attribute.name == name)
+			{
+				return &attribute;
+			}
+		}
+		return nullptr;
+	};
+
+	std::ostringstream out;
+	out << "// generated from the " << name() << " vkutils::VertexLayout\n";
+	out << "#ifndef VERTEX_LAYOUT_GLSL\n#define VERTEX_LAYOUT_GLSL\n";
+	out << "#define VERTEX_LAYOUT_" << (format == eCompact ? "COMPACT" : "STANDARD") << "\n";
+	out << "struct Vertex {\n";
+	for (const DecodedMember &member : decodedMembers)
+	{
+		out << "    " << member.type << " " << member.name << ";\n";
+	}
+	out << "};\n";
+	out << octahedralGlsl;
+
+	// rasterizer: one input per attribute of any stream
+	out << "#ifdef VERTEX_INPUT\n";
+	for (const VertexAttribute &attribute : attributes)
+	{
+		out << "layout (location = " << attribute.location << ") in " << attribute.inputType << " in_" << attribute.name << ";\n";
+	}
+	out << "Vertex inputVertex() {\n    Vertex v;\n";
+	for (const DecodedMember &member : decodedMembers)
+	{
+		const VertexAttribute *attribute = find(member.name);
+		out << "    v." << member.name << " = " << (attribute ? attribute->inputDecode : member.fallback) << ";\n";
+	}
+	out << "    return v;\n}\n#endif\n";
+
+	// ray tracing: all streams are bound as one array of storage buffers and read word by word, the skinning
+	// pass defines VERTEX_BUFFER_WRITE and writes them back the same way
+	out << "#ifdef VERTEX_BUFFER_BINDING\n";
+	out << "#ifdef VERTEX_BUFFER_WRITE\n";
+	out << "layout(binding = VERTEX_BUFFER_BINDING, set = 0) buffer VertexStreams { uint data[]; } vertexStreams[" << streamCount() << "];\n";
+	out << "#else\n";
+	out << "layout(binding = VERTEX_BUFFER_BINDING, set = 0) readonly buffer VertexStreams { uint data[]; } vertexStreams[" << streamCount() << "];\n";
+	out << "#endif\n";
+	for (const DecodedMember &member : decodedMembers)
+	{
+		const VertexAttribute *attribute = find(member.name);
+		out << member.type << " fetch_" << member.name << "(uint index) {\n";
+		if (attribute)
+		{
+			const WordFormat &entry = wordFormat(attribute->format);
+			uint32_t strideWords = strides[attribute->stream] / 4;
+			uint32_t offsetWords = attribute->offset / 4;
+			out << "    uint base = index * " << strideWords << "u + " << offsetWords << "u;\n";
+			out << "    uvec4 w = uvec4(0u);\n";
+			for (uint32_t word = 0; word < entry.words; word++)
+			{
+				out << "    w[" << word << "] = vertexStreams[" << attribute->stream << "].data[base + " << word << "u];\n";
+			}
+			out << "    " << attribute->inputType << " in_" << attribute->name << " = " << entry.decode << ";\n";
+			out << "    return " << attribute->inputDecode << ";\n";
+		}
+		else
+		{
+			out << "    return " << member.fallback << ";\n";
+		}
+		out << "}\n";
+	}
+	out << "Vertex fetchVertex(uint index) {\n    Vertex v;\n";
+	for (const DecodedMember &member : decodedMembers)
+	{
+		out << "    v." << member.name << " = fetch_" << member.name << "(index);\n";
+	}
+	out << "    return v;\n}\n";
+
+	// a member the layout does not store is dropped
+	out << "#ifdef VERTEX_BUFFER_WRITE\n";
+	for (const DecodedMember &member : decodedMembers)
+	{
+		const VertexAttribute *attribute = find(member.name);
+		out << "void store_" << member.name << "(uint index, " << member.type << " v) {\n";
+		if (attribute)
+		{
+			const WordFormat &entry = wordFormat(attribute->format);
+			uint32_t strideWords = strides[attribute->stream] / 4;
+			uint32_t offsetWords = attribute->offset / 4;
+			out << "    " << attribute->inputType << " x = " << (attribute->inputEncode.empty() ? "v" : attribute->inputEncode) << ";\n";
+			out << "    uvec4 w = " << entry.encode << ";\n";
+			out << "    uint base = index * " << strideWords << "u + " << offsetWords << "u;\n";
+			for (uint32_t word = 0; word < entry.words; word++)
+			{
+				out << "    vertexStreams[" << attribute->stream << "].data[base + " << word << "u] = w[" << word << "];\n";
+			}
+		}
+		out << "}\n";
+	}
+	out << "#endif\n#endif\n";
+	out << "#endif\n";
+	return out.str();
+}
+
+VertexInputDescription Vertex::get_vertex_description(const vkutils::VertexLayout &layout)
+{
+	return layout.inputDescription();
+}
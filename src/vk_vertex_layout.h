@@ -0,0 +1,79 @@
+#pragma once
+
+#include <vk_types.h>
+#include <string>
+#include <vector>
+
+struct Vertex;
+
+struct VertexInputDescription
+{
+	std::vector<vk::VertexInputBindingDescription> bindings;
+	std::vector<vk::VertexInputAttributeDescription> attributes;
+	vk::PipelineVertexInputStateCreateFlags flags;
+};
+
+namespace vkutils
+{
+	// One entry of a vertex layout table. The same entry drives the cpu encoder, the rasterizer vertex input
+	// and the glsl decoder, so the three can never disagree.
+	struct VertexAttribute
+	{
+		std::string name;
+		uint32_t location;
+		uint32_t stream;
+		uint32_t offset;
+		vk::Format format;
+		// glsl type of the vertex shader input and the expression turning "in_<name>" into the decoded value,
+		// hit shaders rebuild "in_<name>" from the raw storage buffer words and share the expression
+		std::string inputType;
+		std::string inputDecode;
+		void (*encode)(const Vertex &vertex, unsigned char *dst);
+		// inverse of inputDecode, turns the decoded "v" back into the input type, empty when that is v itself
+		std::string inputEncode{};
+	};
+
+	class VertexLayout
+	{
+	public:
+		enum Format
+		{
+			eStandard,
+			eCompact
+		};
+		Format format{eStandard};
+		bool splitStreams{false};
+		std::vector<VertexAttribute> attributes{};
+		std::vector<uint32_t> strides{};
+
+		static VertexLayout standard();
+		// color and skin streams are only added when the scene actually has those attributes
+		static VertexLayout compact(bool colorStream, bool skinStream);
+		static VertexLayout create(Format format, bool colorStream, bool skinStream, bool splitStreams);
+		VertexLayout split() const;
+
+		uint32_t streamCount() const;
+		uint32_t bytesPerVertex() const;
+		const char *name() const;
+		void write(const Vertex &vertex, const std::vector<unsigned char *> &streams, size_t index) const;
+		VertexInputDescription inputDescription() const;
+		// Source of the virtual "vertex_layout.glsl" include, see shader/MIPS.rchit for usage.
+		std::string glsl() const;
+	};
+}
+
+// Decoded vertex as it is read from glTF. This is also the storage format of VertexLayout::eStandard.
+struct Vertex
+{
+	glm::vec3 pos;
+	float pad0;
+	glm::vec3 normal;
+	float pad1;
+	glm::vec2 uv;
+	float pad2[2];
+	glm::vec4 color;
+	glm::vec4 joint0;
+	glm::vec4 weight0;
+	glm::vec4 tangent;
+	static VertexInputDescription get_vertex_description(const vkutils::VertexLayout &layout = vkutils::VertexLayout::standard());
+};
@@ -0,0 +1,316 @@
+// Offline texture compressor: decodes the PNG/JPEG images of a .glb, box filters a full mip chain and stores it
+// as BCn in DDS containers referenced through MSFT_texture_dds. Normal maps become BC5, opaque color BC1
+// and everything with alpha BC7.
+//
+// usage: glb_texture_compressor <input.glb> <output.glb> [--keep-fallback] [--bc7-normals]
+//   --keep-fallback  keeps the original images as texture.source for loaders without DDS support
+//   --bc7-normals    stores normal maps as BC7 instead of two channel BC5
+#define TINYGLTF_IMPLEMENTATION
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <tiny_gltf.h>
+#include <vk_block_compression.h>
+#include <vk_mipmap.h>
+#include <vk_threadpool.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <set>
+
+namespace
+{
+	struct Job
+	{
+		size_t image;
+		vkutils::bc::Format format = vkutils::bc::Format::eUnknown;
+		std::vector<unsigned char> dds{};
+		size_t sourceBytes = 0;
+	};
+
+	void appendAligned(std::vector<unsigned char> &buffer, const unsigned char *data, size_t size, size_t &offset)
+	{
+		buffer.resize((buffer.size() + 3) & ~size_t(3), 0);
+		offset = buffer.size();
+		buffer.insert(buffer.end(), data, data + size);
+	}
+
+	// Rewrites buffer 0 with only the buffer views that are still referenced, dropping the replaced images.
+	// Extensions that hide buffer view references (draco, meshopt) make this unsafe, the buffer is left alone then.
+	void compactBuffer(tinygltf::Model &model)
+	{
+		for (const std::string &extension : model.extensionsUsed)
+		{
+			if (extension == "KHR_draco_mesh_compression" || extension == "EXT_meshopt_compression")
+			{
+				std::cout << extension << " references buffer views, the replaced images stay in the file" << std::endl;
+				return;
+			}
+		}
+		std::vector<bool> used(model.bufferViews.size(), false);
+		auto use = [&](int view) {
+			if (view >= 0 && static_cast<size_t>(view) < used.size())
+			{
+				used[view] = true;
+			}
+		};
+		for (const tinygltf::Accessor &accessor : model.accessors)
+		{
+			use(accessor.bufferView);
+			if (accessor.sparse.isSparse)
+			{
+				use(accessor.sparse.indices.bufferView);
+				use(accessor.sparse.values.bufferView);
+			}
+		}
+		for (const tinygltf::Image &image : model.images)
+		{
+			use(image.bufferView);
+		}
+
+		std::vector<int> remap(model.bufferViews.size(), -1);
+		std::vector<tinygltf::BufferView> views;
+		std::vector<unsigned char> data;
+		for (size_t i = 0; i < model.bufferViews.size(); i++)
+		{
+			if (!used[i])
+			{
+				continue;
+			}
+			tinygltf::BufferView view = model.bufferViews[i];
+			if (view.buffer == 0)
+			{
+				size_t offset;
+				appendAligned(data, model.buffers[0].data.data() + view.byteOffset, view.byteLength, offset);
+				view.byteOffset = offset;
+			}
+			remap[i] = static_cast<int>(views.size());
+			views.push_back(view);
+		}
+		for (tinygltf::Accessor &accessor : model.accessors)
+		{
+			if (accessor.bufferView >= 0)
+			{
+				accessor.bufferView = remap[accessor.bufferView];
+			}
+			if (accessor.sparse.isSparse)
+			{
+				accessor.sparse.indices.bufferView = remap[accessor.sparse.indices.bufferView];
+				accessor.sparse.values.bufferView = remap[accessor.sparse.values.bufferView];
+			}
+		}
+		for (tinygltf::Image &image : model.images)
+		{
+			if (image.bufferView >= 0)
+			{
+				image.bufferView = remap[image.bufferView];
+			}
+		}
+		model.bufferViews.swap(views);
+		model.buffers[0].data.swap(data);
+	}
+
+	void addExtension(std::vector<std::string> &extensions, const std::string &name)
+	{
+		if (std::find(extensions.begin(), extensions.end(), name) == extensions.end())
+		{
+			extensions.push_back(name);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3)
+	{
+		std::cerr << "usage: glb_texture_compressor <input.glb> <output.glb> [--keep-fallback] [--bc7-normals]" << std::endl;
+		return 1;
+	}
+	bool keepFallback = false;
+	bool bc7Normals = false;
+	for (int i = 3; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--keep-fallback") == 0)
+		{
+			keepFallback = true;
+		}
+		else if (strcmp(argv[i], "--bc7-normals") == 0)
+		{
+			bc7Normals = true;
+		}
+		else
+		{
+			std::cerr << "unknown option " << argv[i] << std::endl;
+			return 1;
+		}
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+	tinygltf::Model model;
+	tinygltf::TinyGLTF gltfContext;
+	std::string error, warning;
+	if (!gltfContext.LoadBinaryFromFile(&model, &error, &warning, argv[1]))
+	{
+		std::cerr << "Could not load " << argv[1] << ": " << error << std::endl;
+		return 1;
+	}
+
+	// an image that is only ever used as a normal map can drop blue, everything else keeps all channels
+	std::set<int> normalImages;
+	std::set<int> colorImages;
+	for (tinygltf::Material &material : model.materials)
+	{
+		if (material.normalTexture.index >= 0)
+		{
+			normalImages.insert(model.textures[material.normalTexture.index].source);
+		}
+		for (int texture : {material.pbrMetallicRoughness.baseColorTexture.index, material.pbrMetallicRoughness.metallicRoughnessTexture.index, material.occlusionTexture.index, material.emissiveTexture.index})
+		{
+			if (texture >= 0)
+			{
+				colorImages.insert(model.textures[texture].source);
+			}
+		}
+	}
+
+	std::vector<Job> jobs;
+	for (size_t i = 0; i < model.images.size(); i++)
+	{
+		const tinygltf::Image &image = model.images[i];
+		if (image.image.empty() || image.bits != 8 || image.component < 1 || image.component > 4)
+		{
+			std::cout << "Keeping image " << i << " (" << image.name << "), it was not decoded to 8 bit" << std::endl;
+			continue;
+		}
+		jobs.push_back(Job{i});
+	}
+
+	vkutils::ThreadPool::shared().parallelFor(jobs.size(), [&](size_t j) {
+		Job &job = jobs[j];
+		const tinygltf::Image &image = model.images[job.image];
+		uint32_t width = static_cast<uint32_t>(image.width);
+		uint32_t height = static_cast<uint32_t>(image.height);
+		size_t texels = static_cast<size_t>(width) * height;
+		std::vector<unsigned char> rgba(texels * 4, 255);
+		bool opaque = true;
+		for (size_t t = 0; t < texels; t++)
+		{
+			const unsigned char *src = &image.image[t * image.component];
+			// grey, grey alpha, rgb and rgba
+			rgba[t * 4 + 0] = src[0];
+			rgba[t * 4 + 1] = image.component >= 3 ? src[1] : src[0];
+			rgba[t * 4 + 2] = image.component >= 3 ? src[2] : src[0];
+			if (image.component == 2 || image.component == 4)
+			{
+				rgba[t * 4 + 3] = src[image.component - 1];
+				opaque = opaque && src[image.component - 1] == 255;
+			}
+		}
+
+		bool normalMap = normalImages.count(static_cast<int>(job.image)) && !colorImages.count(static_cast<int>(job.image));
+		if (normalMap && !bc7Normals)
+		{
+			job.format = vkutils::bc::Format::eBC5;
+		}
+		else
+		{
+			job.format = opaque ? vkutils::bc::Format::eBC1 : vkutils::bc::Format::eBC7;
+		}
+
+		std::vector<unsigned char> chain;
+		std::vector<size_t> levelOffsets = vkutils::mipmap::buildChainRGBA8(rgba.data(), width, height, chain);
+		job.sourceBytes = chain.size();
+		job.dds = vkutils::bc::writeDDS(vkutils::bc::compressChain(job.format, chain.data(), levelOffsets, width, height));
+	});
+
+	if (model.buffers.empty())
+	{
+		model.buffers.push_back(tinygltf::Buffer());
+	}
+	std::vector<int> compressedImage(model.images.size(), -1);
+	size_t sourceBytes = 0;
+	size_t compressedBytes = 0;
+	for (Job &job : jobs)
+	{
+		tinygltf::BufferView view;
+		view.buffer = 0;
+		view.byteLength = job.dds.size();
+		appendAligned(model.buffers[0].data, job.dds.data(), job.dds.size(), view.byteOffset);
+
+		tinygltf::Image image;
+		image.name = model.images[job.image].name;
+		image.mimeType = "image/vnd-ms.dds";
+		image.bufferView = static_cast<int>(model.bufferViews.size());
+		model.bufferViews.push_back(view);
+		compressedImage[job.image] = static_cast<int>(model.images.size());
+		model.images.push_back(image);
+
+		std::cout << "Image " << job.image << " (" << image.name << "): " << vkutils::bc::formatName(job.format) << ", " << job.sourceBytes / 1024 << " KB -> " << job.dds.size() / 1024 << " KB" << std::endl;
+		sourceBytes += job.sourceBytes;
+		compressedBytes += job.dds.size();
+	}
+
+	for (tinygltf::Texture &texture : model.textures)
+	{
+		if (texture.source < 0 || compressedImage[texture.source] < 0)
+		{
+			continue;
+		}
+		tinygltf::Value::Object extension;
+		extension["source"] = tinygltf::Value(compressedImage[texture.source]);
+		texture.extensions["MSFT_texture_dds"] = tinygltf::Value(extension);
+		if (!keepFallback)
+		{
+			texture.source = -1;
+		}
+	}
+	if (!jobs.empty())
+	{
+		addExtension(model.extensionsUsed, "MSFT_texture_dds");
+		if (!keepFallback)
+		{
+			addExtension(model.extensionsRequired, "MSFT_texture_dds");
+		}
+	}
+
+	if (!keepFallback)
+	{
+		// the replaced images are no longer referenced, drop them and their bytes
+		std::vector<int> remap(model.images.size(), -1);
+		std::vector<tinygltf::Image> images;
+		for (size_t i = 0; i < model.images.size(); i++)
+		{
+			if (i < compressedImage.size() && compressedImage[i] >= 0)
+			{
+				continue;
+			}
+			remap[i] = static_cast<int>(images.size());
+			images.push_back(model.images[i]);
+		}
+		for (tinygltf::Texture &texture : model.textures)
+		{
+			if (texture.source >= 0)
+			{
+				texture.source = remap[texture.source];
+			}
+			auto extension = texture.extensions.find("MSFT_texture_dds");
+			if (extension != texture.extensions.end())
+			{
+				tinygltf::Value::Object object;
+				object["source"] = tinygltf::Value(remap[extension->second.Get("source").GetNumberAsInt()]);
+				extension->second = tinygltf::Value(object);
+			}
+		}
+		model.images.swap(images);
+		compactBuffer(model);
+	}
+
+	if (!gltfContext.WriteGltfSceneToFile(&model, argv[2], true, true, false, true))
+	{
+		std::cerr << "Could not write " << argv[2] << std::endl;
+		return 1;
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	std::cout << "Compressed " << jobs.size() << " images: " << sourceBytes / (1024.0 * 1024.0) << " MB of rgba8 mip chains -> " << compressedBytes / (1024.0 * 1024.0) << " MB of BCn in " << std::chrono::duration<double, std::milli>(end - start).count() << " ms" << std::endl;
+	return 0;
+}